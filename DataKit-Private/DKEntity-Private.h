@@ -8,17 +8,20 @@
 
 #import "DKEntity.h"
 
+@class DKFaultGroup;
+
 @interface DKEntity () // CLS_EXT
 @property (nonatomic, copy, readwrite) NSString *entityName;
-@property (nonatomic, strong) NSMutableDictionary *setMap;
-@property (nonatomic, strong) NSMutableDictionary *unsetMap;
-@property (nonatomic, strong) NSMutableDictionary *incMap;
-@property (nonatomic, strong) NSMutableDictionary *pushMap;
-@property (nonatomic, strong) NSMutableDictionary *pushAllMap;
-@property (nonatomic, strong) NSMutableDictionary *addToSetMap;
-@property (nonatomic, strong) NSMutableDictionary *popMap;
-@property (nonatomic, strong) NSMutableDictionary *pullAllMap;
-@property (nonatomic, strong) NSDictionary *resultMap;
+@property (nonatomic, strong) NSMutableDictionary *operations;
+
+// The identity map updates live instances from background queues while
+// the owner reads them, the result state is accessed atomically
+@property (atomic, strong) NSDictionary *resultMap;
+@property (atomic, copy) NSDictionary *projection;
+@property (atomic, strong) DKFaultGroup *faultGroup;
+
+- (void)popObjectEnd:(NSNumber *)end forKey:(NSString *)key;
+
 @end
 
 @interface DKEntity (Private)
@@ -26,5 +29,14 @@
 - (BOOL)hasEntityId:(NSError **)error;
 - (BOOL)hasEntityName:(NSError **)error;
 - (BOOL)commitObjectResultMap:(NSDictionary *)resultMap error:(NSError **)error;
+- (BOOL)commitObjectResultMap:(NSDictionary *)resultMap sentOperations:(NSDictionary *)operations error:(NSError **)error;
+- (void)mergeObjectResultMap:(NSDictionary *)resultMap;
+- (NSDictionary *)saveRequestDict;
+- (NSDictionary *)pendingOperations;
+- (void)mergeOperations:(NSDictionary *)operations;
++ (BOOL)operations:(NSDictionary *)operations conflictWithOperations:(NSDictionary *)otherOperations;
+- (NSDictionary *)operationMapForKey:(NSString *)operation;
+- (NSMutableDictionary *)mutableOperationMapForKey:(NSString *)operation;
+- (BOOL)isFaultForKey:(NSString *)key;
 
 @end
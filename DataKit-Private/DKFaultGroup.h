@@ -0,0 +1,19 @@
+//
+//  DKFaultGroup.h
+//  DataKit
+//
+//  Created by Erik Aigner on 02.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ Shared by the partially loaded entities of one query result. The first fault fetches the complete objects of all members that were not faulted yet in a single request.
+ */
+@interface DKFaultGroup : NSObject
+
+- (id)initWithEntityName:(NSString *)entityName entityIds:(NSArray *)entityIds;
+- (NSDictionary *)resultMapForEntityId:(NSString *)entityId error:(NSError **)error;
+
+@end
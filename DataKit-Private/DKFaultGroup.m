@@ -0,0 +1,106 @@
+//
+//  DKFaultGroup.m
+//  DataKit
+//
+//  Created by Erik Aigner on 02.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKFaultGroup.h"
+
+#import "DKRequest.h"
+
+// Maximum number of objects fetched by one fault request
+static const NSUInteger kDKFaultGroupBatchSize = 100;
+
+@interface DKFaultGroup ()
+@property (nonatomic, copy) NSString *entityName;
+@property (nonatomic, strong) NSMutableOrderedSet *pendingIds;
+@property (nonatomic, strong) NSMutableDictionary *fetched;
+@end
+
+@implementation DKFaultGroup
+DKSynthesize(entityName)
+DKSynthesize(pendingIds)
+DKSynthesize(fetched)
+
+- (id)initWithEntityName:(NSString *)entityName entityIds:(NSArray *)entityIds {
+  self = [super init];
+  if (self) {
+    self.entityName = entityName;
+    self.pendingIds = [NSMutableOrderedSet new];
+    for (NSString *entityId in entityIds) {
+      if ([entityId isKindOfClass:[NSString class]]) {
+        [self.pendingIds addObject:entityId];
+      }
+    }
+    self.fetched = [NSMutableDictionary new];
+  }
+  return self;
+}
+
+- (BOOL)fetchBatchContainingEntityId:(NSString *)entityId error:(NSError **)error {
+  // The requested object comes first, the batch is filled up with the
+  // members that follow it in the result
+  NSMutableArray *ids = [NSMutableArray arrayWithObject:entityId];
+  NSUInteger start = [self.pendingIds indexOfObject:entityId];
+  if (start == NSNotFound) {
+    start = 0;
+  }
+  for (NSUInteger i=0; i<self.pendingIds.count && ids.count < kDKFaultGroupBatchSize; i++) {
+    NSString *oid = [self.pendingIds objectAtIndex:(start + i) % self.pendingIds.count];
+    if (![oid isEqualToString:entityId]) {
+      [ids addObject:oid];
+    }
+  }
+  
+  NSDictionary *inIds = [NSDictionary dictionaryWithObject:ids forKey:@"$in"];
+  NSDictionary *requestDict = [NSDictionary dictionaryWithObjectsAndKeys:
+                               self.entityName, @"entity",
+                               [NSDictionary dictionaryWithObject:inIds forKey:@"_id"], @"q", nil];
+  
+  NSError *requestError = nil;
+  id results = [[DKRequest request] sendRequestWithObject:requestDict method:@"query" error:&requestError];
+  if (requestError != nil) {
+    if (error != NULL) {
+      *error = requestError;
+    }
+    return NO;
+  }
+  if ([results isKindOfClass:[NSArray class]]) {
+    for (NSDictionary *resultMap in results) {
+      if (![resultMap isKindOfClass:[NSDictionary class]]) {
+        continue;
+      }
+      NSString *oid = [resultMap objectForKey:@"_id"];
+      if (oid.length > 0) {
+        [self.fetched setObject:resultMap forKey:oid];
+      }
+    }
+  }
+  [self.pendingIds removeObjectsInArray:ids];
+  
+  return YES;
+}
+
+- (NSDictionary *)resultMapForEntityId:(NSString *)entityId error:(NSError **)error {
+  if (entityId.length == 0) {
+    return nil;
+  }
+  @synchronized (self) {
+    NSDictionary *resultMap = [self.fetched objectForKey:entityId];
+    if (resultMap == nil) {
+      if (![self fetchBatchContainingEntityId:entityId error:error]) {
+        return nil;
+      }
+      resultMap = [self.fetched objectForKey:entityId];
+    }
+    
+    // Each member faults once, drop the result to free memory
+    [self.fetched removeObjectForKey:entityId];
+    
+    return resultMap;
+  }
+}
+
+@end
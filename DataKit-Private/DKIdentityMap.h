@@ -0,0 +1,31 @@
+//
+//  DKIdentityMap.h
+//  DataKit
+//
+//  Created by Erik Aigner on 03.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class DKEntity;
+@class DKFaultGroup;
+
+@interface DKIdentityMap : NSObject
+
++ (DKIdentityMap *)sharedMap;
+
+- (DKEntity *)entityWithName:(NSString *)entityName
+                   resultMap:(NSDictionary *)resultMap
+                  projection:(NSDictionary *)projection
+                  faultGroup:(DKFaultGroup *)faultGroup;
+- (DKEntity *)entityWithName:(NSString *)entityName
+                   resultMap:(NSDictionary *)resultMap
+                  projection:(NSDictionary *)projection
+                  faultGroup:(DKFaultGroup *)faultGroup
+           updatesRegistered:(BOOL)updatesRegistered;
+- (void)registerEntity:(DKEntity *)entity;
+- (void)removeEntity:(DKEntity *)entity;
+- (void)removeAllEntities;
+
+@end
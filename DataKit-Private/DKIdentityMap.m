@@ -0,0 +1,173 @@
+//
+//  DKIdentityMap.m
+//  DataKit
+//
+//  Created by Erik Aigner on 03.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKIdentityMap.h"
+
+#import "DKEntity.h"
+#import "DKEntity-Private.h"
+#import "DKManager.h"
+
+// Number of registrations after which released entries are pruned
+static const NSUInteger kDKIdentityMapPruneInterval = 256;
+
+@interface DKIdentityMapRef : NSObject
+@property (nonatomic, weak) DKEntity *entity;
+@end
+
+@implementation DKIdentityMapRef
+DKSynthesize(entity)
+@end
+
+@interface DKIdentityMap ()
+@property (nonatomic, strong) NSMutableDictionary *refs;
+@property (nonatomic, assign) NSUInteger registrations;
+@end
+
+@implementation DKIdentityMap
+DKSynthesize(refs)
+DKSynthesize(registrations)
+
++ (DKIdentityMap *)sharedMap {
+  static DKIdentityMap *sharedMap;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    sharedMap = [self new];
+  });
+  return sharedMap;
+}
+
+- (id)init {
+  self = [super init];
+  if (self) {
+    self.refs = [NSMutableDictionary new];
+  }
+  return self;
+}
+
++ (NSString *)keyForEntityName:(NSString *)entityName entityId:(NSString *)entityId {
+  if (entityName.length == 0 || ![entityId isKindOfClass:[NSString class]] || entityId.length == 0) {
+    return nil;
+  }
+  return [NSString stringWithFormat:@"%@/%@", entityName, entityId];
+}
+
+- (void)pruneReleasedEntities {
+  NSMutableArray *released = [NSMutableArray new];
+  [self.refs enumerateKeysAndObjectsUsingBlock:^(id key, DKIdentityMapRef *ref, BOOL *stop) {
+    if (ref.entity == nil) {
+      [released addObject:key];
+    }
+  }];
+  [self.refs removeObjectsForKeys:released];
+}
+
+- (void)setEntity:(DKEntity *)entity forKey:(NSString *)key {
+  DKIdentityMapRef *ref = [DKIdentityMapRef new];
+  ref.entity = entity;
+  [self.refs setObject:ref forKey:key];
+  
+  self.registrations++;
+  if (self.registrations % kDKIdentityMapPruneInterval == 0) {
+    [self pruneReleasedEntities];
+  }
+}
+
+- (DKEntity *)entityWithName:(NSString *)entityName
+                   resultMap:(NSDictionary *)resultMap
+                  projection:(NSDictionary *)projection
+                  faultGroup:(DKFaultGroup *)faultGroup {
+  return [self entityWithName:entityName
+                    resultMap:resultMap
+                   projection:projection
+                   faultGroup:faultGroup
+            updatesRegistered:YES];
+}
+
+- (DKEntity *)entityWithName:(NSString *)entityName
+                   resultMap:(NSDictionary *)resultMap
+                  projection:(NSDictionary *)projection
+                  faultGroup:(DKFaultGroup *)faultGroup
+           updatesRegistered:(BOOL)updatesRegistered {
+  NSString *key = nil;
+  if ([DKManager identityMapEnabled]) {
+    key = [isa keyForEntityName:entityName entityId:[resultMap objectForKey:@"_id"]];
+  }
+  
+  @synchronized (self) {
+    DKEntity *entity = (key != nil) ? [[self.refs objectForKey:key] entity] : nil;
+    if (entity == nil) {
+      entity = [[DKEntity alloc] initWithName:entityName];
+      entity.resultMap = resultMap;
+      entity.projection = projection;
+      entity.faultGroup = faultGroup;
+      
+      if (key != nil) {
+        [self setEntity:entity forKey:key];
+      }
+    }
+    else if (!updatesRegistered) {
+      // The result may be older than the live instance, which is kept
+      // as it is
+      return entity;
+    }
+    else if (projection == nil) {
+      [entity mergeObjectResultMap:resultMap];
+    }
+    else {
+      // Partial results only update the keys they contain, the instance
+      // keeps its own fault state
+      NSMutableDictionary *merged = [NSMutableDictionary dictionaryWithDictionary:entity.resultMap];
+      [merged addEntriesFromDictionary:resultMap];
+      entity.resultMap = [NSDictionary dictionaryWithDictionary:merged];
+    }
+    
+    return entity;
+  }
+}
+
+- (void)registerEntity:(DKEntity *)entity {
+  if (![DKManager identityMapEnabled]) {
+    return;
+  }
+  NSString *key = [isa keyForEntityName:entity.entityName entityId:entity.entityId];
+  if (key == nil) {
+    return;
+  }
+  
+  @synchronized (self) {
+    DKEntity *registered = [[self.refs objectForKey:key] entity];
+    if (registered == nil) {
+      [self setEntity:entity forKey:key];
+    }
+    else if (registered != entity) {
+      // Another instance for the same object is live, keep it current
+      [registered mergeObjectResultMap:entity.resultMap];
+    }
+  }
+}
+
+- (void)removeEntity:(DKEntity *)entity {
+  NSString *key = [isa keyForEntityName:entity.entityName entityId:entity.entityId];
+  if (key == nil) {
+    return;
+  }
+  
+  @synchronized (self) {
+    if ([[self.refs objectForKey:key] entity] == entity) {
+      [self.refs removeObjectForKey:key];
+    }
+  }
+}
+
+- (void)removeAllEntities {
+  @synchronized (self) {
+    [self.refs removeAllObjects];
+  }
+}
+
+@end
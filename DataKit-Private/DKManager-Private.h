@@ -0,0 +1,18 @@
+//
+//  DKManager-Private.h
+//  DataKit
+//
+//  Created by Erik Aigner on 29.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKManager.h"
+
+@interface DKManager (Private)
+
++ (void)dispatchInBackground:(dispatch_block_t)block;
++ (NSTimeInterval)consumeQueueWaitTime;
++ (void)noteLiveQueryResponse;
++ (BOOL)hasLiveQueryResponse;
+
+@end
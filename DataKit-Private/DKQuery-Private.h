@@ -8,6 +8,8 @@
 
 #import "DKQuery.h"
 
+@class DKRequest;
+
 @interface DKQuery () // CLS_EXT
 @property (nonatomic, copy, readwrite) NSString *entityName;
 @property (nonatomic, strong) NSMutableDictionary *queryMap;
@@ -16,15 +18,22 @@
 @property (nonatomic, strong) NSMutableArray *ands;
 @property (nonatomic, strong) NSMutableArray *referenceIncludes;
 @property (nonatomic, strong) NSMutableDictionary *fieldInclExcl;
+@property (nonatomic, copy) NSDictionary *textSearch;
 @property (nonatomic, strong) DKMapReduce *mapReduce;
 
-- (id)find:(NSError **)error one:(BOOL)findOne count:(NSUInteger *)countOut;
+- (id)find:(NSError **)error one:(BOOL)findOne count:(NSUInteger *)countOut explain:(NSDictionary **)explainOut;
+- (id)find:(NSError **)error requestDict:(NSMutableDictionary *)requestDict one:(BOOL)findOne count:(NSUInteger *)countOut explain:(NSDictionary **)explainOut;
 
 @end
 
 @interface DKQuery (Private)
 
 - (NSMutableDictionary*)queryDictForKey:(NSString *)key;
+- (NSMutableDictionary *)requestDict;
+- (NSArray *)findAllWithSkip:(NSUInteger)skip limit:(NSUInteger)limit error:(NSError **)error;
+- (id)sendQueryRequestDict:(NSMutableDictionary *)requestDict request:(DKRequest *)request error:(NSError **)error;
+- (NSArray *)entitiesFromResults:(NSArray *)results;
+- (NSArray *)entitiesFromResults:(NSArray *)results updatesRegistered:(BOOL)updatesRegistered;
 - (NSString *)makeRegexSafeString:(NSString *)string;
 
 @end
\ No newline at end of file
@@ -10,6 +10,8 @@
 
 #import "DKConstants.h"
 
+@class DKRequestMetrics;
+
 enum {
   DKResponseStatusSuccess = 200,
   DKResponseStatusError = 400
@@ -19,11 +21,13 @@ typedef NSInteger DKResponseStatus;
 @interface DKRequest : NSObject
 @property (nonatomic, copy, readonly) NSString *endpoint;
 @property (nonatomic, assign) DKCachePolicy cachePolicy;
+@property (nonatomic, assign) BOOL returnsRawData;
 
 + (DKRequest *)request;
 
 + (BOOL)canParseResponse:(NSHTTPURLResponse *)response;
 + (id)parseResponse:(NSHTTPURLResponse *)response withData:(NSData *)data error:(NSError **)error;
++ (id)parseResponse:(NSHTTPURLResponse *)response withData:(NSData *)data metrics:(DKRequestMetrics *)metrics error:(NSError **)error;
 
 - (id)initWithEndpoint:(NSString *)absoluteString;
 
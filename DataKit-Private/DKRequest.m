@@ -10,11 +10,20 @@
 
 #import "DKManager.h"
 #import "DKRelation.h"
+#import "DKEntity.h"
+#import "DKIdentityMap.h"
+#import "DKRequestMetrics.h"
+#import "DKRequestMetrics-Private.h"
 #import "NSError+DataKit.h"
+#import "NSData+DataKit.h"
+
+// Request bodies of at least this size are sent gzip compressed
+static const NSUInteger kDKRequestGzipThreshold = 1024;
 
 
 @interface DKRequest ()
 @property (nonatomic, copy, readwrite) NSString *endpoint;
+@property (nonatomic, strong) DKRequestMetrics *metrics;
 @end
 
 // DEVNOTE: Allow untrusted certs in debug version.
@@ -32,6 +41,8 @@
 @implementation DKRequest
 DKSynthesize(endpoint)
 DKSynthesize(cachePolicy)
+DKSynthesize(returnsRawData)
+DKSynthesize(metrics)
 
 + (DKRequest *)request {
   return [[self alloc] init];
@@ -55,10 +66,14 @@ DKSynthesize(cachePolicy)
 }
 
 - (id)sendRequestWithObject:(id)JSONObject method:(NSString *)apiMethod error:(NSError **)error {
+  self.metrics = [DKRequestMetrics metricsForMethod:apiMethod];
+  
   // Wrap special objects before encoding JSON
+  CFAbsoluteTime t0 = CFAbsoluteTimeGetCurrent();
   JSONObject = [isa wrapSpecialObjectsInJSON:JSONObject];
   
   // Encode JSON
+  CFAbsoluteTime t1 = CFAbsoluteTimeGetCurrent();
   NSError *JSONError = nil;
   NSData *JSONData = [NSJSONSerialization dataWithJSONObject:JSONObject options:0 error:&JSONError];
   if (JSONError != nil) {
@@ -66,9 +81,14 @@ DKSynthesize(cachePolicy)
                      code:DKErrorInvalidParams
               description:NSLocalizedString(@"Could not JSON encode request object", nil)
                  original:JSONError];
+    [self.metrics reportWithResponse:nil error:JSONError];
+    self.metrics = nil;
     return nil;
   }
   
+  self.metrics.wrapTime = t1 - t0;
+  self.metrics.encodeTime = CFAbsoluteTimeGetCurrent() - t1;
+  
   return [self sendRequestWithData:JSONData method:apiMethod error:error];
 }
 
@@ -83,10 +103,21 @@ DKSynthesize(cachePolicy)
   req.timeoutInterval = 20.0;
   req.HTTPMethod = @"POST";
   req.cachePolicy = self.cachePolicy;
-  if (bodyData.length > 0) {
-    req.HTTPBody = bodyData;
+  
+  // Large bodies like saveAll batches compress well
+  NSData *sentData = bodyData;
+  if (bodyData.length >= kDKRequestGzipThreshold) {
+    NSData *gzipped = [bodyData gzipDeflate];
+    if (gzipped != nil && gzipped.length < bodyData.length) {
+      sentData = gzipped;
+      [req setValue:@"gzip" forHTTPHeaderField:@"Content-Encoding"];
+    }
+  }
+  if (sentData.length > 0) {
+    req.HTTPBody = sentData;
   }
   [req setValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
+  [req setValue:@"gzip, deflate" forHTTPHeaderField:@"Accept-Encoding"];
   [req setValue:[DKManager APISecret] forHTTPHeaderField:kDKRequestHeaderSecret];
   
   NSError *requestError = nil;
@@ -101,18 +132,49 @@ DKSynthesize(cachePolicy)
   // Log request
   [isa logData:bodyData isOut:YES];
   
+  // Metrics are already set up if the request was sent with a JSON object
+  DKRequestMetrics *metrics = self.metrics;
+  if (metrics == nil) {
+    metrics = [DKRequestMetrics metricsForMethod:apiMethod];
+  }
+  self.metrics = nil;
+  
+  CFAbsoluteTime t0 = CFAbsoluteTimeGetCurrent();
   NSData *result = [NSURLConnection sendSynchronousRequest:req returningResponse:&response error:&requestError];
   
+  metrics.networkTime = CFAbsoluteTimeGetCurrent() - t0;
+  metrics.bytesOut = sentData.length;
+  metrics.bytesIn = result.length;
+  
   // Check for request errors
   if (requestError != nil) {
     [NSError writeToError:error
                      code:DKErrorConnectionFailed
               description:NSLocalizedString(@"Connection failed", nil)
                  original:requestError];
+    [metrics reportWithResponse:response error:requestError];
     return nil;
   }
   
-  return [isa parseResponse:response withData:result error:error];
+  // Successful responses are handed out undecoded if requested, the
+  // caller decodes them on demand
+  if (self.returnsRawData && response.statusCode == DKResponseStatusSuccess) {
+    [isa logData:result isOut:NO];
+    [metrics reportWithResponse:response error:nil];
+    return result;
+  }
+  
+  if (metrics == nil) {
+    return [isa parseResponse:response withData:result error:error];
+  }
+  
+  NSError *parseError = nil;
+  id parsed = [isa parseResponse:response withData:result metrics:metrics error:&parseError];
+  [metrics reportWithResponse:response error:parseError];
+  if (parseError != nil && error != NULL) {
+    *error = parseError;
+  }
+  return parsed;
 }
 
 + (BOOL)canParseResponse:(NSHTTPURLResponse *)response {
@@ -121,6 +183,10 @@ DKSynthesize(cachePolicy)
 }
 
 + (id)parseResponse:(NSHTTPURLResponse *)response withData:(NSData *)data error:(NSError **)error {
+  return [self parseResponse:response withData:data metrics:nil error:error];
+}
+
++ (id)parseResponse:(NSHTTPURLResponse *)response withData:(NSData *)data metrics:(DKRequestMetrics *)metrics error:(NSError **)error {
   if (![self canParseResponse:response]) {
     [NSError writeToError:error
                      code:DKErrorUnknownStatus
@@ -136,11 +202,15 @@ DKSynthesize(cachePolicy)
       NSError *JSONError = nil;
       
       // A successful operation must not always return a JSON body
+      CFAbsoluteTime t0 = CFAbsoluteTimeGetCurrent();
       if (data.length > 0) {      
         resultObj = [NSJSONSerialization JSONObjectWithData:data
                                                     options:NSJSONReadingAllowFragments
                                                       error:&JSONError];
       }
+      CFAbsoluteTime t1 = CFAbsoluteTimeGetCurrent();
+      metrics.decodeTime = t1 - t0;
+      
       if (JSONError != nil) {
         [NSError writeToError:error
                          code:DKErrorInvalidResponse
@@ -148,7 +218,10 @@ DKSynthesize(cachePolicy)
                      original:JSONError];
       }
       else {
-        return [self unwrapSpecialObjectsInJSON:resultObj];
+        resultObj = [self unwrapSpecialObjectsInJSON:resultObj];
+        metrics.unwrapTime = CFAbsoluteTimeGetCurrent() - t1;
+        
+        return resultObj;
       }
     }
     else if (response.statusCode == DKResponseStatusError) {
@@ -199,6 +272,7 @@ DKSynthesize(cachePolicy)
 }
 
 #define kDKObjectDataToken @"dk:data"
+#define kDKObjectEntityToken @"dk:entity"
 #define kDKObjectRelationRefKey @"$ref"
 #define kDKObjectRelationIDKey @"$id"
 
@@ -224,6 +298,14 @@ DKSynthesize(cachePolicy)
                              relation.entityId, kDKObjectRelationIDKey, nil];
       return dbRef;
     }
+    // DKEntities (included references)
+    else if ([objectToModify isKindOfClass:[DKEntity class]]) {
+      DKEntity *entity = (DKEntity *)objectToModify;
+      NSDictionary *dbRef = [NSDictionary dictionaryWithObjectsAndKeys:
+                             entity.entityName, kDKObjectRelationRefKey,
+                             entity.entityId, kDKObjectRelationIDKey, nil];
+      return dbRef;
+    }
     return objectToModify;
   }];
 }
@@ -247,6 +329,20 @@ DKSynthesize(cachePolicy)
       if (relId.length > 0 && relRef.length > 0) {
         return [DKRelation relationWithEntityName:relRef entityId:relId];
       }
+      
+      // Included references, the server marks them with the entity name
+      NSString *entityName = [dict objectForKey:kDKObjectEntityToken];
+      if ([entityName isKindOfClass:[NSString class]]) {
+        NSMutableDictionary *resultMap = [NSMutableDictionary dictionaryWithDictionary:dict];
+        [resultMap removeObjectForKey:kDKObjectEntityToken];
+        if ([DKManager identityMapEnabled]) {
+          return [[DKIdentityMap sharedMap] entityWithName:entityName
+                                                 resultMap:[self unwrapSpecialObjectsInJSON:resultMap]
+                                                projection:nil
+                                                faultGroup:nil];
+        }
+        return resultMap;
+      }
     }
     return objectToModify;
   }];
@@ -0,0 +1,31 @@
+//
+//  DKRequestMetrics-Private.h
+//  DataKit
+//
+//  Created by Erik Aigner on 29.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKRequestMetrics.h"
+
+@interface DKRequestMetrics () // CLS_EXT
+@property (nonatomic, copy, readwrite) NSString *method;
+@property (nonatomic, assign, readwrite) NSInteger statusCode;
+@property (nonatomic, assign, readwrite) NSInteger errorCode;
+@property (nonatomic, assign, readwrite) NSTimeInterval queueWaitTime;
+@property (nonatomic, assign, readwrite) NSTimeInterval wrapTime;
+@property (nonatomic, assign, readwrite) NSTimeInterval encodeTime;
+@property (nonatomic, assign, readwrite) NSTimeInterval networkTime;
+@property (nonatomic, assign, readwrite) NSTimeInterval decodeTime;
+@property (nonatomic, assign, readwrite) NSTimeInterval unwrapTime;
+@property (nonatomic, assign, readwrite) NSUInteger bytesOut;
+@property (nonatomic, assign, readwrite) NSUInteger bytesIn;
+@end
+
+@interface DKRequestMetrics (Private)
+
++ (DKRequestMetrics *)metricsForMethod:(NSString *)method;
+
+- (void)reportWithResponse:(NSHTTPURLResponse *)response error:(NSError *)error;
+
+@end
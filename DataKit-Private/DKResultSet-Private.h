@@ -0,0 +1,16 @@
+//
+//  DKResultSet-Private.h
+//  DataKit
+//
+//  Created by Erik Aigner on 04.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKResultSet.h"
+
+@interface DKResultSet (Private)
+
+- (id)initWithEntityName:(NSString *)entityName data:(NSData *)data projection:(NSDictionary *)projection;
+- (id)initWithEntityName:(NSString *)entityName data:(NSData *)data rows:(NSData *)rows projection:(NSDictionary *)projection;
+
+@end
@@ -0,0 +1,20 @@
+//
+//  DKSaveBatcher.h
+//  DataKit
+//
+//  Created by Erik Aigner on 27.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class DKEntity;
+
+@interface DKSaveBatcher : NSObject
+
++ (DKSaveBatcher *)sharedBatcher;
+
+- (void)enqueueEntity:(DKEntity *)entity queue:(dispatch_queue_t)queue block:(void (^)(DKEntity *entity, NSError *error))block;
+- (void)flush;
+
+@end
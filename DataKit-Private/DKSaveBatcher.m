@@ -0,0 +1,316 @@
+//
+//  DKSaveBatcher.m
+//  DataKit
+//
+//  Created by Erik Aigner on 27.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKSaveBatcher.h"
+
+#import "DKEntity.h"
+#import "DKEntity-Private.h"
+#import "DKManager.h"
+#import "DKManager-Private.h"
+#import "DKRequest.h"
+
+#define kDKSaveBatcherErrorKey @"dk:error"
+
+@interface DKSaveBatcherRecord : NSObject
+@property (nonatomic, strong) NSMutableArray *entities;
+@property (nonatomic, strong) NSMutableArray *operations;
+@property (nonatomic, strong) NSMutableArray *dispatchers;
+@property (nonatomic, strong) NSMutableArray *callbacks;
+@property (nonatomic, strong) NSDictionary *resultMap;
+@property (nonatomic, assign) BOOL sent;
+@end
+
+@implementation DKSaveBatcherRecord
+DKSynthesize(entities)
+DKSynthesize(operations)
+DKSynthesize(dispatchers)
+DKSynthesize(callbacks)
+DKSynthesize(resultMap)
+DKSynthesize(sent)
+
+- (id)init {
+  self = [super init];
+  if (self) {
+    self.entities = [NSMutableArray new];
+    self.operations = [NSMutableArray new];
+    self.dispatchers = [NSMutableArray new];
+    self.callbacks = [NSMutableArray new];
+  }
+  return self;
+}
+
+- (BOOL)conflictsWithOperations:(NSDictionary *)operations ofEntity:(DKEntity *)entity {
+  NSUInteger i = 0;
+  for (DKEntity *other in self.entities) {
+    if (other != entity &&
+        [DKEntity operations:operations conflictWithOperations:[self.operations objectAtIndex:i]]) {
+      return YES;
+    }
+    i++;
+  }
+  return NO;
+}
+
+@end
+
+@implementation DKSaveBatcher {
+@private
+  dispatch_queue_t    stateQueue_;
+  NSMutableArray      *records_;
+  NSMutableDictionary *recordIndex_;
+  NSMutableDictionary *entityRecords_;
+  NSMutableDictionary *deferredSaves_;
+  NSUInteger          generation_;
+  BOOL                flushScheduled_;
+}
+
++ (DKSaveBatcher *)sharedBatcher {
+  static DKSaveBatcher *batcher;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    batcher = [self new];
+  });
+  return batcher;
+}
+
+- (id)init {
+  self = [super init];
+  if (self) {
+    stateQueue_ = dispatch_queue_create("datakit save batcher queue", DISPATCH_QUEUE_SERIAL);
+    records_ = [NSMutableArray new];
+    recordIndex_ = [NSMutableDictionary new];
+    entityRecords_ = [NSMutableDictionary new];
+    deferredSaves_ = [NSMutableDictionary new];
+  }
+  return self;
+}
+
+- (void)enqueueEntity:(DKEntity *)entity queue:(dispatch_queue_t)queue block:(void (^)(DKEntity *entity, NSError *error))block {
+  block = [block copy];
+  void (^callback)(NSError *) = [^(NSError *error) {
+    if (block != NULL) {
+      dispatch_async(queue, ^{
+        block(entity, error);
+      });
+    }
+  } copy];
+  void (^dispatcher)(dispatch_block_t) = [^(dispatch_block_t work) {
+    dispatch_async(queue, work);
+  } copy];
+  
+  // Saved entities are coalesced by ID, new ones by instance
+  id key = nil;
+  NSString *entityId = entity.entityId;
+  if (entityId.length > 0) {
+    key = [NSString stringWithFormat:@"%@:%@", entity.entityName, entityId];
+  }
+  else {
+    key = [NSValue valueWithNonretainedObject:entity];
+  }
+  NSValue *entityKey = [NSValue valueWithNonretainedObject:entity];
+  
+  // The entity may change until the flush, so its operations are copied
+  // on the caller's queue
+  NSDictionary *operations = [entity pendingOperations];
+  NSDictionary *resultMap = entity.resultMap;
+  
+  dispatch_async(stateQueue_, ^{
+    DKSaveBatcherRecord *record = [entityRecords_ objectForKey:entityKey];
+    if (record != nil) {
+      // The copy of an entity that is already being sent still contains
+      // the sent operations, or it can't be merged with the other
+      // instances anymore. The entity is saved again once the earlier
+      // save committed.
+      if (record.sent || [record conflictsWithOperations:operations ofEntity:entity]) {
+        NSMutableArray *deferred = [deferredSaves_ objectForKey:entityKey];
+        if (deferred == nil) {
+          deferred = [NSMutableArray new];
+          [deferredSaves_ setObject:deferred forKey:entityKey];
+        }
+        [deferred addObject:[^{
+          dispatch_async(queue, ^{
+            [self enqueueEntity:entity queue:queue block:block];
+          });
+        } copy]];
+        return;
+      }
+      
+      // Operations accumulate on the entity, the latest copy replaces
+      // the earlier one
+      NSUInteger index = [record.entities indexOfObjectIdenticalTo:entity];
+      [record.operations replaceObjectAtIndex:index withObject:operations];
+      [record.dispatchers replaceObjectAtIndex:index withObject:dispatcher];
+      [[record.callbacks objectAtIndex:index] addObject:callback];
+    }
+    else {
+      // Operations of another instance that can't be merged into one
+      // update, like a set and an increment of the same key, go into a
+      // new record. The earlier record is sent on its own, before it.
+      record = [recordIndex_ objectForKey:key];
+      if (record != nil && [record conflictsWithOperations:operations ofEntity:entity]) {
+        record = nil;
+      }
+      if (record == nil) {
+        record = [DKSaveBatcherRecord new];
+        [records_ addObject:record];
+        [recordIndex_ setObject:record forKey:key];
+      }
+      [record.entities addObject:entity];
+      [record.operations addObject:operations];
+      [record.dispatchers addObject:dispatcher];
+      [record.callbacks addObject:[NSMutableArray arrayWithObject:callback]];
+      [entityRecords_ setObject:record forKey:entityKey];
+    }
+    record.resultMap = resultMap;
+    
+    // Flush when the batch is full, otherwise after the delay
+    if (records_.count >= [DKManager writeCoalescingBatchSize]) {
+      [self flushRecords];
+    }
+    else if (!flushScheduled_) {
+      flushScheduled_ = YES;
+      NSUInteger generation = generation_;
+      int64_t delay = (int64_t)([DKManager writeCoalescingDelay] * NSEC_PER_SEC);
+      dispatch_after(dispatch_time(DISPATCH_TIME_NOW, delay), stateQueue_, ^{
+        if (generation == generation_) {
+          [self flushRecords];
+        }
+      });
+    }
+  });
+}
+
+- (void)flush {
+  dispatch_async(stateQueue_, ^{
+    [self flushRecords];
+  });
+}
+
+#pragma mark - Private
+
+- (void)flushRecords {
+  generation_++;
+  flushScheduled_ = NO;
+  
+  if (records_.count == 0) {
+    return;
+  }
+  
+  NSArray *records = [NSArray arrayWithArray:records_];
+  [records_ removeAllObjects];
+  [recordIndex_ removeAllObjects];
+  for (DKSaveBatcherRecord *record in records) {
+    record.sent = YES;
+  }
+  
+  [DKManager dispatchInBackground:^{
+    [self saveRecords:records];
+  }];
+}
+
+- (void)saveRecords:(NSArray *)records {
+  NSMutableArray *requestObjects = [NSMutableArray new];
+  NSMutableArray *sentRecords = [NSMutableArray new];
+  
+  // Merge the pending operations of all instances of an entity
+  for (DKSaveBatcherRecord *record in records) {
+    DKEntity *first = [record.entities objectAtIndex:0];
+    DKEntity *merged = [[DKEntity alloc] initWithName:first.entityName];
+    merged.resultMap = record.resultMap;
+    
+    for (NSDictionary *operations in record.operations) {
+      [merged mergeOperations:operations];
+    }
+    
+    if (merged.isDirty) {
+      [requestObjects addObject:[merged saveRequestDict]];
+      [sentRecords addObject:record];
+    }
+    else {
+      [self finishRecord:record resultMap:nil error:nil];
+    }
+  }
+  
+  if (requestObjects.count == 0) {
+    return;
+  }
+  
+  // Send request synchronously. The server reports the result of each
+  // entity, so a failed save doesn't fail the others in the batch.
+  DKRequest *request = [DKRequest request];
+  request.cachePolicy = DKCachePolicyIgnoreCache;
+  
+  NSError *requestError = nil;
+  NSArray *results = [request sendRequestWithObject:requestObjects method:@"save?partial=true" error:&requestError];
+  if (requestError == nil && !([results isKindOfClass:[NSArray class]] && results.count == sentRecords.count)) {
+    [NSError writeToError:&requestError
+                     code:DKErrorInvalidResponse
+              description:NSLocalizedString(@"Save result count does not match request", nil)
+                 original:nil];
+  }
+  
+  NSUInteger i = 0;
+  for (DKSaveBatcherRecord *record in sentRecords) {
+    NSDictionary *resultMap = nil;
+    NSError *error = requestError;
+    if (error == nil) {
+      resultMap = [results objectAtIndex:i];
+      NSDictionary *errorObject = nil;
+      if ([resultMap isKindOfClass:[NSDictionary class]]) {
+        errorObject = [resultMap objectForKey:kDKSaveBatcherErrorKey];
+      }
+      if ([errorObject isKindOfClass:[NSDictionary class]]) {
+        NSNumber *status = [errorObject objectForKey:@"status"];
+        NSString *message = [errorObject objectForKey:@"message"];
+        [NSError writeToError:&error
+                         code:status.integerValue
+                  description:message
+                     original:nil];
+        resultMap = nil;
+      }
+    }
+    [self finishRecord:record resultMap:resultMap error:error];
+    i++;
+  }
+}
+
+- (void)finishRecord:(DKSaveBatcherRecord *)record resultMap:(NSDictionary *)resultMap error:(NSError *)error {
+  // Entities are committed on the queue they were saved from, so the
+  // operations are not modified concurrently
+  NSUInteger i = 0;
+  for (DKEntity *entity in record.entities) {
+    NSDictionary *operations = [record.operations objectAtIndex:i];
+    NSArray *callbacks = [record.callbacks objectAtIndex:i];
+    void (^dispatcher)(dispatch_block_t) = [record.dispatchers objectAtIndex:i];
+    
+    dispatcher(^{
+      NSError *commitError = error;
+      if (commitError == nil && resultMap != nil) {
+        [entity commitObjectResultMap:resultMap sentOperations:operations error:&commitError];
+      }
+      for (void (^callback)(NSError *) in callbacks) {
+        callback(commitError);
+      }
+      
+      // Saves that were held back for this entity are queued again with
+      // the remaining operations
+      NSValue *entityKey = [NSValue valueWithNonretainedObject:entity];
+      dispatch_async(stateQueue_, ^{
+        [entityRecords_ removeObjectForKey:entityKey];
+        NSArray *deferred = [deferredSaves_ objectForKey:entityKey];
+        [deferredSaves_ removeObjectForKey:entityKey];
+        for (dispatch_block_t resave in deferred) {
+          resave();
+        }
+      });
+    });
+    i++;
+  }
+}
+
+@end
@@ -0,0 +1,17 @@
+//
+//  DKSnapshot-Private.h
+//  DataKit
+//
+//  Created by Erik Aigner on 06.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKSnapshot.h"
+
+@interface DKSnapshot (Private)
+
+- (NSData *)data;
+- (NSData *)rowsForRequestDict:(NSDictionary *)requestDict;
+- (NSArray *)resultsForRows:(NSData *)rows limit:(NSUInteger)limit;
+
+@end
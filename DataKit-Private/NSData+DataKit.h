@@ -22,6 +22,12 @@
 
 @end
 
+@interface NSData (Gzip)
+
+- (NSData *)gzipDeflate;
+
+@end
+
 @interface NSData (AES256)
 
 - (NSData *)AES256EncryptWithKey:(NSData *)key UNAVAILABLE_ATTRIBUTE;
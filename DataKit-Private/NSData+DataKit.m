@@ -9,6 +9,7 @@
 #import "NSData+DataKit.h"
 
 #import <CommonCrypto/CommonCryptor.h>
+#import <zlib.h>
 
 @implementation NSData (Hex)
 
@@ -159,6 +160,36 @@ static const char _DKNSDataBase64EncodingTable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZab
 
 @end
 
+@implementation NSData (Gzip)
+
+- (NSData *)gzipDeflate {
+  if (self.length == 0) {
+    return self;
+  }
+  
+  z_stream strm;
+  memset(&strm, 0, sizeof(z_stream));
+  
+  // Window bits 15 + 16 writes a gzip header instead of a zlib header
+  if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, (15 + 16), 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return nil;
+  }
+  strm.next_in = (Bytef *)self.bytes;
+  strm.avail_in = (uInt)self.length;
+  
+  NSMutableData *compressed = [NSMutableData dataWithLength:deflateBound(&strm, strm.avail_in)];
+  strm.next_out = compressed.mutableBytes;
+  strm.avail_out = (uInt)compressed.length;
+  
+  int status = deflate(&strm, Z_FINISH);
+  compressed.length = strm.total_out;
+  deflateEnd(&strm);
+  
+  return (status == Z_STREAM_END) ? compressed : nil;
+}
+
+@end
+
 @implementation NSData (AES256)
 
 - (NSData *)AES256EncryptWithKey:(NSData *)key {
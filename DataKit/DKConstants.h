@@ -23,9 +23,11 @@ enum {
   DKErrorOperationFailed = 101,
   DKErrorOperationNotAllowed = 102,
   DKErrorDuplicateKey = 103,
+  DKErrorPreparedQueryNotFound = 104,
   DKErrorConnectionFailed = 200,
   DKErrorInvalidResponse,
-  DKErrorUnknownStatus
+  DKErrorUnknownStatus,
+  DKErrorCancelled
 };
 typedef NSInteger DKError;
 
@@ -57,6 +57,11 @@
  */
 @property (nonatomic, readonly) BOOL isDirty;
 
+/**
+ `YES` if the entity was loaded with only some of its keys and the others have not been fetched yet, `NO` otherwise
+ */
+@property (nonatomic, readonly) BOOL isFault;
+
 /** @name Creating and Initializing Entities */
 
 /**
@@ -205,11 +210,30 @@
  Gets the object stored at `key`.
  
  If the key does not exist in the saved object, tries to return a value from the unsaved changes.
+ 
+ If the entity was loaded by a query using <[DKQuery includeKeys:]> or <[DKQuery excludeKeys:]> and `key` was not part of the result, the missing keys are fetched synchronously. All entities returned by the same query are faulted in with a single request.
+ 
+ @warning Fetching the missing keys blocks the calling thread until the request finished, and a failed request returns `nil` without reporting the error. Call <faultInInBackgroundWithBlock:> first to fetch them off the main thread.
  @param key The object key
  @return The object or `nil` if no object is set for `key`
  */
 - (id)objectForKey:(NSString *)key;
 
+/**
+ Fetches the keys missing from a partially loaded entity
+ 
+ All entities returned by the same query are faulted in with a single request. Does nothing if the entity is no fault.
+ @param error The error object to be set on error
+ @return `YES` on success, `NO` on error
+ */
+- (BOOL)faultIn:(NSError **)error;
+
+/**
+ Fetches the keys missing from a partially loaded entity in the background and invokes the callback on completion
+ @param block The callback block
+ */
+- (void)faultInInBackgroundWithBlock:(void (^)(DKEntity *entity, NSError *error))block;
+
 /** @name Modifying Objects*/
 
 /**
@@ -326,7 +350,7 @@
 /**
  Ensures that the given `key` is indexed with options
  
- Indexes often improve query perfomance dramatically.
+ Indexes often improve query perfomance dramatically. Use <DKIndex> for compound, sparse or descending indexes.
  @param key The key to index
  @param unique Make the `key` unique
  @param dropDups Automatically drop any duplicates
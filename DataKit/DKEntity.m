@@ -13,21 +13,80 @@
 #import "DKRequest.h"
 #import "DKConstants.h"
 #import "DKManager.h"
+#import "DKManager-Private.h"
+#import "DKIndex.h"
+#import "DKSaveBatcher.h"
+#import "DKFaultGroup.h"
+#import "DKIdentityMap.h"
 
 @implementation DKEntity
 DKSynthesize(entityName)
-DKSynthesize(setMap)
-DKSynthesize(unsetMap)
-DKSynthesize(incMap)
-DKSynthesize(pushMap)
-DKSynthesize(pushAllMap)
-DKSynthesize(addToSetMap)
-DKSynthesize(popMap)
-DKSynthesize(pullAllMap)
+DKSynthesize(operations)
 DKSynthesize(resultMap)
+DKSynthesize(projection)
+DKSynthesize(faultGroup)
 
 #define kDKEntityIDField @"_id"
 #define kDKEntityUpdatedField @"_updated"
+#define kDKEntityNotModifiedKey @"dk:notModified"
+
+// Operation map keys, these match the save request keys
+#define kDKEntityOperationSet @"set"
+#define kDKEntityOperationUnset @"unset"
+#define kDKEntityOperationInc @"inc"
+#define kDKEntityOperationPush @"push"
+#define kDKEntityOperationPushAll @"pushAll"
+#define kDKEntityOperationAddToSet @"addToSet"
+#define kDKEntityOperationPop @"pop"
+#define kDKEntityOperationPullAll @"pullAll"
+
+static void DKEntityValidateKeys(id obj) {
+  // Prevent use of '$' and '.' in keys
+  static NSCharacterSet *forbiddenChars;
+  if (forbiddenChars == nil) {
+    forbiddenChars = [NSCharacterSet characterSetWithCharactersInString:@"$."];
+  }
+  
+  if ([obj isKindOfClass:[NSDictionary class]]) {
+    for (NSString *key in obj) {
+      NSRange range = [key rangeOfCharacterFromSet:forbiddenChars];
+      if (range.location != NSNotFound) {
+        [NSException raise:NSInvalidArgumentException
+                    format:@"Invalid object key '%@'. Keys may not contain '$' or '.'", key];
+      }
+      DKEntityValidateKeys([obj objectForKey:key]);
+    }
+  }
+  else if ([obj isKindOfClass:[NSArray class]]) {
+    for (id obj2 in obj) {
+      DKEntityValidateKeys(obj2);
+    }
+  }
+}
+
+static NSNumber *DKEntityAddNumbers(NSNumber *a, NSNumber *b) {
+  if (a == nil) {
+    return b;
+  }
+  const char *typeA = [a objCType];
+  const char *typeB = [b objCType];
+  if (strcmp(typeA, @encode(double)) == 0 || strcmp(typeA, @encode(float)) == 0 ||
+      strcmp(typeB, @encode(double)) == 0 || strcmp(typeB, @encode(float)) == 0) {
+    return [NSNumber numberWithDouble:[a doubleValue] + [b doubleValue]];
+  }
+  return [NSNumber numberWithLongLong:[a longLongValue] + [b longLongValue]];
+}
+
+static NSString *DKEntityOperationModifier(NSString *operation) {
+  // Set and unset, push and push-all are merged into one modifier
+  if ([operation isEqualToString:kDKEntityOperationUnset]) {
+    return kDKEntityOperationSet;
+  }
+  if ([operation isEqualToString:kDKEntityOperationPushAll]) {
+    return kDKEntityOperationPush;
+  }
+  return operation;
+}
 
 + (DKEntity *)entityWithName:(NSString *)entityName {
   return [[self alloc] initWithName:entityName];
@@ -39,74 +98,16 @@ DKSynthesize(resultMap)
 
 + (BOOL)saveAll:(NSArray *)objects error:(NSError **)error {
   NSMutableArray *requestObjects = [NSMutableArray new];
+  NSMutableArray *dirtyObjects = [NSMutableArray new];
   
   for (DKEntity *entity in objects) {
     // Check if data has been written
     if (!entity.isDirty) {
-      return YES;
+      continue;
     }
     
-    // Prevent use of '!', '$' and '.' in keys
-    static NSCharacterSet *forbiddenChars;
-    if (forbiddenChars == nil) {
-      forbiddenChars = [NSCharacterSet characterSetWithCharactersInString:@"$."];
-    }
-    
-    __block id (^validateKeys)(id obj);
-    validateKeys = [^(id obj) {
-      if ([obj isKindOfClass:[NSDictionary class]]) {
-        for (NSString *key in obj) {
-          NSRange range = [key rangeOfCharacterFromSet:forbiddenChars];
-          if (range.location != NSNotFound) {
-            [NSException raise:NSInvalidArgumentException
-                        format:@"Invalid object key '%@'. Keys may not contain '$' or '.'", key];
-          }
-          id obj2 = [obj objectForKey:key];
-          validateKeys(obj2);
-        }
-      }
-      else if ([obj isKindOfClass:[NSArray class]]) {
-        for (id obj2 in obj) {
-          validateKeys(obj2);
-        }
-      }
-      return obj;
-    } copy];
-    
-    // Create request dict
-    NSMutableDictionary *requestDict = [NSMutableDictionary dictionaryWithObjectsAndKeys:
-                                        entity.entityName, @"entity", nil];
-    if (entity.setMap.count > 0) {
-      [requestDict setObject:validateKeys(entity.setMap) forKey:@"set"];
-    }
-    if (entity.unsetMap.count > 0) {
-      [requestDict setObject:validateKeys(entity.unsetMap) forKey:@"unset"];
-    }
-    if (entity.incMap.count > 0) {
-      [requestDict setObject:validateKeys(entity.incMap) forKey:@"inc"];
-    }
-    if (entity.pushMap.count > 0) {
-      [requestDict setObject:validateKeys(entity.pushMap) forKey:@"push"];
-    }
-    if (entity.pushAllMap.count > 0) {
-      [requestDict setObject:validateKeys(entity.pushAllMap) forKey:@"pushAll"];
-    }
-    if (entity.addToSetMap.count > 0) {
-      [requestDict setObject:validateKeys(entity.addToSetMap) forKey:@"addToSet"];
-    }
-    if (entity.popMap.count > 0) {
-      [requestDict setObject:validateKeys(entity.popMap) forKey:@"pop"];
-    }
-    if (entity.pullAllMap.count > 0) {
-      [requestDict setObject:validateKeys(entity.pullAllMap) forKey:@"pullAll"];
-    }
-    
-    NSString *oid = entity.entityId;
-    if (oid.length > 0) {
-      [requestDict setObject:oid forKey:@"oid"];
-    }
-    
-    [requestObjects addObject:requestDict];
+    [requestObjects addObject:[entity saveRequestDict]];
+    [dirtyObjects addObject:entity];
   }
   
   NSArray *results = nil;
@@ -126,7 +127,7 @@ DKSynthesize(resultMap)
   }
   
   NSUInteger i = 0;
-  for (DKEntity *entity in objects) {
+  for (DKEntity *entity in dirtyObjects) {
     NSError *commitError = nil;
     BOOL success = [entity commitObjectResultMap:[results objectAtIndex:i]
                                            error:&commitError];
@@ -149,7 +150,7 @@ DKSynthesize(resultMap)
 + (void)saveAllInBackground:(NSArray *)objects withBlock:(void (^)(NSArray *entities, NSError *error))block {
   block = [block copy];
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     [self saveAll:objects error:&error];
     if (block != NULL) {
@@ -157,7 +158,7 @@ DKSynthesize(resultMap)
         block(objects, error); 
       });
     }
-  });
+  }];
 }
 
 + (BOOL)destroyAllEntitiesForName:(NSString *)entityName error:(NSError **)error {
@@ -182,14 +183,6 @@ DKSynthesize(resultMap)
   self = [super init];
   if (self) {
     self.entityName = entityName;
-    self.setMap = [NSMutableDictionary new];
-    self.unsetMap = [NSMutableDictionary new];
-    self.incMap = [NSMutableDictionary new];
-    self.pushMap = [NSMutableDictionary new];
-    self.pushAllMap = [NSMutableDictionary new];
-    self.addToSetMap = [NSMutableDictionary new];
-    self.popMap = [NSMutableDictionary new];
-    self.pullAllMap = [NSMutableDictionary new];
   }
   return self;
 }
@@ -242,25 +235,20 @@ DKSynthesize(resultMap)
 }
 
 - (BOOL)isDirty {
-  return (self.setMap.count +
-          self.unsetMap.count +
-          self.incMap.count +
-          self.pushMap.count +
-          self.pushAllMap.count +
-          self.addToSetMap.count +
-          self.popMap.count +
-          self.pullAllMap.count) > 0;
+  for (NSDictionary *map in [self.operations objectEnumerator]) {
+    if (map.count > 0) {
+      return YES;
+    }
+  }
+  return NO;
+}
+
+- (BOOL)isFault {
+  return (self.projection != nil);
 }
 
 - (void)reset {
-  [self.setMap removeAllObjects];
-  [self.unsetMap removeAllObjects];
-  [self.incMap removeAllObjects];
-  [self.pushMap removeAllObjects];
-  [self.pushAllMap removeAllObjects];
-  [self.addToSetMap removeAllObjects];
-  [self.popMap removeAllObjects];
-  [self.pullAllMap removeAllObjects];
+  self.operations = nil;
 }
 
 - (BOOL)save {
@@ -278,7 +266,14 @@ DKSynthesize(resultMap)
 - (void)saveInBackgroundWithBlock:(void (^)(DKEntity *entity, NSError *error))block {
   block = [block copy];
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  
+  // Defer the save if write coalescing is enabled
+  if ([DKManager writeCoalescingEnabled]) {
+    [[DKSaveBatcher sharedBatcher] enqueueEntity:self queue:q block:block];
+    return;
+  }
+  
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     [self save:&error];
     if (block != NULL) {
@@ -286,11 +281,11 @@ DKSynthesize(resultMap)
         block(self, error); 
       });
     }
-  });
+  }];
 }
 
 - (BOOL)refresh {
-  return [self refresh];
+  return [self refresh:NULL];
 }
 
 - (BOOL)refresh:(NSError **)error {
@@ -301,9 +296,15 @@ DKSynthesize(resultMap)
   }
   
   // Create request dict
-  NSDictionary *requestDict = [NSDictionary dictionaryWithObjectsAndKeys:
-                               self.entityName, @"entity",
-                               self.entityId, @"oid", nil];
+  NSMutableDictionary *requestDict = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                      self.entityName, @"entity",
+                                      self.entityId, @"oid", nil];
+  
+  // Send the known update timestamp, so the server can skip unchanged entities
+  NSNumber *updated = [self.resultMap objectForKey:kDKEntityUpdatedField];
+  if ([updated isKindOfClass:[NSNumber class]]) {
+    [requestDict setObject:updated forKey:@"updated"];
+  }
   
   // Send request synchronously
   DKRequest *request = [DKRequest request];
@@ -328,7 +329,7 @@ DKSynthesize(resultMap)
 - (void)refreshInBackgroundWithBlock:(void (^)(DKEntity *entity, NSError *error))block {
   block = [block copy];
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     [self refresh:&error];
     if (block != NULL) {
@@ -336,7 +337,7 @@ DKSynthesize(resultMap)
         block(self, error); 
       });
     }
-  });
+  }];
 }
 
 - (BOOL)delete {
@@ -369,6 +370,7 @@ DKSynthesize(resultMap)
   }
   
   // Remove maps
+  [[DKIdentityMap sharedMap] removeEntity:self];
   self.resultMap = [NSDictionary new];
 
   [self reset];
@@ -383,7 +385,7 @@ DKSynthesize(resultMap)
 - (void)deleteInBackgroundWithBlock:(void (^)(DKEntity *entity, NSError *error))block {
   block = [block copy];
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     [self delete:&error];
     if (block != NULL) {
@@ -391,7 +393,7 @@ DKSynthesize(resultMap)
         block(self, error); 
       });
     }
-  });
+  }];
 }
 
 - (BOOL)ensureIndexForKey:(NSString *)key {
@@ -399,47 +401,58 @@ DKSynthesize(resultMap)
 }
 
 - (BOOL)ensureIndexForKey:(NSString *)key unique:(BOOL)unique dropDuplicates:(BOOL)dropDups error:(NSError **)error {
-  // Create request dict
-  NSDictionary *requestDict = [NSDictionary dictionaryWithObjectsAndKeys:
-                               self.entityName, @"entity",
-                               key, @"key",
-                               [NSNumber numberWithBool:unique], @"unique",
-                               [NSNumber numberWithBool:dropDups], @"drop", nil];
-  
-  // Send request synchronously
-  DKRequest *request = [DKRequest request];
-  request.cachePolicy = DKCachePolicyIgnoreCache;
-  
-  NSError *requestError = nil;
-  [request sendRequestWithObject:requestDict method:@"index" error:&requestError];
-  if (requestError != nil) {
-    if (error != nil) {
-      *error = requestError;
-    }
-    return NO;
-  }
+  DKIndex *index = [DKIndex indexWithEntityName:self.entityName];
+  [index addAscendingKey:key];
+  index.unique = unique;
+  index.dropDuplicates = dropDups;
   
-  return YES;
+  return [index ensure:error];
 }
 
 - (id)objectForKey:(NSString *)key {
-  id obj = [self.setMap objectForKey:key];
+  id obj = [[self operationMapForKey:kDKEntityOperationSet] objectForKey:key];
   if (obj == nil) {
     obj = [self.resultMap objectForKey:key];
   }
+  if (obj == nil && [self isFaultForKey:key]) {
+    NSError *error = nil;
+    if ([self faultIn:&error]) {
+      obj = [self.resultMap objectForKey:key];
+    }
+#ifdef CONFIGURATION_Debug
+    else {
+      NSLog(@"warning: could not fault in key '%@': %@", key, error);
+    }
+#endif
+  }
   return obj;
 }
 
 - (void)setObject:(id)object forKey:(NSString *)key {
-  [self.setMap setObject:object forKey:key];
+  [[self mutableOperationMapForKey:kDKEntityOperationSet] setObject:object forKey:key];
 }
 
 - (void)pushObject:(id)object forKey:(NSString *)key {
-  [self.pushMap setObject:object forKey:key];
+  // Multiple pushes on the same key are combined into a push-all
+  if ([[self operationMapForKey:kDKEntityOperationPush] objectForKey:key] == nil &&
+      [[self operationMapForKey:kDKEntityOperationPushAll] objectForKey:key] == nil) {
+    [[self mutableOperationMapForKey:kDKEntityOperationPush] setObject:object forKey:key];
+  }
+  else {
+    [self pushAllObjects:[NSArray arrayWithObject:object] forKey:key];
+  }
 }
 
 - (void)pushAllObjects:(NSArray *)objects forKey:(NSString *)key {
-  [self.pushAllMap setObject:objects forKey:key];
+  NSMutableArray *list = [NSMutableArray new];
+  id pushed = [[self operationMapForKey:kDKEntityOperationPush] objectForKey:key];
+  if (pushed != nil) {
+    [list addObject:pushed];
+    [[self mutableOperationMapForKey:kDKEntityOperationPush] removeObjectForKey:key];
+  }
+  [list addObjectsFromArray:[[self operationMapForKey:kDKEntityOperationPushAll] objectForKey:key]];
+  [list addObjectsFromArray:objects];
+  [[self mutableOperationMapForKey:kDKEntityOperationPushAll] setObject:list forKey:key];
 }
 
 - (void)addObjectToSet:(id)object forKey:(NSString *)key {
@@ -447,20 +460,20 @@ DKSynthesize(resultMap)
 }
 
 - (void)addAllObjectsToSet:(NSArray *)objects forKey:(NSString *)key {
-  NSMutableArray *list = [self.addToSetMap objectForKey:key];
+  NSMutableArray *list = [[self operationMapForKey:kDKEntityOperationAddToSet] objectForKey:key];
   if (list == nil) {
     list = [NSMutableArray new];
-    [self.addToSetMap setObject:list forKey:key];
+    [[self mutableOperationMapForKey:kDKEntityOperationAddToSet] setObject:list forKey:key];
   }
   for (id obj in objects) {
-    if (![list containsObject:objects]) {
+    if (![list containsObject:obj]) {
       [list addObject:obj];
     }
   }
 }
 
 - (void)popObjectEnd:(NSNumber *)end forKey:(NSString *)key {
-  [self.popMap setObject:end forKey:key];
+  [[self mutableOperationMapForKey:kDKEntityOperationPop] setObject:end forKey:key];
 }
 
 - (void)popLastObjectForKey:(NSString *)key {
@@ -476,11 +489,17 @@ DKSynthesize(resultMap)
 }
 
 - (void)pullAllObjects:(NSArray *)objects forKey:(NSString *)key {
-  [self.pullAllMap setObject:objects forKey:key];
+  NSMutableArray *list = [NSMutableArray arrayWithArray:[[self operationMapForKey:kDKEntityOperationPullAll] objectForKey:key]];
+  for (id obj in objects) {
+    if (![list containsObject:obj]) {
+      [list addObject:obj];
+    }
+  }
+  [[self mutableOperationMapForKey:kDKEntityOperationPullAll] setObject:list forKey:key];
 }
 
 - (void)removeObjectForKey:(NSString *)key {
-  [self.unsetMap setObject:[NSNumber numberWithInteger:1] forKey:key];
+  [[self mutableOperationMapForKey:kDKEntityOperationUnset] setObject:[NSNumber numberWithInteger:1] forKey:key];
 }
 
 - (void)incrementKey:(NSString *)key {
@@ -488,7 +507,9 @@ DKSynthesize(resultMap)
 }
 
 - (void)incrementKey:(NSString *)key byAmount:(NSNumber *)amount {
-  [self.incMap setObject:amount forKey:key];
+  // Increments accumulate until the entity is saved
+  NSNumber *sum = DKEntityAddNumbers([[self operationMapForKey:kDKEntityOperationInc] objectForKey:key], amount);
+  [[self mutableOperationMapForKey:kDKEntityOperationInc] setObject:sum forKey:key];
 }
 
 - (NSURL *)generatePublicURLForFields:(NSArray *)fieldKeys error:(NSError **)error {
@@ -529,7 +550,7 @@ DKSynthesize(resultMap)
 - (void)generatePublicURLForFields:(NSArray *)fieldKeys inBackgroundWithBlock:(void (^)(NSURL *publicURL, NSError *error))block {
   block = [block copy];
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     NSURL *url = [self generatePublicURLForFields:fieldKeys error:&error];
     if (block != NULL) {
@@ -537,7 +558,7 @@ DKSynthesize(resultMap)
         block(url, error); 
       });
     }
-  });
+  }];
 }
 
 - (BOOL)isEqual:(id)object {
@@ -551,6 +572,49 @@ DKSynthesize(resultMap)
   return [NSString stringWithFormat:@"<%@: %p %@> %@", NSStringFromClass(isa), self, self.entityId, self.resultMap];
 }
 
+- (BOOL)faultIn:(NSError **)error {
+  if (self.projection == nil) {
+    return YES;
+  }
+  NSDictionary *resultMap = nil;
+  if (self.faultGroup != nil) {
+    NSError *faultError = nil;
+    resultMap = [self.faultGroup resultMapForEntityId:self.entityId error:&faultError];
+    if (faultError != nil) {
+      if (error != NULL) {
+        *error = faultError;
+      }
+      return NO;
+    }
+  }
+  
+  // Values that were already loaded take precedence over faulted ones.
+  // An object that was deleted in the meantime stays partial.
+  if (resultMap != nil) {
+    NSMutableDictionary *merged = [NSMutableDictionary dictionaryWithDictionary:resultMap];
+    [merged addEntriesFromDictionary:self.resultMap];
+    self.resultMap = [NSDictionary dictionaryWithDictionary:merged];
+  }
+  self.projection = nil;
+  self.faultGroup = nil;
+  
+  return YES;
+}
+
+- (void)faultInInBackgroundWithBlock:(void (^)(DKEntity *entity, NSError *error))block {
+  block = [block copy];
+  dispatch_queue_t q = dispatch_get_current_queue();
+  [DKManager dispatchInBackground:^{
+    NSError *error = nil;
+    [self faultIn:&error];
+    if (block != NULL) {
+      dispatch_async(q, ^{
+        block(self, error);
+      });
+    }
+  }];
+}
+
 @end
 
 @implementation DKEntity (Private)
@@ -578,6 +642,10 @@ DKSynthesize(resultMap)
 }
 
 - (BOOL)commitObjectResultMap:(NSDictionary *)resultMap error:(NSError **)error {
+  return [self commitObjectResultMap:resultMap sentOperations:nil error:error];
+}
+
+- (BOOL)commitObjectResultMap:(NSDictionary *)resultMap sentOperations:(NSDictionary *)operations error:(NSError **)error {
   if (![resultMap isKindOfClass:[NSDictionary class]]) {
     [NSError writeToError:error
                      code:DKErrorInvalidParams
@@ -588,11 +656,215 @@ DKSynthesize(resultMap)
 #endif
     return NO;
   }
-  self.resultMap = resultMap;
   
-  [self reset];
+  // The server returns a not-modified marker if the entity did not change
+  // since the last fetch, in that case we keep the current result map
+  if (!(resultMap.count == 1 && [[resultMap objectForKey:kDKEntityNotModifiedKey] boolValue])) {
+    self.resultMap = resultMap;
+    self.projection = nil;
+    self.faultGroup = nil;
+  }
+  
+  // Operations recorded after a deferred request was built are kept
+  if (operations != nil) {
+    [self removeSentOperations:operations];
+  }
+  else {
+    [self reset];
+  }
+  [[DKIdentityMap sharedMap] registerEntity:self];
   
   return YES;
 }
 
+- (NSDictionary *)saveRequestDict {
+  // Create request dict
+  NSMutableDictionary *requestDict = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                      self.entityName, @"entity", nil];
+  for (NSString *operation in self.operations) {
+    NSDictionary *map = [self.operations objectForKey:operation];
+    if (map.count > 0) {
+      DKEntityValidateKeys(map);
+      [requestDict setObject:map forKey:operation];
+    }
+  }
+  
+  NSString *oid = self.entityId;
+  if (oid.length > 0) {
+    [requestDict setObject:oid forKey:@"oid"];
+  }
+  
+  return requestDict;
+}
+
+- (NSDictionary *)pendingOperations {
+  // Copies the operation maps and the lists in them, so the copy stays
+  // unchanged while the entity is modified further
+  NSMutableDictionary *operations = [NSMutableDictionary new];
+  for (NSString *operation in self.operations) {
+    NSDictionary *map = [self.operations objectForKey:operation];
+    NSMutableDictionary *copy = [NSMutableDictionary new];
+    for (NSString *key in map) {
+      id value = [map objectForKey:key];
+      if ([value isKindOfClass:[NSArray class]]) {
+        value = [NSArray arrayWithArray:value];
+      }
+      [copy setObject:value forKey:key];
+    }
+    if (copy.count > 0) {
+      [operations setObject:copy forKey:operation];
+    }
+  }
+  return operations;
+}
+
+- (void)mergeOperations:(NSDictionary *)operations {
+  NSDictionary *map = [operations objectForKey:kDKEntityOperationSet];
+  for (NSString *key in map) {
+    [self setObject:[map objectForKey:key] forKey:key];
+    [(NSMutableDictionary *)[self operationMapForKey:kDKEntityOperationUnset] removeObjectForKey:key];
+  }
+  map = [operations objectForKey:kDKEntityOperationUnset];
+  for (NSString *key in map) {
+    [self removeObjectForKey:key];
+    [(NSMutableDictionary *)[self operationMapForKey:kDKEntityOperationSet] removeObjectForKey:key];
+  }
+  map = [operations objectForKey:kDKEntityOperationInc];
+  for (NSString *key in map) {
+    [self incrementKey:key byAmount:[map objectForKey:key]];
+  }
+  map = [operations objectForKey:kDKEntityOperationPush];
+  for (NSString *key in map) {
+    [self pushObject:[map objectForKey:key] forKey:key];
+  }
+  map = [operations objectForKey:kDKEntityOperationPushAll];
+  for (NSString *key in map) {
+    [self pushAllObjects:[map objectForKey:key] forKey:key];
+  }
+  map = [operations objectForKey:kDKEntityOperationAddToSet];
+  for (NSString *key in map) {
+    [self addAllObjectsToSet:[map objectForKey:key] forKey:key];
+  }
+  map = [operations objectForKey:kDKEntityOperationPop];
+  for (NSString *key in map) {
+    [self popObjectEnd:[map objectForKey:key] forKey:key];
+  }
+  map = [operations objectForKey:kDKEntityOperationPullAll];
+  for (NSString *key in map) {
+    [self pullAllObjects:[map objectForKey:key] forKey:key];
+  }
+}
+
++ (BOOL)operations:(NSDictionary *)operations conflictWithOperations:(NSDictionary *)otherOperations {
+  // The server rejects updates that modify a key with two modifiers, or a
+  // key and one of its subkeys
+  for (NSString *operation in operations) {
+    NSString *modifier = DKEntityOperationModifier(operation);
+    for (NSString *otherOperation in otherOperations) {
+      BOOL sameModifier = [modifier isEqualToString:DKEntityOperationModifier(otherOperation)];
+      for (NSString *key in [operations objectForKey:operation]) {
+        for (NSString *otherKey in [otherOperations objectForKey:otherOperation]) {
+          if ([key isEqualToString:otherKey]) {
+            if (!sameModifier) {
+              return YES;
+            }
+          }
+          else if ([key hasPrefix:[otherKey stringByAppendingString:@"."]] ||
+                   [otherKey hasPrefix:[key stringByAppendingString:@"."]]) {
+            return YES;
+          }
+        }
+      }
+    }
+  }
+  return NO;
+}
+
+- (void)removeSentOperations:(NSDictionary *)operations {
+  // Operations recorded after the sent copy was taken are kept
+  for (NSString *operation in operations) {
+    NSDictionary *sentMap = [operations objectForKey:operation];
+    for (NSString *key in sentMap) {
+      id sent = [sentMap objectForKey:key];
+      NSMutableDictionary *map = [self.operations objectForKey:operation];
+      id value = [map objectForKey:key];
+      
+      // A sent push followed by more pushes became the head of a push-all
+      if (value == nil && [operation isEqualToString:kDKEntityOperationPush]) {
+        map = [self.operations objectForKey:kDKEntityOperationPushAll];
+        value = [map objectForKey:key];
+        sent = [NSArray arrayWithObject:sent];
+      }
+      if (value == nil) {
+        continue;
+      }
+      
+      if ([value isEqual:sent]) {
+        [map removeObjectForKey:key];
+      }
+      else if ([operation isEqualToString:kDKEntityOperationInc]) {
+        const char *type = [sent objCType];
+        NSNumber *negated = nil;
+        if (strcmp(type, @encode(double)) == 0 || strcmp(type, @encode(float)) == 0) {
+          negated = [NSNumber numberWithDouble:-[sent doubleValue]];
+        }
+        else {
+          negated = [NSNumber numberWithLongLong:-[sent longLongValue]];
+        }
+        [map setObject:DKEntityAddNumbers(value, negated) forKey:key];
+      }
+      else if ([value isKindOfClass:[NSArray class]] && [sent isKindOfClass:[NSArray class]] &&
+               [value count] > [sent count] &&
+               [[value subarrayWithRange:NSMakeRange(0, [sent count])] isEqualToArray:sent]) {
+        NSRange rest = NSMakeRange([sent count], [value count] - [sent count]);
+        [map setObject:[NSMutableArray arrayWithArray:[value subarrayWithRange:rest]] forKey:key];
+      }
+    }
+  }
+}
+
+- (NSDictionary *)operationMapForKey:(NSString *)operation {
+  return [self.operations objectForKey:operation];
+}
+
+- (NSMutableDictionary *)mutableOperationMapForKey:(NSString *)operation {
+  // Operation maps are only created on the first mutation, entities
+  // that are never modified don't allocate any
+  if (self.operations == nil) {
+    self.operations = [NSMutableDictionary new];
+  }
+  NSMutableDictionary *map = [self.operations objectForKey:operation];
+  if (map == nil) {
+    map = [NSMutableDictionary new];
+    [self.operations setObject:map forKey:operation];
+  }
+  return map;
+}
+
+- (void)mergeObjectResultMap:(NSDictionary *)resultMap {
+  // Unlike commit, this keeps any unsaved changes
+  if ([resultMap isKindOfClass:[NSDictionary class]]) {
+    self.resultMap = resultMap;
+    self.projection = nil;
+    self.faultGroup = nil;
+  }
+}
+
+- (BOOL)isFaultForKey:(NSString *)key {
+  if (self.projection == nil || [key isEqualToString:kDKEntityIDField]) {
+    return NO;
+  }
+  
+  // The projection either includes (1) or excludes (0) keys
+  BOOL includes = NO;
+  for (NSNumber *flag in [self.projection allValues]) {
+    if ([flag intValue] == 1) {
+      includes = YES;
+      break;
+    }
+  }
+  NSNumber *flag = [self.projection objectForKey:key];
+  return includes ? (flag == nil) : (flag != nil && [flag intValue] == 0);
+}
+
 @end
\ No newline at end of file
@@ -9,7 +9,10 @@
 #import "DKFile.h"
 
 #import "DKManager.h"
+#import "DKManager-Private.h"
 #import "DKRequest.h"
+#import "DKRequestMetrics.h"
+#import "DKRequestMetrics-Private.h"
 
 @interface DKFile ()
 @property (nonatomic, assign, readwrite) BOOL isVolatile;
@@ -24,6 +27,8 @@
 @property (nonatomic, copy) NSURL *fileURL;
 @property (nonatomic, assign) NSUInteger bytesWritten;
 @property (nonatomic, assign) NSUInteger bytesExpected;
+@property (nonatomic, strong) DKRequestMetrics *metrics;
+@property (nonatomic, assign) CFAbsoluteTime transferStart;
 @end
 
 @implementation DKFile
@@ -39,6 +44,8 @@ DKSynthesize(fileStream)
 DKSynthesize(fileURL)
 DKSynthesize(bytesWritten)
 DKSynthesize(bytesExpected)
+DKSynthesize(metrics)
+DKSynthesize(transferStart)
 
 + (DKFile *)fileWithData:(NSData *)data {
   return [[self alloc] initWithName:nil data:data];
@@ -87,7 +94,7 @@ DKSynthesize(bytesExpected)
 + (void)fileExists:(NSString *)fileName inBackgroundWithBlock:(void (^)(BOOL exists, NSError *error))block {
   block = [block copy];
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     BOOL exists = [self fileExists:fileName error:&error];
     if (block != NULL) {
@@ -95,7 +102,7 @@ DKSynthesize(bytesExpected)
         block(exists, error); 
       });
     }
-  });
+  }];
 }
 
 + (BOOL)deleteFile:(NSString *)fileName error:(NSError **)error {
@@ -131,7 +138,7 @@ DKSynthesize(bytesExpected)
 - (void)deleteInBackgroundWithBlock:(void (^)(BOOL success, NSError *error))block {
   block = [block copy];
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     BOOL success = [self delete:&error];
     if (block != NULL) {
@@ -139,7 +146,7 @@ DKSynthesize(bytesExpected)
         block(success, error); 
       });
     }
-  });
+  }];
 }
 
 - (NSString *)readAssignedFileName:(NSHTTPURLResponse *)response {
@@ -176,14 +183,23 @@ DKSynthesize(bytesExpected)
     [req setValue:name_ forHTTPHeaderField:kDKRequestHeaderFileName];
   }
   
+  DKRequestMetrics *metrics = [DKRequestMetrics metricsForMethod:@"store"];
+  metrics.bytesOut = self.data.length;
+  
   // Save synchronous
   if (saveSync) {
     NSError *reqError = nil;
     NSHTTPURLResponse *response = nil;
+    
+    CFAbsoluteTime t0 = CFAbsoluteTimeGetCurrent();
     NSData *data = [NSURLConnection sendSynchronousRequest:req returningResponse:&response error:&reqError];
     
+    metrics.networkTime = CFAbsoluteTimeGetCurrent() - t0;
+    metrics.bytesIn = data.length;
+    
     NSError *parseErr = nil;
     [DKRequest parseResponse:response withData:data error:&parseErr];
+    [metrics reportWithResponse:response error:(reqError != nil ? reqError : parseErr)];
     
     if (parseErr == nil) {
       self.name = [self readAssignedFileName:response];
@@ -203,6 +219,8 @@ DKSynthesize(bytesExpected)
     self.loadResultBlock = nil;
     self.downloadProgressBlock = nil;
     self.uploadProgressBlock = progressBlock;
+    self.metrics = metrics;
+    self.transferStart = CFAbsoluteTimeGetCurrent();
     
     self.connection = [NSURLConnection connectionWithRequest:req delegate:self];
     [self.connection scheduleInRunLoop:[NSRunLoop currentRunLoop]
@@ -254,12 +272,20 @@ DKSynthesize(bytesExpected)
     [req setValue:self.name forHTTPHeaderField:kDKRequestHeaderFileName];
   }
   
+  DKRequestMetrics *metrics = [DKRequestMetrics metricsForMethod:@"stream"];
+  
   // Load sync
   if (loadSync) {
     NSError *reqError = nil;
     NSHTTPURLResponse *response = nil;
+    
+    CFAbsoluteTime t0 = CFAbsoluteTimeGetCurrent();
     NSData *data = [NSURLConnection sendSynchronousRequest:req returningResponse:&response error:&reqError];
     
+    metrics.networkTime = CFAbsoluteTimeGetCurrent() - t0;
+    metrics.bytesIn = data.length;
+    [metrics reportWithResponse:response error:reqError];
+    
     if (response.statusCode == 200) {
       self.isVolatile = NO;
       return data;
@@ -279,6 +305,8 @@ DKSynthesize(bytesExpected)
     self.uploadProgressBlock = nil;
     self.bytesWritten = 0;
     self.bytesExpected = 0;
+    self.metrics = metrics;
+    self.transferStart = CFAbsoluteTimeGetCurrent();
     
     [self openTempFileStream];
     
@@ -350,7 +378,7 @@ DKSynthesize(bytesExpected)
 - (void)generatePublicURLInBackgroundWithBlock:(void (^)(NSURL *publicURL, NSError *error))block {
   block = [block copy];
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     NSURL *url = [self generatePublicURL:&error];
     if (block != NULL) {
@@ -358,11 +386,21 @@ DKSynthesize(bytesExpected)
         block(url, error); 
       });
     }
-  });
+  }];
 }
 
 #pragma mark - Private
 
+- (void)reportMetricsWithResponse:(NSHTTPURLResponse *)response error:(NSError *)error {
+  DKRequestMetrics *metrics = self.metrics;
+  if (metrics != nil) {
+    self.metrics = nil;
+    metrics.networkTime = CFAbsoluteTimeGetCurrent() - self.transferStart;
+    metrics.bytesIn = self.bytesWritten;
+    [metrics reportWithResponse:response error:error];
+  }
+}
+
 - (void)openTempFileStream {
   [self closeStreamAndCleanUpTempFiles];
   
@@ -391,6 +429,7 @@ DKSynthesize(bytesExpected)
 #pragma mark - NSURLConnectionDelegate
 
 - (void)connection:(NSURLConnection *)connection didFailWithError:(NSError *)error {
+  [self reportMetricsWithResponse:nil error:error];
   if (self.saveResultBlock != nil) {
     self.saveResultBlock(NO, error);
   }
@@ -414,6 +453,7 @@ DKSynthesize(bytesExpected)
 }
 
 - (void)connectionDidFinishLoading:(NSURLConnection *)connection {
+  [self reportMetricsWithResponse:nil error:nil];
   if (self.loadResultBlock != nil) {
     self.loadResultBlock(YES, [NSData dataWithContentsOfURL:self.fileURL], nil);
   }
@@ -444,6 +484,8 @@ DKSynthesize(bytesExpected)
       error = [NSError errorWithDomain:NSCocoaErrorDomain code:500 userInfo:userInfo];
     }
     
+    [self reportMetricsWithResponse:httpResponse error:error];
+    
     // Abort and pass error
     if (error != NULL) {
       [connection cancel];
@@ -451,6 +493,8 @@ DKSynthesize(bytesExpected)
     }
   }
   else if (self.loadResultBlock != nil) {
+    self.metrics.statusCode = httpResponse.statusCode;
+    
     NSDictionary *headers = [httpResponse allHeaderFields];
     for (NSString *key in headers) {
       if ([key caseInsensitiveCompare:@"Content-Length"] == NSOrderedSame) {
@@ -0,0 +1,138 @@
+//
+//  DKIndex.h
+//  DataKit
+//
+//  Created by Erik Aigner on 28.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ Describes an entity index, which can be a single-key or compound index
+ 
+ Keys are indexed in the order they were added. Use <[DKQuery explain:]> to check whether a query actually uses an index.
+ */
+@interface DKIndex : NSObject
+
+/** @name Creating and Initializing Indexes */
+
+/**
+ Creates a new index for the entity name
+ @param entityName The entity name
+ @return The initialized index
+ */
++ (DKIndex *)indexWithEntityName:(NSString *)entityName;
+
+/**
+ Initializes a new index for the entity name
+ @param entityName The entity name
+ @return The initialized index
+ */
+- (id)initWithEntityName:(NSString *)entityName;
+
+/** @name Properties */
+
+/**
+ The entity name
+ */
+@property (nonatomic, copy, readonly) NSString *entityName;
+
+/**
+ The index name
+ 
+ If not set, the server generates a name from the keys. Set after the index was ensured.
+ */
+@property (nonatomic, copy) NSString *name;
+
+/**
+ The indexed keys
+ 
+ Each item is an array containing the key and the direction (`1` for ascending, `-1` for descending).
+ */
+@property (nonatomic, copy, readonly) NSArray *keys;
+
+/**
+ Makes the index unique
+ */
+@property (nonatomic, assign) BOOL unique;
+
+/**
+ Only index entities that contain the indexed keys
+ */
+@property (nonatomic, assign) BOOL sparse;
+
+/**
+ Automatically drop duplicates when creating a unique index
+ */
+@property (nonatomic, assign) BOOL dropDuplicates;
+
+/** @name Adding Keys */
+
+/**
+ Adds a key in ascending order
+ @param key The key to index
+ */
+- (void)addAscendingKey:(NSString *)key;
+
+/**
+ Adds a key in descending order
+ @param key The key to index
+ */
+- (void)addDescendingKey:(NSString *)key;
+
+/** @name Ensuring Indexes */
+
+/**
+ Creates the index if it does not exist yet
+ @return `YES` on success, `NO` otherwise
+ */
+- (BOOL)ensure;
+
+/**
+ Creates the index if it does not exist yet
+ @param error The error object set on error
+ @return `YES` on success, `NO` otherwise
+ */
+- (BOOL)ensure:(NSError **)error;
+
+/**
+ Creates the index in the background
+ @param block The callback block
+ */
+- (void)ensureInBackgroundWithBlock:(void (^)(DKIndex *index, NSError *error))block;
+
+/** @name Listing and Dropping Indexes */
+
+/**
+ Returns all indexes of an entity
+ @param entityName The entity name
+ @param error The error object set on error
+ @return An array of <DKIndex> objects, or `nil` on error
+ */
++ (NSArray *)indexesForEntityName:(NSString *)entityName error:(NSError **)error;
+
+/**
+ Drops the index with the given name
+ 
+ The default index on the entity ID cannot be dropped.
+ @param name The index name
+ @param entityName The entity name
+ @param error The error object set on error
+ @return `YES` on success, `NO` otherwise
+ */
++ (BOOL)dropIndexNamed:(NSString *)name entityName:(NSString *)entityName error:(NSError **)error;
+
+/**
+ Drops the index
+ 
+ The index name must be set.
+ @param error The error object set on error
+ @return `YES` on success, `NO` otherwise
+ */
+- (BOOL)drop:(NSError **)error;
+
++ (id)new UNAVAILABLE_ATTRIBUTE;
+- (id)init UNAVAILABLE_ATTRIBUTE;
+
+@end
@@ -0,0 +1,186 @@
+//
+//  DKIndex.m
+//  DataKit
+//
+//  Created by Erik Aigner on 28.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKIndex.h"
+
+#import "DKRequest.h"
+#import "DKManager.h"
+#import "DKManager-Private.h"
+
+@interface DKIndex ()
+@property (nonatomic, copy, readwrite) NSString *entityName;
+@property (nonatomic, strong) NSMutableArray *keySpec;
+@end
+
+@implementation DKIndex
+DKSynthesize(entityName)
+DKSynthesize(name)
+DKSynthesize(keySpec)
+DKSynthesize(unique)
+DKSynthesize(sparse)
+DKSynthesize(dropDuplicates)
+
++ (DKIndex *)indexWithEntityName:(NSString *)entityName {
+  return [[self alloc] initWithEntityName:entityName];
+}
+
+- (id)initWithEntityName:(NSString *)entityName {
+  if (entityName.length == 0) {
+    return nil;
+  }
+  self = [super init];
+  if (self) {
+    self.entityName = entityName;
+    self.keySpec = [NSMutableArray new];
+  }
+  return self;
+}
+
+- (NSArray *)keys {
+  return [NSArray arrayWithArray:self.keySpec];
+}
+
+- (void)addKey:(NSString *)key direction:(NSInteger)direction {
+  NSArray *pair = [NSArray arrayWithObjects:key, [NSNumber numberWithInteger:direction], nil];
+  [self.keySpec addObject:pair];
+}
+
+- (void)addAscendingKey:(NSString *)key {
+  [self addKey:key direction:1];
+}
+
+- (void)addDescendingKey:(NSString *)key {
+  [self addKey:key direction:-1];
+}
+
+- (BOOL)ensure {
+  return [self ensure:NULL];
+}
+
+- (BOOL)ensure:(NSError **)error {
+  if (self.keySpec.count == 0) {
+    [NSException raise:NSInternalInconsistencyException format:@"Index has no keys"];
+    return NO;
+  }
+  
+  // Create request dict
+  NSMutableDictionary *requestDict = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                      self.entityName, @"entity",
+                                      self.keySpec, @"keys",
+                                      [NSNumber numberWithBool:self.unique], @"unique",
+                                      [NSNumber numberWithBool:self.sparse], @"sparse",
+                                      [NSNumber numberWithBool:self.dropDuplicates], @"drop", nil];
+  if (self.name.length > 0) {
+    [requestDict setObject:self.name forKey:@"name"];
+  }
+  
+  // Send request synchronously
+  DKRequest *request = [DKRequest request];
+  request.cachePolicy = DKCachePolicyIgnoreCache;
+  
+  NSError *requestError = nil;
+  NSDictionary *result = [request sendRequestWithObject:requestDict method:@"index" error:&requestError];
+  if (requestError != nil) {
+    if (error != nil) {
+      *error = requestError;
+    }
+    return NO;
+  }
+  
+  if ([result isKindOfClass:[NSDictionary class]]) {
+    NSString *indexName = [result objectForKey:@"name"];
+    if ([indexName isKindOfClass:[NSString class]]) {
+      self.name = indexName;
+    }
+  }
+  
+  return YES;
+}
+
+- (void)ensureInBackgroundWithBlock:(void (^)(DKIndex *index, NSError *error))block {
+  block = [block copy];
+  dispatch_queue_t q = dispatch_get_current_queue();
+  [DKManager dispatchInBackground:^{
+    NSError *error = nil;
+    [self ensure:&error];
+    if (block != NULL) {
+      dispatch_async(q, ^{
+        block(self, error); 
+      });
+    }
+  }];
+}
+
++ (NSArray *)indexesForEntityName:(NSString *)entityName error:(NSError **)error {
+  NSDictionary *requestDict = [NSDictionary dictionaryWithObject:entityName forKey:@"entity"];
+  
+  // Send request synchronously
+  DKRequest *request = [DKRequest request];
+  request.cachePolicy = DKCachePolicyIgnoreCache;
+  
+  NSError *requestError = nil;
+  NSArray *results = [request sendRequestWithObject:requestDict method:@"indexes" error:&requestError];
+  if (requestError != nil) {
+    if (error != nil) {
+      *error = requestError;
+    }
+    return nil;
+  }
+  
+  NSMutableArray *indexes = [NSMutableArray new];
+  if ([results isKindOfClass:[NSArray class]]) {
+    for (NSDictionary *info in results) {
+      if (![info isKindOfClass:[NSDictionary class]]) {
+        continue;
+      }
+      DKIndex *index = [self indexWithEntityName:entityName];
+      index.name = [info objectForKey:@"name"];
+      index.unique = [[info objectForKey:@"unique"] boolValue];
+      index.sparse = [[info objectForKey:@"sparse"] boolValue];
+      for (NSArray *pair in [info objectForKey:@"keys"]) {
+        if ([pair isKindOfClass:[NSArray class]] && pair.count == 2) {
+          [index addKey:[pair objectAtIndex:0] direction:[[pair objectAtIndex:1] integerValue]];
+        }
+      }
+      [indexes addObject:index];
+    }
+  }
+  
+  return [NSArray arrayWithArray:indexes];
+}
+
++ (BOOL)dropIndexNamed:(NSString *)name entityName:(NSString *)entityName error:(NSError **)error {
+  NSDictionary *requestDict = [NSDictionary dictionaryWithObjectsAndKeys:
+                               entityName, @"entity",
+                               name, @"name", nil];
+  
+  // Send request synchronously
+  DKRequest *request = [DKRequest request];
+  request.cachePolicy = DKCachePolicyIgnoreCache;
+  
+  NSError *requestError = nil;
+  [request sendRequestWithObject:requestDict method:@"dropIndex" error:&requestError];
+  if (requestError != nil) {
+    if (error != nil) {
+      *error = requestError;
+    }
+    return NO;
+  }
+  
+  return YES;
+}
+
+- (BOOL)drop:(NSError **)error {
+  if (self.name.length == 0) {
+    [NSException raise:NSInternalInconsistencyException format:@"Index has no name"];
+    return NO;
+  }
+  return [[self class] dropIndexNamed:self.name entityName:self.entityName error:error];
+}
+
+@end
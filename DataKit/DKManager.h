@@ -8,6 +8,9 @@
 
 #import <Foundation/Foundation.h>
 
+@class DKRequestMetrics;
+@class DKSnapshot;
+
 /**
  The manager is used to configure common DataKit parameters
  */
@@ -74,6 +77,83 @@
  */
 + (BOOL)dropDatabase:(NSString *)dbName error:(NSError **)error;
 
+/** @name Write Coalescing */
+
+/**
+ Enables write coalescing for background saves.
+ 
+ When enabled, `saveInBackground` and `saveInBackgroundWithBlock:` calls are collected for a short delay. Operations queued on the same entity are merged (increments are summed, pushes and pulls accumulated) and all pending entities are sent in a single batched save request. Operations that can't be merged into one update, like a set and an increment of the same key on different instances, are sent as separate saves in order. Each block receives the result of its own entity, a failed save doesn't fail the others in the batch. Entities are committed and blocks are called on the queue the save was started from. Disabled by default.
+ @param flag `YES` to enable write coalescing, `NO` to disable
+ */
++ (void)setWriteCoalescingEnabled:(BOOL)flag;
+
+/**
+ Returns the write coalescing status
+ @return `YES` if write coalescing is enabled, `NO` otherwise
+ */
++ (BOOL)writeCoalescingEnabled;
+
+/**
+ Sets the maximum time coalesced writes are held back before they are sent
+ @param delay The delay in seconds, defaults to 0.5
+ */
++ (void)setWriteCoalescingDelay:(NSTimeInterval)delay;
+
+/**
+ Returns the write coalescing delay
+ @return The delay in seconds
+ */
++ (NSTimeInterval)writeCoalescingDelay;
+
+/**
+ Sets the number of pending entities that triggers an immediate flush
+ @param size The batch size, defaults to 50
+ */
++ (void)setWriteCoalescingBatchSize:(NSUInteger)size;
+
+/**
+ Returns the write coalescing batch size
+ @return The batch size
+ */
++ (NSUInteger)writeCoalescingBatchSize;
+
+/**
+ Sends all pending coalesced writes without waiting for the delay to expire
+ */
++ (void)flushCoalescedWrites;
+
+/** @name Identity Map */
+
+/**
+ Enables the entity identity map.
+ 
+ When enabled, each object is represented by at most one live <DKEntity> instance. Query results, refreshed entities and references included with <[DKQuery includeReferenceAtKey:]> reuse and update the instance that is already in use for the same entity name and ID, instead of creating a copy. Unsaved changes of a reused instance are kept. Background loads update the fetched values of a reused instance on their own queue, reading them from another queue at the same time is safe. The map does not retain entities, an entry goes away once the entity is released. Disabled by default.
+ @param flag `YES` to enable the identity map, `NO` to disable
+ */
++ (void)setIdentityMapEnabled:(BOOL)flag;
+
+/**
+ Returns the identity map status
+ @return `YES` if the identity map is enabled, `NO` otherwise
+ */
++ (BOOL)identityMapEnabled;
+
+/** @name Bootstrap Snapshot */
+
+/**
+ Sets a snapshot that answers queries until the app switches to the live server.
+ 
+ Queries contained in the snapshot, and queries for a single entity ID of a snapshot object, are answered from it without a request. Queries with `DKCachePolicyIgnoreCache`, the default policy, only use the snapshot until the server answered the first query, queries with other policies use it as long as it is set. All other queries go to the server. Entities that are already loaded are returned as they are, snapshot objects do not overwrite them. To switch over, merge the changes since the snapshot <[DKSnapshot creationDate]> into the bootstrapped entities with <[DKQuery mergeChangesIntoEntities:since:inBackgroundWithBlock:]> and set the snapshot to `nil`.
+ @param snapshot The snapshot, or `nil` to query the server only
+ */
++ (void)setBootstrapSnapshot:(DKSnapshot *)snapshot;
+
+/**
+ Returns the bootstrap snapshot
+ @return The snapshot, or `nil` if none is set
+ */
++ (DKSnapshot *)bootstrapSnapshot;
+
 /** @name Debug */
 
 /**
@@ -90,4 +170,20 @@
  */
 + (BOOL)requestLogEnabled;
 
+/** @name Request Metrics */
+
+/**
+ Sets a handler that receives the <DKRequestMetrics> of every API request and file transfer.
+ 
+ The handler is invoked synchronously on the thread that performed the request, so it should only hand the metrics off to your telemetry and return quickly. Metrics are not collected if no handler is set.
+ @param handler The metrics handler, or `nil` to disable metrics collection
+ */
++ (void)setRequestMetricsHandler:(void (^)(DKRequestMetrics *metrics))handler;
+
+/**
+ Returns the request metrics handler
+ @return The metrics handler, or `nil` if none is set
+ */
++ (void (^)(DKRequestMetrics *metrics))requestMetricsHandler;
+
 @end
@@ -7,14 +7,27 @@
 //
 
 #import "DKManager.h"
+#import "DKManager-Private.h"
 
 #import "DKRequest.h"
+#import "DKSaveBatcher.h"
+#import "DKIdentityMap.h"
+#import "DKSnapshot.h"
 
 @implementation DKManager
 
 static NSString *kDKManagerAPIEndpoint;
 static NSString *kDKManagerAPISecret;
 static BOOL kDKManagerRequestLogEnabled;
+static BOOL kDKManagerWriteCoalescingEnabled;
+static BOOL kDKManagerIdentityMapEnabled;
+static NSTimeInterval kDKManagerWriteCoalescingDelay = 0.5;
+static NSUInteger kDKManagerWriteCoalescingBatchSize = 50;
+static void (^kDKManagerRequestMetricsHandler)(DKRequestMetrics *);
+static DKSnapshot *kDKManagerBootstrapSnapshot;
+static BOOL kDKManagerLiveQueryResponse;
+
+#define kDKManagerQueueWaitKey @"DKManagerQueueWait"
 
 + (void)setAPIEndpoint:(NSString *)absoluteString {
   NSURL *ep = [NSURL URLWithString:absoluteString];
@@ -76,6 +89,65 @@ static BOOL kDKManagerRequestLogEnabled;
   return YES;
 }
 
++ (void)setWriteCoalescingEnabled:(BOOL)flag {
+  kDKManagerWriteCoalescingEnabled = flag;
+  if (!flag) {
+    [self flushCoalescedWrites];
+  }
+}
+
++ (BOOL)writeCoalescingEnabled {
+  return kDKManagerWriteCoalescingEnabled;
+}
+
++ (void)setWriteCoalescingDelay:(NSTimeInterval)delay {
+  kDKManagerWriteCoalescingDelay = MAX(delay, 0);
+}
+
++ (NSTimeInterval)writeCoalescingDelay {
+  return kDKManagerWriteCoalescingDelay;
+}
+
++ (void)setWriteCoalescingBatchSize:(NSUInteger)size {
+  kDKManagerWriteCoalescingBatchSize = MAX(size, 1);
+}
+
++ (NSUInteger)writeCoalescingBatchSize {
+  return kDKManagerWriteCoalescingBatchSize;
+}
+
++ (void)flushCoalescedWrites {
+  [[DKSaveBatcher sharedBatcher] flush];
+}
+
++ (void)setIdentityMapEnabled:(BOOL)flag {
+  kDKManagerIdentityMapEnabled = flag;
+  if (!flag) {
+    [[DKIdentityMap sharedMap] removeAllEntities];
+  }
+}
+
++ (BOOL)identityMapEnabled {
+  return kDKManagerIdentityMapEnabled;
+}
+
++ (void)setBootstrapSnapshot:(DKSnapshot *)snapshot {
+  kDKManagerBootstrapSnapshot = snapshot;
+  kDKManagerLiveQueryResponse = NO;
+}
+
++ (DKSnapshot *)bootstrapSnapshot {
+  return kDKManagerBootstrapSnapshot;
+}
+
++ (void)noteLiveQueryResponse {
+  kDKManagerLiveQueryResponse = YES;
+}
+
++ (BOOL)hasLiveQueryResponse {
+  return kDKManagerLiveQueryResponse;
+}
+
 + (void)setRequestLogEnabled:(BOOL)flag {
   kDKManagerRequestLogEnabled = flag;
 }
@@ -84,4 +156,43 @@ static BOOL kDKManagerRequestLogEnabled;
   return kDKManagerRequestLogEnabled;
 }
 
++ (void)setRequestMetricsHandler:(void (^)(DKRequestMetrics *))handler {
+  kDKManagerRequestMetricsHandler = [handler copy];
+}
+
++ (void (^)(DKRequestMetrics *))requestMetricsHandler {
+  return kDKManagerRequestMetricsHandler;
+}
+
+@end
+
+@implementation DKManager (Private)
+
++ (void)dispatchInBackground:(dispatch_block_t)block {
+  if (kDKManagerRequestMetricsHandler == nil) {
+    dispatch_async([self queue], block);
+    return;
+  }
+  
+  // Remember the time the block spent in the queue, so the first
+  // request it sends can report it
+  CFAbsoluteTime enqueued = CFAbsoluteTimeGetCurrent();
+  dispatch_async([self queue], ^{
+    NSMutableDictionary *threadDict = [[NSThread currentThread] threadDictionary];
+    [threadDict setObject:[NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent() - enqueued]
+                   forKey:kDKManagerQueueWaitKey];
+    block();
+    [threadDict removeObjectForKey:kDKManagerQueueWaitKey];
+  });
+}
+
++ (NSTimeInterval)consumeQueueWaitTime {
+  NSMutableDictionary *threadDict = [[NSThread currentThread] threadDictionary];
+  NSNumber *wait = [threadDict objectForKey:kDKManagerQueueWaitKey];
+  if (wait != nil) {
+    [threadDict removeObjectForKey:kDKManagerQueueWaitKey];
+  }
+  return [wait doubleValue];
+}
+
 @end
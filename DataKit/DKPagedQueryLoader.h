@@ -0,0 +1,96 @@
+//
+//  DKPagedQueryLoader.h
+//  DataKit
+//
+//  Created by Erik Aigner on 05.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class DKQuery;
+
+/**
+ Loads query results page by page and prefetches the following pages in the background.
+ 
+ Requests for a page that is already being fetched are coalesced into one fetch. The loader is independent of UIKit and not thread safe, use it from a single queue (usually the main queue). Completion blocks are called on the queue that requested the page.
+ */
+@interface DKPagedQueryLoader : NSObject
+
+/** @name Initializing Loaders */
+
+/**
+ Initializes a loader that fetches the pages of `query`
+ 
+ Each page is fetched with its own skip and limit, the <[DKQuery skip]> and <[DKQuery limit]> of `query` are ignored and not modified. The query must not be modified while the loader is in use.
+ @param query The query
+ @return The initialized loader
+ */
+- (id)initWithQuery:(DKQuery *)query;
+
+/**
+ Initializes a loader with a custom page source
+ 
+ The source block is called on the DataKit background queue and must return the objects in the range specified by `offset` and `limit` synchronously.
+ @param source The page source block
+ @return The initialized loader
+ */
+- (id)initWithPageSource:(NSArray *(^)(NSUInteger offset, NSUInteger limit, NSError **error))source;
+
+/** @name Configuration */
+
+/**
+ The number of objects per page, defaults to 25
+ */
+@property (nonatomic, assign) NSUInteger pageSize;
+
+/**
+ The number of pages fetched ahead of the last requested page, defaults to 1
+ */
+@property (nonatomic, assign) NSUInteger prefetchPageCount;
+
+/**
+ The maximum number of pages kept in memory, defaults to 0 (unlimited)
+ 
+ If more pages are loaded, the pages farthest from the last requested page are released first.
+ */
+@property (nonatomic, assign) NSUInteger maxLoadedPageCount;
+
+/** @name Loading Pages */
+
+/**
+ `NO` if a page with less than <pageSize> objects was loaded
+ */
+@property (nonatomic, assign, readonly) BOOL hasMore;
+
+/**
+ Loads the page at `pageIndex` and prefetches the following pages
+ 
+ If the page is already loaded, `block` is called immediately.
+ @param pageIndex The page index
+ @param block The completion block, `objects` is `nil` on error
+ */
+- (void)loadPageAtIndex:(NSUInteger)pageIndex block:(void (^)(NSArray *objects, NSError *error))block;
+
+/**
+ Returns the objects of a loaded page
+ @param pageIndex The page index
+ @return The page objects, or `nil` if the page is not loaded
+ */
+- (NSArray *)objectsForPageAtIndex:(NSUInteger)pageIndex;
+
+/**
+ Returns whether the page is currently being fetched
+ @param pageIndex The page index
+ @return `YES` if a fetch for the page is in flight
+ */
+- (BOOL)isLoadingPageAtIndex:(NSUInteger)pageIndex;
+
+/**
+ Releases all loaded pages
+ 
+ Completion blocks of fetches that are still in flight are called with a `DKErrorCancelled` error.
+ */
+- (void)reset;
+
+@end
@@ -0,0 +1,198 @@
+//
+//  DKPagedQueryLoader.m
+//  DataKit
+//
+//  Created by Erik Aigner on 05.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKPagedQueryLoader.h"
+
+#import "DKQuery.h"
+#import "DKQuery-Private.h"
+#import "DKManager.h"
+#import "DKManager-Private.h"
+#import "NSError+DataKit.h"
+
+@interface DKPagedQueryLoader ()
+@property (nonatomic, copy) NSArray *(^pageSource)(NSUInteger offset, NSUInteger limit, NSError **error);
+@property (nonatomic, strong) NSMutableDictionary *pages;
+@property (nonatomic, strong) NSMutableDictionary *waiters;
+@property (nonatomic, assign) NSUInteger lastPageIndex;
+@property (nonatomic, assign) NSUInteger focusPageIndex;
+@property (nonatomic, assign) NSUInteger generation;
+@end
+
+@implementation DKPagedQueryLoader
+DKSynthesize(pageSource)
+DKSynthesize(pages)
+DKSynthesize(waiters)
+DKSynthesize(lastPageIndex)
+DKSynthesize(focusPageIndex)
+DKSynthesize(generation)
+DKSynthesize(pageSize)
+DKSynthesize(prefetchPageCount)
+DKSynthesize(maxLoadedPageCount)
+
+- (id)initWithQuery:(DKQuery *)query {
+  // Pages are fetched concurrently, each with its own range
+  return [self initWithPageSource:^NSArray *(NSUInteger offset, NSUInteger limit, NSError **error) {
+    return [query findAllWithSkip:offset limit:limit error:error];
+  }];
+}
+
+- (id)initWithPageSource:(NSArray *(^)(NSUInteger, NSUInteger, NSError **))source {
+  self = [super init];
+  if (self) {
+    self.pageSource = source;
+    self.pageSize = 25;
+    self.prefetchPageCount = 1;
+    self.pages = [NSMutableDictionary new];
+    self.waiters = [NSMutableDictionary new];
+    self.lastPageIndex = NSNotFound;
+  }
+  return self;
+}
+
+- (BOOL)hasMore {
+  return (self.lastPageIndex == NSNotFound);
+}
+
+- (NSArray *)objectsForPageAtIndex:(NSUInteger)pageIndex {
+  return [self.pages objectForKey:[NSNumber numberWithUnsignedInteger:pageIndex]];
+}
+
+- (BOOL)isLoadingPageAtIndex:(NSUInteger)pageIndex {
+  return ([self.waiters objectForKey:[NSNumber numberWithUnsignedInteger:pageIndex]] != nil);
+}
+
+- (void)loadPageAtIndex:(NSUInteger)pageIndex block:(void (^)(NSArray *, NSError *))block {
+  self.focusPageIndex = pageIndex;
+  
+  NSArray *objects = [self objectsForPageAtIndex:pageIndex];
+  if (objects != nil) {
+    if (block != NULL) {
+      block(objects, nil);
+    }
+  }
+  else if (pageIndex > self.lastPageIndex) {
+    if (block != NULL) {
+      block([NSArray array], nil);
+    }
+  }
+  else {
+    [self fetchPageAtIndex:pageIndex block:block];
+  }
+  
+  // Prefetch the following pages
+  for (NSUInteger i=1; i<=self.prefetchPageCount; i++) {
+    NSUInteger nextIndex = pageIndex + i;
+    if (nextIndex > self.lastPageIndex) {
+      break;
+    }
+    if ([self objectsForPageAtIndex:nextIndex] == nil) {
+      [self fetchPageAtIndex:nextIndex block:NULL];
+    }
+  }
+}
+
+- (void)fetchPageAtIndex:(NSUInteger)pageIndex block:(void (^)(NSArray *, NSError *))block {
+  NSNumber *key = [NSNumber numberWithUnsignedInteger:pageIndex];
+  
+  // Coalesce requests for pages already in flight
+  NSMutableArray *waiting = [self.waiters objectForKey:key];
+  if (waiting != nil) {
+    if (block != NULL) {
+      [waiting addObject:[block copy]];
+    }
+    return;
+  }
+  waiting = [NSMutableArray new];
+  if (block != NULL) {
+    [waiting addObject:[block copy]];
+  }
+  [self.waiters setObject:waiting forKey:key];
+  
+  NSArray *(^source)(NSUInteger, NSUInteger, NSError **) = self.pageSource;
+  NSUInteger pageSize = self.pageSize;
+  NSUInteger generation = self.generation;
+  
+  dispatch_queue_t q = dispatch_get_current_queue();
+  [DKManager dispatchInBackground:^{
+    NSError *error = nil;
+    NSArray *objects = source(pageIndex * pageSize, pageSize, &error);
+    dispatch_async(q, ^{
+      [self finishPageAtIndex:pageIndex generation:generation objects:objects error:error];
+    });
+  }];
+}
+
+- (void)finishPageAtIndex:(NSUInteger)pageIndex generation:(NSUInteger)generation objects:(NSArray *)objects error:(NSError *)error {
+  // The loader was reset while the page was fetched
+  if (generation != self.generation) {
+    return;
+  }
+  
+  NSNumber *key = [NSNumber numberWithUnsignedInteger:pageIndex];
+  NSArray *waiting = [self.waiters objectForKey:key];
+  [self.waiters removeObjectForKey:key];
+  
+  if (error == nil) {
+    if (objects == nil) {
+      objects = [NSArray array];
+    }
+    if (objects.count < self.pageSize) {
+      self.lastPageIndex = MIN(self.lastPageIndex, pageIndex);
+    }
+    [self.pages setObject:objects forKey:key];
+    [self releaseDistantPages];
+  }
+  
+  for (void (^block)(NSArray *, NSError *) in waiting) {
+    block((error == nil) ? objects : nil, error);
+  }
+}
+
+- (void)releaseDistantPages {
+  if (self.maxLoadedPageCount == 0 || self.pages.count <= self.maxLoadedPageCount) {
+    return;
+  }
+  
+  // Release the pages farthest from the last requested page first
+  NSUInteger focus = self.focusPageIndex;
+  NSArray *keys = [[self.pages allKeys] sortedArrayUsingComparator:^NSComparisonResult(NSNumber *a, NSNumber *b) {
+    NSUInteger da = (a.unsignedIntegerValue > focus) ? a.unsignedIntegerValue - focus : focus - a.unsignedIntegerValue;
+    NSUInteger db = (b.unsignedIntegerValue > focus) ? b.unsignedIntegerValue - focus : focus - b.unsignedIntegerValue;
+    if (da == db) {
+      return NSOrderedSame;
+    }
+    return (da > db) ? NSOrderedAscending : NSOrderedDescending;
+  }];
+  
+  NSUInteger count = self.pages.count - self.maxLoadedPageCount;
+  [self.pages removeObjectsForKeys:[keys subarrayWithRange:NSMakeRange(0, count)]];
+}
+
+- (void)reset {
+  NSArray *waiting = [self.waiters allValues];
+  
+  self.generation++;
+  self.lastPageIndex = NSNotFound;
+  [self.pages removeAllObjects];
+  [self.waiters removeAllObjects];
+  
+  // Fetches in flight are discarded, their callers are notified
+  NSError *error = nil;
+  [NSError writeToError:&error
+                   code:DKErrorCancelled
+            description:NSLocalizedString(@"Page load cancelled", nil)
+               original:nil];
+  
+  for (NSArray *blocks in waiting) {
+    for (void (^block)(NSArray *, NSError *) in blocks) {
+      block(nil, error);
+    }
+  }
+}
+
+@end
@@ -11,6 +11,7 @@
 
 @class DKEntity;
 @class DKMapReduce;
+@class DKResultSet;
 
 /**
  Class for performing queries on entity collections.
@@ -39,6 +40,38 @@
  */
 @property (nonatomic, assign) DKCachePolicy cachePolicy;
 
+/**
+ Allows the server to answer the query from a replica set secondary.
+
+ Results may lag behind the latest writes. Defaults to `NO`.
+ */
+@property (nonatomic, assign) BOOL eventuallyConsistent;
+
+/** @name Prepared Queries */
+
+/**
+ Sends the query as a prepared template.
+ 
+ The query conditions, sort order, key subsets and reference includes are registered with the server once and identified by an ID. Later requests for the same template, from this or any other query instance, only send the ID, the <parameters>, <skip> and <limit>. Use <parameterNamed:> for condition values that change between requests. Map reduce queries are never prepared. Defaults to `NO`.
+ */
+@property (nonatomic, assign) BOOL prepared;
+
+/**
+ The values for the placeholders created with <parameterNamed:>, keyed by parameter name
+ */
+@property (nonatomic, copy) NSDictionary *parameters;
+
+/**
+ Returns a placeholder for a condition value of a prepared query
+ 
+    [query whereKey:@"author" equalTo:[DKQuery parameterNamed:@"author"]];
+    query.parameters = [NSDictionary dictionaryWithObject:authorId forKey:@"author"];
+ 
+ @param name The parameter name
+ @return The placeholder to use as a condition value
+ */
++ (id)parameterNamed:(NSString *)name;
+
 /** @name Creating and Initializing Queries */
 
 /**
@@ -218,7 +251,7 @@
 /**
  Checks if the object for key contains the string
  
- Does not work on array fields
+ Does not work on array fields. The regex can not use an index, to search for words use <whereKey:matchesText:> instead.
  @param key The entity key
  @param string The string to match
  */
@@ -238,6 +271,33 @@
  */
 - (void)whereKey:(NSString *)key hasSuffix:(NSString *)suffix;
 
+/**
+ Checks if the string for key equals string, ignoring case
+ 
+ If the key is listed in the server's `normalizedFields` config, this is an indexed lookup on the lowercased copy of the value with diacritics removed, which also ignores diacritics. Otherwise it is a case insensitive regex.
+ @param key The entity key
+ @param string The string to match
+ */
+- (void)whereKey:(NSString *)key equalToStringIgnoringCase:(NSString *)string;
+
+/**
+ Checks if the string for key has the given prefix, ignoring case
+ 
+ Uses an index for keys in the server's `normalizedFields` config, see <whereKey:equalToStringIgnoringCase:>.
+ @param key The entity key
+ @param prefix The prefix string to match
+ */
+- (void)whereKey:(NSString *)key hasPrefixIgnoringCase:(NSString *)prefix;
+
+/**
+ Matches objects whose text at key contains any of the words in text
+ 
+ Unlike the regex conditions this uses an index. The key has to be listed in the server's `textFields` config, which maintains the index when objects are saved. Results are ordered by the number of matched words, unless a sort order is set, and are limited to the server's `textSearchLimit` if no limit is set.
+ @param key The entity key
+ @param text The words to search for
+ */
+- (void)whereKey:(NSString *)key matchesText:(NSString *)text;
+
 /**
  Checks if the entity key exists
  @param key The entity key
@@ -278,7 +338,7 @@
 /**
  Excludes the specified keys from the result entities
  
- This method is mutually exclusive to <includeKeys:>
+ This method is mutually exclusive to <includeKeys:>. Excluded keys are faulted in on first access, see <[DKEntity objectForKey:]>.
  @param keys The keys to exclude
  */
 - (void)excludeKeys:(NSArray *)keys;
@@ -286,7 +346,7 @@
 /**
  Includes only the specified keys in the result entities
  
- This method is mutually exclusive to <excludeKeys:>
+ This method is mutually exclusive to <excludeKeys:>. Other keys are faulted in on first access, see <[DKEntity objectForKey:]>.
  @param keys The keys to include
  */
 - (void)includeKeys:(NSArray *)keys;
@@ -312,6 +372,21 @@
  */
 - (void)findAllInBackgroundWithBlock:(void (^)(NSArray *results, NSError *error))block;
 
+/**
+ Finds all matching entities and returns them as a lazily materialized result set.
+ 
+ Use this instead of <findAll:> for large results that are processed row by row, like exports.
+ @param error The error object to set on error
+ @return The result set
+ */
+- (DKResultSet *)findResultSet:(NSError **)error;
+
+/**
+ Finds all matching entities in the background and returns a lazily materialized result set to the callback block
+ @param block The result callback
+ */
+- (void)findResultSetInBackgroundWithBlock:(void (^)(DKResultSet *resultSet, NSError *error))block;
+
 /**
  Finds the first matching entity
  @return The matched entity
@@ -365,6 +440,8 @@
 
 /**
  Counts the entities matching the query
+ 
+ Queries without conditions and equality matches on fields the server counts are answered from its counters.
  @param error The error object that is written on error
  @return The matched entity count
  */
@@ -376,6 +453,60 @@
  */
 - (void)countAllInBackgroundWithBlock:(void (^)(NSUInteger count, NSError *error))block;
 
+/**
+ Estimates the number of entities matching the query
+
+ Queries without conditions and equality matches on fields the server counts are answered from its counters, like with <countAll:>. Other queries count the matches among the newest objects and scale the result.
+ @param error The error object that is written on error
+ @return The estimated entity count
+ */
+- (NSInteger)estimatedCountAll:(NSError **)error;
+
+/** @name Explaining Queries */
+
+/**
+ Returns the query plan the server uses to execute the query
+ 
+ The plan dictionary contains these keys:
+ 
+ - `cursor` The cursor type, `BasicCursor` means a full collection scan
+ - `index` The name of the used index, or `NSNull` if no index was used
+ - `n` The number of returned entities
+ - `nscanned` The number of scanned index entries or entities
+ - `nscannedObjects` The number of scanned entities
+ - `scanAndOrder` `YES` if results had to be sorted in memory
+ - `millis` The query execution time in milliseconds
+ 
+ @param error The error object set on error
+ @return The query plan, or `nil` on error
+ */
+- (NSDictionary *)explain:(NSError **)error;
+
+/** @name Syncing Changes */
+
+/**
+ Merges all changes made to the entity collection since `date` into the given entities
+ 
+ Fetches entities created or updated after `date`, as well as deleted entity IDs, in pages of <limit> entities (defaults to 100 if no limit is set). Existing entities are updated in place without discarding unsaved changes, new entities are appended and deleted entities are removed from the returned list. Query conditions are ignored, the whole entity collection is synced.
+ 
+ Store the date returned in `nextDate` and pass it on the next sync to only transfer what changed in between. Entities changed at exactly `date` are returned again. The server keeps deletions for a limited time (30 days by default), syncing from an older date fetches all entities and drops the given ones that no longer exist.
+ @param entities The entities to merge changes into, pass `nil` to fetch all entities
+ @param date The date of the last sync, pass `nil` to sync all entities
+ @param nextDate The date to pass on the next sync
+ @param error The error object set on error
+ @return The merged entity list or `nil` on error
+ */
+- (NSArray *)mergeChangesIntoEntities:(NSArray *)entities since:(NSDate *)date nextDate:(NSDate **)nextDate error:(NSError **)error;
+
+/**
+ Merges all changes made to the entity collection since `date` into the given entities in the background
+ @param entities The entities to merge changes into, pass `nil` to fetch all entities
+ @param date The date of the last sync, pass `nil` to sync all entities
+ @param block The result callback block
+ @see mergeChangesIntoEntities:since:nextDate:error:
+ */
+- (void)mergeChangesIntoEntities:(NSArray *)entities since:(NSDate *)date inBackgroundWithBlock:(void (^)(NSArray *entities, NSDate *nextDate, NSError *error))block;
+
 /** @name Resetting Conditions */
 
 /**
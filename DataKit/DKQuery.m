@@ -13,7 +13,14 @@
 #import "DKEntity.h"
 #import "DKEntity-Private.h"
 #import "DKManager.h"
+#import "DKManager-Private.h"
 #import "DKMapReduce.h"
+#import "DKFaultGroup.h"
+#import "DKIdentityMap.h"
+#import "DKResultSet.h"
+#import "DKResultSet-Private.h"
+#import "DKSnapshot.h"
+#import "DKSnapshot-Private.h"
 
 @interface DKQueryConditionProxy : NSProxy
 
@@ -27,12 +34,22 @@ DKSynthesize(limit)
 DKSynthesize(skip)
 DKSynthesize(mapReduce)
 DKSynthesize(cachePolicy)
+DKSynthesize(eventuallyConsistent)
+DKSynthesize(prepared)
+DKSynthesize(parameters)
 DKSynthesize(queryMap)
 DKSynthesize(sort)
 DKSynthesize(ors)
 DKSynthesize(ands)
 DKSynthesize(referenceIncludes)
 DKSynthesize(fieldInclExcl)
+DKSynthesize(textSearch)
+
+#define kDKQueryParameterKey @"$param"
+
++ (id)parameterNamed:(NSString *)name {
+  return [NSDictionary dictionaryWithObject:name forKey:kDKQueryParameterKey];
+}
 
 + (DKQuery *)queryWithEntityName:(NSString *)entityName {
   return [[self alloc] initWithEntityName:entityName];
@@ -60,6 +77,7 @@ DKSynthesize(fieldInclExcl)
   [self.ands removeAllObjects];
   [self.referenceIncludes removeAllObjects];
   [self.fieldInclExcl removeAllObjects];
+  self.textSearch = nil;
 }
 
 - (DKQuery *)or {
@@ -177,6 +195,20 @@ DKSynthesize(fieldInclExcl)
   [self whereKey:key matchesRegex:regex];
 }
 
+- (void)whereKey:(NSString *)key equalToStringIgnoringCase:(NSString *)string {
+  [[self queryDictForKey:key] setObject:string forKey:@"$ieq"];
+}
+
+- (void)whereKey:(NSString *)key hasPrefixIgnoringCase:(NSString *)prefix {
+  [[self queryDictForKey:key] setObject:prefix forKey:@"$iprefix"];
+}
+
+- (void)whereKey:(NSString *)key matchesText:(NSString *)text {
+  self.textSearch = [NSDictionary dictionaryWithObjectsAndKeys:
+                     key, @"key",
+                     text, @"terms", nil];
+}
+
 - (void)whereKeyExists:(NSString *)key {
   [[self queryDictForKey:key] setObject:[NSNumber numberWithBool:YES] forKey:@"$exists"];
 }
@@ -213,8 +245,7 @@ DKSynthesize(fieldInclExcl)
   }
 }
 
-- (id)find:(NSError **)error one:(BOOL)findOne count:(NSUInteger *)countOut {  
-  // Create request dict
+- (NSMutableDictionary *)requestDict {
   NSMutableDictionary *requestDict = [NSMutableDictionary dictionaryWithObjectsAndKeys:
                                       self.entityName, @"entity", nil];
   if (self.queryMap.count > 0) {
@@ -235,6 +266,9 @@ DKSynthesize(fieldInclExcl)
   if (self.sort.count > 0) {
     [requestDict setObject:self.sort forKey:@"sort"];
   }
+  if (self.textSearch != nil) {
+    [requestDict setObject:self.textSearch forKey:@"text"];
+  }
   if (self.limit > 0) {
     [requestDict setObject:[NSNumber numberWithUnsignedInteger:self.limit] forKey:@"limit"];
   }
@@ -259,26 +293,180 @@ DKSynthesize(fieldInclExcl)
   if (self.skip > 0) {
     [requestDict setObject:[NSNumber numberWithUnsignedInteger:self.skip] forKey:@"skip"];
   }
+  if (self.eventuallyConsistent) {
+    [requestDict setObject:[NSNumber numberWithBool:YES] forKey:@"eventual"];
+  }
+  
+  return requestDict;
+}
+
++ (NSMutableDictionary *)preparedIds {
+  static NSMutableDictionary *preparedIds;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    preparedIds = [NSMutableDictionary new];
+  });
+  return preparedIds;
+}
+
+- (NSString *)prepareTemplate:(NSDictionary *)template error:(NSError **)error {
+  NSMutableDictionary *preparedIds = [isa preparedIds];
+  @synchronized (preparedIds) {
+    NSString *prepId = [preparedIds objectForKey:template];
+    if (prepId != nil) {
+      return prepId;
+    }
+  }
+  
+  DKRequest *request = [DKRequest request];
+  request.cachePolicy = DKCachePolicyIgnoreCache;
+  
+  NSError *requestError = nil;
+  NSDictionary *result = [request sendRequestWithObject:template method:@"prepare" error:&requestError];
+  if (requestError != nil) {
+    if (error != NULL) {
+      *error = requestError;
+    }
+    return nil;
+  }
+  NSString *prepId = [result isKindOfClass:[NSDictionary class]] ? [result objectForKey:@"id"] : nil;
+  if (![prepId isKindOfClass:[NSString class]]) {
+    [NSError writeToError:error
+                     code:DKErrorInvalidResponse
+              description:NSLocalizedString(@"Prepare did not return a query ID", nil)
+                 original:nil];
+    return nil;
+  }
+  @synchronized (preparedIds) {
+    [preparedIds setObject:prepId forKey:template];
+  }
+  
+  return prepId;
+}
+
+- (id)sendQueryRequestDict:(NSMutableDictionary *)requestDict request:(DKRequest *)request error:(NSError **)error {
+  if (!self.prepared || self.mapReduce != nil) {
+    return [request sendRequestWithObject:requestDict method:@"query" error:error];
+  }
+  
+  // Split off the template, the remaining keys are sent with every request
+  NSArray *templateKeys = [NSArray arrayWithObjects:@"entity", @"q", @"or", @"and", @"refIncl", @"fieldInEx", @"sort", nil];
+  NSMutableDictionary *templateDict = [NSMutableDictionary new];
+  for (NSString *key in templateKeys) {
+    id value = [requestDict objectForKey:key];
+    if (value != nil) {
+      [templateDict setObject:value forKey:key];
+      [requestDict removeObjectForKey:key];
+    }
+  }
+  
+  // Wrapping creates an immutable deep copy, which is safe to use as
+  // a cache key while the query is modified
+  NSDictionary *template = [DKRequest wrapSpecialObjectsInJSON:templateDict];
+  if (self.parameters.count > 0) {
+    [requestDict setObject:self.parameters forKey:@"params"];
+  }
+  
+  // The server may have lost the template (e.g. after its database was
+  // dropped), prepare it again once in that case
+  for (NSUInteger attempt=0; attempt<2; attempt++) {
+    NSError *prepareError = nil;
+    NSString *prepId = [self prepareTemplate:template error:&prepareError];
+    if (prepId == nil) {
+      if (error != NULL) {
+        *error = prepareError;
+      }
+      return nil;
+    }
+    [requestDict setObject:prepId forKey:@"prep"];
+    
+    NSError *requestError = nil;
+    id result = [request sendRequestWithObject:requestDict method:@"query" error:&requestError];
+    if (requestError.code == DKErrorPreparedQueryNotFound && attempt == 0) {
+      @synchronized ([isa preparedIds]) {
+        [[isa preparedIds] removeObjectForKey:template];
+      }
+      continue;
+    }
+    if (requestError != nil && error != NULL) {
+      *error = requestError;
+    }
+    return result;
+  }
+  
+  return nil;
+}
+
+- (NSData *)rowsInSnapshot:(DKSnapshot *)snapshot forRequestDict:(NSDictionary *)requestDict count:(BOOL)count {
+  if (snapshot == nil || self.mapReduce != nil || self.parameters.count > 0) {
+    return nil;
+  }
+  
+  // Queries that ignore the cache (the default) use the snapshot until
+  // the server answered the first query, then they go to the server
+  if (self.cachePolicy == DKCachePolicyIgnoreCache && [DKManager hasLiveQueryResponse]) {
+    return nil;
+  }
+  
+  // Snapshot results are limited, the count of the full result is not
+  // known then
+  if (count && (self.limit > 0 || self.skip > 0 || self.textSearch != nil)) {
+    return nil;
+  }
+  return [snapshot rowsForRequestDict:requestDict];
+}
+
+- (id)find:(NSError **)error one:(BOOL)findOne count:(NSUInteger *)countOut explain:(NSDictionary **)explainOut {
+  return [self find:error requestDict:[self requestDict] one:findOne count:countOut explain:explainOut];
+}
+
+- (id)find:(NSError **)error requestDict:(NSMutableDictionary *)requestDict one:(BOOL)findOne count:(NSUInteger *)countOut explain:(NSDictionary **)explainOut {
   if (findOne) {
     [requestDict setObject:[NSNumber numberWithBool:YES] forKey:@"findOne"];
   }
+  
+  // Answer from the bootstrap snapshot if it contains the query
+  DKSnapshot *snapshot = (explainOut == NULL) ? [DKManager bootstrapSnapshot] : nil;
+  NSData *rows = [self rowsInSnapshot:snapshot forRequestDict:requestDict count:(countOut != NULL)];
+  if (rows != nil) {
+    NSUInteger rowCount = rows.length / sizeof(NSRange);
+    if (countOut != NULL) {
+      *countOut = rowCount;
+      return nil;
+    }
+    NSArray *results = [snapshot resultsForRows:rows limit:(findOne ? 1 : rowCount)];
+    
+    // Live entities may be newer than the snapshot, they are not overwritten
+    return [self entitiesFromResults:results updatesRegistered:NO];
+  }
   if (countOut != NULL) {
     [requestDict setObject:[NSNumber numberWithBool:YES] forKey:@"count"];
   }
-  
+  if (explainOut != NULL) {
+    [requestDict setObject:[NSNumber numberWithBool:YES] forKey:@"explain"];
+  }
   
   // Send request synchronously
   DKRequest *request = [DKRequest request];
   request.cachePolicy = self.cachePolicy;
   
   NSError *requestError = nil;
-  id results = [request sendRequestWithObject:requestDict method:@"query" error:&requestError];
+  id results = [self sendQueryRequestDict:requestDict request:request error:&requestError];
   if (requestError != nil) {
     if (error != nil) {
       *error = requestError;
     }
     return nil;
   }
+  [DKManager noteLiveQueryResponse];
+  
+  // Explain returns the query plan only
+  if (explainOut != NULL) {
+    if ([results isKindOfClass:[NSDictionary class]]) {
+      *explainOut = results;
+    }
+    return nil;
+  }
   
   // Map reduce is uses, process result and return
   if (self.mapReduce != nil) {
@@ -287,17 +475,7 @@ DKSynthesize(fieldInclExcl)
   
   // Query returned results
   else if ([results isKindOfClass:[NSArray class]]) {
-    NSMutableArray *entities = [NSMutableArray new];
-    for (NSDictionary *objDict in results) {
-      if ([objDict isKindOfClass:[NSDictionary class]]) {
-        DKEntity *entity = [[DKEntity alloc] initWithName:self.entityName];
-        entity.resultMap = objDict;
-        
-        [entities addObject:entity];
-      }
-    }
-    
-    return [NSArray arrayWithArray:entities];
+    return [self entitiesFromResults:results];
   }
   
   // Query returned object count
@@ -323,12 +501,33 @@ DKSynthesize(fieldInclExcl)
     [NSException raise:NSInternalInconsistencyException format:@"cannot use find-all with map reduce set"];
     return nil;
   }
-  return [self find:error one:NO count:NULL];
+  return [self find:error one:NO count:NULL explain:NULL];
+}
+
+- (NSArray *)findAllWithSkip:(NSUInteger)skip limit:(NSUInteger)limit error:(NSError **)error {
+  if (self.mapReduce != nil) {
+    [NSException raise:NSInternalInconsistencyException format:@"cannot use find-all with map reduce set"];
+    return nil;
+  }
+  
+  // The range is only set on the request, so that several ranges of the
+  // query can be fetched at once
+  NSMutableDictionary *requestDict = [self requestDict];
+  [requestDict removeObjectForKey:@"skip"];
+  [requestDict removeObjectForKey:@"limit"];
+  if (skip > 0) {
+    [requestDict setObject:[NSNumber numberWithUnsignedInteger:skip] forKey:@"skip"];
+  }
+  if (limit > 0) {
+    [requestDict setObject:[NSNumber numberWithUnsignedInteger:limit] forKey:@"limit"];
+  }
+  
+  return [self find:error requestDict:requestDict one:NO count:NULL explain:NULL];
 }
 
 - (void)findAllInBackgroundWithBlock:(void (^)(NSArray *results, NSError *error))block {
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     NSArray *entities = [self findAll:&error];
     if (block != NULL) {
@@ -336,7 +535,65 @@ DKSynthesize(fieldInclExcl)
         block(entities, error); 
       });
     }
-  });
+  }];
+}
+
+- (DKResultSet *)findResultSet:(NSError **)error {
+  if (self.mapReduce != nil) {
+    [NSException raise:NSInternalInconsistencyException format:@"cannot use result sets with map reduce set"];
+    return nil;
+  }
+  
+  NSDictionary *projection = nil;
+  if (self.fieldInclExcl.count > 0) {
+    projection = [NSDictionary dictionaryWithDictionary:self.fieldInclExcl];
+  }
+  
+  // Snapshot rows are decoded from the mapped snapshot
+  NSMutableDictionary *requestDict = [self requestDict];
+  DKSnapshot *snapshot = [DKManager bootstrapSnapshot];
+  NSData *rows = [self rowsInSnapshot:snapshot forRequestDict:requestDict count:NO];
+  if (rows != nil) {
+    return [[DKResultSet alloc] initWithEntityName:self.entityName data:snapshot.data rows:rows projection:projection];
+  }
+  
+  // Send request synchronously, the response is decoded row by row later
+  DKRequest *request = [DKRequest request];
+  request.cachePolicy = self.cachePolicy;
+  request.returnsRawData = YES;
+  
+  NSError *requestError = nil;
+  NSData *data = [self sendQueryRequestDict:requestDict request:request error:&requestError];
+  if (requestError != nil) {
+    if (error != nil) {
+      *error = requestError;
+    }
+    return nil;
+  }
+  [DKManager noteLiveQueryResponse];
+  
+  DKResultSet *resultSet = [[DKResultSet alloc] initWithEntityName:self.entityName data:data projection:projection];
+  if (resultSet == nil) {
+    [NSError writeToError:error
+                     code:DKErrorInvalidResponse
+              description:NSLocalizedString(@"Query did not return an object list", nil)
+                 original:nil];
+  }
+  
+  return resultSet;
+}
+
+- (void)findResultSetInBackgroundWithBlock:(void (^)(DKResultSet *resultSet, NSError *error))block {
+  dispatch_queue_t q = dispatch_get_current_queue();
+  [DKManager dispatchInBackground:^{
+    NSError *error = nil;
+    DKResultSet *resultSet = [self findResultSet:&error];
+    if (block != NULL) {
+      dispatch_async(q, ^{
+        block(resultSet, error); 
+      });
+    }
+  }];
 }
 
 - (DKEntity *)findOne {
@@ -348,12 +605,12 @@ DKSynthesize(fieldInclExcl)
     [NSException raise:NSInternalInconsistencyException format:@"cannot use find-one with map reduce set"];
     return nil;
   }
-  return [[self find:error one:YES count:NULL] lastObject];
+  return [[self find:error one:YES count:NULL explain:NULL] lastObject];
 }
 
 - (void)findOneInBackgroundWithBlock:(void (^)(DKEntity *entity, NSError *error))block {
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     DKEntity *entity = [self findOne:&error];
     if (block != NULL) {
@@ -361,7 +618,7 @@ DKSynthesize(fieldInclExcl)
         block(entity, error); 
       });
     }
-  });
+  }];
 }
 
 - (id)performMapReduce:(DKMapReduce *)mapReduce {
@@ -370,7 +627,7 @@ DKSynthesize(fieldInclExcl)
 
 - (id)performMapReduce:(DKMapReduce *)mapReduce error:(NSError **)error {
   self.mapReduce = mapReduce;
-  id result = [self find:error one:NO count:NULL];
+  id result = [self find:error one:NO count:NULL explain:NULL];
   self.mapReduce = nil;
   
   return result;
@@ -378,7 +635,7 @@ DKSynthesize(fieldInclExcl)
 
 - (void)performMapReduce:(DKMapReduce *)mapReduce inBackgroundWithBlock:(void (^)(id result, NSError *error))block {
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     id result = [self performMapReduce:mapReduce error:&error];
     if (block != NULL) {
@@ -386,7 +643,7 @@ DKSynthesize(fieldInclExcl)
         block(result, error); 
       });
     }
-  });
+  }];
 }
 
 - (NSInteger)countAll {
@@ -395,13 +652,13 @@ DKSynthesize(fieldInclExcl)
 
 - (NSInteger)countAll:(NSError **)error {
   NSUInteger count = 0;
-  [self find:error one:NO count:&count];
+  [self find:error one:NO count:&count explain:NULL];
   return count;
 }
 
 - (void)countAllInBackgroundWithBlock:(void (^)(NSUInteger count, NSError *error))block {
   dispatch_queue_t q = dispatch_get_current_queue();
-  dispatch_async([DKManager queue], ^{
+  [DKManager dispatchInBackground:^{
     NSError *error = nil;
     NSUInteger count = [self countAll:&error];
     if (block != NULL) {
@@ -409,7 +666,142 @@ DKSynthesize(fieldInclExcl)
         block(count, error); 
       });
     }
-  });
+  }];
+}
+
+- (NSInteger)estimatedCountAll:(NSError **)error {
+  NSMutableDictionary *requestDict = [self requestDict];
+  [requestDict setObject:[NSNumber numberWithBool:YES] forKey:@"count"];
+  [requestDict setObject:[NSNumber numberWithBool:YES] forKey:@"estimate"];
+  
+  DKRequest *request = [DKRequest request];
+  request.cachePolicy = self.cachePolicy;
+  
+  id result = [self sendQueryRequestDict:requestDict request:request error:error];
+  if (![result isKindOfClass:[NSNumber class]]) {
+    return 0;
+  }
+  return [(NSNumber *)result integerValue];
+}
+
+- (NSDictionary *)explain:(NSError **)error {
+  if (self.mapReduce != nil) {
+    [NSException raise:NSInternalInconsistencyException format:@"cannot explain map reduce"];
+    return nil;
+  }
+  NSDictionary *plan = nil;
+  NSError *requestError = nil;
+  [self find:&requestError one:NO count:NULL explain:&plan];
+  if (requestError != nil) {
+    if (error != NULL) {
+      *error = requestError;
+    }
+    return nil;
+  }
+  return plan;
+}
+
+- (NSArray *)mergeChangesIntoEntities:(NSArray *)entities since:(NSDate *)date nextDate:(NSDate **)nextDate error:(NSError **)error {
+  // Index the entities that can receive changes
+  NSMutableArray *merged = [NSMutableArray arrayWithArray:entities];
+  NSMutableDictionary *entityMap = [NSMutableDictionary new];
+  for (DKEntity *entity in merged) {
+    if ([entity.entityName isEqualToString:self.entityName] && entity.entityId.length > 0) {
+      [entityMap setObject:entity forKey:entity.entityId];
+    }
+  }
+  
+  NSNumber *since = [NSNumber numberWithDouble:[date timeIntervalSince1970]];
+  NSNumber *pageSize = [NSNumber numberWithUnsignedInteger:(self.limit > 0 ? self.limit : 100)];
+  NSString *after = nil;
+  
+  do {
+    // Create request dict
+    NSMutableDictionary *requestDict = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                        self.entityName, @"entity",
+                                        since, @"since",
+                                        pageSize, @"limit", nil];
+    if (after.length > 0) {
+      [requestDict setObject:after forKey:@"after"];
+    }
+    
+    // Send request synchronously
+    DKRequest *request = [DKRequest request];
+    request.cachePolicy = DKCachePolicyIgnoreCache;
+    
+    NSError *requestError = nil;
+    NSDictionary *changes = [request sendRequestWithObject:requestDict method:@"changes" error:&requestError];
+    if (requestError != nil || ![changes isKindOfClass:[NSDictionary class]]) {
+      if (error != NULL) {
+        *error = requestError;
+      }
+      return nil;
+    }
+    
+    // Collection was destroyed, drop everything we know
+    if ([[changes objectForKey:@"reset"] boolValue]) {
+      [merged removeObjectsInArray:[entityMap allValues]];
+      [entityMap removeAllObjects];
+    }
+    
+    // Remove deleted entities
+    for (NSString *entityId in [changes objectForKey:@"deleted"]) {
+      DKEntity *entity = [entityMap objectForKey:entityId];
+      if (entity != nil) {
+        [merged removeObjectIdenticalTo:entity];
+        [entityMap removeObjectForKey:entityId];
+      }
+    }
+    
+    // Update existing and append new entities
+    for (NSDictionary *objDict in [changes objectForKey:@"results"]) {
+      if ([objDict isKindOfClass:[NSDictionary class]]) {
+        NSString *entityId = [objDict objectForKey:@"_id"];
+        DKEntity *entity = [entityMap objectForKey:entityId];
+        if (entity != nil) {
+          [entity mergeObjectResultMap:objDict];
+        }
+        else {
+          entity = [[DKIdentityMap sharedMap] entityWithName:self.entityName
+                                                   resultMap:objDict
+                                                  projection:nil
+                                                  faultGroup:nil];
+          
+          [merged addObject:entity];
+          if (entityId.length > 0) {
+            [entityMap setObject:entity forKey:entityId];
+          }
+        }
+      }
+    }
+    
+    NSNumber *latest = [changes objectForKey:@"since"];
+    if ([latest isKindOfClass:[NSNumber class]]) {
+      since = latest;
+    }
+    after = [changes objectForKey:@"next"];
+  } while ([after isKindOfClass:[NSString class]] && after.length > 0);
+  
+  if (nextDate != NULL) {
+    *nextDate = [NSDate dateWithTimeIntervalSince1970:[since doubleValue]];
+  }
+  
+  return [NSArray arrayWithArray:merged];
+}
+
+- (void)mergeChangesIntoEntities:(NSArray *)entities since:(NSDate *)date inBackgroundWithBlock:(void (^)(NSArray *entities, NSDate *nextDate, NSError *error))block {
+  block = [block copy];
+  dispatch_queue_t q = dispatch_get_current_queue();
+  [DKManager dispatchInBackground:^{
+    NSError *error = nil;
+    NSDate *nextDate = nil;
+    NSArray *merged = [self mergeChangesIntoEntities:entities since:date nextDate:&nextDate error:&error];
+    if (block != NULL) {
+      dispatch_async(q, ^{
+        block(merged, nextDate, error); 
+      });
+    }
+  }];
 }
 
 @end
@@ -457,6 +849,41 @@ DKSynthesize(fieldInclExcl)
   return dict;
 }
 
+- (NSArray *)entitiesFromResults:(NSArray *)results {
+  return [self entitiesFromResults:results updatesRegistered:YES];
+}
+
+- (NSArray *)entitiesFromResults:(NSArray *)results updatesRegistered:(BOOL)updatesRegistered {
+  NSMutableArray *objDicts = [NSMutableArray new];
+  for (NSDictionary *objDict in results) {
+    if ([objDict isKindOfClass:[NSDictionary class]]) {
+      [objDicts addObject:objDict];
+    }
+  }
+  
+  // Partially loaded entities share one fault group, so that missing
+  // keys are faulted in for all of them at once
+  NSDictionary *projection = nil;
+  DKFaultGroup *group = nil;
+  if (self.fieldInclExcl.count > 0 && objDicts.count > 0) {
+    projection = [NSDictionary dictionaryWithDictionary:self.fieldInclExcl];
+    group = [[DKFaultGroup alloc] initWithEntityName:self.entityName
+                                           entityIds:[objDicts valueForKey:@"_id"]];
+  }
+  
+  NSMutableArray *entities = [NSMutableArray new];
+  for (NSDictionary *objDict in objDicts) {
+    DKEntity *entity = [[DKIdentityMap sharedMap] entityWithName:self.entityName
+                                                       resultMap:objDict
+                                                      projection:projection
+                                                      faultGroup:group
+                                               updatesRegistered:updatesRegistered];
+    [entities addObject:entity];
+  }
+  
+  return [NSArray arrayWithArray:entities];
+}
+
 - (NSString *)makeRegexSafeString:(NSString *)string {
   // There are 11 special regex characters we need to escape!
   // 1: the opening square bracket [
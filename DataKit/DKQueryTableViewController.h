@@ -55,6 +55,11 @@
  */
 @property (nonatomic, assign) NSUInteger objectsPerPage;
 
+/**
+ The number of pages loaded ahead of the displayed ones, defaults to 1
+ */
+@property (nonatomic, assign) NSUInteger prefetchPageCount;
+
 /**
  If the table view is currently fetching a page
  */
@@ -9,11 +9,13 @@
 #import "DKQueryTableViewController.h"
 
 #import "DKEntity.h"
+#import "DKPagedQueryLoader.h"
 
 @interface DKQueryTableViewController ()
 @property (nonatomic, assign) BOOL hasMore;
 @property (nonatomic, assign, readwrite) BOOL isLoading;
-@property (nonatomic, assign) NSUInteger currentOffset;
+@property (nonatomic, assign) NSUInteger nextPageIndex;
+@property (nonatomic, strong) DKPagedQueryLoader *loader;
 @property (nonatomic, strong, readwrite) NSMutableArray *objects;
 @end
 
@@ -26,10 +28,12 @@ DKSynthesize(entityName)
 DKSynthesize(displayedTitleKey)
 DKSynthesize(displayedImageKey)
 DKSynthesize(objectsPerPage)
+DKSynthesize(prefetchPageCount)
 DKSynthesize(isLoading)
 DKSynthesize(objects)
 DKSynthesize(hasMore)
-DKSynthesize(currentOffset)
+DKSynthesize(nextPageIndex)
+DKSynthesize(loader)
 
 - (id)initWithEntityName:(NSString *)entityName {
   return [self initWithStyle:UITableViewStylePlain entityName:entityName];
@@ -40,7 +44,7 @@ DKSynthesize(currentOffset)
   if (self) {
     self.hasMore = YES;
     self.objectsPerPage = 25;
-    self.currentOffset = 0;
+    self.prefetchPageCount = 1;
     self.entityName = entityName;
     self.objects = [NSMutableArray new];
   }
@@ -65,11 +69,12 @@ DKSynthesize(currentOffset)
   if (results.count > 0) {
     [self.objects addObjectsFromArray:results];  
   }
+  if (error == nil) {
+    self.nextPageIndex++;
+    self.hasMore = (results.count == self.objectsPerPage);
+  }
   
-  self.currentOffset += results.count;
-  self.hasMore = (results.count == self.objectsPerPage);
   self.isLoading = NO;
-  self.tableView.userInteractionEnabled = YES;
   
   if (error != nil) {
     UIAlertView *alert = [[UIAlertView alloc] initWithTitle:NSLocalizedString(@"Error", nil)
@@ -89,26 +94,41 @@ DKSynthesize(currentOffset)
   }
 }
 
+- (DKPagedQueryLoader *)createLoader {
+  DKQuery *q = [self tableQuery];
+  DKMapReduce *mr = (q != nil) ? [self tableQueryMapReduce] : nil;
+  
+  // Pages are fetched serially on the DataKit queue, so the loader can
+  // reuse the query for all of them
+  DKPagedQueryLoader *loader = [[DKPagedQueryLoader alloc] initWithPageSource:^NSArray *(NSUInteger offset, NSUInteger limit, NSError **error) {
+    q.skip = offset;
+    q.limit = limit;
+    if (mr != nil) {
+      return [q performMapReduce:mr error:error];
+    }
+    return [q findAll:error];
+  }];
+  loader.pageSize = self.objectsPerPage;
+  loader.prefetchPageCount = self.prefetchPageCount;
+  
+  // Displayed pages are kept in the objects list, the loader only needs
+  // to hold the prefetched ones
+  loader.maxLoadedPageCount = self.prefetchPageCount + 1;
+  
+  return loader;
+}
+
 - (void)appendNextPageWithFinishCallback:(void (^)(NSError *error))callback {
   callback = [callback copy];
-  DKQuery *q = [self tableQuery];
-  q.skip = self.currentOffset;
-  q.limit = self.objectsPerPage;
+  if (self.loader == nil) {
+    self.loader = [self createLoader];
+  }
   
   self.isLoading = YES;
-  self.tableView.userInteractionEnabled = NO;
   
-  DKMapReduce *mr = [self tableQueryMapReduce];
-  if (mr != nil) {
-    [q performMapReduce:mr inBackgroundWithBlock:^(id result, NSError *error) {
-      [self processQueryResults:result error:error callback:callback];
-    }];
-  }
-  else {
-    [q findAllInBackgroundWithBlock:^(NSArray *results, NSError *error) {
-      [self processQueryResults:results error:error callback:callback];
-    }];
-  }
+  [self.loader loadPageAtIndex:self.nextPageIndex block:^(NSArray *objects, NSError *error) {
+    [self processQueryResults:objects error:error callback:callback];
+  }];
 }
 
 - (void)reloadInBackground {
@@ -117,8 +137,14 @@ DKSynthesize(currentOffset)
 
 - (void)reloadInBackgroundWithBlock:(void (^)(NSError *))block {
   self.hasMore = YES;
-  self.currentOffset = 0;
+  self.nextPageIndex = 0;
   [self.objects removeAllObjects];
+  
+  // A new loader picks up changes to the query, results of the previous
+  // one that are still in flight are dropped
+  [self.loader reset];
+  self.loader = nil;
+  
   [self appendNextPageWithFinishCallback:block];
 }
 
@@ -142,7 +168,7 @@ DKSynthesize(currentOffset)
 }
 
 - (void)loadNextPageWithNextPageCell:(DKEntityTableNextPageCell *)cell {
-  if (self.isLoading) {
+  if (self.isLoading || !self.hasMore) {
     return;
   }
   [cell.activityAccessoryView startAnimating];
@@ -211,6 +237,17 @@ DKSynthesize(currentOffset)
   }
 }
 
+- (void)tableView:(UITableView *)tableView willDisplayCell:(UITableViewCell *)cell forRowAtIndexPath:(NSIndexPath *)indexPath {
+  // Load the next page as soon as the next-page cell is shown, it is
+  // usually prefetched already
+  if ([self tableViewCellIsNextPageCellAtIndexPath:indexPath]) {
+    DKEntityTableNextPageCell *nextPageCell = [cell isKindOfClass:[DKEntityTableNextPageCell class]] ? (id)cell : nil;
+    dispatch_async(dispatch_get_main_queue(), ^{
+      [self loadNextPageWithNextPageCell:nextPageCell];
+    });
+  }
+}
+
 - (void)tableView:(UITableView *)tableView didSelectRowAtIndexPath:(NSIndexPath *)indexPath object:(id)object {
   // stub
 }
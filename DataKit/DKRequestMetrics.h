@@ -0,0 +1,79 @@
+//
+//  DKRequestMetrics.h
+//  DataKit
+//
+//  Created by Erik Aigner on 29.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ Timing and transfer metrics of a single API request or file transfer
+ 
+ Metrics are only collected if a handler is set with <[DKManager setRequestMetricsHandler:]>. All times are in seconds.
+ */
+@interface DKRequestMetrics : NSObject
+
+/** @name Request */
+
+/**
+ The API method, e.g. `save`, `query` or `store`
+ */
+@property (nonatomic, copy, readonly) NSString *method;
+
+/**
+ The HTTP status code, `0` if no response was received
+ */
+@property (nonatomic, assign, readonly) NSInteger statusCode;
+
+/**
+ The error code, `0` on success
+ */
+@property (nonatomic, assign, readonly) NSInteger errorCode;
+
+/** @name Timing */
+
+/**
+ Time the operation waited in the serial request queue before it started
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval queueWaitTime;
+
+/**
+ Time spent wrapping special objects like `NSData` and relations before encoding
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval wrapTime;
+
+/**
+ Time spent encoding the request JSON
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval encodeTime;
+
+/**
+ Time from sending the request until the response was received
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval networkTime;
+
+/**
+ Time spent decoding the response JSON
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval decodeTime;
+
+/**
+ Time spent unwrapping special objects after decoding
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval unwrapTime;
+
+/** @name Transfer */
+
+/**
+ Number of request body bytes sent, after compression
+ */
+@property (nonatomic, assign, readonly) NSUInteger bytesOut;
+
+/**
+ Number of response body bytes received, after decompression
+ */
+@property (nonatomic, assign, readonly) NSUInteger bytesIn;
+
+@end
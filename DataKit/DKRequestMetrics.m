@@ -0,0 +1,63 @@
+//
+//  DKRequestMetrics.m
+//  DataKit
+//
+//  Created by Erik Aigner on 29.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKRequestMetrics.h"
+#import "DKRequestMetrics-Private.h"
+
+#import "DKManager.h"
+#import "DKManager-Private.h"
+
+@implementation DKRequestMetrics
+DKSynthesize(method)
+DKSynthesize(statusCode)
+DKSynthesize(errorCode)
+DKSynthesize(queueWaitTime)
+DKSynthesize(wrapTime)
+DKSynthesize(encodeTime)
+DKSynthesize(networkTime)
+DKSynthesize(decodeTime)
+DKSynthesize(unwrapTime)
+DKSynthesize(bytesOut)
+DKSynthesize(bytesIn)
+
+- (NSString *)description {
+  return [NSString stringWithFormat:@"<%@ %p method=%@ status=%i error=%i queue=%.4f wrap=%.4f encode=%.4f "
+          "network=%.4f decode=%.4f unwrap=%.4f out=%u in=%u>",
+          NSStringFromClass([self class]), self, self.method, self.statusCode, self.errorCode,
+          self.queueWaitTime, self.wrapTime, self.encodeTime, self.networkTime, self.decodeTime, self.unwrapTime,
+          self.bytesOut, self.bytesIn];
+}
+
+@end
+
+@implementation DKRequestMetrics (Private)
+
++ (DKRequestMetrics *)metricsForMethod:(NSString *)method {
+  // Don't collect anything if nobody is listening
+  if ([DKManager requestMetricsHandler] == nil) {
+    return nil;
+  }
+  DKRequestMetrics *metrics = [self new];
+  metrics.method = method;
+  metrics.queueWaitTime = [DKManager consumeQueueWaitTime];
+  
+  return metrics;
+}
+
+- (void)reportWithResponse:(NSHTTPURLResponse *)response error:(NSError *)error {
+  void (^handler)(DKRequestMetrics *) = [DKManager requestMetricsHandler];
+  if (handler != nil) {
+    if (response != nil) {
+      self.statusCode = response.statusCode;
+    }
+    self.errorCode = error.code;
+    handler(self);
+  }
+}
+
+@end
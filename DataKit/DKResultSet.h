@@ -0,0 +1,52 @@
+//
+//  DKResultSet.h
+//  DataKit
+//
+//  Created by Erik Aigner on 04.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class DKEntity;
+
+/**
+ A lazily materialized query result.
+ 
+ The result set keeps the raw response and the location of each row in it. Rows are only decoded into a <DKEntity> when they are accessed, so iterating over a large result needs a fraction of the memory of <[DKQuery findAll:]>.
+ 
+ Materialized entities are not retained by the result set. Accessing the same row twice returns a new instance, unless the identity map is enabled (see <[DKManager setIdentityMapEnabled:]>).
+ */
+@interface DKResultSet : NSObject <NSFastEnumeration>
+
+/** @name Properties */
+
+/**
+ The entity name of the rows
+ */
+@property (nonatomic, copy, readonly) NSString *entityName;
+
+/**
+ The number of rows
+ */
+@property (nonatomic, assign, readonly) NSUInteger count;
+
+/** @name Accessing Rows */
+
+/**
+ Returns the entity for the row at `index`
+ @param index The row index
+ @return The entity, or `nil` if the row could not be decoded
+ @exception NSRangeException Raises an exception if `index` is out of bounds
+ */
+- (DKEntity *)entityAtIndex:(NSUInteger)index;
+
+/**
+ Returns the entities for the rows in `range`
+ @param range The row range
+ @return The entities
+ @exception NSRangeException Raises an exception if `range` is out of bounds
+ */
+- (NSArray *)entitiesInRange:(NSRange)range;
+
+@end
@@ -0,0 +1,208 @@
+//
+//  DKResultSet.m
+//  DataKit
+//
+//  Created by Erik Aigner on 04.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKResultSet.h"
+#import "DKResultSet-Private.h"
+
+#import "DKEntity.h"
+#import "DKRequest.h"
+#import "DKIdentityMap.h"
+#import "DKFaultGroup.h"
+
+@interface DKResultSet ()
+@property (nonatomic, copy, readwrite) NSString *entityName;
+@property (nonatomic, strong) NSData *data;
+@property (nonatomic, strong) NSMutableData *rows;
+@property (nonatomic, copy) NSDictionary *projection;
+@property (nonatomic, strong) NSArray *enumerationBatch;
+@property (nonatomic, assign) BOOL updatesRegistered;
+@end
+
+@implementation DKResultSet
+DKSynthesize(entityName)
+DKSynthesize(data)
+DKSynthesize(rows)
+DKSynthesize(projection)
+DKSynthesize(enumerationBatch)
+DKSynthesize(updatesRegistered)
+
+- (id)initWithEntityName:(NSString *)entityName data:(NSData *)data projection:(NSDictionary *)projection {
+  self = [super init];
+  if (self) {
+    self.entityName = entityName;
+    self.data = data;
+    self.projection = projection;
+    self.rows = [NSMutableData new];
+    self.updatesRegistered = YES;
+    
+    if (![self scanRows]) {
+      return nil;
+    }
+  }
+  return self;
+}
+
+- (id)initWithEntityName:(NSString *)entityName data:(NSData *)data rows:(NSData *)rows projection:(NSDictionary *)projection {
+  self = [super init];
+  if (self) {
+    self.entityName = entityName;
+    self.data = data;
+    self.projection = projection;
+    self.rows = [NSMutableData dataWithData:rows];
+    
+    // Snapshot rows do not overwrite live entities, which may be newer
+    self.updatesRegistered = NO;
+  }
+  return self;
+}
+
+- (BOOL)scanRows {
+  // Records the byte range of each top-level object in the response
+  // array without decoding it
+  const char *bytes = (const char *)self.data.bytes;
+  NSUInteger length = self.data.length;
+  NSUInteger depth = 0;
+  NSUInteger start = 0;
+  BOOL inString = NO;
+  BOOL escaped = NO;
+  BOOL sawArray = NO;
+  
+  for (NSUInteger i=0; i<length; i++) {
+    char c = bytes[i];
+    if (inString) {
+      if (escaped) {
+        escaped = NO;
+      }
+      else if (c == '\\') {
+        escaped = YES;
+      }
+      else if (c == '"') {
+        inString = NO;
+      }
+      continue;
+    }
+    switch (c) {
+      case '"':
+        inString = YES;
+        break;
+      case '[':
+      case '{':
+        if (depth == 0) {
+          if (c != '[') {
+            return NO;
+          }
+          sawArray = YES;
+        }
+        else if (depth == 1) {
+          start = i;
+        }
+        depth++;
+        break;
+      case ']':
+      case '}':
+        if (depth == 0) {
+          return NO;
+        }
+        depth--;
+        if (depth == 1) {
+          NSRange row = NSMakeRange(start, i - start + 1);
+          [self.rows appendBytes:&row length:sizeof(NSRange)];
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  
+  return (sawArray && depth == 0 && !inString);
+}
+
+- (NSUInteger)count {
+  return self.rows.length / sizeof(NSRange);
+}
+
+- (DKEntity *)entityAtIndex:(NSUInteger)index {
+  if (index >= self.count) {
+    [NSException raise:NSRangeException format:@"index %u beyond bounds (%u)", index, self.count];
+    return nil;
+  }
+  NSRange row = ((const NSRange *)self.rows.bytes)[index];
+  NSData *rowData = [NSData dataWithBytesNoCopy:(void *)((const char *)self.data.bytes + row.location)
+                                         length:row.length
+                                   freeWhenDone:NO];
+  
+  NSError *JSONError = nil;
+  id resultMap = [NSJSONSerialization JSONObjectWithData:rowData options:0 error:&JSONError];
+  if (![resultMap isKindOfClass:[NSDictionary class]]) {
+#ifdef CONFIGURATION_Debug
+    NSLog(@"warning: could not decode result row %u: %@", index, JSONError);
+#endif
+    return nil;
+  }
+  resultMap = [DKRequest unwrapSpecialObjectsInJSON:resultMap];
+  
+  // Rows of a partial result fault in their missing keys individually
+  DKFaultGroup *group = nil;
+  NSString *entityId = [resultMap objectForKey:@"_id"];
+  if (self.projection != nil && [entityId isKindOfClass:[NSString class]]) {
+    group = [[DKFaultGroup alloc] initWithEntityName:self.entityName
+                                           entityIds:[NSArray arrayWithObject:entityId]];
+  }
+  
+  return [[DKIdentityMap sharedMap] entityWithName:self.entityName
+                                         resultMap:resultMap
+                                        projection:self.projection
+                                        faultGroup:group
+                                 updatesRegistered:self.updatesRegistered];
+}
+
+- (NSArray *)entitiesInRange:(NSRange)range {
+  if (NSMaxRange(range) > self.count) {
+    [NSException raise:NSRangeException format:@"range %@ beyond bounds (%u)", NSStringFromRange(range), self.count];
+    return nil;
+  }
+  NSMutableArray *entities = [NSMutableArray arrayWithCapacity:range.length];
+  for (NSUInteger i=range.location; i<NSMaxRange(range); i++) {
+    DKEntity *entity = [self entityAtIndex:i];
+    if (entity != nil) {
+      [entities addObject:entity];
+    }
+  }
+  return [NSArray arrayWithArray:entities];
+}
+
+- (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(__unsafe_unretained id [])buffer count:(NSUInteger)len {
+  if (state->state == 0) {
+    state->mutationsPtr = &state->extra[0];
+  }
+  
+  // Rows are materialized in chunks of the enumeration buffer size, the
+  // current chunk is kept alive until the next call
+  NSUInteger index = state->state;
+  NSUInteger length = MIN(len, self.count - MIN(index, self.count));
+  self.enumerationBatch = [self entitiesInRange:NSMakeRange(index, length)];
+  state->state = index + length;
+  
+  NSUInteger i = 0;
+  for (DKEntity *entity in self.enumerationBatch) {
+    buffer[i++] = entity;
+  }
+  state->itemsPtr = buffer;
+  
+  if (length == 0) {
+    self.enumerationBatch = nil;
+  }
+  else if (i == 0) {
+    // All rows in this chunk failed to decode, continue with the next
+    return [self countByEnumeratingWithState:state objects:buffer count:len];
+  }
+  
+  return i;
+}
+
+@end
@@ -0,0 +1,81 @@
+//
+//  DKSnapshot.h
+//  DataKit
+//
+//  Created by Erik Aigner on 06.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class DKFile;
+
+/**
+ A read only snapshot of query results, used to bootstrap the client before the first request.
+ 
+ The server builds snapshots for a list of queries (see <createSnapshotFileWithQueries:error:>, or the `datakit snapshot` command line tool for bundled snapshots). The snapshot file contains sorted indexes of its queries and objects, so it is memory mapped instead of read and only the objects of a query are decoded when it is answered.
+ 
+ Set the snapshot with <[DKManager setBootstrapSnapshot:]> to answer queries from it.
+ */
+@interface DKSnapshot : NSObject
+
+/** @name Properties */
+
+/**
+ The date the server started building the snapshot
+ */
+@property (nonatomic, strong, readonly) NSDate *creationDate;
+
+/**
+ The number of objects in the snapshot
+ */
+@property (nonatomic, assign, readonly) NSUInteger objectCount;
+
+/**
+ The number of queries in the snapshot
+ */
+@property (nonatomic, assign, readonly) NSUInteger queryCount;
+
+/** @name Opening Snapshots */
+
+/**
+ Opens a snapshot file, e.g. a bundled resource
+ 
+ The file is memory mapped and must not be modified while the snapshot is in use.
+ @param path The snapshot file path
+ @param error The error if the file could not be opened or is no valid snapshot
+ @return The snapshot, or `nil` on error
+ */
++ (DKSnapshot *)snapshotWithContentsOfFile:(NSString *)path error:(NSError **)error;
+
+/**
+ Opens a snapshot in memory
+ @param data The snapshot data
+ @param error The error if the data is no valid snapshot
+ @return The snapshot, or `nil` on error
+ */
++ (DKSnapshot *)snapshotWithData:(NSData *)data error:(NSError **)error;
+
+/**
+ Opens a snapshot stored on the server
+ 
+ The file is downloaded to the caches directory once and memory mapped from there.
+ @param file The snapshot file
+ @param error The error if the file could not be loaded or is no valid snapshot
+ @return The snapshot, or `nil` on error
+ */
++ (DKSnapshot *)snapshotWithFile:(DKFile *)file error:(NSError **)error;
+
+/** @name Creating Snapshots */
+
+/**
+ Builds a snapshot of the query results on the server and stores it as a file
+ 
+ Map reduce queries and prepared queries with parameters can not be part of a snapshot.
+ @param queries The <DKQuery> objects to include
+ @param error The error if the snapshot could not be built
+ @return The snapshot file, or `nil` on error
+ */
++ (DKFile *)createSnapshotFileWithQueries:(NSArray *)queries error:(NSError **)error;
+
+@end
@@ -0,0 +1,400 @@
+//
+//  DKSnapshot.m
+//  DataKit
+//
+//  Created by Erik Aigner on 06.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKSnapshot.h"
+#import "DKSnapshot-Private.h"
+
+#import "DKFile.h"
+#import "DKQuery.h"
+#import "DKQuery-Private.h"
+#import "DKRequest.h"
+
+// The layout is written by the server (see _encodeSnapshot), all
+// integers are little endian
+//
+//   header   magic, creation date (double), object count, query count,
+//            object index offset, query index offset
+//   indexes  16 byte entries sorted by key bytes, objects are
+//            (key offset, key length, JSON offset, JSON length), queries
+//            are (key offset, key length, list offset, object count)
+//   lists    uint32 object index per query result, in result order
+//   heap     keys and object JSON
+//
+#define kDKSnapshotMagic "DKSNAP01"
+#define kDKSnapshotHeaderSize 32
+#define kDKSnapshotEntrySize 16
+
+typedef struct {
+  uint32_t keyOffset;
+  uint32_t keyLength;
+  uint32_t valueOffset;
+  uint32_t valueLength;
+} DKSnapshotEntry;
+
+static uint32_t DKSnapshotReadUInt32(const char *bytes, NSUInteger offset) {
+  uint32_t value;
+  memcpy(&value, bytes + offset, sizeof(value));
+  return CFSwapInt32LittleToHost(value);
+}
+
+@interface DKSnapshot ()
+@property (nonatomic, strong, readwrite) NSDate *creationDate;
+@property (nonatomic, assign, readwrite) NSUInteger objectCount;
+@property (nonatomic, assign, readwrite) NSUInteger queryCount;
+@property (nonatomic, strong) NSData *data;
+@property (nonatomic, assign) NSUInteger objectIndexOffset;
+@property (nonatomic, assign) NSUInteger queryIndexOffset;
+@end
+
+@implementation DKSnapshot
+DKSynthesize(creationDate)
+DKSynthesize(objectCount)
+DKSynthesize(queryCount)
+DKSynthesize(data)
+DKSynthesize(objectIndexOffset)
+DKSynthesize(queryIndexOffset)
+
++ (DKSnapshot *)snapshotWithContentsOfFile:(NSString *)path error:(NSError **)error {
+  NSError *readError = nil;
+  NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedAlways error:&readError];
+  if (data == nil) {
+    [NSError writeToError:error
+                     code:DKErrorInvalidParams
+              description:NSLocalizedString(@"Could not open snapshot file", nil)
+                 original:readError];
+    return nil;
+  }
+  return [self snapshotWithData:data error:error];
+}
+
++ (DKSnapshot *)snapshotWithData:(NSData *)data error:(NSError **)error {
+  DKSnapshot *snapshot = [[self alloc] initWithData:data];
+  if (snapshot == nil) {
+    [NSError writeToError:error
+                     code:DKErrorInvalidParams
+              description:NSLocalizedString(@"Data is not a valid snapshot", nil)
+                 original:nil];
+  }
+  return snapshot;
+}
+
++ (DKSnapshot *)snapshotWithFile:(DKFile *)file error:(NSError **)error {
+  if (file.name.length == 0) {
+    [NSException raise:NSInternalInconsistencyException format:@"Snapshot file has no name"];
+    return nil;
+  }
+  
+  // Server file names are unique, a downloaded snapshot never changes
+  NSString *cacheDir = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) lastObject];
+  NSString *dir = [cacheDir stringByAppendingPathComponent:@"DKSnapshots"];
+  NSString *path = [dir stringByAppendingPathComponent:file.name];
+  NSFileManager *fm = [NSFileManager defaultManager];
+  if (![fm fileExistsAtPath:path]) {
+    NSError *loadError = nil;
+    NSData *data = [file loadData:&loadError];
+    if (data == nil) {
+      [NSError writeToError:error
+                       code:DKErrorOperationFailed
+                description:NSLocalizedString(@"Could not load snapshot file", nil)
+                   original:loadError];
+      return nil;
+    }
+    NSError *writeError = nil;
+    if (![fm createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:&writeError] ||
+        ![data writeToFile:path options:NSDataWritingAtomic error:&writeError]) {
+      [NSError writeToError:error
+                       code:DKErrorOperationFailed
+                description:NSLocalizedString(@"Could not write snapshot file", nil)
+                   original:writeError];
+      return nil;
+    }
+  }
+  
+  DKSnapshot *snapshot = [self snapshotWithContentsOfFile:path error:error];
+  if (snapshot == nil) {
+    // Load the file again next time
+    [fm removeItemAtPath:path error:NULL];
+  }
+  return snapshot;
+}
+
++ (DKFile *)createSnapshotFileWithQueries:(NSArray *)queries error:(NSError **)error {
+  NSMutableArray *requestDicts = [NSMutableArray new];
+  for (DKQuery *query in queries) {
+    if (query.mapReduce != nil || query.parameters.count > 0) {
+      [NSException raise:NSInternalInconsistencyException format:@"cannot create snapshots of map reduce or parameterized queries"];
+      return nil;
+    }
+    [requestDicts addObject:[query requestDict]];
+  }
+  NSDictionary *requestDict = [NSDictionary dictionaryWithObject:requestDicts forKey:@"queries"];
+  
+  // Send request synchronously
+  DKRequest *request = [DKRequest request];
+  request.cachePolicy = DKCachePolicyIgnoreCache;
+  
+  NSError *requestError = nil;
+  NSDictionary *result = [request sendRequestWithObject:requestDict method:@"snapshot" error:&requestError];
+  if (requestError != nil) {
+    if (error != NULL) {
+      *error = requestError;
+    }
+    return nil;
+  }
+  NSString *fileName = [result isKindOfClass:[NSDictionary class]] ? [result objectForKey:@"fileName"] : nil;
+  if (![fileName isKindOfClass:[NSString class]]) {
+    [NSError writeToError:error
+                     code:DKErrorInvalidResponse
+              description:NSLocalizedString(@"Snapshot did not return a file name", nil)
+                 original:nil];
+    return nil;
+  }
+  
+  return [DKFile fileWithName:fileName];
+}
+
+- (id)initWithData:(NSData *)data {
+  self = [super init];
+  if (self) {
+    self.data = data;
+    
+    // Only the header is read here, index entries are checked when
+    // they are accessed
+    const char *bytes = (const char *)data.bytes;
+    if (data.length < kDKSnapshotHeaderSize || memcmp(bytes, kDKSnapshotMagic, 8) != 0) {
+      return nil;
+    }
+    uint64_t dateBits;
+    memcpy(&dateBits, bytes + 8, sizeof(dateBits));
+    dateBits = CFSwapInt64LittleToHost(dateBits);
+    double created;
+    memcpy(&created, &dateBits, sizeof(created));
+    
+    self.creationDate = [NSDate dateWithTimeIntervalSince1970:created];
+    self.objectCount = DKSnapshotReadUInt32(bytes, 16);
+    self.queryCount = DKSnapshotReadUInt32(bytes, 20);
+    self.objectIndexOffset = DKSnapshotReadUInt32(bytes, 24);
+    self.queryIndexOffset = DKSnapshotReadUInt32(bytes, 28);
+    
+    if ((uint64_t)self.objectIndexOffset + (uint64_t)self.objectCount * kDKSnapshotEntrySize > data.length ||
+        (uint64_t)self.queryIndexOffset + (uint64_t)self.queryCount * kDKSnapshotEntrySize > data.length) {
+      return nil;
+    }
+  }
+  return self;
+}
+
+- (BOOL)readEntry:(DKSnapshotEntry *)entry atOffset:(NSUInteger)offset {
+  const char *bytes = (const char *)self.data.bytes;
+  entry->keyOffset = DKSnapshotReadUInt32(bytes, offset);
+  entry->keyLength = DKSnapshotReadUInt32(bytes, offset + 4);
+  entry->valueOffset = DKSnapshotReadUInt32(bytes, offset + 8);
+  entry->valueLength = DKSnapshotReadUInt32(bytes, offset + 12);
+  return ((uint64_t)entry->keyOffset + entry->keyLength <= self.data.length);
+}
+
+- (BOOL)findKey:(NSData *)key inIndexAtOffset:(NSUInteger)indexOffset count:(NSUInteger)count entry:(DKSnapshotEntry *)entry {
+  const char *bytes = (const char *)self.data.bytes;
+  NSUInteger low = 0;
+  NSUInteger high = count;
+  while (low < high) {
+    NSUInteger mid = low + (high - low) / 2;
+    if (![self readEntry:entry atOffset:indexOffset + mid * kDKSnapshotEntrySize]) {
+      return NO;
+    }
+    int order = memcmp(key.bytes, bytes + entry->keyOffset, MIN(key.length, entry->keyLength));
+    if (order == 0) {
+      order = (key.length > entry->keyLength) - (key.length < entry->keyLength);
+    }
+    if (order == 0) {
+      return YES;
+    }
+    if (order < 0) {
+      high = mid;
+    }
+    else {
+      low = mid + 1;
+    }
+  }
+  return NO;
+}
+
+- (BOOL)objectRange:(NSRange *)range atIndex:(NSUInteger)index {
+  DKSnapshotEntry entry;
+  if (index >= self.objectCount ||
+      ![self readEntry:&entry atOffset:self.objectIndexOffset + index * kDKSnapshotEntrySize] ||
+      (uint64_t)entry.valueOffset + entry.valueLength > self.data.length) {
+    return NO;
+  }
+  *range = NSMakeRange(entry.valueOffset, entry.valueLength);
+  return YES;
+}
+
+- (NSData *)rowsForRequestDict:(NSDictionary *)requestDict {
+  // Transport flags do not change the results
+  NSMutableDictionary *dict = [NSMutableDictionary dictionaryWithDictionary:[DKRequest wrapSpecialObjectsInJSON:requestDict]];
+  [dict removeObjectsForKeys:[NSArray arrayWithObjects:@"findOne", @"count", @"explain", @"estimate", @"eventual", nil]];
+  
+  NSMutableData *key = [NSMutableData new];
+  if (![isa appendCanonicalJSON:dict toData:key]) {
+    return nil;
+  }
+  
+  DKSnapshotEntry entry;
+  if ([self findKey:key inIndexAtOffset:self.queryIndexOffset count:self.queryCount entry:&entry]) {
+    if ((uint64_t)entry.valueOffset + (uint64_t)entry.valueLength * 4 > self.data.length) {
+      return nil;
+    }
+    const char *bytes = (const char *)self.data.bytes;
+    NSMutableData *rows = [NSMutableData dataWithCapacity:entry.valueLength * sizeof(NSRange)];
+    for (NSUInteger i=0; i<entry.valueLength; i++) {
+      NSRange row;
+      if (![self objectRange:&row atIndex:DKSnapshotReadUInt32(bytes, entry.valueOffset + i * 4)]) {
+        return nil;
+      }
+      [rows appendBytes:&row length:sizeof(NSRange)];
+    }
+    return rows;
+  }
+  
+  // Queries for a single entity ID are answered from the object index
+  NSDictionary *queryMap = [dict objectForKey:@"q"];
+  NSString *entityId = [queryMap isKindOfClass:[NSDictionary class]] ? [queryMap objectForKey:@"_id"] : nil;
+  [dict removeObjectsForKeys:[NSArray arrayWithObjects:@"entity", @"q", @"limit", nil]];
+  if (dict.count > 0 || queryMap.count != 1 || ![entityId isKindOfClass:[NSString class]]) {
+    return nil;
+  }
+  const char separator = 0;
+  [key setLength:0];
+  [key appendData:[[requestDict objectForKey:@"entity"] dataUsingEncoding:NSUTF8StringEncoding]];
+  [key appendBytes:&separator length:1];
+  [key appendData:[entityId dataUsingEncoding:NSUTF8StringEncoding]];
+  if ([self findKey:key inIndexAtOffset:self.objectIndexOffset count:self.objectCount entry:&entry] &&
+      (uint64_t)entry.valueOffset + entry.valueLength <= self.data.length) {
+    NSRange row = NSMakeRange(entry.valueOffset, entry.valueLength);
+    return [NSData dataWithBytes:&row length:sizeof(NSRange)];
+  }
+  
+  return nil;
+}
+
+- (NSArray *)resultsForRows:(NSData *)rows limit:(NSUInteger)limit {
+  NSUInteger count = MIN(limit, rows.length / sizeof(NSRange));
+  NSMutableArray *results = [NSMutableArray arrayWithCapacity:count];
+  for (NSUInteger i=0; i<count; i++) {
+    NSRange row = ((const NSRange *)rows.bytes)[i];
+    NSData *rowData = [NSData dataWithBytesNoCopy:(void *)((const char *)self.data.bytes + row.location)
+                                           length:row.length
+                                     freeWhenDone:NO];
+    id resultMap = [NSJSONSerialization JSONObjectWithData:rowData options:0 error:NULL];
+    if ([resultMap isKindOfClass:[NSDictionary class]]) {
+      [results addObject:[DKRequest unwrapSpecialObjectsInJSON:resultMap]];
+    }
+  }
+  return results;
+}
+
++ (BOOL)appendCanonicalJSON:(id)obj toData:(NSMutableData *)data {
+  // Serializes like _canonicalJSON on the server, keys are sorted and
+  // numbers are formatted like %.17g
+  if ([obj isKindOfClass:[NSString class]]) {
+    [self appendJSONString:obj toData:data];
+  }
+  else if ([obj isKindOfClass:[NSNumber class]]) {
+    char buf[32];
+    double value = [obj doubleValue];
+    if (CFGetTypeID((__bridge CFTypeRef)obj) == CFBooleanGetTypeID()) {
+      strlcpy(buf, [obj boolValue] ? "true" : "false", sizeof(buf));
+    }
+    else if (strchr("cCsSiIlLqQ", [obj objCType][0]) != NULL) {
+      snprintf(buf, sizeof(buf), "%lld", [obj longLongValue]);
+    }
+    else if (!isfinite(value)) {
+      strlcpy(buf, "null", sizeof(buf));
+    }
+    else if (value == floor(value) && fabs(value) < 9007199254740992.0) {
+      snprintf(buf, sizeof(buf), "%lld", (long long)value);
+    }
+    else {
+      snprintf(buf, sizeof(buf), "%.17g", value);
+    }
+    [data appendBytes:buf length:strlen(buf)];
+  }
+  else if ([obj isKindOfClass:[NSArray class]]) {
+    [data appendBytes:"[" length:1];
+    NSUInteger i = 0;
+    for (id element in obj) {
+      if (i++ > 0) {
+        [data appendBytes:"," length:1];
+      }
+      if (![self appendCanonicalJSON:element toData:data]) {
+        return NO;
+      }
+    }
+    [data appendBytes:"]" length:1];
+  }
+  else if ([obj isKindOfClass:[NSDictionary class]]) {
+    // JavaScript sorts keys by UTF-16 code units
+    NSArray *keys = [[obj allKeys] sortedArrayUsingComparator:^NSComparisonResult(id a, id b) {
+      return [a compare:b options:NSLiteralSearch];
+    }];
+    [data appendBytes:"{" length:1];
+    NSUInteger i = 0;
+    for (NSString *key in keys) {
+      if (![key isKindOfClass:[NSString class]]) {
+        return NO;
+      }
+      if (i++ > 0) {
+        [data appendBytes:"," length:1];
+      }
+      [self appendJSONString:key toData:data];
+      [data appendBytes:":" length:1];
+      if (![self appendCanonicalJSON:[obj objectForKey:key] toData:data]) {
+        return NO;
+      }
+    }
+    [data appendBytes:"}" length:1];
+  }
+  else if (obj == [NSNull null]) {
+    [data appendBytes:"null" length:4];
+  }
+  else {
+    return NO;
+  }
+  return YES;
+}
+
++ (void)appendJSONString:(NSString *)string toData:(NSMutableData *)data {
+  // Escapes like JSON.stringify
+  NSMutableString *escaped = [NSMutableString stringWithCapacity:string.length + 2];
+  [escaped appendString:@"\""];
+  for (NSUInteger i=0; i<string.length; i++) {
+    unichar c = [string characterAtIndex:i];
+    switch (c) {
+      case '"': [escaped appendString:@"\\\""]; break;
+      case '\\': [escaped appendString:@"\\\\"]; break;
+      case '\b': [escaped appendString:@"\\b"]; break;
+      case '\f': [escaped appendString:@"\\f"]; break;
+      case '\n': [escaped appendString:@"\\n"]; break;
+      case '\r': [escaped appendString:@"\\r"]; break;
+      case '\t': [escaped appendString:@"\\t"]; break;
+      default:
+        if (c < 0x20) {
+          [escaped appendFormat:@"%cu%04x", '\\', c];
+        }
+        else {
+          [escaped appendFormat:@"%C", c];
+        }
+        break;
+    }
+  }
+  [escaped appendString:@"\""];
+  [data appendData:[escaped dataUsingEncoding:NSUTF8StringEncoding]];
+}
+
+@end
@@ -7,9 +7,14 @@
 //
 
 #import "DKManager.h"
+#import "DKRequestMetrics.h"
 #import "DKEntity.h"
 #import "DKRelation.h"
 #import "DKQuery.h"
+#import "DKResultSet.h"
+#import "DKSnapshot.h"
+#import "DKPagedQueryLoader.h"
+#import "DKIndex.h"
 #import "DKMapReduce.h"
 #import "DKFile.h"
 #import "DKConstants.h"
@@ -0,0 +1,21 @@
+//
+//  DKBenchmark.h
+//  DataKit
+//
+//  Created by Erik Aigner on 30.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@interface DKBenchmark : NSObject
+@property (nonatomic, copy, readonly) NSString *name;
+@property (nonatomic, assign, readonly) NSUInteger iterations;
+@property (nonatomic, assign, readonly) double nanosecondsPerOp;
+@property (nonatomic, assign, readonly) double allocationsPerOp;
+
++ (DKBenchmark *)run:(NSString *)name iterations:(NSUInteger)iterations block:(void (^)(void))block;
+
+- (NSString *)reportLine;
+
+@end
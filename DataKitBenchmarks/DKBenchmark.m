@@ -0,0 +1,88 @@
+//
+//  DKBenchmark.m
+//  DataKit
+//
+//  Created by Erik Aigner on 30.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKBenchmark.h"
+
+#import <mach/mach_time.h>
+#import <pthread.h>
+
+// DEVNOTE: malloc_logger is the hook malloc stack logging uses. It's not
+// declared in the public headers, but stable and only used in this bundle.
+typedef void (malloc_logger_t)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t numHotFramesToSkip);
+extern malloc_logger_t *malloc_logger;
+
+#define kDKMallocLogTypeAllocate 2
+
+static pthread_t kDKBenchmarkThread;
+static uint64_t kDKBenchmarkAllocations;
+
+static void DKBenchmarkMallocLogger(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t numHotFramesToSkip) {
+  // Only count allocations of the benchmarking thread
+  if ((type & kDKMallocLogTypeAllocate) && pthread_equal(pthread_self(), kDKBenchmarkThread)) {
+    kDKBenchmarkAllocations++;
+  }
+}
+
+@interface DKBenchmark ()
+@property (nonatomic, copy, readwrite) NSString *name;
+@property (nonatomic, assign, readwrite) NSUInteger iterations;
+@property (nonatomic, assign, readwrite) double nanosecondsPerOp;
+@property (nonatomic, assign, readwrite) double allocationsPerOp;
+@end
+
+@implementation DKBenchmark
+DKSynthesize(name)
+DKSynthesize(iterations)
+DKSynthesize(nanosecondsPerOp)
+DKSynthesize(allocationsPerOp)
+
++ (DKBenchmark *)run:(NSString *)name iterations:(NSUInteger)iterations block:(void (^)(void))block {
+  // Warm up caches and lazily initialized state
+  NSUInteger warmup = MAX(iterations / 10, 1);
+  for (NSUInteger i=0; i<warmup; i++) {
+    @autoreleasepool {
+      block();
+    }
+  }
+  
+  mach_timebase_info_data_t timebase;
+  mach_timebase_info(&timebase);
+  
+  // Measure
+  kDKBenchmarkThread = pthread_self();
+  kDKBenchmarkAllocations = 0;
+  malloc_logger = DKBenchmarkMallocLogger;
+  
+  uint64_t start = mach_absolute_time();
+  for (NSUInteger i=0; i<iterations; i++) {
+    @autoreleasepool {
+      block();
+    }
+  }
+  uint64_t end = mach_absolute_time();
+  
+  malloc_logger = NULL;
+  
+  DKBenchmark *benchmark = [self new];
+  benchmark.name = name;
+  benchmark.iterations = iterations;
+  benchmark.nanosecondsPerOp = (double)(end - start) * timebase.numer / timebase.denom / iterations;
+  benchmark.allocationsPerOp = (double)kDKBenchmarkAllocations / iterations;
+  
+  // Machine readable output, grep for DKBENCH
+  printf("%s\n", [[benchmark reportLine] UTF8String]);
+  
+  return benchmark;
+}
+
+- (NSString *)reportLine {
+  return [NSString stringWithFormat:@"DKBENCH {\"name\":\"%@\",\"iterations\":%u,\"nsPerOp\":%.1f,\"allocsPerOp\":%.2f}",
+          self.name, self.iterations, self.nanosecondsPerOp, self.allocationsPerOp];
+}
+
+@end
@@ -0,0 +1,13 @@
+//
+//  DKSerializationBenchmarks.h
+//  DataKit
+//
+//  Created by Erik Aigner on 30.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+@interface DKSerializationBenchmarks : SenTestCase
+
+@end
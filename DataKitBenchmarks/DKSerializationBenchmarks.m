@@ -0,0 +1,177 @@
+//
+//  DKSerializationBenchmarks.m
+//  DataKit
+//
+//  Created by Erik Aigner on 30.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKSerializationBenchmarks.h"
+
+#import "DataKit.h"
+#import "DKEntity-Private.h"
+#import "DKQuery-Private.h"
+#import "DKRequest.h"
+#import "NSData+DataKit.h"
+#import "DKBenchmark.h"
+
+@implementation DKSerializationBenchmarks
+
+- (NSData *)randomDataWithLength:(NSUInteger)length {
+  NSMutableData *data = [NSMutableData dataWithLength:length];
+  UInt8 *bytes = data.mutableBytes;
+  for (NSUInteger i=0; i<length; i++) {
+    bytes[i] = (UInt8)(rand() % 256);
+  }
+  return [NSData dataWithData:data];
+}
+
+- (NSDictionary *)resultMapWithIndex:(NSUInteger)idx {
+  return [NSDictionary dictionaryWithObjectsAndKeys:
+          [NSString stringWithFormat:@"4f7%021u", idx], @"_id",
+          [NSNumber numberWithUnsignedInteger:idx], @"_seq",
+          [NSNumber numberWithDouble:1333000000.123], @"_updated",
+          @"Some name", @"name",
+          [NSNumber numberWithInteger:42], @"count",
+          [NSArray arrayWithObjects:@"a", @"b", @"c", nil], @"tags",
+          [NSDictionary dictionaryWithObjectsAndKeys:@"Street", @"street", @"City", @"city", nil], @"address", nil];
+}
+
+- (id)JSONObjectWithEntries:(NSUInteger)count data:(NSData *)data {
+  NSMutableArray *objects = [NSMutableArray new];
+  for (NSUInteger i=0; i<count; i++) {
+    NSMutableDictionary *dict = [NSMutableDictionary dictionaryWithDictionary:[self resultMapWithIndex:i]];
+    [dict setObject:[DKRelation relationWithEntityName:@"Other" entityId:@"4f7000000000000000000001"] forKey:@"ref"];
+    if (data != nil) {
+      [dict setObject:data forKey:@"blob"];
+    }
+    [objects addObject:dict];
+  }
+  return objects;
+}
+
+- (void)testBase64 {
+  NSUInteger sizes[] = {64, 4096, 262144};
+  NSUInteger iterations[] = {10000, 1000, 20};
+  
+  for (int i=0; i<3; i++) {
+    NSData *data = [self randomDataWithLength:sizes[i]];
+    NSString *encoded = [data base64String];
+    
+    [DKBenchmark run:[NSString stringWithFormat:@"base64String/%u", sizes[i]]
+          iterations:iterations[i]
+               block:^{
+                 [data base64String];
+               }];
+    
+    DKBenchmark *decode = [DKBenchmark run:[NSString stringWithFormat:@"dataWithBase64String/%u", sizes[i]]
+                                iterations:iterations[i]
+                                     block:^{
+                                       [NSData dataWithBase64String:encoded];
+                                     }];
+    
+    STAssertTrue(decode.nanosecondsPerOp > 0, nil);
+    STAssertEqualObjects([NSData dataWithBase64String:encoded], data, nil);
+  }
+}
+
+- (void)testWrapUnwrap {
+  NSUInteger counts[] = {1, 100, 1000};
+  NSUInteger iterations[] = {5000, 100, 10};
+  NSData *blob = [self randomDataWithLength:256];
+  
+  for (int i=0; i<3; i++) {
+    id JSONObject = [self JSONObjectWithEntries:counts[i] data:blob];
+    id wrapped = [DKRequest wrapSpecialObjectsInJSON:JSONObject];
+    
+    [DKBenchmark run:[NSString stringWithFormat:@"wrapSpecialObjectsInJSON/%u", counts[i]]
+          iterations:iterations[i]
+               block:^{
+                 [DKRequest wrapSpecialObjectsInJSON:JSONObject];
+               }];
+    
+    [DKBenchmark run:[NSString stringWithFormat:@"unwrapSpecialObjectsInJSON/%u", counts[i]]
+          iterations:iterations[i]
+               block:^{
+                 [DKRequest unwrapSpecialObjectsInJSON:wrapped];
+               }];
+    
+    STAssertEqualObjects([DKRequest unwrapSpecialObjectsInJSON:wrapped], JSONObject, nil);
+  }
+}
+
+- (void)testSavePayload {
+  NSUInteger counts[] = {1, 50, 500};
+  NSUInteger iterations[] = {5000, 200, 20};
+  
+  for (int i=0; i<3; i++) {
+    NSMutableArray *entities = [NSMutableArray new];
+    for (NSUInteger j=0; j<counts[i]; j++) {
+      DKEntity *entity = [DKEntity entityWithName:@"Bench"];
+      entity.resultMap = [self resultMapWithIndex:j];
+      [entity setObject:@"Other name" forKey:@"name"];
+      [entity setObject:[NSNumber numberWithInteger:j] forKey:@"rank"];
+      [entity incrementKey:@"count" byAmount:[NSNumber numberWithInteger:1]];
+      [entity pushObject:@"d" forKey:@"tags"];
+      [entities addObject:entity];
+    }
+    
+    // Same steps as saveAll: minus the request, key validation included
+    [DKBenchmark run:[NSString stringWithFormat:@"savePayload/%u", counts[i]]
+          iterations:iterations[i]
+               block:^{
+                 NSMutableArray *requestObjects = [NSMutableArray arrayWithCapacity:entities.count];
+                 for (DKEntity *entity in entities) {
+                   [requestObjects addObject:[entity saveRequestDict]];
+                 }
+                 id wrapped = [DKRequest wrapSpecialObjectsInJSON:requestObjects];
+                 [NSJSONSerialization dataWithJSONObject:wrapped options:0 error:NULL];
+               }];
+  }
+}
+
+- (void)testResultMaterialization {
+  NSUInteger counts[] = {1, 100, 1000};
+  NSUInteger iterations[] = {5000, 100, 10};
+  
+  DKQuery *query = [DKQuery queryWithEntityName:@"Bench"];
+  
+  for (int i=0; i<3; i++) {
+    NSMutableArray *results = [NSMutableArray new];
+    for (NSUInteger j=0; j<counts[i]; j++) {
+      [results addObject:[self resultMapWithIndex:j]];
+    }
+    NSData *responseData = [NSJSONSerialization dataWithJSONObject:results options:0 error:NULL];
+    
+    // Decode, unwrap and materialize like find: does for a response
+    DKBenchmark *benchmark = [DKBenchmark run:[NSString stringWithFormat:@"findMaterialize/%u", counts[i]]
+                                   iterations:iterations[i]
+                                        block:^{
+                                          id decoded = [NSJSONSerialization JSONObjectWithData:responseData
+                                                                                       options:NSJSONReadingAllowFragments
+                                                                                         error:NULL];
+                                          [query entitiesFromResults:[DKRequest unwrapSpecialObjectsInJSON:decoded]];
+                                        }];
+    
+    STAssertTrue(benchmark.allocationsPerOp >= counts[i], nil);
+  }
+}
+
+- (void)testRegexSafeString {
+  NSArray *strings = [NSArray arrayWithObjects:
+                      @"plain",
+                      @"some (text) with [special] chars. and * more?",
+                      [@"" stringByPaddingToLength:1024 withString:@"a.b*c(d)" startingAtIndex:0], nil];
+  
+  DKQuery *query = [DKQuery queryWithEntityName:@"Bench"];
+  
+  for (NSString *string in strings) {
+    [DKBenchmark run:[NSString stringWithFormat:@"makeRegexSafeString/%u", string.length]
+          iterations:10000
+               block:^{
+                 [query makeRegexSafeString:string];
+               }];
+  }
+}
+
+@end
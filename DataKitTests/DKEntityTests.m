@@ -477,7 +477,7 @@
   [e setObject:[NSArray arrayWithObjects:@"X", @"Y", @"Z", nil] forKey:@"values"];
   [e pullObject:@"Y" forKey:key];
   
-  STAssertTrue(e.pullAllMap.count > 0, nil);
+  STAssertTrue([e operationMapForKey:@"pullAll"].count > 0, nil);
   
   error = nil;
   success = [e save:&error];
@@ -561,4 +561,395 @@
   STAssertEquals(count, (NSUInteger)0, nil);
 }
 
+- (void)testConditionalRefresh {
+  NSString *entityName = @"ConditionalRefresh";
+  
+  DKEntity *e0 = [DKEntity entityWithName:entityName];
+  [e0 setObject:@"a" forKey:@"x"];
+  [e0 save];
+  
+  // Refresh unchanged entity keeps the result map
+  NSDictionary *resultMap = e0.resultMap;
+  
+  NSError *error = nil;
+  BOOL success = [e0 refresh:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertTrue(success, nil);
+  STAssertTrue(e0.resultMap == resultMap, nil);
+  STAssertEqualObjects([e0 objectForKey:@"x"], @"a", nil);
+  
+  // Refresh changed entity
+  DKQuery *q = [DKQuery queryWithEntityName:entityName];
+  [q whereEntityIdMatches:e0.entityId];
+  
+  DKEntity *e1 = [q findOne];
+  [e1 setObject:@"b" forKey:@"x"];
+  [e1 save];
+  
+  error = nil;
+  success = [e0 refresh:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertTrue(success, nil);
+  STAssertEqualObjects([e0 objectForKey:@"x"], @"b", nil);
+  STAssertEqualObjects(e0.updatedAt, e1.updatedAt, nil);
+  
+  [e0 delete];
+}
+
+- (void)testCoalescedSave {
+  NSString *entityName = @"CoalescedSave";
+  
+  DKEntity *e0 = [DKEntity entityWithName:entityName];
+  [e0 setObject:[NSNumber numberWithInt:1] forKey:@"count"];
+  [e0 save];
+  
+  DKQuery *q = [DKQuery queryWithEntityName:entityName];
+  [q whereEntityIdMatches:e0.entityId];
+  
+  DKEntity *e1 = [q findOne];
+  
+  [DKManager setWriteCoalescingEnabled:YES];
+  
+  __block NSUInteger done = 0;
+  __block NSError *asyncError = nil;
+  
+  void (^block)(DKEntity *, NSError *) = ^(DKEntity *entity, NSError *error) {
+    if (error != nil) {
+      asyncError = error;
+    }
+    done++;
+  };
+  
+  // Increments on both instances are merged into one save
+  [e0 incrementKey:@"count" byAmount:[NSNumber numberWithInt:2]];
+  [e0 incrementKey:@"count" byAmount:[NSNumber numberWithInt:3]];
+  [e0 saveInBackgroundWithBlock:block];
+  [e1 incrementKey:@"count" byAmount:[NSNumber numberWithInt:4]];
+  [e1 saveInBackgroundWithBlock:block];
+  
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  while (done < 2 && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  
+  [DKManager setWriteCoalescingEnabled:NO];
+  
+  STAssertNil(asyncError, asyncError.localizedDescription);
+  STAssertEqualObjects([e0 objectForKey:@"count"], [NSNumber numberWithInt:10], nil);
+  STAssertEqualObjects([e1 objectForKey:@"count"], [NSNumber numberWithInt:10], nil);
+  STAssertFalse(e0.isDirty, nil);
+  STAssertFalse(e1.isDirty, nil);
+  
+  [e0 delete];
+}
+
+- (void)testCoalescedSaveKeepsLaterChanges {
+  NSString *entityName = @"CoalescedSave";
+  
+  DKEntity *e = [DKEntity entityWithName:entityName];
+  [e setObject:[NSNumber numberWithInt:1] forKey:@"count"];
+  [e save];
+  
+  [DKManager setWriteCoalescingEnabled:YES];
+  
+  __block BOOL done = NO;
+  __block NSError *asyncError = nil;
+  
+  // Changes made before the flush are not part of the request
+  [e incrementKey:@"count" byAmount:[NSNumber numberWithInt:2]];
+  [e pushObject:@"a" forKey:@"list"];
+  [e saveInBackgroundWithBlock:^(DKEntity *entity, NSError *error) {
+    asyncError = error;
+    done = YES;
+  }];
+  [e incrementKey:@"count" byAmount:[NSNumber numberWithInt:4]];
+  [e pushObject:@"b" forKey:@"list"];
+  [e setObject:@"x" forKey:@"later"];
+  
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  while (!done && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  
+  [DKManager setWriteCoalescingEnabled:NO];
+  
+  STAssertNil(asyncError, asyncError.localizedDescription);
+  STAssertTrue(e.isDirty, nil);
+  
+  [e save];
+  [e refresh];
+  
+  STAssertEqualObjects([e objectForKey:@"count"], [NSNumber numberWithInt:7], nil);
+  STAssertEqualObjects([e objectForKey:@"list"], ([NSArray arrayWithObjects:@"a", @"b", nil]), nil);
+  STAssertEqualObjects([e objectForKey:@"later"], @"x", nil);
+  
+  [e delete];
+}
+
+- (void)testCoalescedSaveSeparatesConflicts {
+  NSString *entityName = @"CoalescedSave";
+  
+  DKEntity *e0 = [DKEntity entityWithName:entityName];
+  [e0 setObject:[NSNumber numberWithInt:1] forKey:@"count"];
+  [e0 save];
+  
+  DKQuery *q = [DKQuery queryWithEntityName:entityName];
+  [q whereEntityIdMatches:e0.entityId];
+  
+  DKEntity *e1 = [q findOne];
+  
+  [DKManager setWriteCoalescingEnabled:YES];
+  
+  __block NSUInteger done = 0;
+  __block NSError *asyncError = nil;
+  
+  void (^block)(DKEntity *, NSError *) = ^(DKEntity *entity, NSError *error) {
+    if (error != nil) {
+      asyncError = error;
+    }
+    done++;
+  };
+  
+  // A set and an increment of the same key can't be merged, they are
+  // sent one after another
+  [e0 setObject:[NSNumber numberWithInt:5] forKey:@"count"];
+  [e0 saveInBackgroundWithBlock:block];
+  [e1 incrementKey:@"count" byAmount:[NSNumber numberWithInt:2]];
+  [e1 saveInBackgroundWithBlock:block];
+  
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  while (done < 2 && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  
+  [DKManager setWriteCoalescingEnabled:NO];
+  
+  STAssertNil(asyncError, asyncError.localizedDescription);
+  STAssertFalse(e0.isDirty, nil);
+  STAssertFalse(e1.isDirty, nil);
+  
+  [e0 refresh];
+  
+  STAssertEqualObjects([e0 objectForKey:@"count"], [NSNumber numberWithInt:7], nil);
+  
+  [e0 delete];
+}
+
+- (void)testCoalescedSaveIsolatesFailures {
+  NSString *entityName = @"CoalescedSave";
+  
+  DKEntity *e0 = [DKEntity entityWithName:entityName];
+  [e0 setObject:[NSNumber numberWithInt:1] forKey:@"count"];
+  [e0 save];
+  
+  DKEntity *e1 = [DKEntity entityWithName:entityName];
+  [e1 setObject:@"text" forKey:@"name"];
+  [e1 save];
+  
+  [DKManager setWriteCoalescingEnabled:YES];
+  
+  __block NSUInteger done = 0;
+  __block NSError *error0 = nil;
+  __block NSError *error1 = nil;
+  
+  // Pushing to a string fails on the server, the other save in the same
+  // batch still succeeds
+  [e0 incrementKey:@"count" byAmount:[NSNumber numberWithInt:2]];
+  [e0 saveInBackgroundWithBlock:^(DKEntity *entity, NSError *error) {
+    error0 = error;
+    done++;
+  }];
+  [e1 pushObject:@"a" forKey:@"name"];
+  [e1 saveInBackgroundWithBlock:^(DKEntity *entity, NSError *error) {
+    error1 = error;
+    done++;
+  }];
+  
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  while (done < 2 && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  
+  [DKManager setWriteCoalescingEnabled:NO];
+  
+  STAssertNil(error0, error0.localizedDescription);
+  STAssertNotNil(error1, nil);
+  STAssertFalse(e0.isDirty, nil);
+  STAssertTrue(e1.isDirty, nil);
+  STAssertEqualObjects([e0 objectForKey:@"count"], [NSNumber numberWithInt:3], nil);
+  
+  [e0 delete];
+  [e1 delete];
+}
+
+- (void)testRequestMetrics {
+  NSString *entityName = @"RequestMetrics";
+  
+  NSMutableArray *collected = [NSMutableArray new];
+  [DKManager setRequestMetricsHandler:^(DKRequestMetrics *metrics) {
+    [collected addObject:metrics];
+  }];
+  
+  DKEntity *e = [DKEntity entityWithName:entityName];
+  [e setObject:@"a" forKey:@"x"];
+  [e save];
+  
+  STAssertEquals(collected.count, (NSUInteger)1, nil);
+  
+  DKRequestMetrics *metrics = [collected lastObject];
+  
+  STAssertEqualObjects(metrics.method, @"save", nil);
+  STAssertEquals(metrics.statusCode, (NSInteger)200, nil);
+  STAssertEquals(metrics.errorCode, (NSInteger)0, nil);
+  STAssertTrue(metrics.networkTime > 0, nil);
+  STAssertTrue(metrics.bytesOut > 0, nil);
+  STAssertTrue(metrics.bytesIn > 0, nil);
+  
+  // Failed requests report the error code
+  DKQuery *q = [DKQuery queryWithEntityName:entityName];
+  [q whereKey:@"x" matchesRegex:@"("];
+  [q findAll];
+  
+  metrics = [collected lastObject];
+  
+  STAssertEqualObjects(metrics.method, @"query", nil);
+  STAssertEquals(metrics.statusCode, (NSInteger)400, nil);
+  STAssertEquals(metrics.errorCode, (NSInteger)DKErrorOperationFailed, nil);
+  
+  [DKManager setRequestMetricsHandler:nil];
+  
+  [e delete];
+  
+  STAssertEquals(collected.count, (NSUInteger)2, nil);
+}
+
+- (void)testCompressedSave {
+  NSString *entityName = @"CompressedSave";
+  
+  __block DKRequestMetrics *metrics = nil;
+  [DKManager setRequestMetricsHandler:^(DKRequestMetrics *m) {
+    metrics = m;
+  }];
+  
+  // Repetitive content is sent gzipped and returned gzipped
+  NSString *text = [@"" stringByPaddingToLength:8192 withString:@"datakit " startingAtIndex:0];
+  DKEntity *e = [DKEntity entityWithName:entityName];
+  [e setObject:text forKey:@"text"];
+  
+  NSError *error = nil;
+  BOOL success = [e save:&error];
+  
+  STAssertTrue(success, nil);
+  STAssertNil(error, error.localizedDescription);
+  STAssertNotNil(metrics, nil);
+  STAssertTrue(metrics.bytesOut < text.length, @"bytes out: %i", metrics.bytesOut);
+  
+  [DKManager setRequestMetricsHandler:nil];
+  
+  DKQuery *q = [DKQuery queryWithEntityName:entityName];
+  [q whereEntityIdMatches:e.entityId];
+  
+  DKEntity *e2 = [q findOne:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEqualObjects([e2 objectForKey:@"text"], text, nil);
+  
+  [e delete];
+}
+
+- (void)testLazyOperationMaps {
+  NSString *entityName = @"LazyOperationMaps";
+  
+  [DKEntity destroyAllEntitiesForName:entityName error:NULL];
+  
+  for (NSInteger i=0; i<3; i++) {
+    DKEntity *e = [DKEntity entityWithName:entityName];
+    [e setObject:[NSNumber numberWithInteger:i] forKey:@"n"];
+    [e save];
+  }
+  
+  DKQuery *q = [DKQuery queryWithEntityName:entityName];
+  
+  NSError *error = nil;
+  NSArray *results = [q findAll:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(results.count, (NSUInteger)3, nil);
+  
+  // Reading does not allocate any operation maps
+  for (DKEntity *e in results) {
+    STAssertNotNil([e objectForKey:@"n"], nil);
+    STAssertFalse(e.isDirty, nil);
+    STAssertNil(e.operations, nil);
+  }
+  
+  // The first mutation allocates only the map it needs
+  DKEntity *e = [results lastObject];
+  [e incrementKey:@"n" byAmount:[NSNumber numberWithInteger:2]];
+  [e incrementKey:@"n"];
+  
+  STAssertTrue(e.isDirty, nil);
+  STAssertEquals(e.operations.count, (NSUInteger)1, nil);
+  
+  NSDictionary *requestDict = [e saveRequestDict];
+  NSDictionary *inc = [NSDictionary dictionaryWithObject:[NSNumber numberWithInteger:3] forKey:@"n"];
+  
+  STAssertEqualObjects([requestDict objectForKey:@"inc"], inc, nil);
+  STAssertEqualObjects([requestDict objectForKey:@"oid"], e.entityId, nil);
+  STAssertEquals(requestDict.count, (NSUInteger)3, nil);
+  
+  NSNumber *n = [e objectForKey:@"n"];
+  BOOL success = [e save:&error];
+  
+  STAssertTrue(success, nil);
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals([[e objectForKey:@"n"] integerValue], n.integerValue + 3, nil);
+  STAssertNil(e.operations, nil);
+  
+  [DKEntity destroyAllEntitiesForName:entityName error:NULL];
+}
+
+- (void)testShardedCounter {
+  NSString *entityName = @"ShardedCounter";
+  
+  [DKEntity destroyAllEntitiesForName:entityName error:NULL];
+  
+  DKEntity *e = [DKEntity entityWithName:entityName];
+  [e setObject:[NSNumber numberWithInteger:3] forKey:@"likes"];
+  
+  NSError *error = nil;
+  BOOL success = [e save:&error];
+  
+  STAssertTrue(success, nil);
+  STAssertNil(error, error.localizedDescription);
+  
+  // Increments from different instances land on the counter shards
+  for (NSInteger i=0; i<10; i++) {
+    DKEntity *other = [[DKQuery queryWithEntityName:entityName] findOne];
+    [other incrementKey:@"likes" byAmount:[NSNumber numberWithInteger:2]];
+    
+    success = [other save:&error];
+    
+    STAssertTrue(success, nil);
+    STAssertNil(error, error.localizedDescription);
+  }
+  
+  // Reads return the summed value
+  [e refresh];
+  
+  STAssertEquals([[e objectForKey:@"likes"] integerValue], (NSInteger)23, nil);
+  
+  DKEntity *found = [[DKQuery queryWithEntityName:entityName] findOne];
+  
+  STAssertEquals([[found objectForKey:@"likes"] integerValue], (NSInteger)23, nil);
+  
+  [e incrementKey:@"likes"];
+  [e save];
+  
+  STAssertEquals([[e objectForKey:@"likes"] integerValue], (NSInteger)24, nil);
+  
+  // Setting the value discards the shards
+  [e setObject:[NSNumber numberWithInteger:1] forKey:@"likes"];
+  [e save];
+  [e refresh];
+  
+  STAssertEquals([[e objectForKey:@"likes"] integerValue], (NSInteger)1, nil);
+  
+  [DKEntity destroyAllEntitiesForName:entityName error:NULL];
+}
+
 @end
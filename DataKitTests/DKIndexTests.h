@@ -0,0 +1,13 @@
+//
+//  DKIndexTests.h
+//  DataKit
+//
+//  Created by Erik Aigner on 28.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+@interface DKIndexTests : SenTestCase
+
+@end
@@ -0,0 +1,108 @@
+//
+//  DKIndexTests.m
+//  DataKit
+//
+//  Created by Erik Aigner on 28.03.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKIndexTests.h"
+
+#import "DataKit.h"
+#import "DKTests.h"
+
+@implementation DKIndexTests
+
+- (void)setUp {
+  [DKManager setAPIEndpoint:kDKEndpoint];
+  [DKManager setAPISecret:kDKSecret];
+}
+
+- (void)testCompoundIndex {
+  NSString *entityName = @"CompoundIndex";
+  
+  [DKEntity destroyAllEntitiesForName:entityName error:NULL];
+  
+  for (NSInteger i=0; i<10; i++) {
+    DKEntity *e = [DKEntity entityWithName:entityName];
+    [e setObject:[NSNumber numberWithInteger:i % 2] forKey:@"group"];
+    [e setObject:[NSNumber numberWithInteger:i] forKey:@"rank"];
+    [e save];
+  }
+  
+  // Query without index scans all entities
+  DKQuery *q = [DKQuery queryWithEntityName:entityName];
+  [q whereKey:@"group" equalTo:[NSNumber numberWithInteger:1]];
+  [q orderDescendingByKey:@"rank"];
+  
+  NSError *error = nil;
+  NSDictionary *plan = [q explain:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEqualObjects([plan objectForKey:@"cursor"], @"BasicCursor", nil);
+  STAssertEquals([[plan objectForKey:@"n"] integerValue], (NSInteger)5, nil);
+  STAssertEquals([[plan objectForKey:@"nscanned"] integerValue], (NSInteger)10, nil);
+  
+  // Create compound index
+  DKIndex *index = [DKIndex indexWithEntityName:entityName];
+  [index addAscendingKey:@"group"];
+  [index addDescendingKey:@"rank"];
+  index.sparse = YES;
+  
+  error = nil;
+  BOOL success = [index ensure:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertTrue(success, nil);
+  STAssertEqualObjects(index.name, @"group_1_rank_-1", nil);
+  
+  // Query uses index now
+  error = nil;
+  plan = [q explain:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEqualObjects([plan objectForKey:@"index"], index.name, nil);
+  STAssertEquals([[plan objectForKey:@"nscanned"] integerValue], (NSInteger)5, nil);
+  STAssertFalse([[plan objectForKey:@"scanAndOrder"] boolValue], nil);
+  
+  // List indexes
+  error = nil;
+  NSArray *indexes = [DKIndex indexesForEntityName:entityName error:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(indexes.count, (NSUInteger)2, nil);
+  
+  DKIndex *listed = nil;
+  for (DKIndex *i in indexes) {
+    if ([i.name isEqualToString:index.name]) {
+      listed = i;
+    }
+  }
+  
+  STAssertNotNil(listed, nil);
+  STAssertEqualObjects(listed.keys, index.keys, nil);
+  STAssertTrue(listed.sparse, nil);
+  STAssertFalse(listed.unique, nil);
+  
+  // Drop index
+  error = nil;
+  success = [listed drop:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertTrue(success, nil);
+  
+  indexes = [DKIndex indexesForEntityName:entityName error:NULL];
+  
+  STAssertEquals(indexes.count, (NSUInteger)1, nil);
+  
+  // Default index can't be dropped
+  error = nil;
+  success = [DKIndex dropIndexNamed:@"_id_" entityName:entityName error:&error];
+  
+  STAssertNotNil(error, nil);
+  STAssertFalse(success, nil);
+  
+  [DKEntity destroyAllEntitiesForName:entityName error:NULL];
+}
+
+@end
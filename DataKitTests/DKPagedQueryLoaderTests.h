@@ -0,0 +1,13 @@
+//
+//  DKPagedQueryLoaderTests.h
+//  DataKit
+//
+//  Created by Erik Aigner on 05.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+@interface DKPagedQueryLoaderTests : SenTestCase
+
+@end
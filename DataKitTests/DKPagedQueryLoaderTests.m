@@ -0,0 +1,227 @@
+//
+//  DKPagedQueryLoaderTests.m
+//  DataKit
+//
+//  Created by Erik Aigner on 05.04.12.
+//  Copyright (c) 2012 chocomoko.com. All rights reserved.
+//
+
+#import "DKPagedQueryLoaderTests.h"
+
+#import "DataKit.h"
+#import "DKPagedQueryLoader.h"
+#import "DKTests.h"
+
+@implementation DKPagedQueryLoaderTests
+
+- (void)setUp {
+  [DKManager setAPIEndpoint:kDKEndpoint];
+  [DKManager setAPISecret:kDKSecret];
+}
+
+- (DKPagedQueryLoader *)loaderForObjectCount:(NSUInteger)count fetches:(NSMutableArray *)fetches {
+  return [[DKPagedQueryLoader alloc] initWithPageSource:^NSArray *(NSUInteger offset, NSUInteger limit, NSError **error) {
+    @synchronized (fetches) {
+      [fetches addObject:[NSNumber numberWithUnsignedInteger:offset]];
+    }
+    NSMutableArray *objects = [NSMutableArray new];
+    for (NSUInteger i=offset; i<MIN(offset + limit, count); i++) {
+      [objects addObject:[NSNumber numberWithUnsignedInteger:i]];
+    }
+    return objects;
+  }];
+}
+
+- (void)waitForLoader:(DKPagedQueryLoader *)loader pageIndex:(NSUInteger)pageIndex {
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  while ([loader isLoadingPageAtIndex:pageIndex] &&
+         [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]]);
+}
+
+- (void)testPrefetchAndCoalescing {
+  NSMutableArray *fetches = [NSMutableArray new];
+  DKPagedQueryLoader *loader = [self loaderForObjectCount:10 fetches:fetches];
+  loader.pageSize = 3;
+  loader.prefetchPageCount = 1;
+  
+  __block NSUInteger done = 0;
+  __block NSArray *page = nil;
+  void (^block)(NSArray *, NSError *) = ^(NSArray *objects, NSError *error) {
+    page = objects;
+    done++;
+  };
+  
+  // Requests for the same page share one fetch
+  [loader loadPageAtIndex:0 block:block];
+  [loader loadPageAtIndex:0 block:block];
+  
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  while (done < 2 && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  [self waitForLoader:loader pageIndex:1];
+  
+  NSArray *expected = [NSArray arrayWithObjects:
+                       [NSNumber numberWithInt:0], [NSNumber numberWithInt:1], [NSNumber numberWithInt:2], nil];
+  
+  STAssertEqualObjects(page, expected, nil);
+  STAssertEquals(fetches.count, (NSUInteger)2, @"fetches: %@", fetches);
+  
+  // The next page was prefetched and is returned immediately
+  STAssertNotNil([loader objectsForPageAtIndex:1], nil);
+  
+  done = 0;
+  [loader loadPageAtIndex:1 block:block];
+  
+  STAssertEquals(done, (NSUInteger)1, nil);
+  STAssertEquals(page.count, (NSUInteger)3, nil);
+  STAssertTrue(loader.hasMore, nil);
+  
+  // The short last page ends the list
+  [self waitForLoader:loader pageIndex:2];
+  [loader loadPageAtIndex:3 block:block];
+  while (done < 2 && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  
+  STAssertEquals(page.count, (NSUInteger)1, nil);
+  STAssertFalse(loader.hasMore, nil);
+  
+  // Page 4 was prefetched before the end was known, nothing after it is
+  [self waitForLoader:loader pageIndex:4];
+  [loader loadPageAtIndex:5 block:block];
+  
+  STAssertEquals(done, (NSUInteger)3, nil);
+  STAssertEquals(page.count, (NSUInteger)0, nil);
+  STAssertEquals(fetches.count, (NSUInteger)5, @"fetches: %@", fetches);
+}
+
+- (void)testMaxLoadedPageCount {
+  NSMutableArray *fetches = [NSMutableArray new];
+  DKPagedQueryLoader *loader = [self loaderForObjectCount:100 fetches:fetches];
+  loader.pageSize = 5;
+  loader.prefetchPageCount = 0;
+  loader.maxLoadedPageCount = 2;
+  
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  for (NSUInteger i=0; i<4; i++) {
+    __block BOOL done = NO;
+    [loader loadPageAtIndex:i block:^(NSArray *objects, NSError *error) {
+      done = YES;
+    }];
+    while (!done && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  }
+  
+  // Only the pages closest to the last requested one are kept
+  STAssertNil([loader objectsForPageAtIndex:0], nil);
+  STAssertNil([loader objectsForPageAtIndex:1], nil);
+  STAssertNotNil([loader objectsForPageAtIndex:2], nil);
+  STAssertNotNil([loader objectsForPageAtIndex:3], nil);
+  
+  // Released pages are fetched again
+  __block BOOL done = NO;
+  [loader loadPageAtIndex:0 block:^(NSArray *objects, NSError *error) {
+    done = YES;
+  }];
+  while (!done && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  
+  STAssertEquals(fetches.count, (NSUInteger)5, nil);
+  STAssertNotNil([loader objectsForPageAtIndex:0], nil);
+  STAssertNil([loader objectsForPageAtIndex:2], nil);
+}
+
+- (void)testQueryLoader {
+  NSString *entityName = @"PagedQueryLoader";
+  
+  [DKEntity destroyAllEntitiesForName:entityName error:NULL];
+  
+  for (NSInteger i=0; i<5; i++) {
+    DKEntity *e = [DKEntity entityWithName:entityName];
+    [e setObject:[NSNumber numberWithInteger:i] forKey:@"n"];
+    [e save];
+  }
+  
+  DKQuery *q = [DKQuery queryWithEntityName:entityName];
+  [q orderAscendingByKey:@"n"];
+  
+  DKPagedQueryLoader *loader = [[DKPagedQueryLoader alloc] initWithQuery:q];
+  loader.pageSize = 2;
+  
+  __block NSArray *page = nil;
+  __block NSError *pageError = nil;
+  [loader loadPageAtIndex:1 block:^(NSArray *objects, NSError *error) {
+    page = objects;
+    pageError = error;
+  }];
+  
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  while (page == nil && pageError == nil && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  
+  STAssertNil(pageError, pageError.localizedDescription);
+  STAssertEquals(page.count, (NSUInteger)2, nil);
+  STAssertEqualObjects([[page objectAtIndex:0] objectForKey:@"n"], [NSNumber numberWithInteger:2], nil);
+  
+  [self waitForLoader:loader pageIndex:2];
+  
+  STAssertEquals([loader objectsForPageAtIndex:2].count, (NSUInteger)1, nil);
+  STAssertFalse(loader.hasMore, nil);
+  
+  [DKEntity destroyAllEntitiesForName:entityName error:NULL];
+}
+
+- (void)testQueryLoaderPrefetch {
+  NSString *entityName = @"PagedQueryLoaderPrefetch";
+  
+  [DKEntity destroyAllEntitiesForName:entityName error:NULL];
+  
+  for (NSInteger i=0; i<9; i++) {
+    DKEntity *e = [DKEntity entityWithName:entityName];
+    [e setObject:[NSNumber numberWithInteger:i] forKey:@"n"];
+    [e save];
+  }
+  
+  DKQuery *q = [DKQuery queryWithEntityName:entityName];
+  [q orderAscendingByKey:@"n"];
+  
+  DKPagedQueryLoader *loader = [[DKPagedQueryLoader alloc] initWithQuery:q];
+  loader.pageSize = 2;
+  loader.prefetchPageCount = 4;
+  
+  // The prefetched pages are fetched at once, each with its own range
+  __block NSArray *page = nil;
+  [loader loadPageAtIndex:0 block:^(NSArray *objects, NSError *error) {
+    page = objects;
+  }];
+  
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  while (page == nil && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  for (NSUInteger i=1; i<=4; i++) {
+    [self waitForLoader:loader pageIndex:i];
+  }
+  
+  for (NSUInteger i=0; i<=4; i++) {
+    NSArray *objects = [loader objectsForPageAtIndex:i];
+    STAssertEquals(objects.count, (NSUInteger)((i < 4) ? 2 : 1), @"page %u", i);
+    for (NSUInteger j=0; j<objects.count; j++) {
+      STAssertEqualObjects([[objects objectAtIndex:j] objectForKey:@"n"], [NSNumber numberWithUnsignedInteger:i * 2 + j], @"page %u", i);
+    }
+  }
+  STAssertEquals(q.skip, (NSUInteger)0, nil);
+  STAssertEquals(q.limit, (NSUInteger)0, nil);
+  
+  [DKEntity destroyAllEntitiesForName:entityName error:NULL];
+}
+
+- (void)testResetCancelsPendingLoads {
+  DKPagedQueryLoader *loader = [[DKPagedQueryLoader alloc] initWithPageSource:^NSArray *(NSUInteger offset, NSUInteger limit, NSError **error) {
+    [NSThread sleepForTimeInterval:0.2];
+    return [NSArray array];
+  }];
+  
+  __block NSError *pageError = nil;
+  [loader loadPageAtIndex:0 block:^(NSArray *objects, NSError *error) {
+    pageError = error;
+  }];
+  [loader reset];
+  
+  STAssertEquals(pageError.code, (NSInteger)DKErrorCancelled, nil);
+  STAssertFalse([loader isLoadingPageAtIndex:0], nil);
+}
+
+@end
@@ -13,7 +13,11 @@
 #import "DKQuery.h"
 #import "DKQuery-Private.h"
 #import "DKManager.h"
+#import "DKRequestMetrics.h"
 #import "DKMapReduce.h"
+#import "DKResultSet.h"
+#import "DKSnapshot.h"
+#import "DKFile.h"
 #import "DKTests.h"
 
 @implementation DKQueryTests
@@ -661,6 +665,68 @@
   [e2 delete];
 }
 
+- (void)testCountAndEstimatedCount {
+  NSString *name = @"CountAndEstimate";
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+  
+  NSMutableArray *entities = [NSMutableArray new];
+  for (NSInteger i=0; i<3; i++) {
+    DKEntity *e = [DKEntity entityWithName:name];
+    [e setObject:[NSNumber numberWithInteger:i % 2] forKey:@"parity"];
+    [e save];
+    [entities addObject:e];
+  }
+  
+  // The first counts seed the total and the per value counter, further
+  // saves and deletes maintain them
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  
+  DKQuery *q1 = [DKQuery queryWithEntityName:name];
+  [q1 whereKey:@"parity" equalTo:[NSNumber numberWithInteger:1]];
+  
+  NSError *error = nil;
+  NSInteger count = [q countAll:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(count, (NSInteger)3, nil);
+  STAssertEquals([q1 countAll], (NSInteger)1, nil);
+  
+  DKEntity *changed = [entities objectAtIndex:0];
+  [changed setObject:[NSNumber numberWithInteger:1] forKey:@"parity"];
+  [changed save];
+  
+  STAssertEquals([q countAll], (NSInteger)3, nil);
+  STAssertEquals([q1 countAll], (NSInteger)2, nil);
+  
+  [[entities lastObject] delete];
+  [entities removeLastObject];
+  
+  DKEntity *added = [DKEntity entityWithName:name];
+  [added setObject:[NSNumber numberWithInteger:1] forKey:@"parity"];
+  [added save];
+  [entities addObject:added];
+  
+  error = nil;
+  count = [q countAll:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(count, (NSInteger)3, nil);
+  STAssertEquals([q1 countAll], (NSInteger)3, nil);
+  
+  // Queries without a counter count small collections exactly
+  DKQuery *q2 = [DKQuery queryWithEntityName:name];
+  [q2 whereKey:@"parity" lessThan:[NSNumber numberWithInteger:1]];
+  
+  error = nil;
+  count = [q2 estimatedCountAll:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(count, (NSInteger)0, nil);
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+}
+
 - (void)testFieldIncludeExclude {
   NSString *name = @"FieldInclExcl";
   
@@ -688,10 +754,14 @@
   STAssertNil(error, error.localizedDescription);
   STAssertNotNil(e2, nil);
   
-  STAssertNil([e2 objectForKey:@"x"], nil);
-  STAssertNil([e2 objectForKey:@"y"], nil);
+  STAssertNil([e2.resultMap objectForKey:@"x"], nil);
+  STAssertNil([e2.resultMap objectForKey:@"y"], nil);
   STAssertEqualObjects([e2 objectForKey:@"z"], @"c", nil);
   
+  // Excluded keys are faulted in on access
+  STAssertEqualObjects([e2 objectForKey:@"x"], @"a", nil);
+  STAssertEqualObjects([e2 objectForKey:@"y"], @"b", nil);
+  
   // Test include
   [q includeKeys:[NSArray arrayWithObjects:@"x", @"y", nil]];
   
@@ -705,11 +775,478 @@
   
   STAssertEqualObjects([e3 objectForKey:@"x"], @"a", nil);
   STAssertEqualObjects([e3 objectForKey:@"y"], @"b", nil);
-  STAssertNil([e3 objectForKey:@"z"], nil);
+  STAssertNil([e3.resultMap objectForKey:@"z"], nil);
+  STAssertEqualObjects([e3 objectForKey:@"z"], @"c", nil);
+  
+  // Keys not stored at all stay nil
+  STAssertNil([e3 objectForKey:@"w"], nil);
+  
+  [e delete];
+}
+
+- (void)testFieldFaultingIsBatched {
+  NSString *name = @"FieldFaulting";
+  
+  NSMutableArray *saved = [NSMutableArray new];
+  for (NSInteger i=0; i<5; i++) {
+    DKEntity *e = [DKEntity entityWithName:name];
+    [e setObject:[NSNumber numberWithInteger:i] forKey:@"n"];
+    [e setObject:[NSString stringWithFormat:@"text %i", i] forKey:@"text"];
+    
+    NSError *error = nil;
+    BOOL success = [e save:&error];
+    
+    STAssertTrue(success, nil);
+    STAssertNil(error, error.localizedDescription);
+    
+    [saved addObject:e];
+  }
+  
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  [q orderAscendingByKey:@"n"];
+  [q includeKeys:[NSArray arrayWithObject:@"n"]];
+  
+  NSError *error = nil;
+  NSArray *results = [q findAll:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(results.count, (NSUInteger)5, nil);
+  
+  NSMutableArray *collected = [NSMutableArray new];
+  [DKManager setRequestMetricsHandler:^(DKRequestMetrics *metrics) {
+    [collected addObject:metrics];
+  }];
+  
+  // All entities from the same query are faulted in with one request
+  for (NSInteger i=0; i<results.count; i++) {
+    DKEntity *e = [results objectAtIndex:i];
+    NSString *text = [NSString stringWithFormat:@"text %i", i];
+    
+    STAssertEqualObjects([e objectForKey:@"text"], text, nil);
+  }
+  
+  [DKManager setRequestMetricsHandler:nil];
+  
+  STAssertEquals(collected.count, (NSUInteger)1, nil);
+  STAssertEqualObjects([[collected lastObject] method], @"query", nil);
+  
+  for (DKEntity *e in saved) {
+    [e delete];
+  }
+}
+
+- (void)testFieldFaultingInBackground {
+  NSString *name = @"FieldFaulting";
+  
+  DKEntity *saved = [DKEntity entityWithName:name];
+  [saved setObject:[NSNumber numberWithInt:1] forKey:@"n"];
+  [saved setObject:@"text" forKey:@"text"];
+  [saved save];
+  
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  [q whereEntityIdMatches:saved.entityId];
+  [q includeKeys:[NSArray arrayWithObject:@"n"]];
+  
+  DKEntity *e = [q findOne];
+  
+  STAssertTrue(e.isFault, nil);
+  
+  __block BOOL done = NO;
+  __block NSError *asyncError = nil;
+  
+  [e faultInInBackgroundWithBlock:^(DKEntity *entity, NSError *error) {
+    asyncError = error;
+    done = YES;
+  }];
+  
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  while (!done && [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]]);
+  
+  STAssertNil(asyncError, asyncError.localizedDescription);
+  STAssertFalse(e.isFault, nil);
+  
+  // The missing keys are loaded, no request is sent anymore
+  NSMutableArray *collected = [NSMutableArray new];
+  [DKManager setRequestMetricsHandler:^(DKRequestMetrics *metrics) {
+    [collected addObject:metrics];
+  }];
+  
+  STAssertEqualObjects([e objectForKey:@"text"], @"text", nil);
+  
+  [DKManager setRequestMetricsHandler:nil];
+  
+  STAssertEquals(collected.count, (NSUInteger)0, nil);
+  
+  [saved delete];
+}
+
+- (void)testIdentityMap {
+  NSString *name = @"IdentityMap";
+  
+  [DKManager setIdentityMapEnabled:YES];
+  
+  DKEntity *e = [DKEntity entityWithName:name];
+  [e setObject:@"a" forKey:@"x"];
+  
+  NSError *error = nil;
+  BOOL success = [e save:&error];
+  
+  STAssertTrue(success, nil);
+  STAssertNil(error, error.localizedDescription);
+  
+  // Saved entities are reused by queries
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  [q whereEntityIdMatches:e.entityId];
+  
+  DKEntity *e2 = [q findOne:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertTrue(e2 == e, nil);
+  
+  // Results of overlapping queries share the instance and see updates
+  DKQuery *q2 = [DKQuery queryWithEntityName:name];
+  [q2 whereKey:@"x" equalTo:@"a"];
+  
+  DKEntity *e3 = [q2 findOne:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertTrue(e3 == e, nil);
+  
+  DKEntity *e4 = [DKEntity entityWithName:name];
+  e4.resultMap = [NSDictionary dictionaryWithObject:e.entityId forKey:@"_id"];
+  [e4 setObject:@"b" forKey:@"x"];
+  success = [e4 save:&error];
+  
+  STAssertTrue(success, nil);
+  STAssertNil(error, error.localizedDescription);
+  STAssertEqualObjects([e objectForKey:@"x"], @"b", nil);
+  
+  [DKManager setIdentityMapEnabled:NO];
+  
+  // Without identity map every result is a new instance
+  DKEntity *e5 = [q findOne:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertTrue(e5 != e, nil);
+  STAssertEqualObjects(e5.entityId, e.entityId, nil);
   
   [e delete];
 }
 
+- (void)testResultSet {
+  NSString *name = @"ResultSet";
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+  
+  // Brackets and quotes in strings must not confuse the row scanner
+  NSArray *texts = [NSArray arrayWithObjects:@"a", @"[b]", @"{\"c\"}", @"d\\", nil];
+  for (NSInteger i=0; i<texts.count; i++) {
+    DKEntity *e = [DKEntity entityWithName:name];
+    [e setObject:[NSNumber numberWithInteger:i] forKey:@"n"];
+    [e setObject:[texts objectAtIndex:i] forKey:@"text"];
+    [e setObject:[NSDictionary dictionaryWithObject:[NSArray arrayWithObject:@"x"] forKey:@"y"] forKey:@"nested"];
+    [e save];
+  }
+  
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  [q orderAscendingByKey:@"n"];
+  
+  NSError *error = nil;
+  DKResultSet *resultSet = [q findResultSet:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(resultSet.count, texts.count, nil);
+  
+  DKEntity *e2 = [resultSet entityAtIndex:1];
+  
+  STAssertEqualObjects([e2 objectForKey:@"text"], @"[b]", nil);
+  STAssertEqualObjects([[e2 objectForKey:@"nested"] objectForKey:@"y"], [NSArray arrayWithObject:@"x"], nil);
+  
+  NSInteger i = 0;
+  for (DKEntity *e in resultSet) {
+    STAssertEqualObjects([e objectForKey:@"n"], [NSNumber numberWithInteger:i], nil);
+    STAssertEqualObjects([e objectForKey:@"text"], [texts objectAtIndex:i], nil);
+    i++;
+  }
+  
+  STAssertEquals(i, (NSInteger)texts.count, nil);
+  STAssertEquals([resultSet entitiesInRange:NSMakeRange(1, 2)].count, (NSUInteger)2, nil);
+  STAssertThrows([resultSet entityAtIndex:texts.count], nil);
+  
+  // Empty results
+  DKQuery *q2 = [DKQuery queryWithEntityName:name];
+  [q2 whereKey:@"n" equalTo:[NSNumber numberWithInteger:-1]];
+  
+  DKResultSet *emptySet = [q2 findResultSet:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertNotNil(emptySet, nil);
+  STAssertEquals(emptySet.count, (NSUInteger)0, nil);
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+}
+
+- (void)testPreparedQuery {
+  NSString *name = @"PreparedQuery";
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+  
+  NSArray *authors = [NSArray arrayWithObjects:@"a", @"a", @"b", nil];
+  for (NSInteger i=0; i<authors.count; i++) {
+    DKEntity *e = [DKEntity entityWithName:name];
+    [e setObject:[authors objectAtIndex:i] forKey:@"author"];
+    [e setObject:[NSNumber numberWithInteger:i] forKey:@"n"];
+    [e save];
+  }
+  
+  NSMutableArray *methods = [NSMutableArray new];
+  [DKManager setRequestMetricsHandler:^(DKRequestMetrics *metrics) {
+    [methods addObject:metrics.method];
+  }];
+  
+  NSMutableArray *counts = [NSMutableArray new];
+  for (NSString *author in [NSArray arrayWithObjects:@"a", @"b", @"c", nil]) {
+    DKQuery *q = [DKQuery queryWithEntityName:name];
+    [q whereKey:@"author" equalTo:[DKQuery parameterNamed:@"author"]];
+    [q orderDescendingByKey:@"n"];
+    q.prepared = YES;
+    q.parameters = [NSDictionary dictionaryWithObject:author forKey:@"author"];
+    
+    NSError *error = nil;
+    NSArray *results = [q findAll:&error];
+    
+    STAssertNil(error, error.localizedDescription);
+    [counts addObject:[NSNumber numberWithUnsignedInteger:results.count]];
+    
+    if ([author isEqualToString:@"a"]) {
+      STAssertEqualObjects([[results objectAtIndex:0] objectForKey:@"n"], [NSNumber numberWithInteger:1], nil);
+    }
+  }
+  
+  [DKManager setRequestMetricsHandler:nil];
+  
+  NSArray *expectedCounts = [NSArray arrayWithObjects:
+                             [NSNumber numberWithInt:2], [NSNumber numberWithInt:1], [NSNumber numberWithInt:0], nil];
+  NSArray *expectedMethods = [NSArray arrayWithObjects:@"prepare", @"query", @"query", @"query", nil];
+  
+  STAssertEqualObjects(counts, expectedCounts, nil);
+  STAssertEqualObjects(methods, expectedMethods, nil);
+  
+  // Missing parameters are rejected
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  [q whereKey:@"author" equalTo:[DKQuery parameterNamed:@"author"]];
+  q.prepared = YES;
+  
+  NSError *error = nil;
+  NSArray *results = [q findAll:&error];
+  
+  STAssertNil(results, nil);
+  STAssertEquals(error.code, (NSInteger)DKErrorInvalidParams, nil);
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+}
+
+- (void)testTextSearch {
+  NSString *name = @"TextSearch";
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+  
+  NSArray *texts = [NSArray arrayWithObjects:
+                    @"The quick brown fox",
+                    @"A quick fox, jumping over the lazy dog",
+                    @"Nothing to see here", nil];
+  for (NSString *text in texts) {
+    DKEntity *e = [DKEntity entityWithName:name];
+    [e setObject:text forKey:@"text"];
+    [e save];
+  }
+  
+  // Best match first, case insensitive
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  [q whereKey:@"text" matchesText:@"LAZY fox"];
+  
+  NSError *error = nil;
+  NSArray *results = [q findAll:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(results.count, (NSUInteger)2, nil);
+  STAssertEqualObjects([[results objectAtIndex:0] objectForKey:@"text"], [texts objectAtIndex:1], nil);
+  STAssertEqualObjects([[results objectAtIndex:1] objectForKey:@"text"], [texts objectAtIndex:0], nil);
+  STAssertNil([[results objectAtIndex:0] objectForKey:@"_kw_text"], nil);
+  
+  // Limit and count
+  q.limit = 1;
+  results = [q findAll:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(results.count, (NSUInteger)1, nil);
+  
+  q.limit = 0;
+  STAssertEquals([q countAll], (NSInteger)2, nil);
+  
+  // Updated text is searchable
+  DKEntity *e = [results objectAtIndex:0];
+  [e setObject:@"Nothing here either" forKey:@"text"];
+  [e save];
+  
+  STAssertEquals([q countAll], (NSInteger)1, nil);
+  
+  // Only configured text fields can be searched
+  DKQuery *q2 = [DKQuery queryWithEntityName:name];
+  [q2 whereKey:@"other" matchesText:@"fox"];
+  
+  results = [q2 findAll:&error];
+  
+  STAssertNil(results, nil);
+  STAssertEquals(error.code, (NSInteger)DKErrorInvalidParams, nil);
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+}
+
+- (void)testCaseInsensitiveMatch {
+  NSString *name = @"NormalizedSearch";
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+  
+  NSArray *names = [NSArray arrayWithObjects:@"Zoë Ångström", @"zoey", @"Bob", nil];
+  for (NSString *value in names) {
+    DKEntity *e = [DKEntity entityWithName:name];
+    [e setObject:value forKey:@"name"];
+    [e setObject:value forKey:@"plain"];
+    [e save];
+  }
+  
+  // Normalized fields ignore case and diacritics
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  [q whereKey:@"name" equalToStringIgnoringCase:@"ZOE angstrom"];
+  
+  NSArray *results = [q findAll];
+  
+  STAssertEquals(results.count, (NSUInteger)1, nil);
+  STAssertEqualObjects([[results objectAtIndex:0] objectForKey:@"name"], [names objectAtIndex:0], nil);
+  STAssertNil([[results objectAtIndex:0] objectForKey:@"_norm_name"], nil);
+  
+  DKQuery *q2 = [DKQuery queryWithEntityName:name];
+  [q2 whereKey:@"name" hasPrefixIgnoringCase:@"ZO"];
+  
+  STAssertEquals([q2 countAll], (NSInteger)2, nil);
+  
+  // Other fields only ignore case
+  DKQuery *q3 = [DKQuery queryWithEntityName:name];
+  [q3 whereKey:@"plain" equalToStringIgnoringCase:@"BOB"];
+  
+  STAssertEquals([q3 countAll], (NSInteger)1, nil);
+  
+  DKQuery *q4 = [DKQuery queryWithEntityName:name];
+  [q4 whereKey:@"plain" hasPrefixIgnoringCase:@"ZOE"];
+  
+  STAssertEquals([q4 countAll], (NSInteger)1, nil);
+  
+  // The copy follows updates
+  DKEntity *e = [results objectAtIndex:0];
+  [e setObject:@"Alice" forKey:@"name"];
+  [e save];
+  
+  STAssertEquals([q countAll], (NSInteger)0, nil);
+  STAssertEquals([q2 countAll], (NSInteger)1, nil);
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+}
+
+- (void)testBootstrapSnapshot {
+  NSString *name = @"SnapshotQuery";
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+  
+  NSMutableArray *entities = [NSMutableArray new];
+  for (NSUInteger i=0; i<3; i++) {
+    DKEntity *e = [DKEntity entityWithName:name];
+    [e setObject:[NSNumber numberWithUnsignedInteger:i] forKey:@"n"];
+    [e setObject:@"a \"quoted\" näme" forKey:@"s"];
+    [e save];
+    [entities addObject:e];
+  }
+  
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  [q whereKey:@"n" greaterThan:[NSNumber numberWithDouble:0.5]];
+  [q orderAscendingByKey:@"n"];
+  
+  DKQuery *q2 = [DKQuery queryWithEntityName:name];
+  [q2 whereKey:@"s" equalTo:@"a \"quoted\" näme"];
+  
+  NSError *error = nil;
+  DKFile *file = [DKSnapshot createSnapshotFileWithQueries:[NSArray arrayWithObjects:q, q2, nil] error:&error];
+  STAssertNil(error, error.localizedDescription);
+  STAssertNotNil(file.name, nil);
+  
+  DKSnapshot *snapshot = [DKSnapshot snapshotWithFile:file error:&error];
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(snapshot.objectCount, (NSUInteger)3, nil);
+  STAssertEquals(snapshot.queryCount, (NSUInteger)2, nil);
+  STAssertTrue([snapshot.creationDate timeIntervalSinceNow] < 0, nil);
+  
+  // Queries using the cache are answered from the snapshot while it is set
+  DKEntity *removed = [entities objectAtIndex:2];
+  [removed delete];
+  
+  DKEntity *changed = [entities objectAtIndex:1];
+  [changed setObject:@"changed" forKey:@"s"];
+  [changed save];
+  
+  [DKManager setBootstrapSnapshot:snapshot];
+  
+  // Until the server answered a query, queries ignoring the cache (the
+  // default) are answered from the snapshot too
+  STAssertEquals([q2 countAll], (NSInteger)3, nil);
+  
+  q.cachePolicy = DKCachePolicyUseCacheElseLoad;
+  q2.cachePolicy = DKCachePolicyUseCacheElseLoad;
+  
+  NSArray *results = [q findAll];
+  STAssertEquals(results.count, (NSUInteger)2, nil);
+  STAssertEqualObjects([[results objectAtIndex:1] objectForKey:@"n"], [NSNumber numberWithInt:2], nil);
+  STAssertEquals([q2 countAll], (NSInteger)3, nil);
+  STAssertEquals([q2 findResultSet:NULL].count, (NSUInteger)3, nil);
+  
+  // Live entities are not overwritten by older snapshot rows
+  STAssertTrue([results objectAtIndex:0] == changed, nil);
+  STAssertEqualObjects([changed objectForKey:@"s"], @"changed", nil);
+  
+  NSArray *rowEntities = [[q2 findResultSet:NULL] entitiesInRange:NSMakeRange(0, 3)];
+  
+  STAssertTrue([rowEntities indexOfObjectIdenticalTo:changed] != NSNotFound, nil);
+  
+  DKQuery *q3 = [DKQuery queryWithEntityName:name];
+  q3.cachePolicy = DKCachePolicyUseCacheElseLoad;
+  [q3 whereEntityIdMatches:removed.entityId];
+  
+  STAssertEqualObjects([[q3 findOne] objectForKey:@"n"], [NSNumber numberWithInt:2], nil);
+  
+  // Other queries go to the server, after that queries ignoring the
+  // cache do too
+  DKQuery *q4 = [DKQuery queryWithEntityName:name];
+  q4.cachePolicy = DKCachePolicyUseCacheElseLoad;
+  
+  STAssertEquals([q4 countAll], (NSInteger)2, nil);
+  
+  q2.cachePolicy = DKCachePolicyIgnoreCache;
+  
+  STAssertEquals([q2 countAll], (NSInteger)1, nil);
+  
+  // Without the snapshot all queries are live
+  [DKManager setBootstrapSnapshot:nil];
+  
+  STAssertEquals([q findAll].count, (NSUInteger)1, nil);
+  STAssertNil([q3 findOne], nil);
+  
+  // Invalid data is rejected
+  STAssertNil([DKSnapshot snapshotWithData:[@"DKSNAP01" dataUsingEncoding:NSUTF8StringEncoding] error:&error], nil);
+  STAssertEquals(error.code, (NSInteger)DKErrorInvalidParams, nil);
+  
+  [DKFile deleteFile:file.name error:NULL];
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+}
+
 - (void)testQueryOnNonExistentCollection {
   DKQuery *q = [DKQuery queryWithEntityName:@"NonExistentCollection"];
   [q whereKeyExists:@"i"];
@@ -721,4 +1258,84 @@
   STAssertEquals(results.count, (NSUInteger)0, @"not nil: %@", results);
 }
 
+- (void)testEventuallyConsistentQuery {
+  NSString *name = @"EventuallyConsistent";
+  
+  DKEntity *e = [DKEntity entityWithName:name];
+  [e setObject:@"a" forKey:@"x"];
+  [e save];
+  
+  // Without a replica set the secondary read falls back to the primary
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  q.eventuallyConsistent = YES;
+  [q whereKey:@"x" equalTo:@"a"];
+  
+  NSError *error = nil;
+  NSArray *results = [q findAll:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertEquals(results.count, (NSUInteger)1, nil);
+  STAssertEqualObjects([[results lastObject] entityId], e.entityId, nil);
+  
+  [e delete];
+}
+
+- (void)testMergeChanges {
+  NSString *name = @"MergeChanges";
+  
+  [DKEntity destroyAllEntitiesForName:name error:NULL];
+  
+  DKEntity *e0 = [DKEntity entityWithName:name];
+  [e0 setObject:@"a" forKey:@"x"];
+  [e0 save];
+  
+  DKEntity *e1 = [DKEntity entityWithName:name];
+  [e1 setObject:@"b" forKey:@"x"];
+  [e1 save];
+  
+  // Initial sync
+  DKQuery *q = [DKQuery queryWithEntityName:name];
+  q.limit = 1;
+  
+  NSError *error = nil;
+  NSDate *syncDate = nil;
+  NSArray *entities = [q mergeChangesIntoEntities:nil since:nil nextDate:&syncDate error:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertNotNil(syncDate, nil);
+  STAssertEquals(entities.count, (NSUInteger)2, nil);
+  
+  // Make changes
+  [NSThread sleepForTimeInterval:0.01];
+  
+  DKEntity *e2 = [DKEntity entityWithName:name];
+  [e2 setObject:@"c" forKey:@"x"];
+  [e2 save];
+  
+  [e1 setObject:@"d" forKey:@"x"];
+  [e1 save];
+  
+  [e0 delete];
+  
+  // Delta sync
+  error = nil;
+  NSDate *syncDate2 = nil;
+  NSArray *entities2 = [q mergeChangesIntoEntities:entities since:syncDate nextDate:&syncDate2 error:&error];
+  
+  STAssertNil(error, error.localizedDescription);
+  STAssertTrue([syncDate2 compare:syncDate] == NSOrderedDescending, nil);
+  STAssertEquals(entities2.count, (NSUInteger)2, nil);
+  
+  NSMutableSet *values = [NSMutableSet new];
+  for (DKEntity *e in entities2) {
+    [values addObject:[e objectForKey:@"x"]];
+    STAssertFalse([e.entityId isEqualToString:e0.entityId], nil);
+  }
+  
+  STAssertEqualObjects(values, ([NSSet setWithObjects:@"c", @"d", nil]), nil);
+  
+  [e1 delete];
+  [e2 delete];
+}
+
 @end
@@ -73,6 +73,24 @@
   
   STAssertEqualObjects([dict objectForKey:@"data"], dataDict, nil);
   STAssertEqualObjects([dict objectForKey:@"_id"], e0.entityId, nil);
+  
+  // With the identity map, included references resolve to live entities
+  [DKManager setIdentityMapEnabled:YES];
+  
+  DKQuery *q0 = [DKQuery queryWithEntityName:entityName];
+  [q0 whereEntityIdMatches:e0.entityId];
+  
+  DKEntity *e3 = [q0 findOne];
+  results = [q findAll];
+  
+  STAssertEquals(results.count, (NSUInteger)1, nil);
+  
+  DKEntity *ref = [[results lastObject] objectForKey:@"relation"];
+  
+  STAssertTrue(ref == e3, nil);
+  STAssertEqualObjects([ref objectForKey:@"data"], dataDict, nil);
+  
+  [DKManager setIdentityMapEnabled:NO];
 }
 
 @end
@@ -0,0 +1,527 @@
+/*jslint node: true, es5: true, nomen: true, regexp: true, indent: 2*/
+"use strict";
+
+/*
+ * DataKit server benchmark
+ *
+ * Starts datakit.js against a local mongod, drives configurable request
+ * mixes at several concurrency levels and prints the results as JSON, so
+ * runs can be compared across commits.
+ *
+ *   node bench.js [--mix write,read,files,mixed] [--concurrency 1,8,32]
+ *                 [--duration 10] [--mongoURI mongodb://localhost/datakit_bench]
+ *                 [--port 3100] [--server http://host:port] [--out result.json]
+ *
+ * With --server, an already running server is benchmarked instead (it must
+ * use the bench secret and allow drop).
+ */
+
+var http = require('http');
+var url = require('url');
+var fs = require('fs');
+var path = require('path');
+var childProcess = require('child_process');
+
+var SECRET = 'c821a09ebf01e090a46b6bbe8b21bcb36eb5b432265a51a76739c20472908989';
+var ENTITY = 'BenchItem';
+var PARENT_ENTITY = 'BenchParent';
+var SEED_COUNT = 1000;
+var BATCH_SIZE = 10;
+var FILE_SIZE = 16 * 1024;
+
+var MIXES = {
+  'write': {'saveOne': 7, 'saveBatch': 3},
+  'read': {'query': 6, 'queryRefIncl': 4},
+  'files': {'store': 5, 'stream': 5},
+  'public': {'public': 1},
+  'mixed': {'saveOne': 2, 'saveBatch': 1, 'query': 3, 'queryRefIncl': 2, 'store': 1, 'stream': 1, 'public': 1}
+};
+
+var _parseArgs = function (argv) {
+  var opts, i, key;
+  opts = {
+    'mix': 'write,read,files,public,mixed',
+    'concurrency': '1,8,32',
+    'duration': '10',
+    'mongoURI': 'mongodb://localhost:27017/datakit_bench',
+    'port': '3100',
+    'server': null,
+    'out': null
+  };
+  for (i = 0; i < argv.length; i += 1) {
+    if (argv[i].indexOf('--') === 0) {
+      key = argv[i].substr(2);
+      if (!opts.hasOwnProperty(key)) {
+        throw new Error('unknown option ' + argv[i]);
+      }
+      opts[key] = argv[i + 1];
+      i += 1;
+    }
+  }
+  return {
+    'mixes': opts.mix.split(','),
+    'concurrency': opts.concurrency.split(',').map(function (c) {
+      return parseInt(c, 10);
+    }),
+    'duration': parseFloat(opts.duration),
+    'mongoURI': opts.mongoURI,
+    'port': parseInt(opts.port, 10),
+    'server': opts.server,
+    'out': opts.out
+  };
+};
+
+// HTTP
+
+var _endpoint = null;
+var _agent = null;
+
+var _concat = function (chunks) {
+  var len, buf, offset;
+  len = chunks.reduce(function (l, c) {
+    return l + c.length;
+  }, 0);
+  buf = new Buffer(len);
+  offset = 0;
+  chunks.forEach(function (c) {
+    c.copy(buf, offset);
+    offset += c.length;
+  });
+  return buf;
+};
+
+var _request = function (method, p, headers, body, cb) {
+  var u, req, chunks, done;
+  u = url.parse(_endpoint + '/' + p);
+  headers = headers || {};
+  headers['x-datakit-secret'] = SECRET;
+  if (body !== null) {
+    headers['content-length'] = body.length;
+  }
+  done = false;
+  req = http.request({
+    'host': u.hostname,
+    'port': u.port,
+    'path': (u.pathname || '/') + (u.search || ''),
+    'method': method,
+    'headers': headers,
+    'agent': _agent
+  }, function (res) {
+    chunks = [];
+    res.on('data', function (c) {
+      chunks.push(c);
+    });
+    res.on('end', function () {
+      if (!done) {
+        done = true;
+        cb(res.statusCode === 200 ? null : new Error('status ' + res.statusCode), res, _concat(chunks));
+      }
+    });
+  });
+  req.on('error', function (e) {
+    if (!done) {
+      done = true;
+      cb(e, null, null);
+    }
+  });
+  if (body !== null) {
+    req.write(body);
+  }
+  req.end();
+};
+
+var _json = function (p, obj, cb) {
+  var body = new Buffer(JSON.stringify(obj));
+  _request('POST', p, {'content-type': 'application/json'}, body, function (err, res, data) {
+    var parsed = null;
+    if (!err && data.length > 0) {
+      try {
+        parsed = JSON.parse(data.toString());
+      } catch (e) {
+        err = e;
+      }
+    }
+    cb(err, parsed, res);
+  });
+};
+
+// Operations
+
+var _state = {
+  'ids': [],
+  'parentId': null,
+  'fileName': null,
+  'publicKey': null,
+  'payload': null
+};
+
+var _randomItem = function () {
+  return {
+    'entity': ENTITY,
+    'set': {
+      'name': 'item-' + Math.floor(Math.random() * 1e9),
+      'rank': Math.floor(Math.random() * 100),
+      'tags': ['a', 'b', 'c'],
+      'parent': {'$ref': PARENT_ENTITY, '$id': _state.parentId}
+    }
+  };
+};
+
+var OPS = {
+  'saveOne': function (cb) {
+    _json('save', [_randomItem()], cb);
+  },
+  'saveBatch': function (cb) {
+    var batch, i;
+    batch = [];
+    for (i = 0; i < BATCH_SIZE; i += 1) {
+      batch.push(_randomItem());
+    }
+    _json('save', batch, cb);
+  },
+  'query': function (cb) {
+    _json('query', {
+      'entity': ENTITY,
+      'q': {'rank': {'$gte': Math.floor(Math.random() * 90)}},
+      'limit': 20
+    }, cb);
+  },
+  'queryRefIncl': function (cb) {
+    _json('query', {
+      'entity': ENTITY,
+      'q': {'rank': {'$gte': Math.floor(Math.random() * 90)}},
+      'refIncl': ['parent'],
+      'limit': 20
+    }, cb);
+  },
+  'store': function (cb) {
+    _request('POST', 'store', {'content-type': 'application/octet-stream'}, _state.payload, cb);
+  },
+  'stream': function (cb) {
+    _request('GET', 'stream', {'x-datakit-filename': _state.fileName}, null, cb);
+  },
+  'public': function (cb) {
+    _request('GET', 'public/' + _state.publicKey, {}, null, cb);
+  }
+};
+
+var _series = function (fns, cb) {
+  var next = function (i) {
+    if (i === fns.length) {
+      return cb(null);
+    }
+    fns[i](function (err) {
+      if (err) {
+        return cb(err);
+      }
+      next(i + 1);
+    });
+  };
+  next(0);
+};
+
+var _seed = function (cb) {
+  var i, seeded;
+  _state.payload = new Buffer(FILE_SIZE);
+  for (i = 0; i < FILE_SIZE; i += 1) {
+    _state.payload[i] = i % 256;
+  }
+  seeded = 0;
+  _series([
+    function (next) {
+      _json('drop', {}, next);
+    },
+    function (next) {
+      _json('save', [{'entity': PARENT_ENTITY, 'set': {'name': 'parent'}}], function (err, results) {
+        if (!err) {
+          _state.parentId = results[0]._id;
+        }
+        next(err);
+      });
+    },
+    function (next) {
+      var saveMore = function () {
+        var batch, j;
+        if (seeded >= SEED_COUNT) {
+          return next(null);
+        }
+        batch = [];
+        for (j = 0; j < 100; j += 1) {
+          batch.push(_randomItem());
+        }
+        _json('save', batch, function (err, results) {
+          if (err) {
+            return next(err);
+          }
+          results.forEach(function (r) {
+            _state.ids.push(r._id);
+          });
+          seeded += batch.length;
+          saveMore();
+        });
+      };
+      saveMore();
+    },
+    function (next) {
+      _json('index', {'entity': ENTITY, 'keys': [['rank', 1]]}, next);
+    },
+    function (next) {
+      _request('POST', 'store', {'content-type': 'application/octet-stream'}, _state.payload, function (err, res) {
+        if (!err) {
+          _state.fileName = res.headers['x-datakit-assigned-filename'];
+        }
+        next(err);
+      });
+    },
+    function (next) {
+      _json('publish', {'entity': ENTITY, 'oid': _state.ids[0]}, function (err, result) {
+        if (!err) {
+          _state.publicKey = result.key;
+        }
+        next(err);
+      });
+    }
+  ], cb);
+};
+
+// Measurement
+
+var _percentile = function (sorted, q) {
+  if (sorted.length === 0) {
+    return 0;
+  }
+  return sorted[Math.min(sorted.length - 1, Math.floor(q * sorted.length))];
+};
+
+var _serverRSS = function (cb) {
+  _request('GET', 'metrics', {}, null, function (err, res, data) {
+    var match = null;
+    if (!err) {
+      match = /^process_resident_memory_bytes (\d+)/m.exec(data.toString());
+    }
+    cb(match ? parseInt(match[1], 10) : null);
+  });
+};
+
+var _pickOp = function (mix) {
+  var total, r, name;
+  total = 0;
+  for (name in mix) {
+    if (mix.hasOwnProperty(name)) {
+      total += mix[name];
+    }
+  }
+  r = Math.random() * total;
+  for (name in mix) {
+    if (mix.hasOwnProperty(name)) {
+      r -= mix[name];
+      if (r < 0) {
+        return name;
+      }
+    }
+  }
+  return name;
+};
+
+var _runScenario = function (mixName, concurrency, duration, cb) {
+  var mix, latencies, perOp, errors, ops, start, deadline, active, worker, finish, i;
+  mix = MIXES[mixName];
+  if (!mix) {
+    return cb(new Error('unknown mix ' + mixName));
+  }
+  _agent = new http.Agent();
+  _agent.maxSockets = concurrency;
+  latencies = [];
+  perOp = {};
+  errors = 0;
+  ops = 0;
+  start = Date.now();
+  deadline = start + duration * 1000;
+  active = concurrency;
+
+  worker = function () {
+    var name, t0;
+    if (Date.now() >= deadline) {
+      active -= 1;
+      if (active === 0) {
+        finish();
+      }
+      return;
+    }
+    name = _pickOp(mix);
+    t0 = process.hrtime ? process.hrtime() : Date.now();
+    OPS[name](function (err) {
+      var ms;
+      if (process.hrtime) {
+        ms = process.hrtime(t0);
+        ms = ms[0] * 1e3 + ms[1] / 1e6;
+      } else {
+        ms = Date.now() - t0;
+      }
+      ops += 1;
+      if (err) {
+        errors += 1;
+      }
+      latencies.push(ms);
+      perOp[name] = (perOp[name] || 0) + 1;
+      worker();
+    });
+  };
+
+  finish = function () {
+    var elapsed, sorted, sum;
+    elapsed = (Date.now() - start) / 1000;
+    sorted = latencies.sort(function (a, b) {
+      return a - b;
+    });
+    sum = sorted.reduce(function (a, b) {
+      return a + b;
+    }, 0);
+    _serverRSS(function (rss) {
+      cb(null, {
+        'mix': mixName,
+        'concurrency': concurrency,
+        'duration': elapsed,
+        'ops': ops,
+        'errors': errors,
+        'opCounts': perOp,
+        'throughput': ops / elapsed,
+        'latencyMs': {
+          'mean': sorted.length ? sum / sorted.length : 0,
+          'p50': _percentile(sorted, 0.5),
+          'p90': _percentile(sorted, 0.9),
+          'p95': _percentile(sorted, 0.95),
+          'p99': _percentile(sorted, 0.99),
+          'max': sorted.length ? sorted[sorted.length - 1] : 0
+        },
+        'serverRSSBytes': rss
+      });
+    });
+  };
+
+  for (i = 0; i < concurrency; i += 1) {
+    worker();
+  }
+};
+
+// Server
+
+var _startServer = function (opts, cb) {
+  var conf, child, attempts, poll;
+  conf = {
+    'secret': SECRET,
+    'salt': 'bench',
+    'port': opts.port,
+    'mongoURI': opts.mongoURI,
+    'allowDestroy': true,
+    'allowDrop': true
+  };
+  child = childProcess.spawn(process.execPath, [
+    '-e',
+    'require(' + JSON.stringify(path.join(__dirname, 'datakit')) + ').run(' + JSON.stringify(conf) + ');'
+  ], {'cwd': __dirname});
+  child.stderr.on('data', function (d) {
+    process.stderr.write(d);
+  });
+  _endpoint = 'http://127.0.0.1:' + opts.port;
+  attempts = 0;
+  poll = function () {
+    _request('GET', '', {}, null, function (err) {
+      if (!err) {
+        return cb(null, child);
+      }
+      attempts += 1;
+      if (attempts > 50) {
+        child.kill();
+        return cb(new Error('server did not start'));
+      }
+      setTimeout(poll, 200);
+    });
+  };
+  setTimeout(poll, 200);
+};
+
+var _gitCommit = function (cb) {
+  childProcess.exec('git rev-parse HEAD', {'cwd': __dirname}, function (err, stdout) {
+    cb(err ? null : stdout.trim());
+  });
+};
+
+var main = function () {
+  var opts, server, scenarios, results, fail, report, run, seedAndRun;
+  opts = _parseArgs(process.argv.slice(2));
+  scenarios = [];
+  opts.mixes.forEach(function (mix) {
+    opts.concurrency.forEach(function (c) {
+      scenarios.push([mix, c]);
+    });
+  });
+  results = [];
+
+  fail = function (err) {
+    console.error('benchmark failed:', err.message || err);
+    if (server) {
+      server.kill();
+    }
+    process.exit(1);
+  };
+
+  report = function () {
+    _gitCommit(function (commit) {
+      var out = JSON.stringify({
+        'date': new Date().toISOString(),
+        'commit': commit,
+        'node': process.version,
+        'options': opts,
+        'results': results
+      }, null, 2);
+      if (opts.out) {
+        fs.writeFileSync(opts.out, out + '\n');
+      } else {
+        console.log(out);
+      }
+      if (server) {
+        server.kill();
+      }
+    });
+  };
+
+  run = function (i) {
+    if (i === scenarios.length) {
+      return report();
+    }
+    console.error('running', scenarios[i][0], 'at concurrency', scenarios[i][1]);
+    _runScenario(scenarios[i][0], scenarios[i][1], opts.duration, function (err, result) {
+      if (err) {
+        return fail(err);
+      }
+      results.push(result);
+      run(i + 1);
+    });
+  };
+
+  seedAndRun = function () {
+    _agent = new http.Agent();
+    _seed(function (err) {
+      if (err) {
+        return fail(err);
+      }
+      run(0);
+    });
+  };
+
+  if (opts.server) {
+    _endpoint = opts.server.replace(/\/$/, '');
+    seedAndRun();
+  } else {
+    _startServer(opts, function (err, child) {
+      if (err) {
+        return fail(err);
+      }
+      server = child;
+      seedAndRun();
+    });
+  }
+};
+
+main();
@@ -0,0 +1,282 @@
+#!/usr/bin/env node
+/*jslint node: true, es5: true, nomen: true, regexp: true, indent: 2*/
+"use strict";
+
+/*
+ * DataKit command line tool
+ *
+ * Streams NDJSON (one JSON object per line) into and out of an entity
+ * collection, for migrations and backfills.
+ *
+ *   datakit import <entity> [file] [--server http://host:port] [--secret secret]
+ *   datakit export <entity> [file] [--server http://host:port] [--secret secret]
+ *                  [--query '{"key": "value"}'] [--after objectId]
+ *   datakit snapshot <queries.json> [file] [--server http://host:port] [--secret secret]
+ *
+ * Without file, import reads stdin and export writes stdout. The server and
+ * secret default to the DATAKIT_SERVER and DATAKIT_SECRET environment
+ * variables. An interrupted export prints the last exported id, pass it
+ * with --after to resume.
+ *
+ * Snapshot writes a bootstrap snapshot (see DKSnapshot) for the JSON array
+ * of query request dicts in queries.json, to bundle it with an app.
+ */
+
+var http = require('http');
+var https = require('https');
+var url = require('url');
+var fs = require('fs');
+
+var _fail = function (message) {
+  console.error('datakit:', message);
+  process.exit(1);
+};
+
+var _usage = function () {
+  console.error('usage: datakit import <entity> [file] [--server url] [--secret secret]');
+  console.error('       datakit export <entity> [file] [--server url] [--secret secret] [--query json] [--after id]');
+  console.error('       datakit snapshot <queries.json> [file] [--server url] [--secret secret]');
+  process.exit(2);
+};
+
+var _parseArgs = function (argv) {
+  var opts, args, i, key;
+  opts = {
+    'server': process.env.DATAKIT_SERVER || 'http://localhost:3000',
+    'secret': process.env.DATAKIT_SECRET || null,
+    'query': null,
+    'after': null
+  };
+  args = [];
+  for (i = 0; i < argv.length; i += 1) {
+    if (argv[i].indexOf('--') === 0) {
+      key = argv[i].substr(2);
+      if (!opts.hasOwnProperty(key) || i + 1 >= argv.length) {
+        _usage();
+      }
+      opts[key] = argv[i + 1];
+      i += 1;
+    } else {
+      args.push(argv[i]);
+    }
+  }
+  if (args.length < 2 || args.length > 3 || ['import', 'export', 'snapshot'].indexOf(args[0]) < 0) {
+    _usage();
+  }
+  opts.command = args[0];
+  opts.entity = args[1];
+  opts.file = args[2] || null;
+  if (opts.query !== null) {
+    try {
+      opts.query = JSON.parse(opts.query);
+    } catch (e) {
+      _fail('invalid query ' + opts.query);
+    }
+  }
+  return opts;
+};
+
+var _request = function (opts, p, headers, cb) {
+  var u, transport;
+  u = url.parse(opts.server.replace(/\/$/, '') + '/' + p);
+  transport = (u.protocol === 'https:') ? https : http;
+  if (opts.secret !== null) {
+    headers['x-datakit-secret'] = opts.secret;
+  }
+  return transport.request({
+    'host': u.hostname,
+    'port': u.port,
+    'path': (u.pathname || '/') + (u.search || ''),
+    'method': 'POST',
+    'headers': headers
+  }, cb);
+};
+
+var _lines = function (stream, onLine, onEnd) {
+  var rest = '';
+  stream.setEncoding('utf8');
+  stream.on('data', function (str) {
+    var lines = (rest + str).split('\n');
+    rest = lines.pop();
+    lines.forEach(onLine);
+  });
+  stream.on('end', function () {
+    if (rest.length > 0) {
+      onLine(rest);
+    }
+    onEnd();
+  });
+};
+
+var _errorMessage = function (line) {
+  var error = JSON.parse(line)['dk:error'];
+  return error.message + (error.err ? ' (' + error.err + ')' : '');
+};
+
+var _import = function (opts) {
+  var input, req, done;
+  input = (opts.file !== null) ? fs.createReadStream(opts.file) : process.stdin;
+  done = false;
+
+  // The server reports the imported count after every batch
+  req = _request(opts, 'import?progress=true&entity=' + encodeURIComponent(opts.entity), {
+    'content-type': 'application/x-ndjson'
+  }, function (res) {
+    var body = '';
+    if (res.statusCode !== 200) {
+      res.on('data', function (c) {
+        body += c;
+      });
+      return res.on('end', function () {
+        _fail('import failed with status ' + res.statusCode + ' ' + body);
+      });
+    }
+    _lines(res, function (line) {
+      var status;
+      if (line.length === 0) {
+        return;
+      }
+      status = JSON.parse(line);
+      if (status.hasOwnProperty('dk:error')) {
+        _fail('import failed after ' + status.imported + ' objects: ' + _errorMessage(line));
+      }
+      if (status.done) {
+        done = true;
+      }
+      console.error('imported', status.imported);
+    }, function () {
+      if (!done) {
+        _fail('import was interrupted');
+      }
+    });
+  });
+  req.on('error', function (err) {
+    _fail(err.message);
+  });
+  input.on('error', function (err) {
+    _fail(err.message);
+  });
+  input.pipe(req);
+  if (input === process.stdin) {
+    process.stdin.resume();
+  }
+};
+
+var _export = function (opts) {
+  var output, body, req, count, lastLine, interrupted;
+  output = (opts.file !== null) ? fs.createWriteStream(opts.file) : process.stdout;
+  body = {'entity': opts.entity};
+  if (opts.query !== null) {
+    body.q = opts.query;
+  }
+  if (opts.after !== null) {
+    body.after = opts.after;
+  }
+  body = new Buffer(JSON.stringify(body));
+  count = 0;
+  lastLine = null;
+  interrupted = function (message) {
+    if (lastLine !== null) {
+      message += ', resume with --after ' + JSON.parse(lastLine)._id;
+    }
+    _fail(message);
+  };
+  req = _request(opts, 'export', {
+    'content-type': 'application/json',
+    'content-length': body.length
+  }, function (res) {
+    var error, finished;
+    if (res.statusCode !== 200) {
+      return _fail('export failed with status ' + res.statusCode);
+    }
+    error = null;
+    finished = false;
+    _lines(res, function (line) {
+      if (line.length === 0) {
+        return;
+      }
+      if (line.indexOf('{"dk:error"') === 0) {
+        error = _errorMessage(line);
+        return;
+      }
+      lastLine = line;
+      count += 1;
+      if (count % 10000 === 0) {
+        console.error('exported', count);
+      }
+      if (!output.write(line + '\n')) {
+        res.pause();
+        output.once('drain', function () {
+          res.resume();
+        });
+      }
+    }, function () {
+      finished = true;
+      if (error !== null) {
+        return interrupted('export failed after ' + count + ' objects: ' + error);
+      }
+      console.error('exported', count);
+      if (output !== process.stdout) {
+        output.end();
+      }
+    });
+    res.on('close', function () {
+      if (!finished) {
+        interrupted('export was interrupted after ' + count + ' objects');
+      }
+    });
+  });
+  req.on('error', function (err) {
+    interrupted(err.message);
+  });
+  req.end(body);
+};
+
+var _snapshot = function (opts) {
+  var queries, body, req;
+  try {
+    // The second argument names the queries file instead of an entity
+    queries = JSON.parse(fs.readFileSync(opts.entity, 'utf8'));
+  } catch (e) {
+    _fail('could not read queries from ' + opts.entity + ' (' + e.message + ')');
+  }
+  body = new Buffer(JSON.stringify({'queries': queries, 'store': false}));
+  req = _request(opts, 'snapshot', {
+    'content-type': 'application/json',
+    'content-length': body.length
+  }, function (res) {
+    var bufs = [];
+    res.on('data', function (c) {
+      bufs.push(c);
+    });
+    res.on('end', function () {
+      var data = Buffer.concat(bufs);
+      if (res.statusCode !== 200) {
+        return _fail('snapshot failed with status ' + res.statusCode + ' ' + data.toString());
+      }
+      if (opts.file !== null) {
+        fs.writeFileSync(opts.file, data);
+      } else {
+        process.stdout.write(data);
+      }
+      console.error('snapshot', data.readUInt32LE(16), 'objects,', data.readUInt32LE(20), 'queries');
+    });
+  });
+  req.on('error', function (err) {
+    _fail(err.message);
+  });
+  req.end(body);
+};
+
+var main = function () {
+  var opts = _parseArgs(process.argv.slice(2));
+  if (opts.command === 'import') {
+    _import(opts);
+  } else if (opts.command === 'export') {
+    _export(opts);
+  } else {
+    _snapshot(opts);
+  }
+};
+
+main();
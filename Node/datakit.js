@@ -16,8 +16,11 @@ var assert = require('assert');
 var mongo = require('mongodb');
 var crypto = require('crypto');
 var fs = require('fs');
-var doSync = require('sync');
+var zlib = require('zlib');
+var StringDecoder = require('string_decoder').StringDecoder;
 var uuid = require('node-uuid');
+var cluster = require('cluster');
+var os = require('os');
 var app = {};
 
 // private functions
@@ -36,10 +39,13 @@ var _m = function (m) {
   // console.log("invoking", m);
   return exports[m];
 };
+var _hasSecret = function (req) {
+  var s = req.header('x-datakit-secret', null);
+  return _exists(s) && s === _conf.secret;
+};
 var _secureMethod = function (m) {
   return function (req, res) {
-    var s = req.header('x-datakit-secret', null);
-    if (_exists(s) && s === _conf.secret) {
+    if (_hasSecret(req)) {
       return _m(m)(req, res);
     }
     res.header('WWW-Authenticate', 'datakit-secret');
@@ -64,16 +70,24 @@ var _createRoutes = function (path) {
   app.get(m('public/:key'), _m('getPublishedObject'));
   app.post(m('publish'), _secureMethod('publishObject'));
   app.post(m('save'), _secureMethod('saveObject'));
+  app.post(m('import'), _secureMethod('importObjects'));
+  app.post(m('export'), _secureMethod('exportObjects'));
   app.post(m('delete'), _secureMethod('deleteObject'));
   app.post(m('refresh'), _secureMethod('refreshObject'));
   app.post(m('query'), _secureMethod('query'));
+  app.post(m('prepare'), _secureMethod('prepare'));
   app.post(m('index'), _secureMethod('index'));
+  app.post(m('indexes'), _secureMethod('indexes'));
+  app.post(m('dropIndex'), _secureMethod('dropIndex'));
   app.post(m('destroy'), _secureMethod('destroy'));
   app.post(m('drop'), _secureMethod('drop'));
   app.post(m('store'), _secureMethod('store'));
   app.post(m('unlink'), _secureMethod('unlink'));
   app.get(m('stream'), _secureMethod('stream'));
   app.post(m('exists'), _secureMethod('exists'));
+  app.post(m('snapshot'), _secureMethod('snapshot'));
+  app.post(m('changes'), _secureMethod('changes'));
+  app.get(m('metrics'), _conf.publicMetrics ? _m('metrics') : _secureMethod('metrics'));
 };
 var _parseMongoException = function (e) {
   if (!_exists(e)) {
@@ -85,9 +99,10 @@ var _parseMongoException = function (e) {
   }
   return null;
 };
-var _e = function (res, snm, err) {
+var _errorObject = function (snm, err) {
   var eo, me, stackLines, l;
   eo = {'status': snm[0], 'message': snm[1]};
+  _metrics.errors[snm[0]] = _safe(_metrics.errors[snm[0]], 0) + 1;
   me = _parseMongoException(err);
   if (me !== null) {
     eo.err = me.message;
@@ -99,7 +114,10 @@ var _e = function (res, snm, err) {
     //   console.error("error returned at", l);
     // });
   }
-  return res.json(eo, 400);
+  return eo;
+};
+var _e = function (res, snm, err) {
+  return res.json(_errorObject(snm, err), 400);
 };
 var _c = {
   red: '\u001b[31m',
@@ -111,731 +129,3962 @@ var _c = {
 };
 var _DKDB = {
   PUBLIC_OBJECTS: 'datakit.pub',
-  SEQENCE: 'datakit.seq'
+  SEQENCE: 'datakit.seq',
+  TOMBSTONES: 'datakit.tomb',
+  COUNTS: 'datakit.count',
+  PREPARED: 'datakit.prep',
+  SHARDS: 'datakit.shard',
+  COUNTED_WRITES: 'datakit.countw',
+  SNAPSHOTS: 'datakit.snap'
 };
 var _ERR = {
   INVALID_PARAMS: [100, 'Invalid parameters'],
   OPERATION_FAILED: [101, 'Operation failed'],
   OPERATION_NOT_ALLOWED: [102, 'Operation not allowed'],
-  DUPLICATE_KEY: [103, 'Duplicate key']
+  DUPLICATE_KEY: [103, 'Duplicate key'],
+  PREPARED_QUERY_NOT_FOUND: [104, 'Prepared query not found']
 };
-var _copyKeys = function (s, t) {
-  var key;
-  for (key in s) {
-    if (s.hasOwnProperty(key)) {
-      t[key] = s[key];
+var _NOT_MODIFIED = {'dk:notModified': true};
+var _KEYWORD_PREFIX = '_kw_';
+var _NORMALIZED_PREFIX = '_norm_';
+var _Reservoir = function (size) {
+  // Fixed size uniform sample of observed values (Vitter's algorithm R),
+  // keeps memory bounded no matter how many values are recorded
+  this.size = size;
+  this.values = [];
+  this.count = 0;
+  this.sum = 0;
+};
+_Reservoir.prototype.add = function (v) {
+  var i;
+  this.count += 1;
+  this.sum += v;
+  if (this.values.length < this.size) {
+    this.values.push(v);
+  } else {
+    i = Math.floor(Math.random() * this.count);
+    if (i < this.size) {
+      this.values[i] = v;
     }
   }
 };
-var _traverse = function (o, func) {
-  var i;
-  for (i in o) {
-    if (o.hasOwnProperty(i)) {
-      func.apply(o, [i, o[i]]);
-      if (typeof (o[i]) === 'object') {
-        _traverse(o[i], func);
-      }
+var _quantiles = function (values, qs) {
+  var sorted, result, i;
+  sorted = values.slice().sort(function (a, b) {
+    return a - b;
+  });
+  result = [];
+  for (i = 0; i < qs.length; i += 1) {
+    if (sorted.length === 0) {
+      result.push(0);
+    } else {
+      result.push(sorted[Math.min(sorted.length - 1, Math.floor(qs[i] * sorted.length))]);
     }
   }
+  return result;
 };
-var _decodeDkObj = function (o) {
-  _traverse(o, function (key, value) {
-    if (key === 'dk:data') {
-      this[key] = new Buffer(value, 'base64');
+var _metrics = {
+  routes: {},
+  mongo: {},
+  errors: {},
+  inFlight: 0
+};
+var _QUANTILES = [0.5, 0.95, 0.99];
+var _routeMetrics = function (route) {
+  var rm = _metrics.routes[route];
+  if (!_exists(rm)) {
+    rm = _metrics.routes[route] = {
+      'latency': new _Reservoir(1024),
+      'bytesIn': 0,
+      'bytesOut': 0
+    };
+  }
+  return rm;
+};
+var _recordMongoOp = function (op, ms) {
+  var r = _metrics.mongo[op];
+  if (!_exists(r)) {
+    r = _metrics.mongo[op] = new _Reservoir(1024);
+  }
+  r.add(ms / 1000);
+};
+var _instrumentMongo = function () {
+  var wrap = function (proto, prefix, names) {
+    names.forEach(function (name) {
+      var orig = proto[name];
+      if (typeof orig !== 'function' || orig._dkInstrumented) {
+        return;
+      }
+      proto[name] = function () {
+        var args, cb, start;
+        args = Array.prototype.slice.call(arguments);
+        cb = args[args.length - 1];
+        if (typeof cb === 'function') {
+          start = Date.now();
+          args[args.length - 1] = function () {
+            _recordMongoOp(prefix + name, Date.now() - start);
+            return cb.apply(this, arguments);
+          };
+        }
+        return orig.apply(this, args);
+      };
+      proto[name]._dkInstrumented = true;
+    });
+  };
+  if (_exists(mongo.Collection)) {
+    wrap(mongo.Collection.prototype, '', [
+      'insert', 'update', 'remove', 'findOne', 'findAndModify', 'count',
+      'ensureIndex', 'dropIndex', 'indexInformation', 'mapReduce', 'aggregate', 'drop'
+    ]);
+  }
+  if (_exists(mongo.Cursor)) {
+    wrap(mongo.Cursor.prototype, 'cursor.', ['toArray', 'count', 'explain']);
+  }
+};
+var _metricsMiddleware = function (req, res, next) {
+  var start, bytesIn, bytesOut, write, end, done, count;
+  start = Date.now();
+  bytesIn = parseInt(req.header('content-length', 0), 10) || 0;
+  bytesOut = 0;
+  write = res.write;
+  end = res.end;
+  done = false;
+  _metrics.inFlight += 1;
+
+  count = function (chunk, encoding) {
+    if (_exists(chunk)) {
+      bytesOut += Buffer.isBuffer(chunk) ? chunk.length : Buffer.byteLength(String(chunk), encoding);
     }
-    if (key === '$id') {
-      this[key] = new mongo.ObjectID(value);
+  };
+  res.write = function (chunk, encoding) {
+    count(chunk, encoding);
+    return write.apply(res, arguments);
+  };
+  res.end = function (chunk, encoding) {
+    var rm, route;
+    count(chunk, encoding);
+    if (!done) {
+      done = true;
+      _metrics.inFlight -= 1;
+      route = (_exists(req.route) && _exists(req.route.path)) ? req.route.path : 'unmatched';
+      rm = _routeMetrics(req.method + ' ' + route);
+      rm.latency.add((Date.now() - start) / 1000);
+      rm.bytesIn += bytesIn;
+      rm.bytesOut += bytesOut;
     }
-  });
+    return end.apply(res, arguments);
+  };
+  next();
 };
-var _encodeDkObj = function (o) {
-  _traverse(o, function (key, value) {
-    if (key === 'dk:data') {
-      this[key] = value.toString('base64');
-    }
+var _STREAMED_ROUTES = ['save', 'import'];
+var _isStreamedRoute = function (req) {
+  var prefix, pathname;
+  if (req.method !== 'POST') {
+    return false;
+  }
+  prefix = _conf.path.replace(/^\/+|\/+$/g, '');
+  pathname = req.url.split('?')[0].replace(/^\/+/, '');
+  return _STREAMED_ROUTES.some(function (route) {
+    return pathname === (prefix.length > 0 ? prefix + '/' : '') + route;
   });
 };
-var _generateNextSequenceNumber = function (entity) {
-  var col, doc;
-  col = _db.collection.sync(_db, _DKDB.SEQENCE);
-  col.insert.sync(col, {'_id': entity, 'seq': new mongo.Long(0)});
-  doc = col.findAndModify.sync(
-    col,
-    {'_id': entity},
-    [],
-    {'$inc': {'seq': 1}},
-    {'new': true}
-  );
-
-  return doc.seq;
+var _streamedBodyMiddleware = function (req, res, next) {
+  // Streamed routes parse the body themselves, the body parser skips
+  // requests that already have one
+  if (_isStreamedRoute(req)) {
+    req.body = {};
+  }
+  next();
+};
+var _invalidParams = function (message) {
+  var err = new Error(message);
+  err.dkError = _ERR.INVALID_PARAMS;
+  return err;
+};
+var _ArrayParser = function (maxElementSize) {
+  // Incremental parser for a top level JSON array of objects, only one
+  // element is held in memory at a time
+  this.maxElementSize = maxElementSize;
+  this.decoder = new StringDecoder('utf8');
+  this.started = false;
+  this.done = false;
+  this.depth = 0;
+  this.inString = false;
+  this.escape = false;
+  this.parts = [];
+  this.size = 0;
 };
-var _streamFileFromGridFS = function (req, res, fn) {
-  doSync(function streamFileSync() {
-    var gs, stream;
-    if (!fn) {
-      // HTTP: Not Found
-      return res.send('', 404);
+_ArrayParser.prototype.write = function (chunk) {
+  var str, elements, start, i, c, part;
+  str = Buffer.isBuffer(chunk) ? this.decoder.write(chunk) : String(chunk);
+  elements = [];
+  start = -1;
+  for (i = 0; i < str.length; i += 1) {
+    c = str.charAt(i);
+    if (this.depth > 0) {
+      if (this.inString) {
+        if (this.escape) {
+          this.escape = false;
+        } else if (c === '\\') {
+          this.escape = true;
+        } else if (c === '"') {
+          this.inString = false;
+        }
+      } else if (c === '"') {
+        this.inString = true;
+      } else if (c === '{' || c === '[') {
+        this.depth += 1;
+      } else if (c === '}' || c === ']') {
+        this.depth -= 1;
+        if (this.depth === 0) {
+          part = str.substring(Math.max(start, 0), i + 1);
+          this.parts.push(part);
+          elements.push(JSON.parse(this.parts.join('')));
+          this.parts = [];
+          this.size = 0;
+          start = -1;
+        }
+      }
+    } else if (!/\s/.test(c)) {
+      if (!this.started) {
+        if (c !== '[') {
+          throw _invalidParams('Expected a JSON array');
+        }
+        this.started = true;
+      } else if (this.done) {
+        throw _invalidParams('Unexpected data after JSON array');
+      } else if (c === ']') {
+        this.done = true;
+      } else if (c === '{') {
+        this.depth = 1;
+        start = i;
+      } else if (c !== ',') {
+        throw _invalidParams('Expected a JSON object');
+      }
     }
-
-    // Open grid store
-    gs = new mongo.GridStore(_db, fn, 'r');
-    try {
-      gs = gs.open.sync(gs);
-    } catch (e) {
-      console.log(e);
-      // HTTP: Server Error
-      return res.send('', 500);
+  }
+  if (start >= 0) {
+    part = str.substring(start);
+    this.parts.push(part);
+  } else if (this.depth > 0) {
+    this.parts.push(str);
+  }
+  if (this.depth > 0) {
+    this.size += str.length - Math.max(start, 0);
+    if (this.size > this.maxElementSize) {
+      throw _invalidParams('Object exceeds the maximum size');
     }
-
-    // Write head
-    // HTTP: Partial Content
-    console.log(fn, "=>", "content", gs.contentType, "len", gs.length);
-    res.writeHead(200, {
-      'Connection': 'close',
-      'Content-Type': gs.contentType,
-      'Content-Length': gs.length
-    });
-
-    stream = gs.stream(true);
-    stream.on('data', function (data) {
-      res.write(data);
-    });
-    stream.on('close', function () {
-      res.end();
-    });
-  });
+  }
+  return elements;
 };
-// prototypes
-String.prototype.repeat = function (num) {
-  var a = [];
-  a.length = parseInt(num, 10) + 1;
-  return a.join(this);
+_ArrayParser.prototype.end = function () {
+  if (!this.done) {
+    throw _invalidParams('Unterminated JSON array');
+  }
 };
-// exported functions
-exports.run = function (c) {
-  doSync(function runSync() {
-    var pad, nl, buf, srv, db, parse;
-    pad = '-'.repeat(80);
-    nl = '\n';
-    console.log(nl + pad + nl + 'DATAKIT' + nl + pad);
-    _conf.mongoURI = _safe(c.mongoURI, 'mongodb://localhost:27017/datakit');
-    _conf.path = _safe(c.path, '');
-    _conf.port = _safe(c.port, process.env.PORT || 3000);
-    _conf.secret = _safe(c.secret, null);
-    _conf.salt = _safe(c.salt, "datakit");
-    _conf.allowDestroy = _safe(c.allowDestroy, false);
-    _conf.allowDrop = _safe(c.allowDrop, false);
-    _conf.cert = _safe(c.cert, null);
-    _conf.key = _safe(c.key, null);
-    _conf.express = _safe(c.express, function (app) {});
-
-    if (_exists(_conf.cert) && _exists(_conf.key)) {
-      app = express.createServer({
-        'key': fs.readFileSync(_conf.key),
-        'cert': fs.readFileSync(_conf.cert)
+var _LineParser = function (maxElementSize) {
+  // Incremental parser for newline delimited JSON objects
+  this.maxElementSize = maxElementSize;
+  this.decoder = new StringDecoder('utf8');
+  this.rest = '';
+};
+_LineParser.prototype.parseLine = function (line) {
+  var obj;
+  if (/^\s*$/.test(line)) {
+    return null;
+  }
+  try {
+    obj = JSON.parse(line);
+  } catch (e) {
+    throw _invalidParams('Invalid JSON line');
+  }
+  if (obj === null || typeof obj !== 'object' || Array.isArray(obj)) {
+    throw _invalidParams('Expected a JSON object');
+  }
+  return obj;
+};
+_LineParser.prototype.write = function (chunk) {
+  var str, lines, elements, i, obj;
+  str = Buffer.isBuffer(chunk) ? this.decoder.write(chunk) : String(chunk);
+  lines = (this.rest + str).split('\n');
+  this.rest = lines.pop();
+  if (this.rest.length > this.maxElementSize) {
+    throw _invalidParams('Object exceeds the maximum size');
+  }
+  elements = [];
+  for (i = 0; i < lines.length; i += 1) {
+    obj = this.parseLine(lines[i]);
+    if (obj !== null) {
+      elements.push(obj);
+    }
+  }
+  return elements;
+};
+_LineParser.prototype.end = function () {
+  var obj = this.parseLine(this.rest);
+  this.rest = '';
+  return (obj !== null) ? [obj] : [];
+};
+var _isLineDelimited = function (req) {
+  return (/ndjson|x-json-stream/i).test(req.header('content-type', ''));
+};
+var _requestSource = function (req) {
+  var encoding, inflate;
+  encoding = String(req.header('content-encoding', 'identity')).toLowerCase();
+  if (encoding === 'gzip') {
+    inflate = zlib.createGunzip();
+  } else if (encoding === 'deflate') {
+    inflate = zlib.createInflate();
+  } else {
+    return req;
+  }
+  req.pipe(inflate);
+  return inflate;
+};
+var _streamArray = function (req, batchSize, onBatch, cb) {
+  // Hands the elements of a JSON array or NDJSON body to onBatch as they
+  // arrive, the request is paused while a batch is written
+  var source, parser, pending, writing, ended, failed, fail, flush;
+  source = _requestSource(req);
+  if (_isLineDelimited(req)) {
+    parser = new _LineParser(_conf.maxEntitySize);
+  } else {
+    parser = new _ArrayParser(_conf.maxEntitySize);
+  }
+  pending = [];
+  writing = false;
+  ended = false;
+  failed = false;
+  fail = function (err) {
+    if (!failed) {
+      failed = true;
+      cb(err);
+    }
+  };
+  flush = function () {
+    if (writing || failed) {
+      return;
+    }
+    if (pending.length >= batchSize || (ended && pending.length > 0)) {
+      writing = true;
+      return onBatch(pending.splice(0, batchSize), function (err) {
+        writing = false;
+        if (err) {
+          return fail(err);
+        }
+        flush();
       });
-    } else {
-      app = express.createServer();
     }
-
-    // Install the body parser
-    parse = express.bodyParser();
-    app.use(parse);
-
-    if (_conf.secret === null) {
-      buf = crypto.randomBytes.sync(crypto, 32);
-      _conf.secret = buf.toString('hex');
-      console.log(_c.red + 'WARN:\tNo secret found in config, generated new one.\n',
-                  '\tCopy this secret to your DataKit iOS app and server config!\n\n',
-                  _c.yellow,
-                  '\t' + _conf.secret, nl, nl,
-                  _c.red,
-                  '\tTerminating process.',
-                  _c.reset);
-      process.exit(1);
+    if (ended) {
+      return cb(null);
     }
-    if (_conf.secret.length !== 64) {
-      console.log(_c.red, '\nSecret is not a hex string of length 64 (256 bytes), terminating process.\n', _c.reset);
-      process.exit(2);
+    source.resume();
+  };
+  source.on('data', function (chunk) {
+    if (failed) {
+      return;
     }
-
-    console.log('CONF:', JSON.stringify(_conf, undefined, 2), nl);
-
-    // Create API routes
-    _createRoutes(_conf.path);
-    _conf.express(app);
-
-    // Connect to DB and run
     try {
-      _db = mongo.Db.connect.sync(mongo.Db, _conf.mongoURI, {});
-      app.listen(_conf.port, function appListen() {
-        console.log(_c.green + 'DataKit started on port', _conf.port, _c.reset);
-      });
+      pending.push.apply(pending, parser.write(chunk));
     } catch (e) {
-      console.error(e);
+      return fail(e.dkError ? e : _invalidParams(e.message));
+    }
+    if (pending.length >= batchSize) {
+      source.pause();
+      flush();
     }
   });
-};
-exports.info = function (req, res) {
-  res.send('datakit', 200);
-};
-exports.getPublishedObject = function (req, res) {
-  doSync(function publicSync() {
-    var key, col, result, oid, fields;
-    key = req.param('key', null);
-    if (!_exists(key)) {
-      return res.send(404);
+  source.on('end', function () {
+    if (failed) {
+      return;
     }
     try {
-      col = _db.collection.sync(_db, _DKDB.PUBLIC_OBJECTS);
-      result = col.findOne.sync(col, {'_id': key});
-
-      if (result.isFile) {
-        return _streamFileFromGridFS(req, res, result.q);
-      } else {
-        oid = new mongo.ObjectID(result.q.oid);
-        fields = result.q.fields;
-
-        col = _db.collection.sync(_db, result.q.entity);
-        result = col.findOne.sync(col, {'_id': oid}, fields);
-
-        if (fields.length === 1) {
-          return res.send(result[fields[0]], 200);
-        } else {
-          return res.json(result, 200);
-        }
-      }
+      pending.push.apply(pending, _safe(parser.end(), []));
     } catch (e) {
-      console.error(e);
+      return fail(e);
     }
-
-    return res.send(404);
+    ended = true;
+    flush();
+  });
+  source.on('error', function (err) {
+    fail(_invalidParams(err.message));
   });
 };
-exports.publishObject = function (req, res) {
-  doSync(function publishObjectSync() {
-    var entity, fn, isFile, oid, q, fields, query, idf, signature, shasum, key, col;
-    entity = req.param('entity', null);
-    oid = req.param('oid', null);
-    fn = req.param('fileName', null);
-    idf = null;
-    isFile = false;
-    if (_exists(fn)) {
-      idf = "file:" + fn;
-      isFile = true;
-    } else if (_exists(entity) && _exists(oid)) {
-      fields = req.param('fields', null);
-      query = {
-        'entity': entity,
-        'oid': oid,
-        'fields': []
-      };
-      if (fields !== null && fields.length > 0) {
-        query.fields = fields;
-      }
-      idf = JSON.stringify(query);
-    } else {
-      return _e(res, _ERR.INVALID_PARAMS);
-    }
+var _COMPRESSIBLE = /^(text\/|application\/(json|javascript|x-javascript|xml))/i;
+var _acceptedEncoding = function (req) {
+  var accept = String(req.header('accept-encoding', '')).toLowerCase();
+  if (/\bgzip\b/.test(accept)) {
+    return 'gzip';
+  }
+  if (/\bdeflate\b/.test(accept)) {
+    return 'deflate';
+  }
+  return null;
+};
+var _inflateRequest = function (req, res, next) {
+  var encoding, inflate, chunks, length, done;
+  encoding = String(req.header('content-encoding', 'identity')).toLowerCase();
+  if ((encoding !== 'gzip' && encoding !== 'deflate') || !/json/.test(req.header('content-type', '')) || _isStreamedRoute(req)) {
+    return next();
+  }
 
-    // Compute key
-    signature = _conf.secret + _conf.salt + idf;
-    shasum = crypto.createHash('sha256');
-    shasum.update(signature);
-    key = shasum.digest('hex');
+  // Only requests with the secret are inflated, and the inflated body is
+  // limited to maxEntitySize, so that small compressed bodies can not
+  // exhaust memory
+  if (!_hasSecret(req)) {
+    res.header('WWW-Authenticate', 'datakit-secret');
+    return res.send(401);
+  }
+  inflate = (encoding === 'gzip') ? zlib.createGunzip() : zlib.createInflate();
+  chunks = [];
+  length = 0;
+  done = false;
+  inflate.on('data', function (chunk) {
+    if (done) {
+      return;
+    }
+    length += chunk.length;
+    if (length > _conf.maxEntitySize) {
+      done = true;
+      req.unpipe(inflate);
+      inflate.close();
+      res.header('Connection', 'close');
+      return res.send(413);
+    }
+    chunks.push(chunk);
+  });
+  inflate.on('end', function () {
+    var buf, offset;
+    if (done) {
+      return;
+    }
+    done = true;
+    buf = new Buffer(length);
+    offset = 0;
+    chunks.forEach(function (chunk) {
+      chunk.copy(buf, offset);
+      offset += chunk.length;
+    });
 
+    // The body parser skips requests that already have a body
     try {
-      q = isFile ? fn : query;
-      col = _db.collection.sync(_db, _DKDB.PUBLIC_OBJECTS);
-      col.update.sync(col, {'_id': key}, {'$set': {'q': q, 'isFile': isFile}}, {'safe': true, 'upsert': true});
-
-      return res.json({'key': key}, 200);
+      req.body = JSON.parse(buf.toString('utf8'));
     } catch (e) {
-      console.error(e);
-      return _e(res, _ERR.OPERATION_FAILED, e);
+      return _e(res, _ERR.INVALID_PARAMS, e);
+    }
+    next();
+  });
+  inflate.on('error', function (err) {
+    if (done) {
+      return;
     }
+    done = true;
+    _e(res, _ERR.INVALID_PARAMS, err);
   });
+  req.pipe(inflate);
 };
-exports.saveObject = function (req, res) {
-  doSync(function saveSync() {
-    var i, entities, results, errors, ent, entity, oidStr, fset, funset, finc, fpush, fpushAll, faddToSet, fpop, fpullAll, oid, ts, collection, doc, isNew, opts, update, ats, key;
-    entities = req.body;
-    results = [];
-    errors = [];
-
-    for (i in entities) {
-      if (entities.hasOwnProperty(i)) {
-        ent = entities[i];
-        entity = _safe(ent.entity, null);
-        if (!_exists(entity)) {
-          return _e(res, _ERR.INVALID_PARAMS);
-        }
-        oidStr = _safe(ent.oid, null);
-        fset = _safe(ent.set, {});
-        funset = _safe(ent.unset, null);
-        finc = _safe(ent.inc, null);
-        fpush = _safe(ent.push, null);
-        fpushAll = _safe(ent.pushAll, null);
-        faddToSet = _safe(ent.addToSet, null);
-        fpop = _safe(ent.pop, null);
-        fpullAll = _safe(ent.pullAll, null);
-        oid = null;
-
-        _decodeDkObj(fset);
-        _decodeDkObj(fpush);
-        _decodeDkObj(fpushAll);
-        _decodeDkObj(faddToSet);
-        _decodeDkObj(fpullAll);
-
-        if (_exists(oidStr)) {
-          oid = new mongo.ObjectID(oidStr);
-          if (!_exists(oid)) {
-            return _e(res, _ERR.INVALID_PARAMS);
-          }
-        }
-        try {
-          ts = parseInt((new Date().getTime()) / 1000, 10);
-          collection = _db.collection.sync(_db, entity);
-          isNew = (oid === null);
-
-          // Automatically insert the update timestamp
-          fset._updated = ts;
-
-          // Insert new object
-          if (isNew) {
-            // Generate new sequence number         
-            fset._seq = _generateNextSequenceNumber(entity);
-            doc = collection.insert.sync(collection, fset);
-            oid = doc[0]._id;
-          }
-
-          // Update instead if oid exists, or an operation needs to be executed
-          // that requires an insert first.
-          opts = {'upsert': true, 'new': true};
-          update = {};
-          if (_exists(fset) && !isNew) {
-            update.$set = fset;
-          }
-          if (_exists(funset)) {
-            update.$unset = funset;
-          }
-          if (_exists(finc)) {
-            update.$inc = finc;
-          }
-          if (_exists(fpush)) {
-            update.$push = fpush;
-          }
-          if (_exists(fpushAll)) {
-            update.$pushAll = fpushAll;
-          }
-          if (_exists(faddToSet)) {
-            ats = {};
-            for (key in faddToSet) {
-              if (faddToSet.hasOwnProperty(key)) {
-                ats[key] = {'$each': faddToSet[key]};
-              }
-            }
-            update.$addToSet = ats;
-          }
-          if (_exists(fpop)) {
-            update.$pop = fpop;
-          }
-          if (_exists(fpullAll)) {
-            update.$pullAll = fpullAll;
-          }
-
-          // Find and modify
-          if (!isNew || (isNew && Object.keys(update).length > 0)) {
-            doc = collection.findAndModify.sync(collection, {'_id': oid}, [], update, opts);
-          }
-
-          if (doc.length > 0) {
-            doc = doc[0];
-          }
-
-          _encodeDkObj(doc);
+var _compressionMiddleware = function (req, res, next) {
+  var encoding, writeHead, write, end, stream, ensureHead, toBuffer;
+  encoding = _acceptedEncoding(req);
+  writeHead = res.writeHead;
+  write = res.write;
+  end = res.end;
+  stream = null;
 
-          results.push(doc);
-        } catch (e) {
-          errors.push(e);
+  // Compression is decided once the headers are known, so that binary
+  // content types and small bodies are sent as is
+  res.writeHead = function (status) {
+    var headers, key, type, length;
+    headers = arguments[arguments.length - 1];
+    if (arguments.length > 1 && typeof headers === 'object') {
+      for (key in headers) {
+        if (headers.hasOwnProperty(key)) {
+          res.setHeader(key, headers[key]);
         }
       }
     }
-    if (errors.length > 0) {
-      return _e(res, _ERR.OPERATION_FAILED, errors.pop());
+    type = String(_safe(res.getHeader('content-type'), ''));
+    length = parseInt(res.getHeader('content-length'), 10);
+    if (encoding !== null &&
+        _conf.compress &&
+        status >= 200 && status !== 204 && status !== 304 &&
+        req.method !== 'HEAD' &&
+        !_exists(res.getHeader('content-encoding')) &&
+        _COMPRESSIBLE.test(type) &&
+        !(length < _conf.compressionThreshold)) {
+      stream = (encoding === 'gzip') ? zlib.createGzip() : zlib.createDeflate();
+      stream.on('data', function (chunk) {
+        write.call(res, chunk);
+      });
+      stream.on('end', function () {
+        end.call(res);
+      });
+      stream.on('drain', function () {
+        res.emit('drain');
+      });
+      res.setHeader('Content-Encoding', encoding);
+      res.removeHeader('Content-Length');
     }
-    res.json(results, 200);
-  });
-};
-exports.deleteObject = function (req, res) {
-  doSync(function deleteSync() {
-    var entity, oidStr, oid, collection, result;
-    entity = req.param('entity', null);
-    oidStr = req.param('oid', null);
-    if (!_exists(entity)) {
-      return _e(res, _ERR.INVALID_PARAMS);
+    if (_COMPRESSIBLE.test(type)) {
+      res.setHeader('Vary', 'Accept-Encoding');
     }
-    if (!_exists(oidStr)) {
-      return _e(res, _ERR.INVALID_PARAMS);
+    return writeHead.call(res, status);
+  };
+  ensureHead = function () {
+    if (!res._header) {
+      res.writeHead(res.statusCode);
     }
-    oid = new mongo.ObjectID(oidStr);
-    if (!_exists(oid)) {
-      return _e(res, _ERR.INVALID_PARAMS);
+  };
+  toBuffer = function (chunk, enc) {
+    return Buffer.isBuffer(chunk) ? chunk : new Buffer(String(chunk), enc);
+  };
+  res.write = function (chunk, enc) {
+    ensureHead();
+    if (stream === null) {
+      return write.apply(res, arguments);
     }
-    try {
-      collection = _db.collection.sync(_db, entity);
-      result = collection.remove.sync(collection, {'_id': oid}, {'safe': true});
-      res.send('', 200);
-    } catch (e) {
-      console.error(e);
-      return _e(res, _ERR.OPERATION_FAILED, e);
+    return stream.write(toBuffer(chunk, enc));
+  };
+  res.end = function (chunk, enc) {
+    ensureHead();
+    if (stream === null) {
+      return end.apply(res, arguments);
     }
-  });
-};
-exports.refreshObject = function (req, res) {
-  doSync(function refreshSync() {
-    var entity, oidStr, oid, collection, result;
-    entity = req.param('entity', null);
-    oidStr = req.param('oid', null);
-    if (!_exists(entity)) {
-      return _e(res, _ERR.INVALID_PARAMS);
+    if (_exists(chunk)) {
+      stream.write(toBuffer(chunk, enc));
     }
-    if (!_exists(oidStr)) {
-      return _e(res, _ERR.INVALID_PARAMS);
+    stream.end();
+  };
+
+  _inflateRequest(req, res, next);
+};
+var _metricsSnapshot = function () {
+  var snap = JSON.parse(JSON.stringify(_metrics));
+  snap.rss = process.memoryUsage().rss;
+  return snap;
+};
+var _mergeReservoirs = function (a, b) {
+  var r, values, i;
+  if (!_exists(a)) {
+    return b;
+  }
+  // Randomly downsample the combined values to the reservoir size
+  r = new _Reservoir(a.size);
+  values = a.values.concat(b.values);
+  while (values.length > r.size) {
+    i = Math.floor(Math.random() * values.length);
+    values[i] = values[values.length - 1];
+    values.pop();
+  }
+  r.values = values;
+  r.count = a.count + b.count;
+  r.sum = a.sum + b.sum;
+  return r;
+};
+var _mergeSnapshots = function (snaps) {
+  var merged, key, s, i, rm;
+  merged = {'routes': {}, 'mongo': {}, 'errors': {}, 'inFlight': 0, 'rss': 0};
+  for (i = 0; i < snaps.length; i += 1) {
+    s = snaps[i];
+    for (key in s.routes) {
+      if (s.routes.hasOwnProperty(key)) {
+        rm = merged.routes[key] = _safe(merged.routes[key], {'latency': null, 'bytesIn': 0, 'bytesOut': 0});
+        rm.latency = _mergeReservoirs(rm.latency, s.routes[key].latency);
+        rm.bytesIn += s.routes[key].bytesIn;
+        rm.bytesOut += s.routes[key].bytesOut;
+      }
     }
-    oid = new mongo.ObjectID(oidStr);
-    if (!_exists(oid)) {
-      return _e(res, _ERR.INVALID_PARAMS);
+    for (key in s.mongo) {
+      if (s.mongo.hasOwnProperty(key)) {
+        merged.mongo[key] = _mergeReservoirs(merged.mongo[key], s.mongo[key]);
+      }
     }
-    try {
-      collection = _db.collection.sync(_db, entity);
-      result = collection.findOne.sync(collection, {'_id': oid});
-      if (!_exists(result)) {
-        throw 'Could not find object';
+    for (key in s.errors) {
+      if (s.errors.hasOwnProperty(key)) {
+        merged.errors[key] = _safe(merged.errors[key], 0) + s.errors[key];
       }
-
-      _encodeDkObj(result);
-
-      res.json(result, 200);
-    } catch (e) {
-      console.error(e);
-      return _e(res, _ERR.OPERATION_FAILED, e);
     }
-  });
+    merged.inFlight += s.inFlight;
+    merged.rss += s.rss;
+  }
+  return merged;
 };
-exports.query = function (req, res) {
-  doSync(function querySync() {
-    var entity, doFindOne, doCount, query, opts, or, and, refIncl, fieldInclExcl, sort, skip, limit, mr, mrOpts, sortValues, order, results, cursor, collection, result, key, resultCount, i, j, field, dbRef, resolved;
-    entity = req.param('entity', null);
-    if (!_exists(entity)) {
-      return _e(res, _ERR.INVALID_PARAMS);
+var _prometheusText = function (snap) {
+  var lines, summary, key, q, i;
+  lines = [];
+  summary = function (name, label, value, reservoir) {
+    q = _quantiles(reservoir.values, _QUANTILES);
+    for (i = 0; i < _QUANTILES.length; i += 1) {
+      lines.push(name + '{' + label + '="' + value + '",quantile="' + _QUANTILES[i] + '"} ' + q[i]);
     }
-    doFindOne = req.param('findOne', false);
-    doCount = req.param('count', false);
-    query = req.param('q', {});
-    opts = {};
-    or = req.param('or', null);
-    and = req.param('and', null);
-    refIncl = req.param('refIncl', []);
-    fieldInclExcl = req.param('fieldInEx', null);
-    sort = req.param('sort', null);
-    skip = req.param('skip', null);
-    limit = req.param('limit', null);
-    mr = req.param('mr', null);
+    lines.push(name + '_sum{' + label + '="' + value + '"} ' + reservoir.sum);
+    lines.push(name + '_count{' + label + '="' + value + '"} ' + reservoir.count);
+  };
 
-    if (_exists(or)) {
-      query.$or = or;
+  lines.push('# HELP datakit_request_duration_seconds Request latency by route');
+  lines.push('# TYPE datakit_request_duration_seconds summary');
+  for (key in snap.routes) {
+    if (snap.routes.hasOwnProperty(key)) {
+      summary('datakit_request_duration_seconds', 'route', key, snap.routes[key].latency);
     }
-    if (_exists(and)) {
-      query.$and = and;
+  }
+  lines.push('# HELP datakit_request_bytes_total Request body bytes by route');
+  lines.push('# TYPE datakit_request_bytes_total counter');
+  for (key in snap.routes) {
+    if (snap.routes.hasOwnProperty(key)) {
+      lines.push('datakit_request_bytes_total{route="' + key + '"} ' + snap.routes[key].bytesIn);
     }
-    if (_exists(sort)) {
-      sortValues = [];
-      for (key in sort) {
-        if (sort.hasOwnProperty(key)) {
-          order = (sort[key] === 1) ? 'asc' : 'desc';
-          sortValues.push([key, order]);
-        }
-      }
-      opts.sort = sortValues;
+  }
+  lines.push('# HELP datakit_response_bytes_total Response body bytes by route');
+  lines.push('# TYPE datakit_response_bytes_total counter');
+  for (key in snap.routes) {
+    if (snap.routes.hasOwnProperty(key)) {
+      lines.push('datakit_response_bytes_total{route="' + key + '"} ' + snap.routes[key].bytesOut);
     }
-    if (_exists(skip)) {
-      opts.skip = parseInt(skip, 10);
+  }
+  lines.push('# HELP datakit_mongo_duration_seconds MongoDB operation latency');
+  lines.push('# TYPE datakit_mongo_duration_seconds summary');
+  for (key in snap.mongo) {
+    if (snap.mongo.hasOwnProperty(key)) {
+      summary('datakit_mongo_duration_seconds', 'op', key, snap.mongo[key]);
     }
-    if (_exists(limit)) {
-      opts.limit = parseInt(limit, 10);
+  }
+  lines.push('# HELP datakit_errors_total Error responses by DataKit error code');
+  lines.push('# TYPE datakit_errors_total counter');
+  for (key in snap.errors) {
+    if (snap.errors.hasOwnProperty(key)) {
+      lines.push('datakit_errors_total{code="' + key + '"} ' + snap.errors[key]);
     }
+  }
+  lines.push('# HELP datakit_requests_in_flight Requests currently being processed');
+  lines.push('# TYPE datakit_requests_in_flight gauge');
+  lines.push('datakit_requests_in_flight ' + snap.inFlight);
+  lines.push('# HELP process_resident_memory_bytes Resident memory size in bytes');
+  lines.push('# TYPE process_resident_memory_bytes gauge');
+  lines.push('process_resident_memory_bytes ' + snap.rss);
 
-    // replace oid strings with oid objects
-    _traverse(query, function (key, value) {
-      if (key === '_id') {
-        this[key] = new mongo.ObjectID(value);
+  return lines.join('\n') + '\n';
+};
+var _isClustered = function () {
+  return _conf.workers > 1 && cluster.isWorker;
+};
+var _pendingMetrics = {};
+var _metricsRequestId = 0;
+var _collectClusterMetrics = function (cb) {
+  var id;
+  _metricsRequestId += 1;
+  id = process.pid + ':' + _metricsRequestId;
+  _pendingMetrics[id] = cb;
+  process.send({'dk': 'metrics:collect', 'id': id});
+
+  // Fall back to local metrics if the master does not answer
+  setTimeout(function () {
+    if (_exists(_pendingMetrics[id])) {
+      delete _pendingMetrics[id];
+      cb(_metricsSnapshot());
+    }
+  }, 2000);
+};
+var _broadcast = function (msg) {
+  // Applies the message locally and relays it to all other workers
+  _handleBroadcast(msg);
+  if (_isClustered()) {
+    process.send({'dk': 'broadcast', 'pid': process.pid, 'msg': msg});
+  }
+};
+var _handleBroadcast = function (msg) {
+  if (msg.type === 'changeIndex:reset') {
+    delete _changeIndexes[msg.entity];
+    Object.keys(_fieldIndexes).forEach(function (key) {
+      if (key.indexOf(msg.entity + '.') === 0) {
+        delete _fieldIndexes[key];
       }
     });
+  } else if (msg.type === 'database:reset') {
+    // Everything cached about the dropped database is gone with it
+    _changeIndexes = {};
+    _fieldIndexes = {};
+    _prepared = {};
+    _preparedCount = 0;
+    _shardCache = {};
+    _shardCacheCount = 0;
+  }
+};
+var _installWorkerMessaging = function () {
+  process.on('message', function (msg) {
+    var cb;
+    if (!_exists(msg) || !_exists(msg.dk)) {
+      return;
+    }
+    if (msg.dk === 'metrics:snapshot') {
+      process.send({'dk': 'metrics:snapshot', 'id': msg.id, 'snapshot': _metricsSnapshot()});
+    } else if (msg.dk === 'metrics:result') {
+      cb = _pendingMetrics[msg.id];
+      if (_exists(cb)) {
+        delete _pendingMetrics[msg.id];
+        cb(msg.snapshot);
+      }
+    } else if (msg.dk === 'broadcast') {
+      _handleBroadcast(msg.msg);
+    }
+  });
+};
+var _runMaster = function () {
+  var workers, collecting, fork, finish, onMessage, onDeath, pidOf;
+  workers = {};
+  collecting = {};
+  pidOf = function (w) {
+    return _exists(w.process) ? w.process.pid : w.pid;
+  };
+  finish = function (id) {
+    var c = collecting[id];
+    if (_exists(c)) {
+      delete collecting[id];
+      c.requester.send({'dk': 'metrics:result', 'id': id, 'snapshot': _mergeSnapshots(c.snapshots)});
+    }
+  };
+  onMessage = function (w, msg) {
+    var pid, c;
+    if (!_exists(msg) || !_exists(msg.dk)) {
+      return;
+    }
+    if (msg.dk === 'metrics:collect') {
+      collecting[msg.id] = {'requester': w, 'snapshots': [], 'expected': Object.keys(workers).length};
+      for (pid in workers) {
+        if (workers.hasOwnProperty(pid)) {
+          workers[pid].worker.send({'dk': 'metrics:snapshot', 'id': msg.id});
+        }
+      }
+      setTimeout(function () {
+        finish(msg.id);
+      }, 1000);
+    } else if (msg.dk === 'metrics:snapshot') {
+      c = collecting[msg.id];
+      if (_exists(c)) {
+        c.snapshots.push(msg.snapshot);
+        if (c.snapshots.length >= c.expected) {
+          finish(msg.id);
+        }
+      }
+    } else if (msg.dk === 'broadcast') {
+      for (pid in workers) {
+        if (workers.hasOwnProperty(pid) && String(pid) !== String(msg.pid)) {
+          workers[pid].worker.send(msg);
+        }
+      }
+    }
+  };
+  fork = function () {
+    var w = cluster.fork();
+    workers[pidOf(w)] = {'worker': w, 'started': Date.now()};
+    w.on('message', function (msg) {
+      onMessage(w, msg);
+    });
+  };
+  onDeath = function (w) {
+    var pid, info, delay;
+    pid = pidOf(w);
+    info = workers[pid];
+    if (!_exists(info)) {
+      return;
+    }
+    delete workers[pid];
+
+    // Back off if workers crash right after starting
+    delay = (Date.now() - info.started < 5000) ? 1000 : 0;
+    console.error(_c.red + 'worker', pid, 'died, restarting', _c.reset);
+    setTimeout(fork, delay);
+  };
+
+  // node 0.6 emits 'death', later versions 'exit'
+  cluster.on('death', onDeath);
+  cluster.on('exit', onDeath);
+  process.on('SIGTERM', function () {
+    var pid;
+    cluster.removeListener('death', onDeath);
+    cluster.removeListener('exit', onDeath);
+    for (pid in workers) {
+      if (workers.hasOwnProperty(pid)) {
+        process.kill(parseInt(pid, 10));
+      }
+    }
+    process.exit(0);
+  });
+
+  while (Object.keys(workers).length < _conf.workers) {
+    fork();
+  }
+  console.log(_c.green + 'DataKit master started', _conf.workers, 'workers on port', _conf.port, _c.reset);
+};
+var _canonicalQuery = function (o) {
+  // Replaces all values with '?' so queries differing only in their
+  // arguments are logged identically
+  var key, keys, result, i;
+  if (Array.isArray(o)) {
+    return o.map(_canonicalQuery);
+  }
+  if (o === null || typeof o !== 'object' || o instanceof mongo.ObjectID) {
+    return '?';
+  }
+  keys = Object.keys(o).sort();
+  result = {};
+  for (i = 0; i < keys.length; i += 1) {
+    key = keys[i];
+    result[key] = _canonicalQuery(o[key]);
+  }
+  return result;
+};
+var _slowQueryLog = null;
+var _logSlowQuery = function (entry) {
+  var line = JSON.stringify(entry);
+  if (_slowQueryLog !== null) {
+    _slowQueryLog.write(line + '\n');
+  } else {
+    console.log(_c.yellow + 'slow query:', line, _c.reset);
+  }
+};
+var _copyKeys = function (s, t) {
+  var key;
+  for (key in s) {
+    if (s.hasOwnProperty(key)) {
+      t[key] = s[key];
+    }
+  }
+};
+var _traverse = function (o, func) {
+  var i;
+  for (i in o) {
+    if (o.hasOwnProperty(i)) {
+      func.apply(o, [i, o[i]]);
+      if (typeof (o[i]) === 'object') {
+        _traverse(o[i], func);
+      }
+    }
+  }
+};
+var _decodeDkObj = function (o) {
+  _traverse(o, function (key, value) {
+    if (key === 'dk:data') {
+      this[key] = new Buffer(value, 'base64');
+    }
+    if (key === '$id') {
+      this[key] = new mongo.ObjectID(value);
+    }
+  });
+};
+var _toObjectIds = function (value) {
+  var key, out;
+  if (typeof value === 'string') {
+    return new mongo.ObjectID(value);
+  }
+  if (Array.isArray(value)) {
+    return value.map(_toObjectIds);
+  }
+  if (value !== null && typeof value === 'object' && !(value instanceof mongo.ObjectID)) {
+    // operator objects like {$in: [...]} or {$ne: ...}
+    out = {};
+    for (key in value) {
+      if (value.hasOwnProperty(key)) {
+        out[key] = _toObjectIds(value[key]);
+      }
+    }
+    return out;
+  }
+  return value;
+};
+var _encodeDkObj = function (o) {
+  _traverse(o, function (key, value) {
+    if (key === 'dk:data') {
+      this[key] = value.toString('base64');
+    }
+    if (key.indexOf(_KEYWORD_PREFIX) === 0 || key.indexOf(_NORMALIZED_PREFIX) === 0) {
+      // search keywords and normalized copies are internal
+      delete this[key];
+    }
+  });
+};
+var _timestamp = function () {
+  // Seconds since epoch with millisecond precision, so that changes
+  // happening within the same second can still be told apart
+  return (new Date().getTime()) / 1000;
+};
+var _parallel = function (tasks, cb) {
+  // Runs node-style tasks concurrently, the callback receives
+  // the results in task order or the first error
+  var results, pending, failed;
+  results = [];
+  pending = tasks.length;
+  failed = false;
+  if (pending === 0) {
+    return cb(null, results);
+  }
+  tasks.forEach(function (task, i) {
+    task(function (err, result) {
+      if (failed) {
+        return;
+      }
+      if (err) {
+        failed = true;
+        return cb(err);
+      }
+      results[i] = result;
+      pending -= 1;
+      if (pending === 0) {
+        cb(null, results);
+      }
+    });
+  });
+};
+var _series = function (tasks, cb) {
+  // Runs node-style tasks one after another, stops at the first error
+  var results, next;
+  results = [];
+  next = function (i) {
+    if (i >= tasks.length) {
+      return cb(null, results);
+    }
+    tasks[i](function (err, result) {
+      if (err) {
+        return cb(err);
+      }
+      results.push(result);
+      next(i + 1);
+    });
+  };
+  next(0);
+};
+var _collection = function (name, cb) {
+  _db.collection(name, cb);
+};
+var _connectOptions = function () {
+  var socket = {
+    'keepAlive': _conf.mongoKeepAlive,
+    'connectTimeoutMS': _conf.mongoConnectTimeoutMS,
+    'socketTimeoutMS': _conf.mongoSocketTimeoutMS
+  };
+  return {
+    'db': {'w': 1},
+    'server': {'poolSize': _conf.mongoPoolSize, 'auto_reconnect': true, 'socketOptions': socket},
+    'replSet': {'poolSize': _conf.mongoPoolSize, 'socketOptions': socket}
+  };
+};
+var _readOptions = function (route, eventual) {
+  // Writes always go to the primary, reads use the preference configured
+  // for their route unless the client accepts eventually consistent results
+  var pref = _safe(_conf.readPreference[route], 'primary');
+  if (eventual) {
+    pref = _conf.eventualReadPreference;
+  }
+  if (pref === 'primary') {
+    return {};
+  }
+  return {'readPreference': pref};
+};
+var _insertTombstone = function (entity, oidStr, cb) {
+  _collection(_DKDB.TOMBSTONES, function (err, col) {
+    if (err) {
+      return cb(err);
+    }
+    // The creation date is a Date, which the TTL index expires
+    col.insert({'entity': entity, 'oid': oidStr, '_updated': _timestamp(), 'created': new Date()}, {'safe': true}, cb);
+  });
+};
+var _ensureSystemIndexes = function (cb) {
+  // Indexes of the internal collections, created on startup and again
+  // after the database was dropped
+  _series([
+    function (cb) {
+      _collection(_DKDB.TOMBSTONES, function (err, col) {
+        if (err) {
+          return cb(err);
+        }
+        col.ensureIndex([['entity', 1], ['_updated', 1]], {'safe': true}, function (err) {
+          if (err || !(_conf.tombstoneTtl > 0)) {
+            return cb(err);
+          }
+          col.ensureIndex([['created', 1]], {'safe': true, 'expireAfterSeconds': _conf.tombstoneTtl}, cb);
+        });
+      });
+    },
+    function (cb) {
+      _collection(_DKDB.COUNTS, function (err, col) {
+        if (err) {
+          return cb(err);
+        }
+        col.ensureIndex([['entity', 1], ['field', 1], ['value', 1]], {'safe': true, 'unique': true}, cb);
+      });
+    },
+    function (cb) {
+      _collection(_DKDB.SHARDS, function (err, col) {
+        if (err) {
+          return cb(err);
+        }
+        col.ensureIndex([['entity', 1], ['oid', 1], ['field', 1], ['shard', 1]], {'safe': true, 'unique': true}, cb);
+      });
+    }
+  ], cb);
+};
+var _changeIndexes = {};
+var _ensureChangeIndex = function (entity, cb) {
+  if (_changeIndexes[entity]) {
+    return cb(null);
+  }
+  _collection(entity, function (err, col) {
+    if (err) {
+      return cb(err);
+    }
+    col.ensureIndex([['_updated', 1], ['_id', 1]], {'safe': true}, function (err) {
+      if (!err) {
+        _changeIndexes[entity] = true;
+      }
+      cb(err);
+    });
+  });
+};
+var _explainResult = function (plan) {
+  var index, match;
+  // Cursor names look like 'BtreeCursor key_1_other_-1' when an index is used
+  index = null;
+  match = /^BtreeCursor (\S+)/.exec(plan.cursor || '');
+  if (match) {
+    index = match[1];
+  }
+  return {
+    'cursor': plan.cursor,
+    'index': index,
+    'n': plan.n,
+    'nscanned': plan.nscanned,
+    'nscannedObjects': plan.nscannedObjects,
+    'scanAndOrder': !!plan.scanAndOrder,
+    'millis': plan.millis,
+    'indexBounds': plan.indexBounds
+  };
+};
+var _checkSlowQuery = function (collection, entity, query, opts, ms, n) {
+  var entry;
+  if (!_exists(_conf.slowQueryMs) || ms < _conf.slowQueryMs) {
+    return;
+  }
+  entry = {
+    'date': new Date().toISOString(),
+    'entity': entity,
+    'query': _canonicalQuery(query),
+    'sort': _exists(opts.sort) ? opts.sort : null,
+    'ms': ms,
+    'n': n
+  };
+
+  // Only slow queries pay for the additional explain round trip, which
+  // runs after the response has been sent
+  collection.find(query, opts, function (err, cursor) {
+    if (err) {
+      entry.nscanned = null;
+      return _logSlowQuery(entry);
+    }
+    cursor.explain(function (err, plan) {
+      if (err) {
+        entry.nscanned = null;
+      } else {
+        plan = _explainResult(plan);
+        entry.nscanned = plan.nscanned;
+        entry.index = plan.index;
+      }
+      _logSlowQuery(entry);
+    });
+  });
+};
+var _reserveSequenceNumbers = function (entity, count, cb) {
+  _collection(_DKDB.SEQENCE, function (err, col) {
+    if (err) {
+      return cb(err);
+    }
+    col.insert({'_id': entity, 'seq': new mongo.Long(0)}, function () {
+      // The insert fails for every but the first object of an entity
+      col.findAndModify(
+        {'_id': entity},
+        [],
+        {'$inc': {'seq': count}},
+        {'new': true},
+        function (err, doc) {
+          var last;
+          if (err) {
+            return cb(err);
+          }
+          last = (typeof doc.seq === 'number') ? doc.seq : doc.seq.toNumber();
+          cb(null, last - count + 1);
+        }
+      );
+    });
+  });
+};
+var _generateNextSequenceNumber = function (entity, cb) {
+  _reserveSequenceNumbers(entity, 1, cb);
+};
+var _COUNTED_WRITE_TIMEOUT_MS = 60000;
+var _countedFields = function (entity) {
+  return _safe(_conf.countedFields[entity], []);
+};
+var _isCountable = function (v) {
+  var t = typeof v;
+  return t === 'string' || t === 'number' || t === 'boolean';
+};
+var _counterKey = function (entity, query) {
+  // Totals and equality matches on a counted top level field
+  // can be answered from a counter
+  var keys, field, value;
+  keys = Object.keys(query);
+  if (keys.length === 0) {
+    return {'entity': entity, 'field': null, 'value': null};
+  }
+  field = keys[0];
+  value = query[field];
+  if (keys.length > 1 || _countedFields(entity).indexOf(field) < 0 || !_isCountable(value)) {
+    return null;
+  }
+  return {'entity': entity, 'field': field, 'value': value};
+};
+var _touchesCountedField = function (op) {
+  var fields = _countedFields(op.entity);
+  if (fields.length === 0) {
+    return false;
+  }
+  return ['set', 'unset', 'inc', 'push', 'pushAll', 'addToSet', 'pop', 'pullAll'].some(function (k) {
+    return _exists(op[k]) && Object.keys(op[k]).some(function (key) {
+      return fields.indexOf(key.split('.')[0]) >= 0;
+    });
+  });
+};
+var _countedValues = function (v) {
+  // Equality queries also match array members, so each distinct
+  // member of an array is counted as a value of its own
+  var values = [];
+  (Array.isArray(v) ? v : [v]).forEach(function (m) {
+    if (_isCountable(m) && values.indexOf(m) < 0) {
+      values.push(m);
+    }
+  });
+  return values;
+};
+var _adjustCounters = function (entity, changes, cb) {
+  // Each change has a total delta and the object before and after,
+  // counters that do not exist yet are seeded on first read instead
+  var fields, deltas, keys, total, add, ids;
+  fields = _countedFields(entity);
+  deltas = {};
+  keys = {};
+  total = 0;
+  add = function (field, value, d) {
+    var id = JSON.stringify([field, value]);
+    if (!deltas.hasOwnProperty(id)) {
+      deltas[id] = 0;
+      keys[id] = {'entity': entity, 'field': field, 'value': value};
+    }
+    deltas[id] += d;
+  };
+  changes.forEach(function (change) {
+    total += change.delta;
+    fields.forEach(function (f) {
+      var before, after;
+      before = _countedValues(_exists(change.before) ? change.before[f] : undefined);
+      after = _countedValues(_exists(change.after) ? change.after[f] : undefined);
+      before.forEach(function (v) {
+        if (after.indexOf(v) < 0) {
+          add(f, v, -1);
+        }
+      });
+      after.forEach(function (v) {
+        if (before.indexOf(v) < 0) {
+          add(f, v, 1);
+        }
+      });
+    });
+  });
+  if (total !== 0) {
+    add(null, null, total);
+  }
+  ids = Object.keys(deltas).filter(function (id) {
+    return deltas[id] !== 0;
+  });
+  if (ids.length === 0) {
+    return cb(null);
+  }
+  _collection(_DKDB.COUNTS, function (err, counts) {
+    if (err) {
+      return cb(err);
+    }
+    _parallel(ids.map(function (id) {
+      return function (cb) {
+        counts.update(keys[id], {'$inc': {'n': deltas[id]}}, {'safe': true}, function (err) {
+          if (!err) {
+            return cb(null);
+          }
+
+          // A counter that missed a change is removed and seeded again
+          counts.remove(keys[id], {'safe': true}, function () {
+            cb(err);
+          });
+        });
+      };
+    }), cb);
+  });
+};
+var _removeCounters = function (entity, cb) {
+  _collection(_DKDB.COUNTS, function (err, counts) {
+    if (err) {
+      return cb(err);
+    }
+    counts.remove({'entity': entity}, {'safe': true}, function (err) {
+      cb(err);
+    });
+  });
+};
+var _beginCountedWrite = function (entity, cb) {
+  // Writes to an entity are registered before they reach the collection
+  // and finished after their counter deltas are applied. Counters are
+  // only seeded while no write is in flight, so a write is never both
+  // part of the seeding count and applied as a delta.
+  _collection(_DKDB.COUNTED_WRITES, function (err, writes) {
+    if (err) {
+      return cb(err);
+    }
+    writes.update({'_id': entity}, {'$inc': {'pending': 1, 'started': 1}, '$set': {'touched': Date.now()}}, {'safe': true, 'upsert': true}, function (err) {
+      cb(err);
+    });
+  });
+};
+var _endCountedWrite = function (entity, cb) {
+  _collection(_DKDB.COUNTED_WRITES, function (err, writes) {
+    if (err) {
+      return cb(err);
+    }
+    writes.update({'_id': entity, 'pending': {'$gt': 0}}, {'$inc': {'pending': -1}}, {'safe': true}, function (err) {
+      if (err) {
+        console.error('error: could not finish counted write (', err, ')');
+      }
+      cb(null);
+    });
+  });
+};
+var _readCounter = function (collection, key, query, cb) {
+  // Counters are seeded from an exact count on first use, and counted
+  // again once they are older than counterRecountMs
+  _collection(_DKDB.COUNTS, function (err, counts) {
+    if (err) {
+      return cb(err);
+    }
+    _collection(_DKDB.COUNTED_WRITES, function (err, writes) {
+      var idle, seed;
+      if (err) {
+        return cb(err);
+      }
+      idle = function (cb) {
+        writes.findOne({'_id': key.entity}, function (err, state) {
+          if (err || !_exists(state)) {
+            return cb(err, {'pending': 0, 'started': 0});
+          }
+          if (state.pending > 0 && state.touched < Date.now() - _COUNTED_WRITE_TIMEOUT_MS) {
+            // Writes of a crashed process are never finished
+            return writes.update({'_id': key.entity, 'started': state.started}, {'$set': {'pending': 0}}, {'safe': true}, function (err) {
+              cb(err, {'pending': 1, 'started': state.started});
+            });
+          }
+          cb(null, state);
+        });
+      };
+      seed = function (counter) {
+        idle(function (err, before) {
+          if (err) {
+            return cb(err);
+          }
+          collection.count(query, function (err, n) {
+            if (err || before.pending > 0) {
+              return cb(err, n);
+            }
+
+            // No write may have started while counting, and the counter
+            // may not have changed since it was read
+            idle(function (err, after) {
+              var settle;
+              if (err || after.pending > 0 || after.started !== before.started) {
+                return cb(err, n);
+              }
+              settle = {'$set': {'n': n, 'seeded': Date.now()}, '$unset': {'seeding': 1}};
+              counts.findAndModify({'_id': counter._id, 'n': counter.n}, [], settle, {'new': true}, function (err) {
+                cb(err, n);
+              });
+            });
+          });
+        });
+      };
+      counts.findOne(key, function (err, counter) {
+        var placeholder;
+        if (err) {
+          return cb(err);
+        }
+        if (_exists(counter)) {
+          if (!_exists(counter.seeding) && _exists(counter.seeded) &&
+              (_conf.counterRecountMs === 0 || counter.seeded > Date.now() - _conf.counterRecountMs)) {
+            return cb(null, counter.n);
+          }
+          return seed(counter);
+        }
+
+        // The placeholder is only used once a seed has been settled
+        placeholder = {'entity': key.entity, 'field': key.field, 'value': key.value, 'n': 0, 'seeding': true};
+        counts.insert(placeholder, {'safe': true}, function () {
+          // Another request may have created the counter first, the
+          // unique index keeps a single one
+          counts.findOne(key, function (err, counter) {
+            if (err || !_exists(counter)) {
+              return collection.count(query, cb);
+            }
+            seed(counter);
+          });
+        });
+      });
+    });
+  });
+};
+var _shardedFields = function (entity) {
+  return _safe(_conf.shardedCounters[entity], {});
+};
+var _filtersShardedField = function (entity, query) {
+  // The stored value of a sharded field is not its sum, filters on it
+  // would not match what clients see
+  var sharded, found;
+  sharded = _shardedFields(entity);
+  found = false;
+  _traverse(query, function (key) {
+    if (sharded.hasOwnProperty(String(key).split('.')[0])) {
+      found = true;
+    }
+  });
+  return found;
+};
+var _splitShardedIncrements = function (op) {
+  // Increments of sharded fields are removed from the operation, they
+  // go to one of the field's counter shards instead of the object
+  var fields, inc, key;
+  fields = _shardedFields(op.entity);
+  inc = null;
+  if (!_exists(op.inc)) {
+    return inc;
+  }
+  for (key in op.inc) {
+    if (op.inc.hasOwnProperty(key) && fields.hasOwnProperty(key)) {
+      if (inc === null) {
+        inc = {};
+      }
+      inc[key] = op.inc[key];
+      delete op.inc[key];
+    }
+  }
+  if (Object.keys(op.inc).length === 0) {
+    op.inc = null;
+  }
+  return inc;
+};
+var _shardCache = {};
+var _shardCacheCount = 0;
+var _shardCacheKey = function (entity, oidStr, field) {
+  return JSON.stringify([entity, oidStr, field]);
+};
+var _cacheShardSum = function (key, n) {
+  // Entries are short lived, the cache starts over instead of evicting
+  if (_shardCacheCount >= 10000) {
+    _shardCache = {};
+    _shardCacheCount = 0;
+  }
+  if (!_shardCache.hasOwnProperty(key)) {
+    _shardCacheCount += 1;
+  }
+  _shardCache[key] = {'n': n, 'expires': Date.now() + _conf.shardedCounterCacheMs};
+};
+var _incrementShards = function (entity, oidStr, inc, cb) {
+  var fields = _shardedFields(entity);
+  if (!_exists(inc)) {
+    return cb(null);
+  }
+  _collection(_DKDB.SHARDS, function (err, shards) {
+    if (err) {
+      return cb(err);
+    }
+    _parallel(Object.keys(inc).map(function (field) {
+      return function (cb) {
+        var key = {
+          'entity': entity,
+          'oid': oidStr,
+          'field': field,
+          'shard': Math.floor(Math.random() * fields[field])
+        };
+        delete _shardCache[_shardCacheKey(entity, oidStr, field)];
+        shards.update(key, {'$inc': {'n': inc[field]}}, {'safe': true, 'upsert': true}, cb);
+      };
+    }), cb);
+  });
+};
+var _resetShards = function (entity, oidStr, op, cb) {
+  // Setting or unsetting a sharded field discards its shards
+  var sharded, fields;
+  sharded = _shardedFields(entity);
+  fields = Object.keys(sharded).filter(function (f) {
+    return (_exists(op.set) && op.set.hasOwnProperty(f)) ||
+      (_exists(op.unset) && op.unset.hasOwnProperty(f));
+  });
+  if (fields.length === 0) {
+    return cb(null);
+  }
+  _collection(_DKDB.SHARDS, function (err, shards) {
+    if (err) {
+      return cb(err);
+    }
+    fields.forEach(function (f) {
+      delete _shardCache[_shardCacheKey(entity, oidStr, f)];
+    });
+    shards.remove({'entity': entity, 'oid': oidStr, 'field': {'$in': fields}}, {'safe': true}, cb);
+  });
+};
+var _isProjected = function (fieldInclExcl, field) {
+  var keys;
+  if (!_exists(fieldInclExcl)) {
+    return true;
+  }
+  keys = Object.keys(fieldInclExcl).filter(function (k) {
+    return k !== '_id';
+  });
+  if (keys.length === 0) {
+    return true;
+  }
+  if (Number(fieldInclExcl[keys[0]]) === 1) {
+    return fieldInclExcl.hasOwnProperty(field);
+  }
+  return !fieldInclExcl.hasOwnProperty(field);
+};
+var _sumShards = function (entity, docs, fieldInclExcl, cb) {
+  // Adds the counter shards to the value stored in the object, sums
+  // are cached for shardedCounterCacheMs
+  var fields, now, sums, missing;
+  fields = Object.keys(_shardedFields(entity)).filter(function (f) {
+    return _isProjected(fieldInclExcl, f);
+  });
+  docs = docs.filter(_exists);
+  if (fields.length === 0 || docs.length === 0) {
+    return cb(null);
+  }
+  now = Date.now();
+  sums = {};
+  missing = [];
+  docs.forEach(function (doc) {
+    var oidStr = String(doc._id);
+    sums[oidStr] = {};
+    fields.forEach(function (f) {
+      var cached = _shardCache[_shardCacheKey(entity, oidStr, f)];
+      if (_exists(cached) && cached.expires > now) {
+        sums[oidStr][f] = cached.n;
+      } else if (missing.indexOf(oidStr) < 0) {
+        missing.push(oidStr);
+      }
+    });
+  });
+  _series([
+    function (cb) {
+      if (missing.length === 0) {
+        return cb(null);
+      }
+      _collection(_DKDB.SHARDS, function (err, shards) {
+        if (err) {
+          return cb(err);
+        }
+        shards.find({'entity': entity, 'oid': {'$in': missing}, 'field': {'$in': fields}}, function (err, cursor) {
+          if (err) {
+            return cb(err);
+          }
+          cursor.toArray(function (err, found) {
+            if (err) {
+              return cb(err);
+            }
+            missing.forEach(function (oidStr) {
+              fields.forEach(function (f) {
+                sums[oidStr][f] = 0;
+              });
+            });
+            found.forEach(function (shard) {
+              sums[shard.oid][shard.field] += shard.n;
+            });
+            if (_conf.shardedCounterCacheMs > 0) {
+              missing.forEach(function (oidStr) {
+                fields.forEach(function (f) {
+                  _cacheShardSum(_shardCacheKey(entity, oidStr, f), sums[oidStr][f]);
+                });
+              });
+            }
+            cb(null);
+          });
+        });
+      });
+    }
+  ], function (err) {
+    if (err) {
+      return cb(err);
+    }
+    docs.forEach(function (doc) {
+      var docSums = sums[String(doc._id)];
+      fields.forEach(function (f) {
+        if (docSums[f] !== 0 || typeof doc[f] === 'number') {
+          doc[f] = ((typeof doc[f] === 'number') ? doc[f] : 0) + docSums[f];
+        }
+      });
+    });
+    cb(null);
+  });
+};
+var _estimateCount = function (collection, query, cb) {
+  // Counts the matches among the newest objects and scales the result
+  // by the collection size, which is read from metadata
+  var size = _conf.countSampleSize;
+  collection.count(function (err, total) {
+    if (err) {
+      return cb(err);
+    }
+    if (total <= size) {
+      return collection.count(query, cb);
+    }
+    collection.find({}, {'_id': 1}, {'sort': [['_id', 'desc']], 'skip': size - 1, 'limit': 1}, function (err, cursor) {
+      if (err) {
+        return cb(err);
+      }
+      cursor.toArray(function (err, boundary) {
+        if (err || boundary.length === 0) {
+          return cb(err, 0);
+        }
+        collection.count({'$and': [query, {'_id': {'$gte': boundary[0]._id}}]}, function (err, matched) {
+          if (err) {
+            return cb(err);
+          }
+          cb(null, Math.round(matched * total / size));
+        });
+      });
+    });
+  });
+};
+var _textFields = function (entity) {
+  return _safe(_conf.textFields[entity], []);
+};
+var _tokenize = function (value) {
+  // Lowercased words, each one only once
+  var seen, tokens;
+  seen = {};
+  tokens = [];
+  if (Array.isArray(value)) {
+    value = value.join(' ');
+  }
+  if (typeof value !== 'string') {
+    return tokens;
+  }
+  value.toLowerCase().split(/[^0-9a-z\u00c0-\uffff]+/).forEach(function (t) {
+    if (t.length > 0 && !seen.hasOwnProperty(t)) {
+      seen[t] = true;
+      tokens.push(t);
+    }
+  });
+  return tokens;
+};
+var _addKeywords = function (entity, doc) {
+  // Text fields are searched through a multikey array of their words
+  _textFields(entity).forEach(function (f) {
+    if (doc.hasOwnProperty(f)) {
+      doc[_KEYWORD_PREFIX + f] = _tokenize(doc[f]);
+    }
+  });
+};
+var _normalizedFields = function (entity) {
+  return _safe(_conf.normalizedFields[entity], []);
+};
+var _FOLDED = {
+  'a': 'àáâãäåāăą',
+  'c': 'çćĉċč',
+  'd': 'ďđ',
+  'e': 'èéêëēĕėęě',
+  'g': 'ĝğġģ',
+  'h': 'ĥħ',
+  'i': 'ìíîïĩīĭįı',
+  'j': 'ĵ',
+  'k': 'ķ',
+  'l': 'ĺļľŀł',
+  'n': 'ñńņňŉ',
+  'o': 'òóôõöøōŏő',
+  'r': 'ŕŗř',
+  's': 'śŝşš',
+  't': 'ţťŧ',
+  'u': 'ùúûüũūŭůűų',
+  'w': 'ŵ',
+  'y': 'ýÿŷ',
+  'z': 'źżž'
+};
+var _foldMap = (function () {
+  var map = {};
+  Object.keys(_FOLDED).forEach(function (base) {
+    _FOLDED[base].split('').forEach(function (c) {
+      map[c] = base;
+    });
+  });
+  return map;
+}());
+var _normalize = function (value) {
+  // Lowercased with latin diacritics removed
+  return value.toLowerCase().replace(/[^\u0000-\u007f]/g, function (c) {
+    return _safe(_foldMap[c], c);
+  });
+};
+var _addNormalized = function (entity, doc) {
+  _normalizedFields(entity).forEach(function (f) {
+    if (doc.hasOwnProperty(f)) {
+      if (typeof doc[f] === 'string') {
+        doc[_NORMALIZED_PREFIX + f] = _normalize(doc[f]);
+      } else {
+        doc[_NORMALIZED_PREFIX + f] = null;
+      }
+    }
+  });
+};
+var _unsetSearchFields = function (entity, unset) {
+  _textFields(entity).forEach(function (f) {
+    if (unset.hasOwnProperty(f)) {
+      unset[_KEYWORD_PREFIX + f] = 1;
+    }
+  });
+  _normalizedFields(entity).forEach(function (f) {
+    if (unset.hasOwnProperty(f)) {
+      unset[_NORMALIZED_PREFIX + f] = 1;
+    }
+  });
+};
+var _escapeRegex = function (str) {
+  return str.replace(/[\-\[\]\/\{\}\(\)\*\+\?\.\\\^\$\|]/g, '\\$&');
+};
+var _fieldIndexes = {};
+var _ensureFieldIndex = function (entity, field, cb) {
+  var key = entity + '.' + field;
+  if (_fieldIndexes[key]) {
+    return cb(null);
+  }
+  _collection(entity, function (err, col) {
+    var spec;
+    if (err) {
+      return cb(err);
+    }
+    spec = {};
+    spec[field] = 1;
+    col.ensureIndex(spec, {'safe': true}, function (err) {
+      if (!err) {
+        _fieldIndexes[key] = true;
+      }
+      cb(err);
+    });
+  });
+};
+var _backfillNormalized = function (cb) {
+  // Objects saved before a field was added to normalizedFields have no
+  // normalized copy, so lookups on the copy would not find them
+  _series(Object.keys(_conf.normalizedFields).map(function (entity) {
+    return function (cb) {
+      _collection(entity, function (err, collection) {
+        if (err) {
+          return cb(err);
+        }
+        _series(_normalizedFields(entity).map(function (f) {
+          return function (cb) {
+            var shadow, query, fields;
+            shadow = _NORMALIZED_PREFIX + f;
+            query = {};
+            query[f] = {'$exists': true};
+            query[shadow] = {'$exists': false};
+            fields = {};
+            fields[f] = 1;
+            collection.find(query, fields, function (err, cursor) {
+              var filled, next;
+              if (err) {
+                return cb(err);
+              }
+              filled = 0;
+              next = function () {
+                cursor.nextObject(function (err, doc) {
+                  var copy, match;
+                  if (err) {
+                    return cb(err);
+                  }
+                  if (!_exists(doc)) {
+                    if (filled > 0) {
+                      console.log('Added', filled, 'normalized copies of', entity + '.' + f);
+                    }
+                    return cb(null);
+                  }
+                  copy = {};
+                  copy[f] = doc[f];
+                  _addNormalized(entity, copy);
+                  delete copy[f];
+
+                  // A save in the meantime already wrote the copy
+                  match = {'_id': doc._id};
+                  match[shadow] = {'$exists': false};
+                  collection.update(match, {'$set': copy}, {'safe': true}, function (err) {
+                    if (err) {
+                      return cb(err);
+                    }
+                    filled += 1;
+                    next();
+                  });
+                });
+              };
+              next();
+            });
+          };
+        }), cb);
+      });
+    };
+  }), cb);
+};
+var _saveEntity = function (op, cb) {
+  var fset, oid, isNew, shardInc, counterOnly;
+  fset = op.set;
+  oid = op.oid;
+  isNew = (oid === null);
+
+  // Sharded increments alone do not write the object, so that hot
+  // counters do not contend on it
+  shardInc = _splitShardedIncrements(op);
+  counterOnly = !isNew && shardInc !== null && Object.keys(fset).length === 0 &&
+    ['unset', 'inc', 'push', 'pushAll', 'addToSet', 'pop', 'pullAll'].every(function (k) {
+      return !_exists(op[k]);
+    });
+
+  // Automatically insert the update timestamp
+  fset._updated = _timestamp();
+
+  // Keep the keywords of text fields and normalized copies in sync
+  _addKeywords(op.entity, fset);
+  _addNormalized(op.entity, fset);
+  if (_exists(op.unset)) {
+    _unsetSearchFields(op.entity, op.unset);
+  }
+
+  _collection(op.entity, function (err, collection) {
+    var begin, done, counted, before, insert, modify, upserted;
+    if (err) {
+      return cb(err);
+    }
+    upserted = false;
+    counted = false;
+    begin = function (cb) {
+      if (counterOnly) {
+        return cb(null);
+      }
+      _beginCountedWrite(op.entity, function (err) {
+        counted = !err;
+        cb(err);
+      });
+    };
+    done = function (err, doc) {
+      if (!counted) {
+        return cb(err, doc);
+      }
+      _endCountedWrite(op.entity, function () {
+        cb(err, doc);
+      });
+    };
+    insert = function (cb) {
+      if (!isNew) {
+        return cb(null, null);
+      }
+
+      // Generate new sequence number
+      _generateNextSequenceNumber(op.entity, function (err, seq) {
+        if (err) {
+          return cb(err);
+        }
+        fset._seq = seq;
+        collection.insert(fset, function (err, doc) {
+          if (err) {
+            return cb(err);
+          }
+          oid = doc[0]._id;
+          cb(null, doc);
+        });
+      });
+    };
+    modify = function (doc, cb) {
+      var opts, update, ats, key;
+      if (counterOnly) {
+        return collection.findOne({'_id': oid}, function (err, found) {
+          if (err || _exists(found)) {
+            return cb(err, found);
+          }
+
+          // The object does not exist yet, create it like any other save
+          counterOnly = false;
+          begin(function (err) {
+            if (err) {
+              return cb(err);
+            }
+            modify(doc, cb);
+          });
+        });
+      }
+
+      // Update instead if oid exists, or an operation needs to be executed
+      // that requires an insert first.
+      opts = {'upsert': true, 'new': true};
+      update = {};
+      if (_exists(fset) && !isNew) {
+        update.$set = fset;
+      }
+      if (_exists(op.unset)) {
+        update.$unset = op.unset;
+      }
+      if (_exists(op.inc)) {
+        update.$inc = op.inc;
+      }
+      if (_exists(op.push)) {
+        update.$push = op.push;
+      }
+      if (_exists(op.pushAll)) {
+        update.$pushAll = op.pushAll;
+      }
+      if (_exists(op.addToSet)) {
+        ats = {};
+        for (key in op.addToSet) {
+          if (op.addToSet.hasOwnProperty(key)) {
+            ats[key] = {'$each': op.addToSet[key]};
+          }
+        }
+        update.$addToSet = ats;
+      }
+      if (_exists(op.pop)) {
+        update.$pop = op.pop;
+      }
+      if (_exists(op.pullAll)) {
+        update.$pullAll = op.pullAll;
+      }
+      if (isNew && Object.keys(update).length === 0) {
+        return cb(null, doc);
+      }
+
+      // Find and modify, an upsert creates the object
+      collection.findAndModify({'_id': oid}, [], update, opts, function (err, doc, result) {
+        upserted = _exists(result) && _exists(result.lastErrorObject) && result.lastErrorObject.updatedExisting === false;
+        cb(err, doc);
+      });
+    };
+    before = function (cb) {
+      var fields;
+      if (isNew || !_touchesCountedField(op)) {
+        return cb(null, null);
+      }
+
+      // Per value counters need the previous values of counted fields
+      fields = {};
+      _countedFields(op.entity).forEach(function (f) {
+        fields[f] = 1;
+      });
+      collection.findOne({'_id': oid}, fields, cb);
+    };
+    begin(function (err) {
+      if (err) {
+        return cb(err);
+      }
+      before(function (err, prev) {
+        if (err) {
+          return done(err);
+        }
+        insert(function (err, doc) {
+          if (err) {
+            return done(err);
+          }
+          modify(doc, function (err, doc) {
+            var oidStr, change;
+            if (err) {
+              return done(err);
+            }
+            if (doc.length > 0) {
+              doc = doc[0];
+            }
+            oidStr = String(doc._id);
+
+            // Counters follow the written object, even if the shards fail
+            change = {'delta': (isNew || upserted) ? 1 : 0, 'before': prev, 'after': doc};
+            if (!isNew && !upserted && prev === null) {
+              change.after = null;
+            }
+            _adjustCounters(op.entity, [change], function (err) {
+              if (err) {
+                console.error('error: could not update counters (', err, ')');
+              }
+              _series([
+                function (cb) {
+                  if (isNew) {
+                    return cb(null);
+                  }
+                  _resetShards(op.entity, oidStr, op, cb);
+                },
+                function (cb) {
+                  _incrementShards(op.entity, oidStr, shardInc, cb);
+                },
+                function (cb) {
+                  _sumShards(op.entity, [doc], null, cb);
+                }
+              ], function (err) {
+                if (err) {
+                  return done(err);
+                }
+
+                _encodeDkObj(doc);
+
+                done(null, doc);
+              });
+            });
+          });
+        });
+      });
+    });
+  });
+};
+var _saveOperation = function (ent, index) {
+  var op = {
+    'index': index,
+    'entity': _safe(ent.entity, null),
+    'oidStr': _safe(ent.oid, null),
+    'set': _safe(ent.set, {}),
+    'unset': _safe(ent.unset, null),
+    'inc': _safe(ent.inc, null),
+    'push': _safe(ent.push, null),
+    'pushAll': _safe(ent.pushAll, null),
+    'addToSet': _safe(ent.addToSet, null),
+    'pop': _safe(ent.pop, null),
+    'pullAll': _safe(ent.pullAll, null),
+    'oid': null
+  };
+  if (!_exists(op.entity)) {
+    throw _invalidParams('Missing entity name');
+  }
+
+  _decodeDkObj(op.set);
+  _decodeDkObj(op.push);
+  _decodeDkObj(op.pushAll);
+  _decodeDkObj(op.addToSet);
+  _decodeDkObj(op.pullAll);
+
+  if (_exists(op.oidStr)) {
+    try {
+      op.oid = new mongo.ObjectID(op.oidStr);
+    } catch (e) {
+      throw _invalidParams('Invalid object id');
+    }
+  }
+  return op;
+};
+var _saveBatch = function (ops, results, partial, cb) {
+  // Saves to the same object keep their order, everything else runs
+  // concurrently. With partial results a failed save is reported in place
+  // of its result and the other saves still succeed.
+  var groups, keys, errors;
+  groups = {};
+  keys = [];
+  errors = [];
+  ops.forEach(function (op) {
+    var key = _exists(op.oid) ? (op.entity + ':' + op.oidStr) : ('new:' + op.index);
+    if (!groups.hasOwnProperty(key)) {
+      groups[key] = [];
+      keys.push(key);
+    }
+    groups[key].push(op);
+  });
+  _parallel(keys.map(function (key) {
+    return function (cb) {
+      _series(groups[key].map(function (op) {
+        return function (cb) {
+          _saveEntity(op, function (err, doc) {
+            if (err && partial) {
+              results[op.index] = {'dk:error': _errorObject(_safe(err.dkError, _ERR.OPERATION_FAILED), err)};
+            } else if (err) {
+              errors.push(err);
+            } else {
+              results[op.index] = doc;
+            }
+            cb(null);
+          });
+        };
+      }), cb);
+    };
+  }), function () {
+    cb(errors.length > 0 ? errors.pop() : null);
+  });
+};
+var _objectIdParam = function (req) {
+  var oidStr = req.param('oid', null);
+  if (!_exists(oidStr)) {
+    return null;
+  }
+  try {
+    return new mongo.ObjectID(oidStr);
+  } catch (e) {
+    return null;
+  }
+};
+var _streamFileFromGridFS = function (req, res, fn, readOpts) {
+  var gs;
+  if (!fn) {
+    // HTTP: Not Found
+    return res.send('', 404);
+  }
+
+  // Open grid store
+  gs = new mongo.GridStore(_db, fn, 'r', _safe(readOpts, {}));
+  gs.open(function (err, gs) {
+    var stream;
+    if (err) {
+      console.log(err);
+      // HTTP: Server Error
+      return res.send('', 500);
+    }
+
+    // Write head
+    // HTTP: Partial Content
+    console.log(fn, "=>", "content", gs.contentType, "len", gs.length);
+    res.writeHead(200, {
+      'Connection': 'close',
+      'Content-Type': gs.contentType,
+      'Content-Length': gs.length
+    });
+
+    stream = gs.stream(true);
+    stream.on('data', function (data) {
+      res.write(data);
+    });
+    stream.on('close', function () {
+      res.end();
+    });
+  });
+};
+var _sortOptions = function (sort) {
+  var sortValues, key, order;
+  if (!_exists(sort)) {
+    return null;
+  }
+  sortValues = [];
+  for (key in sort) {
+    if (sort.hasOwnProperty(key)) {
+      order = (sort[key] === 1) ? 'asc' : 'desc';
+      sortValues.push([key, order]);
+    }
+  }
+  return sortValues;
+};
+var _isPlainObject = function (v) {
+  return (v !== null && typeof v === 'object' && !Array.isArray(v) &&
+          !(v instanceof mongo.ObjectID) && !(v instanceof RegExp) && !(v instanceof Date));
+};
+var _isParam = function (v) {
+  return _isPlainObject(v) && typeof v.$param === 'string' && Object.keys(v).length === 1;
+};
+var _compileTemplate = function (node, isId) {
+  var out, key;
+  // converts constant oid strings once, parameter placeholders are kept
+  if (_isParam(node)) {
+    return node;
+  }
+  if (Array.isArray(node)) {
+    return node.map(function (n) {
+      return _compileTemplate(n, isId);
+    });
+  }
+  if (_isPlainObject(node)) {
+    out = {};
+    for (key in node) {
+      if (node.hasOwnProperty(key)) {
+        out[key] = _compileTemplate(node[key], isId || key === '_id');
+      }
+    }
+    return out;
+  }
+  if (isId && typeof node === 'string') {
+    return new mongo.ObjectID(node);
+  }
+  return node;
+};
+var _bindTemplate = function (node, params, isId) {
+  var out, key, name;
+  if (_isParam(node)) {
+    name = node.$param;
+    if (!params.hasOwnProperty(name)) {
+      throw _invalidParams('Missing query parameter ' + name);
+    }
+    return isId ? _toObjectIds(params[name]) : params[name];
+  }
+  if (Array.isArray(node)) {
+    return node.map(function (n) {
+      return _bindTemplate(n, params, isId);
+    });
+  }
+  if (_isPlainObject(node)) {
+    out = {};
+    for (key in node) {
+      if (node.hasOwnProperty(key)) {
+        out[key] = _bindTemplate(node[key], params, isId || key === '_id');
+      }
+    }
+    return out;
+  }
+  return node;
+};
+var _compilePrepared = function (spec) {
+  var q;
+  if (!_exists(spec) || typeof spec.entity !== 'string' || spec.entity.length === 0) {
+    throw _invalidParams('Missing entity name');
+  }
+  q = _isPlainObject(spec.q) ? spec.q : {};
+  if (_exists(spec.or)) {
+    q.$or = spec.or;
+  }
+  if (_exists(spec.and)) {
+    q.$and = spec.and;
+  }
+  return {
+    'entity': spec.entity,
+    'q': _compileTemplate(q, false),
+    'sort': _sortOptions(spec.sort),
+    'refIncl': _safe(spec.refIncl, []),
+    'fieldInclExcl': _safe(spec.fieldInEx, null)
+  };
+};
+var _prepared = {};
+var _preparedCount = 0;
+var _cachePrepared = function (id, plan) {
+  // plans are persisted, so the cache can simply start over when full
+  if (_preparedCount >= _conf.preparedCacheSize) {
+    _prepared = {};
+    _preparedCount = 0;
+  }
+  if (!_prepared.hasOwnProperty(id)) {
+    _preparedCount += 1;
+  }
+  _prepared[id] = plan;
+};
+var _loadPrepared = function (id, cb) {
+  var err;
+  if (_prepared.hasOwnProperty(id)) {
+    return cb(null, _prepared[id]);
+  }
+  // prepared by another worker or before a restart
+  _collection(_DKDB.PREPARED, function (colErr, col) {
+    if (colErr) {
+      return cb(colErr);
+    }
+    col.findOne({'_id': id}, function (findErr, doc) {
+      var plan;
+      if (findErr) {
+        return cb(findErr);
+      }
+      if (!_exists(doc)) {
+        err = new Error('Prepared query not found');
+        err.dkError = _ERR.PREPARED_QUERY_NOT_FOUND;
+        return cb(err);
+      }
+      try {
+        plan = _compilePrepared(JSON.parse(doc.spec));
+      } catch (e) {
+        return cb(e);
+      }
+      _cachePrepared(id, plan);
+      cb(null, plan);
+    });
+  });
+};
+var _textParam = function (entity, query, text) {
+  // Adds the keyword condition of a text search to the query
+  var search;
+  if (!_exists(text)) {
+    return null;
+  }
+  if (!_isPlainObject(text) || typeof text.key !== 'string') {
+    throw _invalidParams('Invalid text search');
+  }
+  if (_textFields(entity).indexOf(text.key) < 0) {
+    throw _invalidParams('Key is not a text field');
+  }
+  search = {'field': _KEYWORD_PREFIX + text.key, 'tokens': _tokenize(text.terms)};
+  query[search.field] = {'$in': search.tokens};
+  return search;
+};
+var _rewriteCaseInsensitive = function (entity, query, indexed) {
+  // $ieq and $iprefix conditions become range queries on the normalized
+  // copy of a field, or a case insensitive regex if there is none
+  var fields = _normalizedFields(entity);
+  Object.keys(query).forEach(function (key) {
+    var cond, op, value, norm, shadow;
+    cond = query[key];
+    if (key === '$or' || key === '$and') {
+      if (Array.isArray(cond)) {
+        cond.forEach(function (q) {
+          if (_isPlainObject(q)) {
+            _rewriteCaseInsensitive(entity, q, indexed);
+          }
+        });
+      }
+      return;
+    }
+    if (!_isPlainObject(cond)) {
+      return;
+    }
+    if (cond.hasOwnProperty('$ieq')) {
+      op = '$ieq';
+    } else if (cond.hasOwnProperty('$iprefix')) {
+      op = '$iprefix';
+    } else {
+      return;
+    }
+    value = cond[op];
+    if (typeof value !== 'string') {
+      throw _invalidParams('Case insensitive matches need a string');
+    }
+    delete cond[op];
+    if (fields.indexOf(key) < 0) {
+      cond.$regex = '^' + _escapeRegex(value) + (op === '$ieq' ? '$' : '');
+      cond.$options = 'i';
+      return;
+    }
+    norm = _normalize(value);
+    shadow = _NORMALIZED_PREFIX + key;
+    query[shadow] = (op === '$ieq') ? norm : {'$gte': norm, '$lt': norm + '\uffff'};
+    if (Object.keys(cond).length === 0) {
+      delete query[key];
+    }
+    if (indexed.indexOf(shadow) < 0) {
+      indexed.push(shadow);
+    }
+  });
+};
+var _rankText = function (collection, query, text, opts, cb) {
+  // Orders the matches by the number of search terms they contain, the
+  // keyword index narrows down the candidates before they are unwound
+  var pipeline, aggOpts, done;
+  pipeline = [
+    {'$match': query},
+    {'$project': {'kw': '$' + text.field}},
+    {'$unwind': '$kw'},
+    {'$match': {'kw': {'$in': text.tokens}}},
+    {'$group': {'_id': '$_id', 'score': {'$sum': 1}}},
+    {'$sort': {'score': -1, '_id': 1}}
+  ];
+  if (_exists(opts.skip)) {
+    pipeline.push({'$skip': opts.skip});
+  }
+  pipeline.push({'$limit': opts.limit});
+  done = function (err, ranked) {
+    if (err) {
+      return cb(err);
+    }
+    cb(null, ranked.map(function (r) {
+      return r._id;
+    }));
+  };
+  if (_exists(opts.readPreference)) {
+    aggOpts = {'readPreference': opts.readPreference};
+    return collection.aggregate(pipeline, aggOpts, done);
+  }
+  collection.aggregate(pipeline, done);
+};
+var _query = function (param, spec, cb) {
+  // Runs a query spec, the callback receives the encoded results
+  var entity, doFindOne, doCount, doExplain, doEstimate, query, opts, refIncl, fieldInclExcl, text, missing, skip, limit, mr, fail, send, deliver, readOpts;
+  entity = spec.entity;
+  query = spec.query;
+  refIncl = spec.refIncl;
+  fieldInclExcl = spec.fieldInclExcl;
+  text = _safe(spec.text, null);
+  mr = spec.mr;
+  doFindOne = param('findOne', false);
+  doCount = param('count', false);
+  doExplain = param('explain', false);
+  doEstimate = param('estimate', false);
+  readOpts = _readOptions('query', param('eventual', false));
+  opts = {};
+  skip = param('skip', null);
+  limit = param('limit', null);
+
+  if (_exists(spec.sort)) {
+    opts.sort = spec.sort;
+  }
+  if (_exists(skip)) {
+    opts.skip = parseInt(skip, 10);
+  }
+  if (_exists(readOpts.readPreference)) {
+    opts.readPreference = readOpts.readPreference;
+  }
+  if (_exists(limit)) {
+    opts.limit = parseInt(limit, 10);
+  }
+
+  fail = function (err) {
+    console.error(err);
+    return cb(err);
+  };
+  send = function (results) {
+    _encodeDkObj(results);
+
+    return cb(null, results);
+  };
+  deliver = function (results) {
+    // Resolve all included references concurrently
+    var tasks = [];
+    results.forEach(function (result) {
+      refIncl.forEach(function (field) {
+        tasks.push(function (cb) {
+          var dbRef = result[field];
+          try {
+            _db.dereference(dbRef, function (err, resolved) {
+              if (!err && _def(resolved)) {
+                // mark the entity, so clients can map it to an instance
+                resolved['dk:entity'] = dbRef.namespace;
+                result[field] = resolved;
+              }
+              cb(null);
+            });
+          } catch (refErr) {
+            // stub, could not resolve reference
+            cb(null);
+          }
+        });
+      });
+    });
+    _parallel(tasks, function () {
+      _sumShards(entity, results, fieldInclExcl, function (err) {
+        if (err) {
+          return fail(err);
+        }
+        send(results);
+      });
+    });
+  };
+
+  // Search fields need their index before the first query
+  missing = _safe(spec.indexed, []).filter(function (f) {
+    return !_fieldIndexes[entity + '.' + f];
+  });
+  if (missing.length > 0) {
+    return _parallel(missing.map(function (f) {
+      return function (cb) {
+        _ensureFieldIndex(entity, f, cb);
+      };
+    }), function (err) {
+      if (err) {
+        return fail(err);
+      }
+      _query(param, spec, cb);
+    });
+  }
 
-    try {
-      // console.log('query', entity, '=>',
-      //             JSON.stringify(query),
-      //             JSON.stringify(fieldInclExcl),
-      //             JSON.stringify(opts));
-
-      collection = _db.collection.sync(_db, entity);
-
-      if (mr !== null) {
-        mrOpts = {
-          'query': query,
-          'out': {'inline': 1}
-        };
-        // if (_exists(opts.sort)) {
-        //   mrOpts.sort = opts.sort;
-        // }
-        if (_exists(opts.limit)) {
-          mrOpts.limit = opts.limit;
-        }
-        if (_exists(mr.context)) {
-          mrOpts.scope = mr.context;
-        }
-        if (_exists(mr.finalize)) {
-          mrOpts.finalize = mr.finalize;
-        }
-        results = collection.mapReduce.sync(
-          collection,
-          mr.map,
-          mr.reduce,
-          mrOpts
-        );
-      } else {
-        if (doFindOne) {
-          opts.limit = 1;
-        }
-        if (fieldInclExcl !== null) {
-          cursor = collection.find.sync(collection, query, fieldInclExcl, opts);
-        } else {
-          cursor = collection.find.sync(collection, query, opts);
-        }
-
-        if (doCount) {
-          results = cursor.count.sync(cursor);
+  // console.log('query', entity, '=>',
+  //             JSON.stringify(query),
+  //             JSON.stringify(fieldInclExcl),
+  //             JSON.stringify(opts));
+
+  _collection(entity, function (err, collection) {
+    var mrOpts, start, found, counted, counterKey, fetchOpts;
+    if (err) {
+      return fail(err);
+    }
+    if (mr !== null) {
+      mrOpts = {
+        'query': query,
+        'out': {'inline': 1}
+      };
+      // if (_exists(opts.sort)) {
+      //   mrOpts.sort = opts.sort;
+      // }
+      if (_exists(opts.limit)) {
+        mrOpts.limit = opts.limit;
+      }
+      if (_exists(mr.context)) {
+        mrOpts.scope = mr.context;
+      }
+      if (_exists(mr.finalize)) {
+        mrOpts.finalize = mr.finalize;
+      }
+      if (_exists(opts.readPreference)) {
+        mrOpts.readPreference = opts.readPreference;
+      }
+      return collection.mapReduce(mr.map, mr.reduce, mrOpts, function (err, results) {
+        if (err) {
+          return fail(err);
+        }
+        send(results);
+      });
+    }
+    if (doCount && !doExplain && !doFindOne && !_exists(opts.skip) && !_exists(opts.limit)) {
+      counted = function (err, n) {
+        if (err) {
+          return fail(err);
+        }
+        send(n);
+      };
+      counterKey = _counterKey(entity, query);
+      if (counterKey !== null) {
+        return _readCounter(collection, counterKey, query, counted);
+      }
+      if (doEstimate) {
+        return _estimateCount(collection, query, counted);
+      }
+    }
+    if (doFindOne) {
+      opts.limit = 1;
+    }
+    start = Date.now();
+    if (text !== null && !doCount && !doExplain && !_exists(opts.sort)) {
+      // Text searches are ordered by relevance, unless sorted otherwise
+      opts.limit = _safe(opts.limit, _conf.textSearchLimit);
+      return _rankText(collection, query, text, opts, function (err, ids) {
+        if (err) {
+          return fail(err);
+        }
+        fetchOpts = {};
+        if (_exists(opts.readPreference)) {
+          fetchOpts.readPreference = opts.readPreference;
+        }
+        found = function (err, cursor) {
+          if (err) {
+            return fail(err);
+          }
+          cursor.toArray(function (err, docs) {
+            var byId;
+            if (err) {
+              return fail(err);
+            }
+            _checkSlowQuery(collection, entity, query, opts, Date.now() - start, docs.length);
+            byId = {};
+            docs.forEach(function (doc) {
+              byId[String(doc._id)] = doc;
+            });
+            deliver(ids.map(function (id) {
+              return byId[String(id)];
+            }).filter(_exists));
+          });
+        };
+        if (fieldInclExcl !== null) {
+          collection.find({'_id': {'$in': ids}}, fieldInclExcl, fetchOpts, found);
         } else {
-          results = cursor.toArray.sync(cursor);
-          resultCount = Object.keys(results).length;
-
-          if (resultCount > 1000) {
-            console.log(_c.yellow + 'warning: query',
-                        entity,
-                        '->',
-                        query,
-                        'returned',
-                        resultCount,
-                        'results, may impact server performance negatively. try to optimize the query!',
-                        _c.reset);
+          collection.find({'_id': {'$in': ids}}, fetchOpts, found);
+        }
+      });
+    }
+    found = function (err, cursor) {
+      if (err) {
+        return fail(err);
+      }
+      if (doExplain) {
+        return cursor.explain(function (err, plan) {
+          if (err) {
+            return fail(err);
+          }
+          cb(null, _explainResult(plan));
+        });
+      }
+      if (doCount) {
+        return cursor.count(function (err, results) {
+          if (err) {
+            return fail(err);
+          }
+          _checkSlowQuery(collection, entity, query, opts, Date.now() - start, results);
+          send(results);
+        });
+      }
+      cursor.toArray(function (err, results) {
+        var resultCount;
+        if (err) {
+          return fail(err);
+        }
+        resultCount = Object.keys(results).length;
+        _checkSlowQuery(collection, entity, query, opts, Date.now() - start, resultCount);
+
+        if (resultCount > 1000) {
+          console.log(_c.yellow + 'warning: query',
+                      entity,
+                      '->',
+                      query,
+                      'returned',
+                      resultCount,
+                      'results, may impact server performance negatively. try to optimize the query!',
+                      _c.reset);
+        }
+        deliver(results);
+      });
+    };
+    if (fieldInclExcl !== null) {
+      collection.find(query, fieldInclExcl, opts, found);
+    } else {
+      collection.find(query, opts, found);
+    }
+  });
+};
+var _SNAPSHOT_MAGIC = 'DKSNAP01';
+var _SNAPSHOT_HEADER_SIZE = 32;
+var _SNAPSHOT_ENTRY_SIZE = 16;
+var _SNAPSHOT_TRANSPORT_KEYS = ['findOne', 'count', 'explain', 'estimate', 'eventual'];
+var _snapshotNumber = function (n) {
+  // Formats like printf %.17g, so clients can build the same query keys
+  var m, sign, digits, exp, frac;
+  if (!isFinite(n)) {
+    return 'null';
+  }
+  if (n === Math.floor(n) && Math.abs(n) < 9007199254740992) {
+    return String(n);
+  }
+  m = /^(-?)(\d)\.(\d+)e([+\-]\d+)$/.exec(n.toExponential(16));
+  sign = m[1];
+  digits = (m[2] + m[3]).replace(/0+$/, '');
+  exp = parseInt(m[4], 10);
+  if (exp < -4 || exp >= 17) {
+    frac = digits.substr(1);
+    return sign + digits.charAt(0) + (frac.length > 0 ? '.' + frac : '') +
+      'e' + (exp < 0 ? '-' : '+') + (Math.abs(exp) < 10 ? '0' : '') + Math.abs(exp);
+  }
+  if (exp < 0) {
+    return sign + '0.' + '0'.repeat(-exp - 1) + digits;
+  }
+  if (digits.length <= exp + 1) {
+    return sign + digits + '0'.repeat(exp + 1 - digits.length);
+  }
+  return sign + digits.substr(0, exp + 1) + '.' + digits.substr(exp + 1);
+};
+var _canonicalJSON = function (o) {
+  // JSON with sorted keys, used as the lookup key of snapshot queries
+  var keys;
+  if (o === null || o === undefined) {
+    return 'null';
+  }
+  if (typeof o === 'number') {
+    return _snapshotNumber(o);
+  }
+  if (typeof o === 'boolean' || typeof o === 'string') {
+    return JSON.stringify(o);
+  }
+  if (Array.isArray(o)) {
+    return '[' + o.map(_canonicalJSON).join(',') + ']';
+  }
+  keys = Object.keys(o).sort();
+  return '{' + keys.map(function (key) {
+    return JSON.stringify(key) + ':' + _canonicalJSON(o[key]);
+  }).join(',') + '}';
+};
+var _snapshotKey = function (spec) {
+  var copy = {};
+  Object.keys(spec).forEach(function (key) {
+    if (_SNAPSHOT_TRANSPORT_KEYS.indexOf(key) < 0) {
+      copy[key] = spec[key];
+    }
+  });
+  return _canonicalJSON(copy);
+};
+var _runQuery = function (param, cb) {
+  // Runs a query request, used by the query route and for snapshots
+  var prep, entity, query, or, and, text, indexed;
+  prep = param('prep', null);
+  if (_exists(prep)) {
+    return _loadPrepared(prep, function (err, plan) {
+      var params, bound;
+      if (err) {
+        return cb(err);
+      }
+      params = param('params', {});
+      indexed = [];
+      try {
+        bound = _bindTemplate(plan.q, _isPlainObject(params) ? params : {}, false);
+        _rewriteCaseInsensitive(plan.entity, bound, indexed);
+        text = _textParam(plan.entity, bound, param('text', null));
+      } catch (e) {
+        return cb(_invalidParams(e.message));
+      }
+      if (text !== null) {
+        indexed.push(text.field);
+      }
+      _query(param, {
+        'entity': plan.entity,
+        'query': bound,
+        'sort': plan.sort,
+        'refIncl': plan.refIncl,
+        'fieldInclExcl': plan.fieldInclExcl,
+        'text': text,
+        'indexed': indexed,
+        'mr': null
+      }, cb);
+    });
+  }
+  entity = param('entity', null);
+  if (!_exists(entity)) {
+    return cb(_invalidParams('Missing entity name'));
+  }
+  query = param('q', {});
+  or = param('or', null);
+  and = param('and', null);
+
+  if (_exists(or)) {
+    query.$or = or;
+  }
+  if (_exists(and)) {
+    query.$and = and;
+  }
+
+  // replace oid strings with oid objects
+  _traverse(query, function (key, value) {
+    if (key === '_id') {
+      this[key] = _toObjectIds(value);
+    }
+  });
+  indexed = [];
+  try {
+    _rewriteCaseInsensitive(entity, query, indexed);
+    text = _textParam(entity, query, param('text', null));
+  } catch (e) {
+    return cb(_invalidParams(e.message));
+  }
+  if (text !== null) {
+    indexed.push(text.field);
+  }
+
+  _query(param, {
+    'entity': entity,
+    'query': query,
+    'sort': _sortOptions(param('sort', null)),
+    'refIncl': param('refIncl', []),
+    'fieldInclExcl': param('fieldInEx', null),
+    'text': text,
+    'indexed': indexed,
+    'mr': param('mr', null)
+  }, cb);
+};
+var _pruneSnapshots = function (set, cb) {
+  // Stored snapshots are recorded by query set, older ones than the
+  // newest snapshotsKept are deleted
+  _collection(_DKDB.SNAPSHOTS, function (err, col) {
+    if (err) {
+      return cb(err);
+    }
+    col.find({'set': set}, {'sort': [['created', -1]], 'skip': _conf.snapshotsKept}, function (err, cursor) {
+      if (err) {
+        return cb(err);
+      }
+      cursor.toArray(function (err, docs) {
+        if (err) {
+          return cb(err);
+        }
+        _parallel(docs.map(function (doc) {
+          return function (cb) {
+            mongo.GridStore.unlink(_db, doc._id, function (err) {
+              if (err) {
+                return cb(err);
+              }
+              col.remove({'_id': doc._id}, {'safe': true}, cb);
+            });
+          };
+        }), cb);
+      });
+    });
+  });
+};
+var _compareBytes = function (a, b) {
+  var i, n;
+  n = Math.min(a.length, b.length);
+  for (i = 0; i < n; i += 1) {
+    if (a[i] !== b[i]) {
+      return a[i] - b[i];
+    }
+  }
+  return a.length - b.length;
+};
+var _encodeSnapshot = function (created, objects, queries) {
+  // Layout (little endian):
+  //   header   magic, creation date (double), object count, query count,
+  //            object index offset, query index offset
+  //   indexes  16 byte entries sorted by key bytes, objects are
+  //            (key offset, key length, JSON offset, JSON length), queries
+  //            are (key offset, key length, list offset, object count)
+  //   lists    uint32 object index per query result, in result order
+  //   heap     keys and object JSON
+  var objs, qs, positions, listOffset, heapOffset, size, buf, off;
+  objs = Object.keys(objects).map(function (key) {
+    return {'key': key, 'bytes': new Buffer(key), 'data': new Buffer(objects[key])};
+  }).sort(function (a, b) {
+    return _compareBytes(a.bytes, b.bytes);
+  });
+  qs = Object.keys(queries).map(function (key) {
+    return {'bytes': new Buffer(key), 'list': queries[key]};
+  }).sort(function (a, b) {
+    return _compareBytes(a.bytes, b.bytes);
+  });
+  positions = {};
+  objs.forEach(function (o, i) {
+    positions[o.key] = i;
+  });
+  listOffset = _SNAPSHOT_HEADER_SIZE + _SNAPSHOT_ENTRY_SIZE * (objs.length + qs.length);
+  heapOffset = listOffset;
+  size = 0;
+  qs.forEach(function (q) {
+    heapOffset += 4 * q.list.length;
+    size += q.bytes.length;
+  });
+  objs.forEach(function (o) {
+    size += o.bytes.length + o.data.length;
+  });
+  buf = new Buffer(heapOffset + size);
+  buf.write(_SNAPSHOT_MAGIC, 0, 'ascii');
+  buf.writeDoubleLE(created, 8);
+  buf.writeUInt32LE(objs.length, 16);
+  buf.writeUInt32LE(qs.length, 20);
+  buf.writeUInt32LE(_SNAPSHOT_HEADER_SIZE, 24);
+  buf.writeUInt32LE(_SNAPSHOT_HEADER_SIZE + _SNAPSHOT_ENTRY_SIZE * objs.length, 28);
+  off = _SNAPSHOT_HEADER_SIZE;
+  objs.forEach(function (o) {
+    buf.writeUInt32LE(heapOffset, off);
+    buf.writeUInt32LE(o.bytes.length, off + 4);
+    o.bytes.copy(buf, heapOffset);
+    heapOffset += o.bytes.length;
+    buf.writeUInt32LE(heapOffset, off + 8);
+    buf.writeUInt32LE(o.data.length, off + 12);
+    o.data.copy(buf, heapOffset);
+    heapOffset += o.data.length;
+    off += _SNAPSHOT_ENTRY_SIZE;
+  });
+  qs.forEach(function (q) {
+    buf.writeUInt32LE(heapOffset, off);
+    buf.writeUInt32LE(q.bytes.length, off + 4);
+    q.bytes.copy(buf, heapOffset);
+    heapOffset += q.bytes.length;
+    buf.writeUInt32LE(listOffset, off + 8);
+    buf.writeUInt32LE(q.list.length, off + 12);
+    q.list.forEach(function (key) {
+      buf.writeUInt32LE(positions[key], listOffset);
+      listOffset += 4;
+    });
+    off += _SNAPSHOT_ENTRY_SIZE;
+  });
+  return buf;
+};
+var _buildSnapshot = function (specs, cb) {
+  var created, objects, queries, size, tasks;
+  // Changes after the creation date are merged in by the client
+  created = Date.now() / 1000;
+  objects = {};
+  queries = {};
+  size = 0;
+  tasks = specs.map(function (spec) {
+    return function (cb) {
+      var key, variant, params;
+      if (!_isPlainObject(spec) || typeof spec.entity !== 'string' || _exists(spec.prep) || _exists(spec.mr)) {
+        return cb(_invalidParams('Snapshot queries need an entity and cannot be prepared or map reduce'));
+      }
+      key = _snapshotKey(spec);
+      if (queries.hasOwnProperty(key)) {
+        return cb(null);
+      }
+
+      // Id lookups only use full objects, projected objects and objects
+      // with included references are stored under their own key
+      variant = '';
+      if (_exists(spec.fieldInEx) || _exists(spec.refIncl)) {
+        variant = '\u0000' + _canonicalJSON([_safe(spec.fieldInEx, null), _safe(spec.refIncl, null)]);
+      }
+      params = JSON.parse(key);
+      _runQuery(function (key, d) {
+        return params.hasOwnProperty(key) ? params[key] : d;
+      }, function (err, docs) {
+        if (err) {
+          return cb(err);
+        }
+        if (!Array.isArray(docs)) {
+          return cb(_invalidParams('Snapshot query did not return an object list'));
+        }
+        queries[key] = docs.map(function (doc) {
+          var objKey = spec.entity + '\u0000' + String(doc._id) + variant;
+          if (!objects.hasOwnProperty(objKey)) {
+            objects[objKey] = JSON.stringify(doc);
+            size += Buffer.byteLength(objects[objKey]);
+          }
+          return objKey;
+        });
+        if (size > _conf.maxSnapshotSize) {
+          return cb(_invalidParams('Snapshot exceeds maxSnapshotSize'));
+        }
+        cb(null);
+      });
+    };
+  });
+  _series(tasks, function (err) {
+    if (err) {
+      return cb(err);
+    }
+    cb(null, _encodeSnapshot(created, objects, queries));
+  });
+};
+// prototypes
+String.prototype.repeat = function (num) {
+  var a = [];
+  a.length = parseInt(num, 10) + 1;
+  return a.join(this);
+};
+// exported functions
+exports.run = function (c) {
+  var pad, nl, buf, srv, parse, workers;
+  pad = '-'.repeat(80);
+  nl = '\n';
+  if (!cluster.isWorker) {
+    console.log(nl + pad + nl + 'DATAKIT' + nl + pad);
+  }
+  _conf.mongoURI = _safe(c.mongoURI, 'mongodb://localhost:27017/datakit');
+  _conf.path = _safe(c.path, '');
+  _conf.port = _safe(c.port, process.env.PORT || 3000);
+  _conf.secret = _safe(c.secret, null);
+  _conf.salt = _safe(c.salt, "datakit");
+  _conf.allowDestroy = _safe(c.allowDestroy, false);
+  _conf.allowDrop = _safe(c.allowDrop, false);
+  _conf.cert = _safe(c.cert, null);
+  _conf.key = _safe(c.key, null);
+  _conf.express = _safe(c.express, function (app) {});
+  _conf.changesPageSize = _safe(c.changesPageSize, 100);
+  _conf.tombstoneTtl = _safe(c.tombstoneTtl, 30 * 24 * 3600);
+  _conf.publicMetrics = _safe(c.publicMetrics, false);
+  _conf.slowQueryMs = _safe(c.slowQueryMs, null);
+  _conf.slowQueryLog = _safe(c.slowQueryLog, null);
+  _conf.mongoPoolSize = _safe(c.mongoPoolSize, 5);
+  _conf.mongoKeepAlive = _safe(c.mongoKeepAlive, 0);
+  _conf.mongoConnectTimeoutMS = _safe(c.mongoConnectTimeoutMS, 0);
+  _conf.mongoSocketTimeoutMS = _safe(c.mongoSocketTimeoutMS, 0);
+  _conf.readPreference = _safe(c.readPreference, {});
+  _conf.eventualReadPreference = _safe(c.eventualReadPreference, 'secondaryPreferred');
+  _conf.compress = _safe(c.compress, true);
+  _conf.compressionThreshold = _safe(c.compressionThreshold, 1024);
+  _conf.streamBatchSize = _safe(c.streamBatchSize, 100);
+  _conf.maxEntitySize = _safe(c.maxEntitySize, 16 * 1024 * 1024);
+  _conf.countedFields = _safe(c.countedFields, {});
+  _conf.countSampleSize = _safe(c.countSampleSize, 1000);
+  _conf.counterRecountMs = _safe(c.counterRecountMs, 3600000);
+  _conf.preparedCacheSize = _safe(c.preparedCacheSize, 1000);
+  _conf.textFields = _safe(c.textFields, {});
+  _conf.textSearchLimit = _safe(c.textSearchLimit, 100);
+  _conf.normalizedFields = _safe(c.normalizedFields, {});
+  _conf.shardedCounters = _safe(c.shardedCounters, {});
+  _conf.shardedCounterCacheMs = _safe(c.shardedCounterCacheMs, 0);
+  _conf.maxSnapshotSize = _safe(c.maxSnapshotSize, 64 * 1024 * 1024);
+  _conf.snapshotsKept = _safe(c.snapshotsKept, 3);
+
+  // Zero workers uses one worker per core
+  workers = parseInt(_safe(c.workers, 1), 10);
+  _conf.workers = (workers > 0) ? workers : os.cpus().length;
+
+  if (_exists(_conf.cert) && _exists(_conf.key)) {
+    app = express.createServer({
+      'key': fs.readFileSync(_conf.key),
+      'cert': fs.readFileSync(_conf.cert)
+    });
+  } else {
+    app = express.createServer();
+  }
+
+  // Install metrics collection before anything else touches the request
+  _instrumentMongo();
+  app.use(_metricsMiddleware);
+  app.use(_compressionMiddleware);
+  app.use(_streamedBodyMiddleware);
+  if (_exists(_conf.slowQueryLog)) {
+    _slowQueryLog = fs.createWriteStream(_conf.slowQueryLog, {'flags': 'a'});
+  }
+
+  // Install the body parser
+  parse = express.bodyParser();
+  app.use(parse);
+
+  if (_conf.secret === null) {
+    buf = crypto.randomBytes(32);
+    _conf.secret = buf.toString('hex');
+    console.log(_c.red + 'WARN:\tNo secret found in config, generated new one.\n',
+                '\tCopy this secret to your DataKit iOS app and server config!\n\n',
+                _c.yellow,
+                '\t' + _conf.secret, nl, nl,
+                _c.red,
+                '\tTerminating process.',
+                _c.reset);
+    process.exit(1);
+  }
+  if (_conf.secret.length !== 64) {
+    console.log(_c.red, '\nSecret is not a hex string of length 64 (256 bytes), terminating process.\n', _c.reset);
+    process.exit(2);
+  }
+
+  if (!cluster.isWorker) {
+    console.log('CONF:', JSON.stringify(_conf, undefined, 2), nl);
+  }
+
+  // The master only supervises the workers, which share the port
+  if (_conf.workers > 1 && cluster.isMaster) {
+    return _runMaster();
+  }
+  if (_isClustered()) {
+    _installWorkerMessaging();
+  }
+
+  // Create API routes
+  _createRoutes(_conf.path);
+  _conf.express(app);
+
+  // Connect to DB and run
+  _series([
+    function (cb) {
+      mongo.Db.connect(_conf.mongoURI, _connectOptions(), function (err, db) {
+        _db = db;
+        cb(err);
+      });
+    },
+    _ensureSystemIndexes
+  ], function (err) {
+    if (err) {
+      return console.error(err);
+    }
+    app.listen(_conf.port, function appListen() {
+      console.log(_c.green + 'DataKit started on port', _conf.port, cluster.isWorker ? '(worker ' + process.pid + ')' : '', _c.reset);
+    });
+    _backfillNormalized(function (err) {
+      if (err) {
+        console.error('error: could not add normalized copies (', err, ')');
+      }
+    });
+  });
+};
+exports.info = function (req, res) {
+  res.send('datakit', 200);
+};
+exports.metrics = function (req, res) {
+  var send = function (snap) {
+    res.header('Content-Type', 'text/plain; version=0.0.4');
+    res.send(_prometheusText(snap), 200);
+  };
+  if (_isClustered()) {
+    return _collectClusterMetrics(send);
+  }
+  send(_metricsSnapshot());
+};
+exports.getPublishedObject = function (req, res) {
+  var key, notFound, readOpts;
+  key = req.param('key', null);
+  readOpts = _readOptions('public');
+  if (!_exists(key)) {
+    return res.send(404);
+  }
+  notFound = function (err) {
+    if (_exists(err)) {
+      console.error(err);
+    }
+    return res.send(404);
+  };
+  _collection(_DKDB.PUBLIC_OBJECTS, function (err, col) {
+    if (err) {
+      return notFound(err);
+    }
+    col.findOne({'_id': key}, readOpts, function (err, result) {
+      var oid, fields;
+      if (err || !_exists(result)) {
+        return notFound(err);
+      }
+      if (result.isFile) {
+        return _streamFileFromGridFS(req, res, result.q, readOpts);
+      }
+      try {
+        oid = new mongo.ObjectID(result.q.oid);
+      } catch (e) {
+        return notFound(e);
+      }
+      fields = result.q.fields;
+      _collection(result.q.entity, function (err, col) {
+        if (err) {
+          return notFound(err);
+        }
+        col.findOne({'_id': oid}, fields, readOpts, function (err, result) {
+          if (err || !_exists(result)) {
+            return notFound(err);
+          }
+          if (fields.length === 1) {
+            return res.send(result[fields[0]], 200);
+          }
+          return res.json(result, 200);
+        });
+      });
+    });
+  });
+};
+exports.publishObject = function (req, res) {
+  var entity, fn, isFile, oid, q, fields, query, idf, signature, shasum, key;
+  entity = req.param('entity', null);
+  oid = req.param('oid', null);
+  fn = req.param('fileName', null);
+  idf = null;
+  isFile = false;
+  if (_exists(fn)) {
+    idf = "file:" + fn;
+    isFile = true;
+  } else if (_exists(entity) && _exists(oid)) {
+    fields = req.param('fields', null);
+    query = {
+      'entity': entity,
+      'oid': oid,
+      'fields': []
+    };
+    if (fields !== null && fields.length > 0) {
+      query.fields = fields;
+    }
+    idf = JSON.stringify(query);
+  } else {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+
+  // Compute key
+  signature = _conf.secret + _conf.salt + idf;
+  shasum = crypto.createHash('sha256');
+  shasum.update(signature);
+  key = shasum.digest('hex');
+
+  q = isFile ? fn : query;
+  _collection(_DKDB.PUBLIC_OBJECTS, function (err, col) {
+    if (err) {
+      console.error(err);
+      return _e(res, _ERR.OPERATION_FAILED, err);
+    }
+    col.update({'_id': key}, {'$set': {'q': q, 'isFile': isFile}}, {'safe': true, 'upsert': true}, function (err) {
+      if (err) {
+        console.error(err);
+        return _e(res, _ERR.OPERATION_FAILED, err);
+      }
+      return res.json({'key': key}, 200);
+    });
+  });
+};
+exports.saveObject = function (req, res) {
+  var results, count, partial;
+  results = [];
+  count = 0;
+  partial = req.param('partial', false);
+
+  // Entities are written in batches while the body is still arriving,
+  // batches are written one after another
+  _streamArray(req, _conf.streamBatchSize, function (entities, cb) {
+    var ops, i;
+    ops = [];
+    for (i = 0; i < entities.length; i += 1) {
+      try {
+        ops.push(_saveOperation(entities[i], count));
+      } catch (e) {
+        if (!partial) {
+          return cb(e);
+        }
+        results[count] = {'dk:error': _errorObject(_safe(e.dkError, _ERR.OPERATION_FAILED), e)};
+      }
+      count += 1;
+    }
+    _saveBatch(ops, results, partial, cb);
+  }, function (err) {
+    if (err) {
+      return _e(res, _safe(err.dkError, _ERR.OPERATION_FAILED), err);
+    }
+    res.json(results, 200);
+  });
+};
+exports.importObjects = function (req, res) {
+  var entity, imported, progress;
+  entity = req.param('entity', null);
+  if (!_exists(entity)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  imported = 0;
+
+  // With progress the response is a NDJSON line per written batch
+  progress = req.param('progress', false);
+  if (progress) {
+    res.header('Content-Type', 'application/x-ndjson');
+    res.writeHead(200);
+  }
+
+  // Only the number of imported objects is returned, so memory stays
+  // bounded by the batch size
+  _streamArray(req, _conf.streamBatchSize, function (docs, cb) {
+    var i, doc;
+    for (i = 0; i < docs.length; i += 1) {
+      doc = docs[i];
+      _decodeDkObj(doc);
+      if (typeof doc._id === 'string') {
+        try {
+          doc._id = new mongo.ObjectID(doc._id);
+        } catch (e) {
+          return cb(_invalidParams('Invalid object id'));
+        }
+      }
+    }
+    _reserveSequenceNumbers(entity, docs.length, function (err, first) {
+      var ts;
+      if (err) {
+        return cb(err);
+      }
+      ts = _timestamp();
+      docs.forEach(function (d, n) {
+        d._updated = ts;
+        d._seq = first + n;
+        _addKeywords(entity, d);
+        _addNormalized(entity, d);
+      });
+      _collection(entity, function (err, collection) {
+        if (err) {
+          return cb(err);
+        }
+        _beginCountedWrite(entity, function (err) {
+          if (err) {
+            return cb(err);
+          }
+          collection.insert(docs, {'safe': true}, function (err) {
+            var count, query;
+            count = function (written, insertErr) {
+              imported += written.length;
+              _adjustCounters(entity, written.map(function (d) {
+                return {'delta': 1, 'after': d};
+              }), function (err) {
+                _endCountedWrite(entity, function () {
+                  if (insertErr) {
+                    return cb(insertErr);
+                  }
+                  if (!err && progress) {
+                    res.write(JSON.stringify({'imported': imported}) + '\n');
+                  }
+                  cb(err);
+                });
+              });
+            };
+            if (!err) {
+              return count(docs, null);
+            }
+
+            // The insert stops at the first object that fails, the objects
+            // before it were written and are counted. They are the ones with
+            // the sequence numbers reserved for this batch.
+            query = {
+              '_id': {'$in': docs.map(function (d) {
+                return d._id;
+              }).filter(_exists)},
+              '_seq': {'$gte': first, '$lt': first + docs.length}
+            };
+            collection.find(query, {'_seq': 1}, function (e, cursor) {
+              var unknown = function () {
+                // The counters are seeded again if the written objects
+                // are not known
+                _removeCounters(entity, function () {
+                  count([], err);
+                });
+              };
+              if (e) {
+                return unknown();
+              }
+              cursor.toArray(function (e, found) {
+                var seqs;
+                if (e) {
+                  return unknown();
+                }
+                seqs = found.map(function (f) {
+                  return f._seq;
+                });
+                count(docs.filter(function (d) {
+                  return seqs.indexOf(d._seq) >= 0;
+                }), err);
+              });
+            });
+          });
+        });
+      });
+    });
+  }, function (err) {
+    var snm;
+    if (err) {
+      snm = _safe(err.dkError, _ERR.OPERATION_FAILED);
+      if (progress) {
+        return res.end(JSON.stringify({'dk:error': _errorObject(snm, err), 'imported': imported}) + '\n');
+      }
+      return _e(res, snm, err);
+    }
+    if (progress) {
+      return res.end(JSON.stringify({'imported': imported, 'done': true}) + '\n');
+    }
+    res.json({'imported': imported}, 200);
+  });
+};
+exports.exportObjects = function (req, res) {
+  var entity, query, after, readOpts, opts, closed;
+  entity = req.param('entity', null);
+  if (!_exists(entity)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  query = req.param('q', {});
+  after = req.param('after', null);
+  readOpts = _readOptions('export', req.param('eventual', false));
+  closed = false;
+  try {
+    _traverse(query, function (key, value) {
+      if (key === '_id') {
+        this[key] = _toObjectIds(value);
+      }
+    });
+
+    // Objects are written in id order, so an interrupted export can be
+    // resumed after the last written id
+    if (_exists(after)) {
+      query = {'$and': [query, {'_id': {'$gt': new mongo.ObjectID(after)}}]};
+    }
+  } catch (e) {
+    return _e(res, _ERR.INVALID_PARAMS, e);
+  }
+  if (_filtersShardedField(entity, query)) {
+    return _e(res, _ERR.INVALID_PARAMS, new Error('Exports cannot filter on sharded counter fields'));
+  }
+  opts = {'sort': [['_id', 'asc']]};
+  if (_exists(readOpts.readPreference)) {
+    opts.readPreference = readOpts.readPreference;
+  }
+  req.on('close', function () {
+    closed = true;
+  });
+  _collection(entity, function (err, collection) {
+    if (err) {
+      return _e(res, _ERR.OPERATION_FAILED, err);
+    }
+    collection.find(query, opts, function (err, cursor) {
+      var next, read, write, fail;
+      if (err) {
+        return _e(res, _ERR.OPERATION_FAILED, err);
+      }
+      res.header('Content-Type', 'application/x-ndjson');
+      res.writeHead(200);
+      fail = function (err) {
+        console.error(err);
+        res.end(JSON.stringify({'dk:error': _errorObject(_ERR.OPERATION_FAILED, err)}) + '\n');
+      };
+
+      // A page of streamBatchSize objects is held at a time, so shard
+      // sums are loaded with one query per page. The cursor is only
+      // advanced while the response accepts more data.
+      read = function (page, cb) {
+        if (page.length >= _conf.streamBatchSize) {
+          return cb(null, page, false);
+        }
+        cursor.nextObject(function (err, doc) {
+          if (err) {
+            return cb(err);
+          }
+          if (doc === null) {
+            return cb(null, page, true);
+          }
+          page.push(doc);
+          read(page, cb);
+        });
+      };
+      write = function (page, done) {
+        var doc;
+        if (closed) {
+          return cursor.close();
+        }
+        if (page.length === 0) {
+          return done ? res.end() : process.nextTick(next);
+        }
+        doc = page.shift();
+        _encodeDkObj(doc);
+        if (res.write(JSON.stringify(doc) + '\n')) {
+          return write(page, done);
+        }
+        res.once('drain', function () {
+          write(page, done);
+        });
+      };
+      next = function () {
+        if (closed) {
+          return cursor.close();
+        }
+        read([], function (err, page, done) {
+          if (err) {
+            return fail(err);
           }
 
-          for (i in results) {
-            if (results.hasOwnProperty(i)) {
-              for (j in refIncl) {
-                if (refIncl.hasOwnProperty(j)) {
-                  result = results[i];
-                  field = refIncl[j];
-                  dbRef = result[field];
-                  try {
-                    resolved = _db.dereference.sync(_db, dbRef);
-                    if (_def(resolved)) {
-                      result[field] = resolved;
-                    }
-                  } catch (refErr) {
-                    // stub, could not resolve reference
-                  }
-                }
-              }
+          // Exported sharded fields contain the sum of their shards, like
+          // objects returned by queries
+          _sumShards(entity, page, null, function (err) {
+            if (err) {
+              return fail(err);
+            }
+            write(page, done);
+          });
+        });
+      };
+      next();
+    });
+  });
+};
+exports.deleteObject = function (req, res) {
+  var entity, oidStr, oid, remove;
+  entity = req.param('entity', null);
+  oidStr = req.param('oid', null);
+  if (!_exists(entity)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  oid = _objectIdParam(req);
+  if (!_exists(oid)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+
+  remove = function (cb) {
+    _collection(entity, function (err, collection) {
+      var done;
+      if (err) {
+        return cb(err);
+      }
+      done = function (err, changes) {
+        _adjustCounters(entity, changes, function (adjustErr) {
+          _endCountedWrite(entity, function () {
+            cb(_exists(err) ? err : adjustErr, changes.length > 0);
+          });
+        });
+      };
+      _beginCountedWrite(entity, function (err) {
+        if (err) {
+          return cb(err);
+        }
+        if (_countedFields(entity).length === 0) {
+          return collection.remove({'_id': oid}, {'safe': true}, function (err, removed) {
+            if (err || !removed) {
+              return done(err, []);
             }
+            done(null, [{'delta': -removed}]);
+          });
+        }
+
+        // Per value counters need the values of the removed object
+        collection.findAndRemove({'_id': oid}, [], function (err, doc) {
+          if (err || !_exists(doc)) {
+            return done(err, []);
           }
+          done(null, [{'delta': -1, 'before': doc}]);
+        });
+      });
+    });
+  };
+
+  // The tombstone is only written once the object is gone, so deleting a
+  // missing object doesn't report a deletion
+  remove(function (err, removed) {
+    if (err) {
+      console.error(err);
+      return _e(res, _ERR.OPERATION_FAILED, err);
+    }
+    _parallel([
+      function (cb) {
+        if (!removed) {
+          return cb(null);
+        }
+        _insertTombstone(entity, oidStr, cb);
+      },
+      function (cb) {
+        if (Object.keys(_shardedFields(entity)).length === 0) {
+          return cb(null);
         }
+        _collection(_DKDB.SHARDS, function (err, shards) {
+          if (err) {
+            return cb(err);
+          }
+          shards.remove({'entity': entity, 'oid': String(oid)}, {'safe': true}, cb);
+        });
+      }
+    ], function (err) {
+      if (err) {
+        console.error(err);
+        return _e(res, _ERR.OPERATION_FAILED, err);
+      }
+      res.send('', 200);
+    });
+  });
+};
+exports.refreshObject = function (req, res) {
+  var entity, oid, updated, fail, send, readOpts;
+  entity = req.param('entity', null);
+  updated = req.param('updated', null);
+  readOpts = _readOptions('refresh');
+  if (!_exists(entity)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  oid = _objectIdParam(req);
+  if (!_exists(oid)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  fail = function (err) {
+    console.error(err);
+    return _e(res, _ERR.OPERATION_FAILED, err);
+  };
+  send = function (result) {
+    if (!_exists(result)) {
+      return fail(new Error('Could not find object'));
+    }
+    _sumShards(entity, [result], null, function (err) {
+      if (err) {
+        return fail(err);
       }
 
-      _encodeDkObj(results);
+      _encodeDkObj(result);
 
-      return res.json(results, 200);
-    } catch (e) {
-      console.error(e);
-      return _e(res, _ERR.OPERATION_FAILED, e);
+      res.json(result, 200);
+    });
+  };
+  _collection(entity, function (err, collection) {
+    if (err) {
+      return fail(err);
+    }
+
+    // Sharded counters change without updating the object
+    if (!_exists(updated) || Object.keys(_shardedFields(entity)).length > 0) {
+      return collection.findOne({'_id': oid}, readOpts, function (err, result) {
+        if (err) {
+          return fail(err);
+        }
+        send(result);
+      });
     }
+
+    // Only transfer the object if it changed since the client's version
+    collection.findOne({'_id': oid, '_updated': {'$ne': updated}}, readOpts, function (err, result) {
+      if (err) {
+        return fail(err);
+      }
+      if (_exists(result)) {
+        return send(result);
+      }
+      collection.findOne({'_id': oid}, {'_id': 1}, readOpts, function (err, stub) {
+        if (err) {
+          return fail(err);
+        }
+        if (_exists(stub)) {
+          return res.json(_NOT_MODIFIED, 200);
+        }
+        send(null);
+      });
+    });
   });
 };
-exports.index = function (req, res) {
-  doSync(function indexSync() {
-    var entity, key, unique, drop, opts, collection, cursor;
-    entity = req.param('entity', null);
-    key = req.param('key', null);
-    unique = req.param('unique', false);
-    drop = req.param('drop', false);
-    if (!_exists(entity)) {
-      return _e(res, _ERR.INVALID_PARAMS);
+exports.prepare = function (req, res) {
+  var spec, specStr, id;
+  spec = {
+    'entity': req.param('entity', null),
+    'q': req.param('q', null),
+    'or': req.param('or', null),
+    'and': req.param('and', null),
+    'sort': req.param('sort', null),
+    'refIncl': req.param('refIncl', null),
+    'fieldInEx': req.param('fieldInEx', null)
+  };
+  specStr = JSON.stringify(spec);
+  id = crypto.createHash('sha256').update(specStr).digest('hex');
+  if (_prepared.hasOwnProperty(id)) {
+    return res.json({'id': id}, 200);
+  }
+  try {
+    _cachePrepared(id, _compilePrepared(JSON.parse(specStr)));
+  } catch (e) {
+    return _e(res, _ERR.INVALID_PARAMS, e);
+  }
+
+  // the spec is stored as string, its operators are not valid field names
+  _collection(_DKDB.PREPARED, function (err, col) {
+    if (err) {
+      console.error(err);
+      return _e(res, _ERR.OPERATION_FAILED, err);
+    }
+    col.update({'_id': id}, {'$set': {'spec': specStr}}, {'safe': true, 'upsert': true}, function (err) {
+      if (err) {
+        console.error(err);
+        return _e(res, _ERR.OPERATION_FAILED, err);
+      }
+      return res.json({'id': id}, 200);
+    });
+  });
+};
+exports.query = function (req, res) {
+  _runQuery(function (key, d) {
+    return req.param(key, d);
+  }, function (err, results) {
+    if (err) {
+      return _e(res, _safe(err.dkError, _ERR.OPERATION_FAILED), err);
     }
-    if (!_exists(key)) {
+    res.json(results, 200);
+  });
+};
+exports.changes = function (req, res) {
+  var entity, since, after, limit, sep, afterTs, afterOid, query, opts, tasks, expired;
+  entity = req.param('entity', null);
+  since = parseFloat(req.param('since', 0)) || 0;
+  after = req.param('after', null);
+  limit = parseInt(req.param('limit', _conf.changesPageSize), 10);
+  if (!_exists(entity)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  if (!(limit > 0)) {
+    limit = _conf.changesPageSize;
+  }
+
+  // Tombstones expire after tombstoneTtl seconds, clients that synced
+  // before that start over with all objects and a reset
+  expired = (since > 0 && _conf.tombstoneTtl > 0 && since < _timestamp() - _conf.tombstoneTtl);
+  if (expired) {
+    since = 0;
+  }
+
+  // Changes are paged by (_updated, _id), the 'after' token
+  // marks the last document of the previous page. Objects updated at
+  // exactly 'since' are returned again, merging them is idempotent.
+  query = {'_updated': {'$gte': since}};
+  if (_exists(after)) {
+    sep = String(after).indexOf(':');
+    if (sep < 0) {
       return _e(res, _ERR.INVALID_PARAMS);
     }
-    try {
-      opts = {
-        'safe': true,
-        'unique': unique,
-        'dropDups': drop
+    afterTs = parseFloat(after.substring(0, sep));
+    afterOid = new mongo.ObjectID(after.substring(sep + 1));
+    query = {'$or': [
+      {'_updated': {'$gt': afterTs}},
+      {'_updated': afterTs, '_id': {'$gt': afterOid}}
+    ]};
+  }
+  opts = {
+    'sort': [['_updated', 'asc'], ['_id', 'asc']],
+    'limit': limit + 1
+  };
+
+  _ensureChangeIndex(entity, function (err) {
+    var find;
+    if (err) {
+      console.error(err);
+      return _e(res, _ERR.OPERATION_FAILED, err);
+    }
+    find = function (name, query, opts) {
+      return function (cb) {
+        _collection(name, function (err, collection) {
+          if (err) {
+            return cb(err);
+          }
+          collection.find(query, opts, function (err, cursor) {
+            if (err) {
+              return cb(err);
+            }
+            cursor.toArray(cb);
+          });
+        });
       };
-      collection = _db.collection.sync(_db, entity);
-      cursor = collection.ensureIndex.sync(collection, {key: 1}, opts);
+    };
 
-      return res.send('', 200);
-    } catch (e) {
-      return _e(res, _ERR.OPERATION_FAILED, e);
+    // Deletions are only reported with the first page, they are
+    // fetched alongside the changed objects
+    tasks = [find(entity, query, opts)];
+    if (!_exists(after)) {
+      tasks.push(find(
+        _DKDB.TOMBSTONES,
+        {'entity': entity, '_updated': {'$gte': since}},
+        {'sort': [['_updated', 'asc']]}
+      ));
     }
+    _parallel(tasks, function (err, found) {
+      var results, more, last, tombs, deleted, reset, latest, i;
+      if (err) {
+        console.error(err);
+        return _e(res, _ERR.OPERATION_FAILED, err);
+      }
+      results = found[0];
+      more = (results.length > limit);
+      if (more) {
+        results.pop();
+      }
+      latest = since;
+      if (results.length > 0) {
+        last = results[results.length - 1];
+        latest = Math.max(latest, last._updated);
+      }
+
+      deleted = [];
+      reset = expired;
+      tombs = _safe(found[1], []);
+      for (i = 0; i < tombs.length; i += 1) {
+        if (tombs[i].oid === null) {
+          reset = true;
+          deleted = [];
+        } else {
+          deleted.push(tombs[i].oid);
+        }
+        latest = Math.max(latest, tombs[i]._updated);
+      }
+
+      _sumShards(entity, results, null, function (err) {
+        if (err) {
+          console.error(err);
+          return _e(res, _ERR.OPERATION_FAILED, err);
+        }
+
+        _encodeDkObj(results);
+
+        return res.json({
+          'results': results,
+          'deleted': deleted,
+          'reset': reset,
+          'since': latest,
+          'next': more ? (String(last._updated) + ':' + last._id.toHexString()) : null
+        }, 200);
+      });
+    });
   });
 };
-exports.destroy = function (req, res) {
-  doSync(function destroySync() {
-    if (!_conf.allowDestroy) {
-      return _e(res, _ERR.OPERATION_NOT_ALLOWED);
-    }
-    var entity, collection;
-    entity = req.param('entity', null);
-    if (!_exists(entity)) {
+exports.index = function (req, res) {
+  var entity, key, keys, spec, unique, drop, sparse, name, opts, i, dir;
+  entity = req.param('entity', null);
+  key = req.param('key', null);
+  keys = req.param('keys', null);
+  unique = req.param('unique', false);
+  drop = req.param('drop', false);
+  sparse = req.param('sparse', false);
+  name = req.param('name', null);
+  if (!_exists(entity)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+
+  // Keys are passed as ordered [key, direction] pairs, a single key
+  // creates an ascending index
+  if (!_exists(keys) && _exists(key)) {
+    keys = [[key, 1]];
+  }
+  if (!_exists(keys) || !Array.isArray(keys) || keys.length === 0) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  spec = [];
+  for (i = 0; i < keys.length; i += 1) {
+    if (!Array.isArray(keys[i]) || typeof keys[i][0] !== 'string') {
       return _e(res, _ERR.INVALID_PARAMS);
     }
-    try {
-      collection = _db.collection.sync(_db, entity);
-      collection.drop.sync(collection);
-
-      return res.send('', 200);
-    } catch (e) {
-      return _e(res, _ERR.OPERATION_FAILED, e);
+    dir = (parseInt(keys[i][1], 10) === -1) ? -1 : 1;
+    spec.push([keys[i][0], dir]);
+  }
+  opts = {
+    'safe': true,
+    'unique': unique,
+    'dropDups': drop,
+    'sparse': sparse
+  };
+  if (_exists(name)) {
+    opts.name = name;
+  }
+  _collection(entity, function (err, collection) {
+    if (err) {
+      return _e(res, _ERR.OPERATION_FAILED, err);
     }
+    collection.ensureIndex(spec, opts, function (err, indexName) {
+      if (err) {
+        return _e(res, _ERR.OPERATION_FAILED, err);
+      }
+      return res.json({'name': indexName}, 200);
+    });
   });
 };
-exports.drop = function (req, res) {
-  doSync(function dropSync() {
-    if (_conf.allowDrop) {
-      try {
-        _db.dropDatabase.sync(_db);
-        console.log("dropped database", _db.databaseName);
-        res.send('', 200);
-      } catch (e) {
-        console.error(e);
-        _e(res, _ERR.OPERATION_FAILED, e);
+exports.indexes = function (req, res) {
+  var entity;
+  entity = req.param('entity', null);
+  if (!_exists(entity)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  _collection(entity, function (err, collection) {
+    if (err) {
+      return _e(res, _ERR.OPERATION_FAILED, err);
+    }
+    collection.indexInformation({'full': true}, function (err, info) {
+      var results, i, index, keys, key;
+      if (err) {
+        return _e(res, _ERR.OPERATION_FAILED, err);
       }
-    } else {
-      _e(res, _ERR.OPERATION_NOT_ALLOWED);
+      results = [];
+      for (i = 0; i < info.length; i += 1) {
+        index = info[i];
+        keys = [];
+        for (key in index.key) {
+          if (index.key.hasOwnProperty(key)) {
+            keys.push([key, index.key[key]]);
+          }
+        }
+        results.push({
+          'name': index.name,
+          'keys': keys,
+          'unique': !!index.unique,
+          'sparse': !!index.sparse
+        });
+      }
+
+      return res.json(results, 200);
+    });
+  });
+};
+exports.dropIndex = function (req, res) {
+  var entity, name;
+  entity = req.param('entity', null);
+  name = req.param('name', null);
+  if (!_exists(entity) || !_exists(name)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  if (name === '_id_') {
+    return _e(res, _ERR.OPERATION_NOT_ALLOWED);
+  }
+  _collection(entity, function (err, collection) {
+    if (err) {
+      return _e(res, _ERR.OPERATION_FAILED, err);
     }
+    collection.dropIndex(name, function (err) {
+      if (err) {
+        return _e(res, _ERR.OPERATION_FAILED, err);
+      }
+      return res.send('', 200);
+    });
   });
 };
-exports.store = function (req, res) {
-  doSync(function storeSync() {
-    // Get filename and mode
-    var fileName, store, bufs, onEnd, onClose, onCancel, isClosing, pendingWrites, tick, gs, exists;
-    fileName = req.header('x-datakit-filename', null);
-
-    // Generate filename if neccessary, else check for conflict
-    if (fileName === null) {
-      fileName = uuid.v4();
-    }
-
-    store = null;
-    bufs = [];
-    onEnd = false;
-    onClose = false;
-    onCancel = false;
-    isClosing = false;
-    pendingWrites = 0;
-    tick = function (data) {
-      if (data && !(onClose || onCancel)) {
-        bufs.push(data);
-      }
-      if (pendingWrites <= 0 && bufs.length === 0 && (onClose || onEnd || onCancel)) {
-        if (!isClosing) {
-          isClosing = true;
-          store.close(function () {
-            if (onClose) {
-              console.log("connection closed, unlink file");
-              // Remove the file if stream was closed prematurely
-              mongo.GridStore.unlink(_db, fileName, function (err) {
-                res.send('', 400);
-              });
-            } else if (onEnd) {
-              res.writeHead(200, {
-                'x-datakit-assigned-filename': fileName
-              });
-              res.end();
-            }
-            store = null;
-          });
+exports.destroy = function (req, res) {
+  if (!_conf.allowDestroy) {
+    return _e(res, _ERR.OPERATION_NOT_ALLOWED);
+  }
+  var entity;
+  entity = req.param('entity', null);
+  if (!_exists(entity)) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  _parallel([
+    function (cb) {
+      _collection(entity, function (err, collection) {
+        if (err) {
+          return cb(err);
         }
+        collection.drop(cb);
+      });
+    },
+    function (cb) {
+      // A tombstone without object id marks the whole collection as reset
+      _insertTombstone(entity, null, cb);
+    },
+    function (cb) {
+      _removeCounters(entity, cb);
+    },
+    function (cb) {
+      _collection(_DKDB.SHARDS, function (err, shards) {
+        if (err) {
+          return cb(err);
+        }
+        shards.remove({'entity': entity}, {'safe': true}, cb);
+      });
+    }
+  ], function (err) {
+    if (err) {
+      return _e(res, _ERR.OPERATION_FAILED, err);
+    }
+    _broadcast({'type': 'changeIndex:reset', 'entity': entity});
+
+    return res.send('', 200);
+  });
+};
+exports.drop = function (req, res) {
+  if (_conf.allowDrop) {
+    _db.dropDatabase(function (err) {
+      if (err) {
+        console.error(err);
+        return _e(res, _ERR.OPERATION_FAILED, err);
       }
-      if (store !== null && bufs.length > 0 && pendingWrites <= 0) {
-        pendingWrites += 1;
-        store.write(bufs.shift(), function (err, success) {
-          if (err) {
-            console.error('error: could not write chunk (', err, ')');
+      console.log("dropped database", _db.databaseName);
+      _broadcast({'type': 'database:reset'});
+      _ensureSystemIndexes(function (err) {
+        if (err) {
+          console.error(err);
+          return _e(res, _ERR.OPERATION_FAILED, err);
+        }
+        res.send('', 200);
+      });
+    });
+  } else {
+    _e(res, _ERR.OPERATION_NOT_ALLOWED);
+  }
+};
+exports.store = function (req, res) {
+  // Get filename and mode
+  var fileName, store, bufs, onEnd, onClose, onCancel, isClosing, pendingWrites, tick, gs;
+  fileName = req.header('x-datakit-filename', null);
+
+  // Generate filename if neccessary, else check for conflict
+  if (fileName === null) {
+    fileName = uuid.v4();
+  }
+
+  store = null;
+  bufs = [];
+  onEnd = false;
+  onClose = false;
+  onCancel = false;
+  isClosing = false;
+  pendingWrites = 0;
+  tick = function (data) {
+    if (data && !(onClose || onCancel)) {
+      bufs.push(data);
+    }
+    if (store !== null && pendingWrites <= 0 && bufs.length === 0 && (onClose || onEnd || onCancel)) {
+      if (!isClosing) {
+        isClosing = true;
+        store.close(function () {
+          if (onClose) {
+            console.log("connection closed, unlink file");
+            // Remove the file if stream was closed prematurely
+            mongo.GridStore.unlink(_db, fileName, function (err) {
+              res.send('', 400);
+            });
+          } else if (onEnd) {
+            res.writeHead(200, {
+              'x-datakit-assigned-filename': fileName
+            });
+            res.end();
           }
-          pendingWrites -= 1;
-          tick();
+          store = null;
         });
       }
-    };
+    }
+    if (store !== null && bufs.length > 0 && pendingWrites <= 0) {
+      pendingWrites += 1;
+      store.write(bufs.shift(), function (err, success) {
+        if (err) {
+          console.error('error: could not write chunk (', err, ')');
+        }
+        pendingWrites -= 1;
+        tick();
+      });
+    }
+  };
 
-    // Register handlers
-    req.on('end', function () {
-      onEnd = true;
-      tick(null);
-    });
-    req.on('close', function () {
-      onClose = true;
-      tick(null);
-    });
-    req.on('data', function (data) {
-      tick(data);
-    });
+  // Register handlers
+  req.on('end', function () {
+    onEnd = true;
+    tick(null);
+  });
+  req.on('close', function () {
+    onClose = true;
+    tick(null);
+  });
+  req.on('data', function (data) {
+    tick(data);
+  });
 
-    // Check if file exists
-    try {
-      exists = mongo.GridStore.exist.sync(mongo.GridStore, _db, fileName);
-      if (exists) {
-        return _e(res, _ERR.DUPLICATE_KEY);
+  // Pipe to GridFS
+  gs = new mongo.GridStore(_db, fileName, 'w+', {
+    // Generally the chunk size doesn't matter much,
+    // we just use a smaller chunk size to verify file
+    // integrity when testing.
+    'chunkSize': 1024 * 50
+  });
+
+  // Check if file exists while the store is opened, opening in append
+  // mode does not touch an existing file until the store is closed
+  _parallel([
+    function (cb) {
+      mongo.GridStore.exist(_db, fileName, cb);
+    },
+    function (cb) {
+      gs.open(cb);
+    }
+  ], function (err, results) {
+    if (err || results[0]) {
+      bufs = [];
+      onCancel = true;
+      if (err) {
+        console.error(err);
+        return _e(res, _ERR.OPERATION_FAILED, err);
       }
-    } catch (e) {
-      console.error(e);
-      return _e(res, _ERR.OPERATION_FAILED, e);
+      return _e(res, _ERR.DUPLICATE_KEY);
+    }
+    store = results[1];
+    tick();
+  });
+};
+exports.snapshot = function (req, res) {
+  var queries, store, set;
+  queries = req.param('queries', null);
+  if (!Array.isArray(queries) || queries.length === 0) {
+    return _e(res, _ERR.INVALID_PARAMS);
+  }
+  store = req.param('store', true);
+  _buildSnapshot(queries, function (err, buf) {
+    var fileName, gs;
+    if (err) {
+      return _e(res, _safe(err.dkError, _ERR.OPERATION_FAILED), err);
+    }
+    if (!store) {
+      res.header('Content-Type', 'application/octet-stream');
+      return res.send(buf, 200);
     }
 
-    // Pipe to GridFS
-    gs = new mongo.GridStore(_db, fileName, 'w+', {
-      // Generally the chunk size doesn't matter much,
-      // we just use a smaller chunk size to verify file
-      // integrity when testing.
-      'chunkSize': 1024 * 50
-    });
-    gs.open(function (err, s) {
+    // Stored snapshots are downloaded like any other file
+    fileName = uuid.v4() + '.dksnap';
+    gs = new mongo.GridStore(_db, fileName, 'w', {'chunkSize': 1024 * 256});
+    gs.open(function (err, store) {
       if (err) {
-        console.log(err);
-        bufs = [];
-        onCancel = true;
         return _e(res, _ERR.OPERATION_FAILED, err);
       }
-      store = s;
-      tick();
+      store.write(buf, function (err) {
+        if (err) {
+          return _e(res, _ERR.OPERATION_FAILED, err);
+        }
+        store.close(function (err) {
+          if (err) {
+            return _e(res, _ERR.OPERATION_FAILED, err);
+          }
+          res.json({'fileName': fileName}, 200);
+
+          // File names stay unique, clients cache downloaded snapshots
+          // by name
+          set = crypto.createHash('sha256').update(_canonicalJSON(queries.map(function (spec) {
+            return _isPlainObject(spec) ? _snapshotKey(spec) : null;
+          }))).digest('hex');
+          _collection(_DKDB.SNAPSHOTS, function (err, col) {
+            if (err) {
+              return console.error(err);
+            }
+            col.insert({'_id': fileName, 'set': set, 'created': Date.now()}, {'safe': true}, function (err) {
+              if (err) {
+                return console.error(err);
+              }
+              _pruneSnapshots(set, function (err) {
+                if (err) {
+                  console.error('error: could not delete old snapshots (', err, ')');
+                }
+              });
+            });
+          });
+        });
+      });
     });
   });
 };
 exports.unlink = function (req, res) {
-  doSync(function unlinkSync() {
-    var files, i, gs, lastErr;
-    files = req.param('files', []);
-    gs = mongo.GridStore;
-    lastErr = null;
-    for (i = 0; i < files.length; i += 1) {
-      try {
-        gs.unlink.sync(gs, _db, files[i]);
-      } catch (e) {
-        lastErr = e;
-      }
-    }
+  var files, lastErr;
+  files = req.param('files', []);
+  lastErr = null;
+  _parallel(files.map(function (file) {
+    return function (cb) {
+      mongo.GridStore.unlink(_db, file, function (err) {
+        if (err) {
+          lastErr = err;
+        }
+        cb(null);
+      });
+    };
+  }), function () {
     if (lastErr !== null) {
       return _e(res, _ERR.OPERATION_FAILED, lastErr);
     }
@@ -843,25 +4092,21 @@ exports.unlink = function (req, res) {
   });
 };
 exports.stream = function (req, res) {
-  doSync(function streamSync() {
-    _streamFileFromGridFS(req, res, req.header('x-datakit-filename', null));
-  });
+  _streamFileFromGridFS(req, res, req.header('x-datakit-filename', null), _readOptions('stream'));
 };
 exports.exists = function (req, res) {
-  doSync(function existsSync() {
-    var fileName, gs, exists;
-    fileName = req.param('fileName', null);
-    if (fileName) {
-      gs = mongo.GridStore;
-      try {
-        exists = gs.exist.sync(gs, _db, fileName);
-        if (exists) {
-          return res.send('', 200);
-        }
-      } catch (e) {
-        console.error(e);
-        return _e(res, _ERR.OPERATION_FAILED, e);
-      }
+  var fileName;
+  fileName = req.param('fileName', null);
+  if (!fileName) {
+    return _e(res, _ERR.DUPLICATE_KEY);
+  }
+  mongo.GridStore.exist(_db, fileName, function (err, exists) {
+    if (err) {
+      console.error(err);
+      return _e(res, _ERR.OPERATION_FAILED, err);
+    }
+    if (exists) {
+      return res.send('', 200);
     }
     return _e(res, _ERR.DUPLICATE_KEY);
   });
@@ -5,5 +5,9 @@ require("./datakit").run({
   "secret": "c821a09ebf01e090a46b6bbe8b21bcb36eb5b432265a51a76739c20472908989",
   "salt": "cfgsalt",
   'allowDestroy': true,
-  'allowDrop': true
+  'allowDrop': true,
+  'countedFields': {'CountAndEstimate': ['parity']},
+  'textFields': {'TextSearch': ['text']},
+  'normalizedFields': {'NormalizedSearch': ['name']},
+  'shardedCounters': {'ShardedCounter': {'likes': 8}}
 });
\ No newline at end of file